@@ -114,10 +114,15 @@ public:
     CRollingBloomFilter(unsigned int nElements, double nFPRate, unsigned int nTweak);
 
     void insert(const std::vector<unsigned char>& vKey);
+    void insert(const uint256& hash);
     bool contains(const std::vector<unsigned char>& vKey) const;
+    bool contains(const uint256& hash) const;
 
     void clear();
 
+    //! Memory used by the filter; it does not change as items are inserted
+    size_t DynamicMemoryUsage() const;
+
 private:
     unsigned int nBloomSize;
     unsigned int nInsertions;
@@ -133,3 +133,9 @@ void CBlockIndex::BuildSkip()
     if (pprev)
         pskip = pprev->GetAncestor(GetSkipHeight(nHeight));
 }
+
+void CChain::BuildSkipRange(int nBegin, int nEnd) const
+{
+    for (int nHeight = std::max(nBegin, 1); nHeight < nEnd; ++nHeight)
+        vChain[nHeight]->pskip = vChain[GetSkipHeight(nHeight)];
+}
@@ -390,6 +390,13 @@ public:
 
     /** Find the last common block between this chain and a block index entry. */
     const CBlockIndex *FindFork(const CBlockIndex *pindex) const;
+
+    /**
+     * Set pskip of the blocks at heights [nBegin, nEnd) to what BuildSkip
+     * would set.  Only the chain itself is read, so that disjoint ranges
+     * can be done in parallel.
+     */
+    void BuildSkipRange(int nBegin, int nEnd) const;
 };
 
 #endif // BITCOIN_CHAIN_H
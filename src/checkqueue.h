@@ -8,10 +8,12 @@
 #include <algorithm>
 #include <vector>
 
+#include <boost/bind.hpp>
 #include <boost/foreach.hpp>
 #include <boost/thread/condition_variable.hpp>
 #include <boost/thread/locks.hpp>
 #include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
 
 template <typename T>
 class CCheckQueueControl;
@@ -212,4 +214,30 @@ public:
     }
 };
 
+/**
+ * Worker threads for a CCheckQueue that is only needed for a while, like
+ * the ones of VerifyDB.  The threads are interrupted and joined when
+ * this goes out of scope, so it has to be declared after the queue.
+ */
+template <typename T>
+class CCheckQueueThreads
+{
+private:
+    boost::thread_group threads;
+
+public:
+    //! Start nThreads workers; the master makes one more while it waits
+    CCheckQueueThreads(CCheckQueue<T>& queue, int nThreads)
+    {
+        for (int i = 0; i < nThreads; i++)
+            threads.create_thread(boost::bind(&CCheckQueue<T>::Thread, &queue));
+    }
+
+    ~CCheckQueueThreads()
+    {
+        threads.interrupt_all();
+        threads.join_all();
+    }
+};
+
 #endif // BITCOIN_CHECKQUEUE_H
@@ -4,10 +4,13 @@
 
 #include "coins.h"
 
+#include "clientversion.h"
 #include "memusage.h"
 #include "random.h"
+#include "streams.h"
 #include "undo.h"
 #include "util.h"
+#include "crypto/sha256.h"
 
 #include <assert.h>
 
@@ -67,6 +70,30 @@ bool CCoinsView::GetStats(CCoinsStats &stats) const { return false; }
 bool CCoinsView::ValidateNameDB() const { return false; }
 
 
+/**
+ * The set hash element of a coins entry is the same data that
+ * GetStatsSerialized hashes for each entry.
+ */
+CCoinsSetElement::CCoinsSetElement(const uint256& txid, const CCoins& coins) : nOutputs(0), nAmount(0) {
+    CDataStream ss(SER_DISK, CLIENT_VERSION);
+    ss << txid;
+    ss << VARINT(coins.nVersion);
+    ss << (coins.fCoinBase ? 'c' : 'n');
+    ss << VARINT(coins.nHeight);
+    for (unsigned int i = 0; i < coins.vout.size(); i++) {
+        const CTxOut &out = coins.vout[i];
+        if (!out.IsNull()) {
+            ++nOutputs;
+            ss << VARINT(i+1);
+            ss << out;
+            nAmount += out.nValue;
+        }
+    }
+    ss << VARINT(0);
+    CSHA256().Write((const unsigned char*)&ss[0], ss.size()).Finalize(hash.begin());
+    nSerializedSize = 32 + ::GetSerializeSize(coins, SER_DISK, CLIENT_VERSION);
+}
+
 CCoinsViewBacked::CCoinsViewBacked(CCoinsView *viewIn) : base(viewIn) { }
 bool CCoinsViewBacked::GetCoins(const uint256 &txid, CCoins &coins) const { return base->GetCoins(txid, coins); }
 bool CCoinsViewBacked::HaveCoins(const uint256 &txid) const { return base->HaveCoins(txid); }
@@ -82,7 +109,7 @@ bool CCoinsViewBacked::ValidateNameDB() const { return base->ValidateNameDB(); }
 
 CCoinsKeyHasher::CCoinsKeyHasher() : salt(GetRandHash()) {}
 
-CCoinsViewCache::CCoinsViewCache(CCoinsView *baseIn) : CCoinsViewBacked(baseIn), hasModifier(false), cachedCoinsUsage(0) { }
+CCoinsViewCache::CCoinsViewCache(CCoinsView *baseIn, bool fSetElementsIn) : CCoinsViewBacked(baseIn), hasModifier(false), cachedCoinsUsage(0), fSetElements(fSetElementsIn) { }
 
 CCoinsViewCache::~CCoinsViewCache()
 {
@@ -120,6 +147,11 @@ bool CCoinsViewCache::GetCoins(const uint256 &txid, CCoins &coins) const {
     return false;
 }
 
+void CCoinsViewCache::RecordOriginal(CCoinsCacheEntry& entry, const uint256& txid) const {
+    if (fSetElements && !(entry.flags & (CCoinsCacheEntry::DIRTY | CCoinsCacheEntry::FRESH)))
+        entry.original.reset(new CCoinsSetElement(txid, entry.coins));
+}
+
 CCoinsModifier CCoinsViewCache::ModifyCoins(const uint256 &txid) {
     assert(!hasModifier);
     std::pair<CCoinsMap::iterator, bool> ret = cacheCoins.insert(std::make_pair(txid, CCoinsCacheEntry()));
@@ -136,6 +168,7 @@ CCoinsModifier CCoinsViewCache::ModifyCoins(const uint256 &txid) {
     } else {
         cachedCoinUsage = memusage::DynamicUsage(ret.first->second.coins);
     }
+    RecordOriginal(ret.first->second, txid);
     // Assume that whenever ModifyCoins is called, the entry will be modified.
     ret.first->second.flags |= CCoinsCacheEntry::DIRTY;
     return CCoinsModifier(*this, ret.first, cachedCoinUsage);
@@ -212,7 +245,9 @@ CNameIterator* CCoinsViewCache::IterateNames() const {
    name history.  */
 void CCoinsViewCache::SetName(const valtype &name, const CNameData& data, bool undo) {
     CNameData oldData;
-    if (GetName(name, oldData))
+    const bool fExists = GetName(name, oldData);
+    cacheNames.recordOriginal(name, fExists ? &oldData : NULL);
+    if (fExists)
     {
         cacheNames.removeExpireIndex(name, oldData.getHeight());
 
@@ -252,6 +287,7 @@ void CCoinsViewCache::DeleteName(const valtype &name) {
         cacheNames.removeExpireIndex(name, oldData.getHeight());
     else
         assert(false);
+    cacheNames.recordOriginal(name, &oldData);
 
     if (fNameHistory)
     {
@@ -289,6 +325,7 @@ bool CCoinsViewCache::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlockIn
                     cacheCoins.erase(itUs);
                 } else {
                     // A normal modification.
+                    RecordOriginal(itUs->second, itUs->first);
                     cachedCoinsUsage -= memusage::DynamicUsage(itUs->second.coins);
                     itUs->second.coins.swap(it->second.coins);
                     cachedCoinsUsage += memusage::DynamicUsage(itUs->second.coins);
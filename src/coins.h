@@ -16,6 +16,7 @@
 #include <stdint.h>
 
 #include <boost/foreach.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/unordered_map.hpp>
 
 class CTxInUndo;
@@ -285,10 +286,28 @@ public:
     }
 };
 
+/**
+ * What one version of a CCoins contributes to the statistics and the set
+ * hash of the coin database (see CChainStateSetInfo).  The set hash element
+ * is kept only as the SHA256 of its data, which is enough to take it out of
+ * the set hash again.
+ */
+struct CCoinsSetElement
+{
+    uint256 hash;
+    uint64_t nOutputs;
+    CAmount nAmount;
+    uint64_t nSerializedSize;
+
+    CCoinsSetElement(const uint256& txid, const CCoins& coins);
+};
+
 struct CCoinsCacheEntry
 {
     CCoins coins; // The actual cached data.
     unsigned char flags;
+    // Set element of the version in the parent view, if the cache keeps track of them.
+    boost::shared_ptr<const CCoinsSetElement> original;
 
     enum Flags {
         DIRTY = (1 << 0), // This cache entry is potentially different from the version in the parent view.
@@ -308,6 +327,7 @@ struct CCoinsStats
     uint64_t nTransactionOutputs;
     uint64_t nSerializedSize;
     uint256 hashSerialized;
+    uint256 hashMuHash;
     CAmount nTotalAmount;
 
     CCoinsStats() : nHeight(0), nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), nTotalAmount(0) {}
@@ -421,8 +441,19 @@ protected:
     /** Name changes cache.  */
     CNameCache cacheNames;
 
+    /**
+     * Whether to record the set element of the parent's version of each
+     * entry that is modified.  This is done for the cache on top of the
+     * coin database, so that it can update its set hash without reading
+     * the old versions back.
+     */
+    bool fSetElements;
+
+    //! Record the set element of an entry that still matches the parent
+    void RecordOriginal(CCoinsCacheEntry& entry, const uint256& txid) const;
+
 public:
-    CCoinsViewCache(CCoinsView *baseIn);
+    CCoinsViewCache(CCoinsView *baseIn, bool fSetElementsIn = false);
     ~CCoinsViewCache();
 
     // Standard CCoinsView methods
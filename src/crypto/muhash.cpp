@@ -0,0 +1,188 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#include "crypto/muhash.h"
+
+#include "crypto/common.h"
+#include "crypto/sha256.h"
+
+#include <string.h>
+
+namespace
+{
+/** 2^3072 - MAX_PRIME_DIFF is the modulus. */
+const uint32_t MAX_PRIME_DIFF = 1103717;
+}
+
+Num3072::Num3072()
+{
+    SetToOne();
+}
+
+Num3072::Num3072(const unsigned char data[BYTE_SIZE])
+{
+    for (int i = 0; i < LIMBS; ++i)
+        limbs[i] = ReadLE32(data + 4 * i);
+    if (IsOverflow())
+        FullReduce();
+}
+
+void Num3072::SetToOne()
+{
+    limbs[0] = 1;
+    for (int i = 1; i < LIMBS; ++i)
+        limbs[i] = 0;
+}
+
+/** Check whether the number is at least the modulus (but below 2^3072). */
+bool Num3072::IsOverflow() const
+{
+    if (limbs[0] <= 0xFFFFFFFF - MAX_PRIME_DIFF)
+        return false;
+    for (int i = 1; i < LIMBS; ++i) {
+        if (limbs[i] != 0xFFFFFFFF)
+            return false;
+    }
+    return true;
+}
+
+/** Subtract the modulus, by adding MAX_PRIME_DIFF and dropping 2^3072. */
+void Num3072::FullReduce()
+{
+    uint64_t cur = MAX_PRIME_DIFF;
+    for (int i = 0; i < LIMBS; ++i) {
+        cur += limbs[i];
+        limbs[i] = (uint32_t)cur;
+        cur >>= 32;
+    }
+}
+
+void Num3072::Multiply(const Num3072& a)
+{
+    // Schoolbook multiplication into a product of twice the size.
+    uint32_t tmp[2 * LIMBS];
+    memset(tmp, 0, sizeof(tmp));
+    for (int i = 0; i < LIMBS; ++i) {
+        uint64_t carry = 0;
+        for (int j = 0; j < LIMBS; ++j) {
+            const uint64_t cur = (uint64_t)limbs[i] * a.limbs[j] + tmp[i + j] + carry;
+            tmp[i + j] = (uint32_t)cur;
+            carry = cur >> 32;
+        }
+        tmp[i + LIMBS] = (uint32_t)carry;
+    }
+
+    // Reduce using 2^3072 = MAX_PRIME_DIFF (mod p): the upper half is
+    // multiplied by MAX_PRIME_DIFF and added to the lower half.
+    uint64_t carry = 0;
+    for (int i = 0; i < LIMBS; ++i) {
+        const uint64_t cur = (uint64_t)tmp[LIMBS + i] * MAX_PRIME_DIFF + tmp[i] + carry;
+        limbs[i] = (uint32_t)cur;
+        carry = cur >> 32;
+    }
+
+    // Fold what is left above 2^3072 in the same way.
+    while (carry != 0) {
+        uint64_t cur = carry * MAX_PRIME_DIFF;
+        for (int i = 0; i < LIMBS && cur != 0; ++i) {
+            cur += limbs[i];
+            limbs[i] = (uint32_t)cur;
+            cur >>= 32;
+        }
+        carry = cur;
+    }
+
+    if (IsOverflow())
+        FullReduce();
+}
+
+Num3072 Num3072::GetInverse() const
+{
+    // By Fermat's little theorem, the inverse is this^(p - 2).  All limbs
+    // of p - 2 except for the lowest one have every bit set.
+    Num3072 out;
+    for (int i = LIMBS - 1; i >= 0; --i) {
+        const uint32_t exp = (i == 0 ? 0xFFFFFFFF - MAX_PRIME_DIFF - 1 : 0xFFFFFFFF);
+        for (int bit = 31; bit >= 0; --bit) {
+            out.Multiply(out);
+            if ((exp >> bit) & 1)
+                out.Multiply(*this);
+        }
+    }
+    return out;
+}
+
+void Num3072::ToBytes(unsigned char out[BYTE_SIZE]) const
+{
+    for (int i = 0; i < LIMBS; ++i)
+        WriteLE32(out + 4 * i, limbs[i]);
+}
+
+/** Hash an element to a number, by expanding its SHA-256 in counter mode. */
+Num3072 MuHash3072::ToNum3072(const unsigned char* data, size_t len)
+{
+    unsigned char seed[CSHA256::OUTPUT_SIZE];
+    CSHA256().Write(data, len).Finalize(seed);
+    return HashedToNum3072(seed);
+}
+
+Num3072 MuHash3072::HashedToNum3072(const unsigned char seed[CSHA256::OUTPUT_SIZE])
+{
+    unsigned char expanded[Num3072::BYTE_SIZE];
+    for (size_t i = 0; i < Num3072::BYTE_SIZE / CSHA256::OUTPUT_SIZE; ++i) {
+        unsigned char counter[4];
+        WriteLE32(counter, i);
+        CSHA256().Write(seed, CSHA256::OUTPUT_SIZE).Write(counter, sizeof(counter)).Finalize(expanded + i * CSHA256::OUTPUT_SIZE);
+    }
+
+    return Num3072(expanded);
+}
+
+MuHash3072& MuHash3072::Insert(const unsigned char* data, size_t len)
+{
+    numerator.Multiply(ToNum3072(data, len));
+    return *this;
+}
+
+MuHash3072& MuHash3072::Remove(const unsigned char* data, size_t len)
+{
+    denominator.Multiply(ToNum3072(data, len));
+    return *this;
+}
+
+MuHash3072& MuHash3072::InsertHashed(const unsigned char hash[CSHA256::OUTPUT_SIZE])
+{
+    numerator.Multiply(HashedToNum3072(hash));
+    return *this;
+}
+
+MuHash3072& MuHash3072::RemoveHashed(const unsigned char hash[CSHA256::OUTPUT_SIZE])
+{
+    denominator.Multiply(HashedToNum3072(hash));
+    return *this;
+}
+
+MuHash3072& MuHash3072::operator*=(const MuHash3072& mul)
+{
+    numerator.Multiply(mul.numerator);
+    denominator.Multiply(mul.denominator);
+    return *this;
+}
+
+MuHash3072& MuHash3072::operator/=(const MuHash3072& div)
+{
+    numerator.Multiply(div.denominator);
+    denominator.Multiply(div.numerator);
+    return *this;
+}
+
+void MuHash3072::Finalize(unsigned char hash[OUTPUT_SIZE]) const
+{
+    Num3072 result = denominator.GetInverse();
+    result.Multiply(numerator);
+
+    unsigned char data[Num3072::BYTE_SIZE];
+    result.ToBytes(data);
+    CSHA256().Write(data, sizeof(data)).Finalize(hash);
+}
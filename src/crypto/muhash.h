@@ -0,0 +1,93 @@
+// Copyright (c) 2015 The Bitcoin Core developers
+// Distributed under the MIT software license, see the accompanying
+// file COPYING or http://www.opensource.org/licenses/mit-license.php.
+
+#ifndef BITCOIN_CRYPTO_MUHASH_H
+#define BITCOIN_CRYPTO_MUHASH_H
+
+#include "serialize.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+
+/** A number modulo the prime 2^3072 - 1103717. */
+class Num3072
+{
+private:
+    static const int LIMBS = 96;
+    uint32_t limbs[LIMBS];
+
+    bool IsOverflow() const;
+    void FullReduce();
+
+public:
+    static const size_t BYTE_SIZE = 384;
+
+    /** Construct the number one. */
+    Num3072();
+    /** Construct a number from its little-endian byte representation. */
+    explicit Num3072(const unsigned char data[BYTE_SIZE]);
+
+    void SetToOne();
+    void Multiply(const Num3072& a);
+    Num3072 GetInverse() const;
+    void ToBytes(unsigned char out[BYTE_SIZE]) const;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        for (int i = 0; i < LIMBS; ++i)
+            READWRITE(limbs[i]);
+    }
+};
+
+/**
+ * A hash of a set of byte strings (MuHash3072).  Elements can be added and
+ * removed in any order and the resulting hash only depends on the contents
+ * of the set.  Each element is hashed to a number modulo a 3072-bit prime,
+ * and the set is represented by the product of them.  Removals are kept
+ * in a separate denominator, so that only Finalize needs a modular inverse.
+ */
+class MuHash3072
+{
+private:
+    Num3072 numerator;
+    Num3072 denominator;
+
+    static Num3072 ToNum3072(const unsigned char* data, size_t len);
+    static Num3072 HashedToNum3072(const unsigned char hash[32]);
+
+public:
+    static const size_t OUTPUT_SIZE = 32;
+
+    /** Construct the hash of the empty set. */
+    MuHash3072() {}
+
+    MuHash3072& Insert(const unsigned char* data, size_t len);
+    MuHash3072& Remove(const unsigned char* data, size_t len);
+
+    /**
+     * Like Insert and Remove, but for an element given by the SHA256 of its
+     * data.  That is all an element is reduced to, so it can be kept around
+     * instead of the data to take the element out again later.
+     */
+    MuHash3072& InsertHashed(const unsigned char hash[32]);
+    MuHash3072& RemoveHashed(const unsigned char hash[32]);
+
+    /** Combine with (or take out) the elements of another set. */
+    MuHash3072& operator*=(const MuHash3072& mul);
+    MuHash3072& operator/=(const MuHash3072& div);
+
+    void Finalize(unsigned char hash[OUTPUT_SIZE]) const;
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(numerator);
+        READWRITE(denominator);
+    }
+};
+
+#endif // BITCOIN_CRYPTO_MUHASH_H
@@ -86,3 +86,16 @@ bool CLevelDBWrapper::WriteBatch(CLevelDBBatch& batch, bool fSync) throw(leveldb
     HandleError(status);
     return true;
 }
+
+CLevelDBSnapshot::CLevelDBSnapshot(const CLevelDBWrapper& db)
+    : pdb(db.pdb), snapshot(db.pdb->GetSnapshot()), readoptions(db.readoptions), iteroptions(db.iteroptions)
+{
+    readoptions.snapshot = snapshot;
+    iteroptions.snapshot = snapshot;
+}
+
+CLevelDBSnapshot::~CLevelDBSnapshot()
+{
+    pdb->ReleaseSnapshot(snapshot);
+    snapshot = NULL;
+}
@@ -75,10 +75,29 @@ public:
 
         batch.Delete(slKey);
     }
+
+    /* Write and erase keys and values that are already serialised.  These
+       are used to copy records between databases (chain state snapshots). */
+    void WriteRaw(const leveldb::Slice& slKey, const leveldb::Slice& slValue)
+    {
+        batch.Put(slKey, slValue);
+    }
+
+    void EraseRaw(const leveldb::Slice& slKey)
+    {
+        batch.Delete(slKey);
+    }
+
+    void Clear()
+    {
+        batch.Clear();
+    }
 };
 
 class CLevelDBWrapper
 {
+    friend class CLevelDBSnapshot;
+
 private:
     //! custom environment this database is using (may be NULL in case of default environment)
     leveldb::Env* penv;
@@ -186,4 +205,74 @@ public:
     }
 };
 
+/**
+ * Consistent read-only view of a CLevelDBWrapper as it was when the
+ * snapshot was taken.  Writes to the database afterwards are not seen
+ * by reads or iterators through it.
+ */
+class CLevelDBSnapshot
+{
+private:
+    leveldb::DB* pdb;
+    const leveldb::Snapshot* snapshot;
+    leveldb::ReadOptions readoptions;
+    leveldb::ReadOptions iteroptions;
+
+    CLevelDBSnapshot(const CLevelDBSnapshot&);
+    void operator=(const CLevelDBSnapshot&);
+
+public:
+    CLevelDBSnapshot(const CLevelDBWrapper& db);
+    ~CLevelDBSnapshot();
+
+    template <typename K, typename V>
+    bool Read(const K& key, V& value) const throw(leveldb_error)
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.reserve(ssKey.GetSerializeSize(key));
+        ssKey << key;
+        leveldb::Slice slKey(&ssKey[0], ssKey.size());
+
+        std::string strValue;
+        leveldb::Status status = pdb->Get(readoptions, slKey, &strValue);
+        if (!status.ok()) {
+            if (status.IsNotFound())
+                return false;
+            LogPrintf("LevelDB read failure: %s\n", status.ToString());
+            HandleError(status);
+        }
+        try {
+            CDataStream ssValue(strValue.data(), strValue.data() + strValue.size(), SER_DISK, CLIENT_VERSION);
+            ssValue >> value;
+        } catch (const std::exception&) {
+            return false;
+        }
+        return true;
+    }
+
+    template <typename K>
+    bool Exists(const K& key) const throw(leveldb_error)
+    {
+        CDataStream ssKey(SER_DISK, CLIENT_VERSION);
+        ssKey.reserve(ssKey.GetSerializeSize(key));
+        ssKey << key;
+        leveldb::Slice slKey(&ssKey[0], ssKey.size());
+
+        std::string strValue;
+        leveldb::Status status = pdb->Get(readoptions, slKey, &strValue);
+        if (!status.ok()) {
+            if (status.IsNotFound())
+                return false;
+            LogPrintf("LevelDB read failure: %s\n", status.ToString());
+            HandleError(status);
+        }
+        return true;
+    }
+
+    leveldb::Iterator* NewIterator() const
+    {
+        return pdb->NewIterator(iteroptions);
+    }
+};
+
 #endif // BITCOIN_LEVELDBWRAPPER_H
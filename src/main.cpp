@@ -13,6 +13,8 @@
 #include "checkpoints.h"
 #include "checkqueue.h"
 #include "consensus/validation.h"
+#include "core_memusage.h"
+#include "crypto/common.h"
 #include "init.h"
 #include "merkleblock.h"
 #include "net.h"
@@ -25,14 +27,26 @@
 #include "utilmoneystr.h"
 #include "validationinterface.h"
 
+#include <limits>
+#include <list>
 #include <sstream>
 
 #include <boost/algorithm/string/replace.hpp>
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/math/distributions/poisson.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <boost/shared_ptr.hpp>
 #include <boost/thread.hpp>
 
+#ifndef WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 using namespace std;
 
 #if defined(NDEBUG)
@@ -52,6 +66,7 @@ int64_t nTimeBestReceived = 0;
 CWaitableCriticalSection csBestBlock;
 CConditionVariable cvBlockChange;
 int nScriptCheckThreads = 0;
+int nBlockFileMaps = DEFAULT_BLOCKFILE_MAPS;
 bool fImporting = false;
 bool fReindex = false;
 bool fTxIndex = false;
@@ -61,6 +76,7 @@ bool fIsBareMultisigStd = true;
 bool fCheckBlockIndex = false;
 bool fCheckpointsEnabled = true;
 size_t nCoinCacheUsage = 5000 * 300;
+size_t nHeaderCacheUsage = DEFAULT_HEADER_CACHE << 20;
 uint64_t nPruneTarget = 0;
 
 /** Fees smaller than this (in satoshi) are considered zero fee (for relaying and mining) */
@@ -127,6 +143,15 @@ namespace {
       */
     multimap<CBlockIndex*, CBlockIndex*> mapBlocksUnlinked;
 
+    /**
+     * Filter for transactions that were recently rejected by
+     * AcceptToMemoryPool.  These are not rerequested until the chain tip
+     * changes, at which point the entire filter is reset.  Protected by
+     * cs_main.
+     */
+    boost::scoped_ptr<CRollingBloomFilter> recentRejects;
+    uint256 hashRecentRejectsChainTip;
+
     CCriticalSection cs_LastBlockFile;
     std::vector<CBlockFileInfo> vinfoBlockFile;
     int nLastBlockFile = 0;
@@ -512,6 +537,8 @@ CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& loc
     return chain.Genesis();
 }
 
+CCoinsViewDB *pcoinsdbview = NULL;
+CCoinsViewAsyncWriter *pcoinswriter = NULL;
 CCoinsViewCache *pcoinsTip = NULL;
 CBlockTreeDB *pblocktree = NULL;
 
@@ -880,8 +907,9 @@ CAmount GetMinRelayFee(const CTransaction& tx, unsigned int nBytes, bool fAllowF
 }
 
 
-bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
-                        bool* pfMissingInputs, bool fRejectAbsurdFee)
+bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                                bool* pfMissingInputs, int64_t nAcceptTime, bool fRejectAbsurdFee,
+                                bool fCurrentEstimate)
 {
     AssertLockHeld(cs_main);
     if (pfMissingInputs)
@@ -1004,7 +1032,7 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         CAmount nFees = nValueIn-nValueOut;
         double dPriority = view.GetPriority(tx, chainActive.Height());
 
-        CTxMemPoolEntry entry(tx, nFees, GetTime(), dPriority, chainActive.Height(), mempool.HasNoInputsOf(tx));
+        CTxMemPoolEntry entry(tx, nFees, nAcceptTime, dPriority, chainActive.Height(), mempool.HasNoInputsOf(tx));
         unsigned int nSize = entry.GetTxSize();
 
         // Don't accept it if it can't get into a block
@@ -1014,6 +1042,17 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
                                       hash.ToString(), nFees, txMinFee),
                              REJECT_INSUFFICIENTFEE, "insufficient fee");
 
+        // Packages that have been evicted from a full pool are not taken
+        // (and relayed) again until the rolling minimum fee has decayed.
+        CAmount nModifiedFees = nFees;
+        double dPriorityDummy = 0;
+        pool.ApplyDeltas(hash, dPriorityDummy, nModifiedFees);
+        CAmount mempoolRejectFee = pool.GetMinFee(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000).GetFee(nSize);
+        if (mempoolRejectFee > 0 && nModifiedFees < mempoolRejectFee)
+            return state.DoS(0, error("AcceptToMemoryPool: mempool min fee not met %s, %d < %d",
+                                      hash.ToString(), nModifiedFees, mempoolRejectFee),
+                             REJECT_INSUFFICIENTFEE, "mempool min fee not met");
+
         // Require that free transactions have sufficient priority to be mined in the next block.
         if (GetBoolArg("-relaypriority", true) && nFees < ::minRelayTxFee.GetFee(nSize) && !AllowFree(view.GetPriority(tx, chainActive.Height() + 1))) {
             return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "insufficient priority");
@@ -1076,7 +1115,14 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
         }
 
         // Store transaction in memory
-        pool.addUnchecked(hash, entry, !IsInitialBlockDownload());
+        pool.addUnchecked(hash, entry, fCurrentEstimate && !IsInitialBlockDownload());
+
+        // Drop expired transactions and evict the lowest fee-rate packages
+        // if the pool is too large now, and reject the tx if it was among them.
+        pool.Expire(GetTime() - GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60);
+        pool.TrimToSize(GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000);
+        if (!pool.exists(hash))
+            return state.DoS(0, false, REJECT_INSUFFICIENTFEE, "mempool full");
     }
 
     SyncWithWallets(tx, NULL);
@@ -1084,6 +1130,12 @@ bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransa
     return true;
 }
 
+bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                        bool* pfMissingInputs, bool fRejectAbsurdFee)
+{
+    return AcceptToMemoryPoolWithTime(pool, state, tx, fLimitFree, pfMissingInputs, GetTime(), fRejectAbsurdFee);
+}
+
 /** Return transaction in tx, and if it was found inside a block, its hash is placed in hashBlock */
 bool GetTransaction(const uint256 &hash, CTransaction &txOut, uint256 &hashBlock, bool fAllowSlow)
 {
@@ -1223,6 +1275,158 @@ bool WriteBlockToDisk(CBlock& block, CDiskBlockPos& pos, const CMessageHeader::M
     return true;
 }
 
+namespace {
+
+/** A read-only memory mapping of a whole blk or rev file. */
+class CBlockFileMapping
+{
+private:
+    // Disallow copies
+    CBlockFileMapping(const CBlockFileMapping&);
+    CBlockFileMapping& operator=(const CBlockFileMapping&);
+
+public:
+    const char* const pbegin;
+    const size_t nSize;
+
+    CBlockFileMapping(const char* pbeginIn, size_t nSizeIn) : pbegin(pbeginIn), nSize(nSizeIn) {}
+
+    ~CBlockFileMapping()
+    {
+#ifndef WIN32
+        munmap(const_cast<char*>(pbegin), nSize);
+#endif
+    }
+};
+
+typedef boost::shared_ptr<const CBlockFileMapping> CBlockFileMappingRef;
+
+/**
+ * Bounded cache of memory-mapped blk and rev files (-blockfilemaps), so that
+ * reading a block, header or undo record from a mapped file needs no system
+ * call.  Mappings are reference counted:  one that is evicted or invalidated
+ * while a reader still uses it is unmapped when that reader is done.
+ */
+class CBlockFileMapCache
+{
+private:
+    struct CEntry
+    {
+        CBlockFileMappingRef mapping;
+        uint64_t nLastUsed;
+    };
+    typedef std::map<std::pair<std::string, int>, CEntry> MapType;
+
+    CCriticalSection cs;
+    MapType mapFiles;
+    uint64_t nUseCounter;
+
+    static CBlockFileMappingRef MapFile(const CDiskBlockPos& pos, const char* prefix)
+    {
+#ifdef WIN32
+        return CBlockFileMappingRef();
+#else
+        const boost::filesystem::path path = GetBlockPosFilename(pos, prefix);
+        const int fd = open(path.string().c_str(), O_RDONLY);
+        if (fd == -1)
+            return CBlockFileMappingRef();
+        struct stat st;
+        void* p = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && st.st_size > 0)
+            p = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        close(fd);
+        if (p == MAP_FAILED) {
+            LogPrintf("Unable to map file %s\n", path.string());
+            return CBlockFileMappingRef();
+        }
+        return CBlockFileMappingRef(new CBlockFileMapping(static_cast<const char*>(p), st.st_size));
+#endif
+    }
+
+public:
+    CBlockFileMapCache() : nUseCounter(0) {}
+
+    /**
+     * Get a mapping of the file containing pos that covers at least its
+     * first nEnd bytes.  Returns an empty reference if mapping is disabled
+     * or the file cannot be mapped.
+     */
+    CBlockFileMappingRef Get(const CDiskBlockPos& pos, const char* prefix, uint64_t nEnd)
+    {
+        if (nBlockFileMaps <= 0)
+            return CBlockFileMappingRef();
+
+        const MapType::key_type key(prefix, pos.nFile);
+        LOCK(cs);
+        MapType::iterator it = mapFiles.find(key);
+        if (it == mapFiles.end() || it->second.mapping->nSize < nEnd) {
+            // Not mapped yet, or the file has grown since it was mapped
+            const CBlockFileMappingRef mapping = MapFile(pos, prefix);
+            if (!mapping || mapping->nSize < nEnd)
+                return CBlockFileMappingRef();
+            if (it == mapFiles.end()) {
+                while (mapFiles.size() >= (size_t)nBlockFileMaps) {
+                    MapType::iterator itOldest = mapFiles.begin();
+                    for (MapType::iterator mi = mapFiles.begin(); mi != mapFiles.end(); ++mi)
+                        if (mi->second.nLastUsed < itOldest->second.nLastUsed)
+                            itOldest = mi;
+                    mapFiles.erase(itOldest);
+                }
+                it = mapFiles.insert(std::make_pair(key, CEntry())).first;
+            }
+            it->second.mapping = mapping;
+        }
+        it->second.nLastUsed = ++nUseCounter;
+        return it->second.mapping;
+    }
+
+    /** Drop the mappings of blk and rev file nFile, e.g. when it is pruned. */
+    void Invalidate(int nFile)
+    {
+        LOCK(cs);
+        mapFiles.erase(std::make_pair(std::string("blk"), nFile));
+        mapFiles.erase(std::make_pair(std::string("rev"), nFile));
+    }
+
+    void Clear()
+    {
+        LOCK(cs);
+        mapFiles.clear();
+    }
+};
+
+CBlockFileMapCache blockFileMaps;
+
+/**
+ * Find the record at pos in a mapped blk or rev file.  Records are preceded
+ * by the network magic and their size, and followed by nTrailer more bytes
+ * (the checksum of undo data).  If the record cannot be read through a
+ * mapping, an empty reference is returned and the caller reads the file.
+ */
+CBlockFileMappingRef GetMappedRecord(const CDiskBlockPos& pos, const char* prefix, unsigned int nTrailer,
+                                     const char*& pbegin, const char*& pend)
+{
+    if (pos.IsNull() || pos.nPos < 4)
+        return CBlockFileMappingRef();
+
+    CBlockFileMappingRef mapping = blockFileMaps.Get(pos, prefix, pos.nPos);
+    if (!mapping)
+        return mapping;
+    const uint64_t nEnd = (uint64_t)pos.nPos + nTrailer
+        + ReadLE32(reinterpret_cast<const unsigned char*>(mapping->pbegin + pos.nPos - 4));
+    if (nEnd > mapping->nSize) {
+        mapping = blockFileMaps.Get(pos, prefix, nEnd);
+        if (!mapping)
+            return mapping;
+    }
+
+    pbegin = mapping->pbegin + pos.nPos;
+    pend = mapping->pbegin + nEnd;
+    return mapping;
+}
+
+} // anon namespace
+
 /* Generic implementation of block reading that can handle
    both a block and its header.  */
 
@@ -1231,14 +1435,20 @@ static bool ReadBlockOrHeader(T& block, const CDiskBlockPos& pos)
 {
     block.SetNull();
 
-    // Open history file to read
-    CAutoFile filein(OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
+    // Read from a mapping of the file if there is one, or open it
+    const char* pbegin = NULL;
+    const char* pend = NULL;
+    const CBlockFileMappingRef mapping = GetMappedRecord(pos, "blk", 0, pbegin, pend);
+    CAutoFile filein(mapping ? NULL : OpenBlockFile(pos, true), SER_DISK, CLIENT_VERSION);
+    if (!mapping && filein.IsNull())
         return error("ReadBlockFromDisk: OpenBlockFile failed for %s", pos.ToString());
 
     // Read block
     try {
-        filein >> block;
+        if (mapping)
+            CMemoryReader(pbegin, pend, SER_DISK, CLIENT_VERSION) >> block;
+        else
+            filein >> block;
     }
     catch (const std::exception& e) {
         return error("%s: Deserialize or I/O error - %s at %s", __func__, e.what(), pos.ToString());
@@ -1272,9 +1482,95 @@ bool ReadBlockFromDisk(CBlock& block, const CBlockIndex* pindex)
     return ReadBlockOrHeader(block, pindex);
 }
 
+namespace {
+
+/**
+ * Memory-bounded cache of the full headers of merge-mined blocks.  Since
+ * CBlockIndex does not keep the auxpow, every such header served to
+ * getheaders or REST would otherwise be read and deserialized from the block
+ * file.  The cached headers share their auxpow with the copies handed out,
+ * so a hit is cheap.  The least recently used headers are evicted when the
+ * estimated memory usage exceeds nHeaderCacheUsage.
+ */
+class CAuxpowHeaderCache
+{
+private:
+    /** Headers with their hash, most recently used first */
+    typedef std::list<std::pair<uint256, CBlockHeader> > ListType;
+    typedef std::map<uint256, ListType::iterator> MapType;
+
+    CCriticalSection cs;
+    ListType listHeaders;
+    MapType mapHeaders;
+    size_t nUsage;
+
+    static size_t EntryUsage(const CBlockHeader& header)
+    {
+        const CAuxPow& auxpow = *header.auxpow;
+        // The auxpow with its shared_ptr control block, its vectors and the list and map nodes
+        return memusage::MallocUsage(sizeof(CAuxPow)) + memusage::MallocUsage(4 * sizeof(void*))
+            + RecursiveDynamicUsage(static_cast<const CTransaction&>(auxpow))
+            + memusage::DynamicUsage(auxpow.vMerkleBranch) + memusage::DynamicUsage(auxpow.vChainMerkleBranch)
+            + memusage::MallocUsage(sizeof(ListType::value_type) + 2 * sizeof(void*))
+            + memusage::MallocUsage(sizeof(memusage::stl_tree_node<MapType::value_type>));
+    }
+
+public:
+    CAuxpowHeaderCache() : nUsage(0) {}
+
+    bool Get(const uint256& hash, CBlockHeader& header)
+    {
+        LOCK(cs);
+        MapType::iterator it = mapHeaders.find(hash);
+        if (it == mapHeaders.end())
+            return false;
+        listHeaders.splice(listHeaders.begin(), listHeaders, it->second);
+        header = it->second->second;
+        return true;
+    }
+
+    /** Add a header if it has an auxpow; others are complete in CBlockIndex. */
+    void Add(const CBlockHeader& header)
+    {
+        if (!header.auxpow)
+            return;
+
+        const uint256 hash = header.GetHash();
+        LOCK(cs);
+        if (mapHeaders.count(hash))
+            return;
+        listHeaders.push_front(std::make_pair(hash, header));
+        mapHeaders.insert(std::make_pair(hash, listHeaders.begin()));
+        nUsage += EntryUsage(header);
+
+        while (nUsage > nHeaderCacheUsage && !listHeaders.empty()) {
+            nUsage -= EntryUsage(listHeaders.back().second);
+            mapHeaders.erase(listHeaders.back().first);
+            listHeaders.pop_back();
+        }
+    }
+
+    void Clear()
+    {
+        LOCK(cs);
+        listHeaders.clear();
+        mapHeaders.clear();
+        nUsage = 0;
+    }
+};
+
+CAuxpowHeaderCache auxpowHeaderCache;
+
+} // anon namespace
+
 bool ReadBlockHeaderFromDisk(CBlockHeader& block, const CBlockIndex* pindex)
 {
-    return ReadBlockOrHeader(block, pindex);
+    if (auxpowHeaderCache.Get(pindex->GetBlockHash(), block))
+        return true;
+    if (!ReadBlockOrHeader(block, pindex))
+        return false;
+    auxpowHeaderCache.Add(block);
+    return true;
 }
 
 CAmount GetBlockSubsidy(int nHeight, const Consensus::Params& consensusParams)
@@ -1613,16 +1909,25 @@ bool UndoWriteToDisk(const CBlockUndo& blockundo, CDiskBlockPos& pos, const uint
 
 bool UndoReadFromDisk(CBlockUndo& blockundo, const CDiskBlockPos& pos, const uint256& hashBlock)
 {
-    // Open history file to read
-    CAutoFile filein(OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
-    if (filein.IsNull())
+    // Read from a mapping of the file if there is one, or open it
+    const char* pbegin = NULL;
+    const char* pend = NULL;
+    const CBlockFileMappingRef mapping = GetMappedRecord(pos, "rev", sizeof(uint256), pbegin, pend);
+    CAutoFile filein(mapping ? NULL : OpenUndoFile(pos, true), SER_DISK, CLIENT_VERSION);
+    if (!mapping && filein.IsNull())
         return error("%s: OpenBlockFile failed", __func__);
 
     // Read block
     uint256 hashChecksum;
     try {
-        filein >> blockundo;
-        filein >> hashChecksum;
+        if (mapping) {
+            CMemoryReader reader(pbegin, pend, SER_DISK, CLIENT_VERSION);
+            reader >> blockundo;
+            reader >> hashChecksum;
+        } else {
+            filein >> blockundo;
+            filein >> hashChecksum;
+        }
     }
     catch (const std::exception& e) {
         return error("%s: Deserialize or I/O error - %s", __func__, e.what());
@@ -1786,6 +2091,10 @@ void static FlushBlockFile(bool fFinalize = false)
 
     CDiskBlockPos posOld(nLastBlockFile, 0);
 
+    // Mappings may reach past the end that the file is truncated to
+    if (fFinalize)
+        blockFileMaps.Invalidate(nLastBlockFile);
+
     FILE *fileOld = OpenBlockFile(posOld);
     if (fileOld) {
         if (fFinalize)
@@ -2148,6 +2457,10 @@ bool static FlushStateToDisk(CValidationState &state, FlushStateMode mode) {
         // Flush the chainstate (which may refer to block index entries).
         if (!pcoinsTip->Flush())
             return AbortNode(state, "Failed to write to coin database");
+        // With -asyncflush, the write goes on in the background unless the
+        // chainstate has to be on disk now.
+        if (pcoinswriter && (mode == FLUSH_STATE_ALWAYS || fFlushForPrune) && !pcoinswriter->Sync())
+            return AbortNode(state, "Failed to write to coin database");
         nLastFlush = nNow;
     }
     if ((mode == FLUSH_STATE_ALWAYS || mode == FLUSH_STATE_PERIODIC) && nNow > nLastSetChain + (int64_t)DATABASE_WRITE_INTERVAL * 1000000) {
@@ -2172,6 +2485,151 @@ void PruneAndFlush() {
     FlushStateToDisk(state, FLUSH_STATE_NONE);
 }
 
+/**
+ * Version of the mempool.dat format.  The file contains the version, the
+ * PrioritiseTransaction deltas, the NAME_NEW hashes of the dumped
+ * transactions and then the number of transactions followed by each transaction
+ * with its entry time (as varint).
+ */
+static const uint64_t MEMPOOL_DUMP_VERSION = 1;
+
+bool LoadMempool()
+{
+    int64_t nStart = GetTimeMillis();
+
+    FILE* filestr = fopen((GetDataDir() / "mempool.dat").string().c_str(), "rb");
+    CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+    if (file.IsNull()) {
+        LogPrintf("Failed to open mempool file from disk. Continuing anyway.\n");
+        return false;
+    }
+
+    const int64_t nExpiryTimeout = GetArg("-mempoolexpiry", DEFAULT_MEMPOOL_EXPIRY) * 60 * 60;
+    int64_t count = 0;
+    int64_t failed = 0;
+    int64_t expired = 0;
+    int64_t already_there = 0;
+
+    try {
+        uint64_t version;
+        file >> version;
+        if (version != MEMPOOL_DUMP_VERSION) {
+            LogPrintf("Unknown mempool file version %d, ignoring it.\n", version);
+            return false;
+        }
+
+        // Restore the deltas and NAME_NEW hashes first, so that they
+        // apply to the transactions as they are accepted.
+        std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+        file >> mapDeltas;
+        for (std::map<uint256, std::pair<double, CAmount> >::const_iterator it = mapDeltas.begin();
+             it != mapDeltas.end(); ++it)
+            mempool.PrioritiseTransaction(it->first, it->first.ToString(),
+                                          it->second.first, it->second.second);
+
+        std::map<valtype, uint256> mapNameNews;
+        file >> mapNameNews;
+        mempool.restoreNameNews(mapNameNews);
+
+        uint64_t num;
+        file >> VARINT(num);
+        while (num--) {
+            CTransaction tx;
+            uint64_t nTime;
+            file >> tx;
+            file >> VARINT(nTime);
+
+            // The transactions have been seen before, so they are not
+            // used for fee estimation.
+            CValidationState state;
+            LOCK(cs_main);
+            if ((int64_t)nTime + nExpiryTimeout <= GetTime()) {
+                ++expired;
+            } else if (mempool.exists(tx.GetHash())) {
+                ++already_there;
+            } else if (AcceptToMemoryPoolWithTime(mempool, state, tx, true, NULL, nTime, false, false)) {
+                ++count;
+            } else {
+                ++failed;
+            }
+            if (ShutdownRequested())
+                return false;
+        }
+
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to deserialize mempool data on disk: %s. Continuing anyway.\n", e.what());
+        return false;
+    }
+
+    LogPrintf("Imported mempool transactions from disk: %i successes, %i failed, %i expired, %i already there (%dms)\n",
+              count, failed, expired, already_there, GetTimeMillis() - nStart);
+    return true;
+}
+
+bool DumpMempool()
+{
+    int64_t nStart = GetTimeMillis();
+
+    std::vector<std::pair<CTransaction, int64_t> > vinfo;
+    std::map<uint256, std::pair<double, CAmount> > mapDeltas;
+    std::map<valtype, uint256> mapNameNews;
+
+    {
+        LOCK(mempool.cs);
+        vinfo.reserve(mempool.mapTx.size());
+        // Write the transactions in the order they were added, so that
+        // parents are accepted before their children when loading.
+        BOOST_FOREACH(const CTxMemPoolEntry& entry, mempool.mapTx.get<insertion_order>())
+            vinfo.push_back(std::make_pair(entry.GetTx(), entry.GetTime()));
+        mapDeltas = mempool.mapDeltas;
+    }
+
+    // The name mempool remembers NAME_NEW hashes also after their
+    // transaction left the pool.  Only those of dumped transactions are
+    // written, so that the stale ones do not pile up across restarts.
+    std::set<uint256> setDumped;
+    for (std::vector<std::pair<CTransaction, int64_t> >::const_iterator it = vinfo.begin();
+         it != vinfo.end(); ++it)
+        setDumped.insert(it->first.GetHash());
+    std::map<valtype, uint256> mapAllNameNews;
+    mempool.getNameNews(mapAllNameNews);
+    for (std::map<valtype, uint256>::const_iterator it = mapAllNameNews.begin();
+         it != mapAllNameNews.end(); ++it)
+        if (setDumped.count(it->second))
+            mapNameNews.insert(*it);
+
+    int64_t nMid = GetTimeMillis();
+
+    try {
+        const boost::filesystem::path pathTmp = GetDataDir() / "mempool.dat.new";
+        FILE* filestr = fopen(pathTmp.string().c_str(), "wb");
+        if (!filestr)
+            return false;
+
+        CAutoFile file(filestr, SER_DISK, CLIENT_VERSION);
+
+        file << MEMPOOL_DUMP_VERSION;
+        file << mapDeltas;
+        file << mapNameNews;
+        file << VARINT((uint64_t)vinfo.size());
+        for (std::vector<std::pair<CTransaction, int64_t> >::const_iterator it = vinfo.begin();
+             it != vinfo.end(); ++it) {
+            file << it->first;
+            file << VARINT((uint64_t)it->second);
+        }
+
+        FileCommit(file.Get());
+        file.fclose();
+        RenameOver(pathTmp, GetDataDir() / "mempool.dat");
+        int64_t nLast = GetTimeMillis();
+        LogPrintf("Dumped mempool: %gs to copy, %gs to dump\n", (nMid-nStart)*0.001, (nLast-nMid)*0.001);
+    } catch (const std::exception& e) {
+        LogPrintf("Failed to dump mempool: %s. Continuing anyway.\n", e.what());
+        return false;
+    }
+    return true;
+}
+
 /** Update chainActive and related internal data structures. */
 void static UpdateTip(CBlockIndex *pindexNew) {
     const CChainParams& chainParams = Params();
@@ -2634,6 +3092,35 @@ CBlockIndex* AddToBlockIndex(const CBlockHeader& block)
     return pindexNew;
 }
 
+/**
+ * Set nChainTx of the queued blocks, all of whose parents have been
+ * received, and recursively of any descendants that were waiting for them
+ * in mapBlocksUnlinked.  Blocks that are at least as good as the tip
+ * become candidates for it.
+ */
+static void LinkReceivedBlocks(std::deque<CBlockIndex*>& queue)
+{
+    while (!queue.empty()) {
+        CBlockIndex *pindex = queue.front();
+        queue.pop_front();
+        pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
+        {
+            LOCK(cs_nBlockSequenceId);
+            pindex->nSequenceId = nBlockSequenceId++;
+        }
+        if (chainActive.Tip() == NULL || !setBlockIndexCandidates.value_comp()(pindex, chainActive.Tip())) {
+            setBlockIndexCandidates.insert(pindex);
+        }
+        std::pair<std::multimap<CBlockIndex*, CBlockIndex*>::iterator, std::multimap<CBlockIndex*, CBlockIndex*>::iterator> range = mapBlocksUnlinked.equal_range(pindex);
+        while (range.first != range.second) {
+            std::multimap<CBlockIndex*, CBlockIndex*>::iterator it = range.first;
+            queue.push_back(it->second);
+            range.first++;
+            mapBlocksUnlinked.erase(it);
+        }
+    }
+}
+
 /** Mark a block as having its data received and checked (up to BLOCK_VALID_TRANSACTIONS). */
 bool ReceivedBlockTransactions(const CBlock &block, CValidationState& state, CBlockIndex *pindexNew, const CDiskBlockPos& pos)
 {
@@ -2650,34 +3137,200 @@ bool ReceivedBlockTransactions(const CBlock &block, CValidationState& state, CBl
         // If pindexNew is the genesis block or all parents are BLOCK_VALID_TRANSACTIONS.
         deque<CBlockIndex*> queue;
         queue.push_back(pindexNew);
+        LinkReceivedBlocks(queue);
+    } else {
+        if (pindexNew->pprev && pindexNew->pprev->IsValid(BLOCK_VALID_TREE)) {
+            mapBlocksUnlinked.insert(std::make_pair(pindexNew->pprev, pindexNew));
+        }
+    }
 
-        // Recursively process any descendant blocks that now may be eligible to be connected.
-        while (!queue.empty()) {
-            CBlockIndex *pindex = queue.front();
-            queue.pop_front();
-            pindex->nChainTx = (pindex->pprev ? pindex->pprev->nChainTx : 0) + pindex->nTx;
-            {
+    return true;
+}
+
+/**
+ * Check that a chain state snapshot fits the current chain.  The snapshot
+ * block must be a known header that extends the active chain.
+ */
+static bool CheckChainStateSnapshot(const CChainStateSnapshot& header, CValidationState& state, CBlockIndex*& pindex)
+{
+    AssertLockHeld(cs_main);
+
+    if (header.nVersion != CChainStateSnapshot::CURRENT_VERSION)
+        return state.Error(strprintf("unsupported snapshot version %d", header.nVersion));
+    if (memcmp(header.pchMessageStart, Params().MessageStart(), sizeof(header.pchMessageStart)) != 0)
+        return state.Error("snapshot is for a different network");
+    if (fNameHistory && !header.fNameHistory)
+        return state.Error("snapshot does not include the name history, but -namehistory is enabled");
+
+    BlockMap::iterator mi = mapBlockIndex.find(header.hashBlock);
+    if (mi == mapBlockIndex.end())
+        return state.Error(strprintf("snapshot block %s is not known, wait for the headers to be synced",
+                                     header.hashBlock.ToString()));
+    pindex = mi->second;
+    if (pindex->nStatus & BLOCK_FAILED_MASK)
+        return state.Error(strprintf("snapshot block %s is invalid", header.hashBlock.ToString()));
+    if (header.vTxCount.size() != static_cast<size_t>(pindex->nHeight))
+        return state.Error("snapshot transaction counts do not match the block height");
+    if (std::find(header.vTxCount.begin(), header.vTxCount.end(), 0) != header.vTxCount.end())
+        return state.Error("snapshot contains blocks without transactions");
+    if (chainActive.Height() >= pindex->nHeight || pindex->GetAncestor(chainActive.Height()) != chainActive.Tip())
+        return state.Error("the active chain is not an ancestor of the snapshot block");
+
+    return true;
+}
+
+bool DumpChainStateSnapshot(const boost::filesystem::path& path, CChainStateSnapshot& header,
+                            CChainStateSnapshotStats& stats, CValidationState& state)
+{
+    boost::scoped_ptr<CChainStateDBSnapshot> snapshot;
+    {
+        LOCK(cs_main);
+        FlushStateToDisk();
+
+        const CBlockIndex* pindex = chainActive.Tip();
+        header.SetNull();
+        memcpy(header.pchMessageStart, Params().MessageStart(), sizeof(header.pchMessageStart));
+        header.hashBlock = pindex->GetBlockHash();
+        header.fNameHistory = fNameHistory;
+        header.vTxCount.resize(pindex->nHeight);
+        for (const CBlockIndex* pindexWalk = pindex; pindexWalk->pprev; pindexWalk = pindexWalk->pprev)
+            header.vTxCount[pindexWalk->nHeight - 1] = pindexWalk->nTx;
+
+        /* The records are streamed from a database snapshot, so that
+           the node can go on while the file is written.  */
+        snapshot.reset(pcoinsdbview->GetSnapshot());
+    }
+
+    const int64_t nStart = GetTimeMillis();
+    const boost::filesystem::path pathTmp = path.string() + ".incomplete";
+    CAutoFile file(fopen(pathTmp.string().c_str(), "wb"), SER_DISK, CLIENT_VERSION);
+    if (file.IsNull())
+        return state.Error(strprintf("cannot open %s for writing", pathTmp.string()));
+    try {
+        if (!pcoinsdbview->DumpSnapshot(*snapshot, header, file, stats))
+            return state.Error("failed to read the coin database");
+        FileCommit(file.Get());
+        file.fclose();
+    } catch (const std::exception& e) {
+        return state.Error(strprintf("failed to write snapshot: %s", e.what()));
+    }
+    if (!RenameOver(pathTmp, path))
+        return state.Error(strprintf("cannot rename %s", pathTmp.string()));
+
+    LogPrintf("Dumped chain state snapshot at %s: %u coins, %u names (%dms)\n",
+              header.hashBlock.ToString(), stats.nCoins, stats.nNames, GetTimeMillis() - nStart);
+    return true;
+}
+
+bool LoadChainStateSnapshot(const boost::filesystem::path& path, const uint256& hashExpected,
+                            CChainStateSnapshot& header, CChainStateSnapshotStats& stats,
+                            CValidationState& state)
+{
+    /* The blocks up to the snapshot are never downloaded, so the node
+       looks like one that has pruned them.  */
+    if (!fPruneMode)
+        return state.Error("loading a snapshot requires pruning (-prune)");
+
+    /* There is only one scratch database for the staged records.  */
+    static CCriticalSection cs_LoadSnapshot;
+    TRY_LOCK(cs_LoadSnapshot, lockLoad);
+    if (!lockLoad)
+        return state.Error("another snapshot is being loaded");
+
+    const int64_t nStart = GetTimeMillis();
+
+    /* Read and verify the records once, without holding cs_main.  They
+       are staged next to the chain state, which stays as it is until
+       the checksum is known to be the expected one.  */
+    try {
+        CAutoFile file(fopen(path.string().c_str(), "rb"), SER_DISK, CLIENT_VERSION);
+        if (file.IsNull())
+            return state.Error(strprintf("cannot open %s", path.string()));
+        file >> header;
+        {
+            LOCK(cs_main);
+            CBlockIndex* pindex;
+            if (!CheckChainStateSnapshot(header, state, pindex))
+                return false;
+        }
+        if (!pcoinsdbview->StageSnapshot(file, header, stats))
+            return state.Error("snapshot file is corrupt");
+    } catch (const std::exception& e) {
+        pcoinsdbview->DiscardStagedSnapshot();
+        return state.Error(strprintf("failed to read snapshot: %s", e.what()));
+    }
+    if (stats.hashChecksum != hashExpected) {
+        pcoinsdbview->DiscardStagedSnapshot();
+        return state.Error(strprintf("snapshot checksum %s does not match the expected %s",
+                                     stats.hashChecksum.ToString(), hashExpected.ToString()));
+    }
+
+    {
+        LOCK(cs_main);
+        CBlockIndex* pindex;
+        if (!CheckChainStateSnapshot(header, state, pindex)) {
+            pcoinsdbview->DiscardStagedSnapshot();
+            return false;
+        }
+
+        FlushStateToDisk();
+        mempool.clear();
+
+        /* From here on the old chain state is gone, so failures
+           are fatal.  */
+        try {
+            if (!pcoinsdbview->ApplyStagedSnapshot(header))
+                return AbortNode(state, "Failed to load chain state snapshot");
+        } catch (const std::exception& e) {
+            return AbortNode(state, strprintf("Failed to load chain state snapshot: %s", e.what()));
+        }
+        pcoinsdbview->DiscardStagedSnapshot();
+        pcoinsTip->SetBestBlock(header.hashBlock);
+
+        /* Link the block index up to the snapshot block as if its blocks
+           had been received and then pruned.  */
+        std::vector<CBlockIndex*> vChain(pindex->nHeight);
+        for (CBlockIndex* pindexWalk = pindex; pindexWalk->pprev; pindexWalk = pindexWalk->pprev)
+            vChain[pindexWalk->nHeight - 1] = pindexWalk;
+        chainActive.SetTip(pindex);
+        BOOST_FOREACH(CBlockIndex* pindexWalk, vChain) {
+            pindexWalk->nTx = header.vTxCount[pindexWalk->nHeight - 1];
+            pindexWalk->RaiseValidity(BLOCK_VALID_SCRIPTS);
+            setDirtyBlockIndex.insert(pindexWalk);
+        }
+        std::deque<CBlockIndex*> queue;
+        BOOST_FOREACH(CBlockIndex* pindexWalk, vChain) {
+            if (!pindexWalk->nChainTx) {
+                pindexWalk->nChainTx = pindexWalk->pprev->nChainTx + pindexWalk->nTx;
                 LOCK(cs_nBlockSequenceId);
-                pindex->nSequenceId = nBlockSequenceId++;
-            }
-            if (chainActive.Tip() == NULL || !setBlockIndexCandidates.value_comp()(pindex, chainActive.Tip())) {
-                setBlockIndexCandidates.insert(pindex);
+                pindexWalk->nSequenceId = nBlockSequenceId++;
             }
-            std::pair<std::multimap<CBlockIndex*, CBlockIndex*>::iterator, std::multimap<CBlockIndex*, CBlockIndex*>::iterator> range = mapBlocksUnlinked.equal_range(pindex);
+            std::pair<std::multimap<CBlockIndex*, CBlockIndex*>::iterator, std::multimap<CBlockIndex*, CBlockIndex*>::iterator> range = mapBlocksUnlinked.equal_range(pindexWalk);
             while (range.first != range.second) {
                 std::multimap<CBlockIndex*, CBlockIndex*>::iterator it = range.first;
-                queue.push_back(it->second);
+                if (!chainActive.Contains(it->second))
+                    queue.push_back(it->second);
                 range.first++;
                 mapBlocksUnlinked.erase(it);
             }
         }
-    } else {
-        if (pindexNew->pprev && pindexNew->pprev->IsValid(BLOCK_VALID_TREE)) {
-            mapBlocksUnlinked.insert(std::make_pair(pindexNew->pprev, pindexNew));
-        }
+        setBlockIndexCandidates.insert(pindex);
+        LinkReceivedBlocks(queue);
+        PruneBlockIndexCandidates();
+
+        fHavePruned = true;
+        pblocktree->WriteFlag("prunedblockfiles", true);
+        if (!FlushStateToDisk(state, FLUSH_STATE_ALWAYS))
+            return false;
+        CheckBlockIndex();
+        uiInterface.NotifyBlockTip(pindex->GetBlockHash());
     }
 
-    return true;
+    LogPrintf("Loaded chain state snapshot at %s: %u coins, %u names (%dms)\n",
+              header.hashBlock.ToString(), stats.nCoins, stats.nNames, GetTimeMillis() - nStart);
+
+    /* Connect blocks after the snapshot that we already have.  */
+    return ActivateBestChain(state);
 }
 
 bool FindBlockPos(CValidationState &state, CDiskBlockPos &pos, unsigned int nAddSize, unsigned int nHeight, uint64_t nTime, bool fKnown = false)
@@ -2790,7 +3443,7 @@ bool CheckDbLockLimit(const CBlock& block, const CTransaction* extraTx)
 
     const unsigned nTotalIds = setTxIds.size() + nNames;
 
-    if (nTotalIds > 4500)
+    if (nTotalIds > MAX_BLOCK_DB_LOCKS)
         return error("%s : %u locks estimated, that is too much for BDB",
                      __func__, nTotalIds);
 
@@ -2998,6 +3651,7 @@ bool AcceptBlockHeader(const CBlockHeader& block, CValidationState& state, CBloc
 
     if (pindex == NULL)
         pindex = AddToBlockIndex(block);
+    auxpowHeaderCache.Add(block);
 
     if (ppindex)
         *ppindex = pindex;
@@ -3168,6 +3822,7 @@ void PruneOneBlockFile(const int fileNumber)
 
     vinfoBlockFile[fileNumber].SetNull();
     setDirtyFileInfo.insert(fileNumber);
+    blockFileMaps.Invalidate(fileNumber);
 }
 
 
@@ -3296,6 +3951,23 @@ CBlockIndex * InsertBlockIndex(uint256 hash)
     return pindexNew;
 }
 
+/** Compute GetBlockProof for a range of blocks, for ParallelForRanges. */
+class ComputeBlockProofRange
+{
+private:
+    const std::vector<std::pair<int, CBlockIndex*> >& vBlocks;
+    std::vector<arith_uint256>& vProof;
+
+public:
+    ComputeBlockProofRange(const std::vector<std::pair<int, CBlockIndex*> >& vBlocksIn, std::vector<arith_uint256>& vProofIn)
+        : vBlocks(vBlocksIn), vProof(vProofIn) {}
+
+    void operator()(size_t nBegin, size_t nEnd) const {
+        for (size_t i = nBegin; i < nEnd; ++i)
+            vProof[i] = GetBlockProof(*vBlocks[i].second);
+    }
+};
+
 bool static LoadBlockIndexDB()
 {
     const CChainParams& chainparams = Params();
@@ -3313,10 +3985,19 @@ bool static LoadBlockIndexDB()
         vSortedByHeight.push_back(make_pair(pindex->nHeight, pindex));
     }
     sort(vSortedByHeight.begin(), vSortedByHeight.end());
-    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+
+    // The work of each block does not depend on the others and is computed
+    // in parallel.  Summing it up needs the parent, so that is done in
+    // height order.
+    uiInterface.InitMessage(_("Computing chain work..."));
+    std::vector<arith_uint256> vBlockProof(vSortedByHeight.size());
+    ParallelForRanges(vSortedByHeight.size(), ComputeBlockProofRange(vSortedByHeight, vBlockProof));
+    boost::this_thread::interruption_point();
+
+    for (size_t i = 0; i < vSortedByHeight.size(); ++i)
     {
-        CBlockIndex* pindex = item.second;
-        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + GetBlockProof(*pindex);
+        CBlockIndex* pindex = vSortedByHeight[i].second;
+        pindex->nChainWork = (pindex->pprev ? pindex->pprev->nChainWork : 0) + vBlockProof[i];
         // We can link the chain of blocks for which we've received transactions at some point.
         // Pruned nodes may have deleted the block.
         if (pindex->nTx > 0) {
@@ -3335,12 +4016,24 @@ bool static LoadBlockIndexDB()
             setBlockIndexCandidates.insert(pindex);
         if (pindex->nStatus & BLOCK_FAILED_MASK && (!pindexBestInvalid || pindex->nChainWork > pindexBestInvalid->nChainWork))
             pindexBestInvalid = pindex;
-        if (pindex->pprev)
-            pindex->BuildSkip();
         if (pindex->IsValid(BLOCK_VALID_TREE) && (pindexBestHeader == NULL || CBlockIndexWorkComparator()(pindexBestHeader, pindex)))
             pindexBestHeader = pindex;
     }
 
+    // The skip pointers of the blocks on the best header chain are taken
+    // from the chain itself, in parallel.  The few blocks on forks then
+    // walk back through their ancestors, in height order so that those
+    // are linked already.
+    CChain chainHeaders;
+    chainHeaders.SetTip(pindexBestHeader);
+    ParallelForRanges(chainHeaders.Height() + 1, boost::bind(&CChain::BuildSkipRange, &chainHeaders, _1, _2));
+    BOOST_FOREACH(const PAIRTYPE(int, CBlockIndex*)& item, vSortedByHeight)
+    {
+        CBlockIndex* pindex = item.second;
+        if (pindex->pprev && !chainHeaders.Contains(pindex))
+            pindex->BuildSkip();
+    }
+
     // Load block file info
     pblocktree->ReadLastBlockFile(nLastBlockFile);
     vinfoBlockFile.resize(nLastBlockFile + 1);
@@ -3410,95 +4103,290 @@ bool static LoadBlockIndexDB()
     return true;
 }
 
-CVerifyDB::CVerifyDB()
+/** Progress of the last CVerifyDB run, protected by cs_verifyProgress */
+static CCriticalSection cs_verifyProgress;
+static CVerifyDBProgress verifyProgress;
+
+CVerifyDBProgress GetVerifyDBProgress()
+{
+    LOCK(cs_verifyProgress);
+    return verifyProgress;
+}
+
+/** Number of blocks read and checked at once by VerifyDB */
+static const unsigned int VERIFYDB_BATCH_BLOCKS = 32;
+
+/** A block to verify, filled in by CBlockVerifyCheck */
+struct CVerifyDBBlock
+{
+    enum Result { UNCHECKED, OK, READ_FAILED, BAD_BLOCK, BAD_UNDO };
+
+    CBlockIndex* pindex;
+    //! Positions of the block and undo data, as in the index when handed out
+    CDiskBlockPos pos;
+    CDiskBlockPos posUndo;
+    CBlock block;
+    Result result;
+
+    CVerifyDBBlock() : pindex(NULL), result(UNCHECKED) {}
+};
+
+/**
+ * Check levels 0 to 2 of VerifyDB for one block.  These need neither
+ * cs_main nor the coins, so that the blocks of a batch are checked in
+ * parallel on the threads of a CCheckQueue.
+ */
+class CBlockVerifyCheck
+{
+private:
+    CVerifyDBBlock* pblock;
+    int nCheckLevel;
+
+public:
+    CBlockVerifyCheck() : pblock(NULL), nCheckLevel(0) {}
+    CBlockVerifyCheck(CVerifyDBBlock* pblockIn, int nCheckLevelIn) : pblock(pblockIn), nCheckLevel(nCheckLevelIn) {}
+
+    bool operator()()
+    {
+        CBlockIndex* pindex = pblock->pindex;
+        // check level 0: read from disk
+        if (!ReadBlockFromDisk(pblock->block, pblock->pos) || pblock->block.GetHash() != pindex->GetBlockHash()) {
+            pblock->result = CVerifyDBBlock::READ_FAILED;
+            return false;
+        }
+        // check level 1: verify block validity
+        CValidationState state;
+        if (nCheckLevel >= 1 && !CheckBlock(pblock->block, state)) {
+            pblock->result = CVerifyDBBlock::BAD_BLOCK;
+            return false;
+        }
+        // check level 2: verify undo validity
+        if (nCheckLevel >= 2 && !pblock->posUndo.IsNull()) {
+            CBlockUndo undo;
+            if (!UndoReadFromDisk(undo, pblock->posUndo, pindex->pprev->GetBlockHash())) {
+                pblock->result = CVerifyDBBlock::BAD_UNDO;
+                return false;
+            }
+        }
+        pblock->result = CVerifyDBBlock::OK;
+        return true;
+    }
+
+    void swap(CBlockVerifyCheck& check)
+    {
+        std::swap(pblock, check.pblock);
+        std::swap(nCheckLevel, check.nCheckLevel);
+    }
+};
+
+/** Whether the data of a block has been pruned (maybe after it was handed to a check) */
+static bool IsBlockPruned(const CBlockIndex* pindex)
+{
+    LOCK(cs_main);
+    return !(pindex->nStatus & BLOCK_HAVE_DATA);
+}
+
+CVerifyDB::CVerifyDB(bool fBackgroundIn) : fBackground(fBackgroundIn)
 {
-    uiInterface.ShowProgress(_("Verifying blocks..."), 0);
+    if (!fBackground)
+        uiInterface.ShowProgress(_("Verifying blocks..."), 0);
 }
 
 CVerifyDB::~CVerifyDB()
 {
-    uiInterface.ShowProgress("", 100);
+    if (!fBackground)
+        uiInterface.ShowProgress("", 100);
+    LOCK(cs_verifyProgress);
+    verifyProgress.fRunning = false;
+}
+
+void CVerifyDB::ReportProgress(int nHeight, int nPercent)
+{
+    if (!fBackground)
+        uiInterface.ShowProgress(_("Verifying blocks..."), nPercent);
+    LOCK(cs_verifyProgress);
+    verifyProgress.nHeight = nHeight;
+    verifyProgress.dProgress = nPercent / 100.0;
 }
 
 bool CVerifyDB::VerifyDB(CCoinsView *coinsview, int nCheckLevel, int nCheckDepth)
 {
-    LOCK(cs_main);
-    if (chainActive.Tip() == NULL || chainActive.Tip()->pprev == NULL)
+    // The blocks are verified below the best block of coinsview, which is
+    // the active tip unless coinsview is a snapshot taken earlier.
+    CBlockIndex* pindexTip = NULL;
+    {
+        LOCK(cs_main);
+        BlockMap::iterator mi = mapBlockIndex.find(coinsview->GetBestBlock());
+        if (mi != mapBlockIndex.end())
+            pindexTip = mi->second;
+        else if (chainActive.Tip() != NULL)
+            return error("VerifyDB(): *** best block of the coin database is not in the block index");
+    }
+    if (pindexTip == NULL || pindexTip->pprev == NULL)
         return true;
 
     // Verify blocks in the best chain
+    const int nTipHeight = pindexTip->nHeight;
     if (nCheckDepth <= 0)
         nCheckDepth = 1000000000; // suffices until the year 19000
-    if (nCheckDepth > chainActive.Height())
-        nCheckDepth = chainActive.Height();
+    if (nCheckDepth > nTipHeight)
+        nCheckDepth = nTipHeight;
     nCheckLevel = std::max(0, std::min(4, nCheckLevel));
-    LogPrintf("Verifying last %i blocks at level %i\n", nCheckDepth, nCheckLevel);
+    LogPrintf("Verifying last %i blocks at level %i%s\n", nCheckDepth, nCheckLevel, fBackground ? " in the background" : "");
+    {
+        LOCK(cs_verifyProgress);
+        verifyProgress = CVerifyDBProgress();
+        verifyProgress.fBackground = fBackground;
+        verifyProgress.fRunning = true;
+        verifyProgress.nCheckLevel = nCheckLevel;
+        verifyProgress.nCheckDepth = nCheckDepth;
+        verifyProgress.nTipHeight = nTipHeight;
+        verifyProgress.nHeight = nTipHeight;
+    }
+
+    // Levels 0 to 2 run on the script check threads (-par) in batches,
+    // level 3 goes through each batch in order afterwards.
+    CCheckQueue<CBlockVerifyCheck> queue(1);
+    CCheckQueueThreads<CBlockVerifyCheck> workers(queue, nScriptCheckThreads - 1);
+
     CCoinsViewCache coins(coinsview);
     std::set<valtype> dummyNames;
-    CBlockIndex* pindexState = chainActive.Tip();
+    CBlockIndex* pindexState = pindexTip;
     CBlockIndex* pindexFailure = NULL;
     int nGoodTransactions = 0;
     CValidationState state;
-    for (CBlockIndex* pindex = chainActive.Tip(); pindex && pindex->pprev; pindex = pindex->pprev)
+    std::vector<CVerifyDBBlock> vBlocks(VERIFYDB_BATCH_BLOCKS);
+    CBlockIndex* pindexNext = pindexTip;
+    while (pindexNext && pindexNext->pprev && pindexNext->nHeight >= nTipHeight - nCheckDepth)
     {
         boost::this_thread::interruption_point();
-        uiInterface.ShowProgress(_("Verifying blocks..."), std::max(1, std::min(99, (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * (nCheckLevel >= 4 ? 50 : 100)))));
-        if (pindex->nHeight < chainActive.Height()-nCheckDepth)
-            break;
-        CBlock block;
-        // check level 0: read from disk
-        if (!ReadBlockFromDisk(block, pindex))
-            return error("VerifyDB(): *** ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
-        // check level 1: verify block validity
-        if (nCheckLevel >= 1 && !CheckBlock(block, state))
-            return error("VerifyDB(): *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
-        // check level 2: verify undo validity
-        if (nCheckLevel >= 2 && pindex) {
-            CBlockUndo undo;
-            CDiskBlockPos pos = pindex->GetUndoPos();
-            if (!pos.IsNull()) {
-                if (!UndoReadFromDisk(undo, pos, pindex->pprev->GetBlockHash()))
-                    return error("VerifyDB(): *** found bad undo data at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+        ReportProgress(pindexNext->nHeight, std::max(1, std::min(99, (int)(((double)(nTipHeight - pindexNext->nHeight)) / (double)nCheckDepth * (nCheckLevel >= 4 ? 50 : 100)))));
+
+        // Hand out the next batch of blocks
+        unsigned int nBlocks = 0;
+        {
+            LOCK(cs_main);
+            for (; nBlocks < vBlocks.size() && pindexNext && pindexNext->pprev && pindexNext->nHeight >= nTipHeight - nCheckDepth; pindexNext = pindexNext->pprev) {
+                if (!(pindexNext->nStatus & BLOCK_HAVE_DATA))
+                    break;
+                CVerifyDBBlock& block = vBlocks[nBlocks++];
+                block.pindex = pindexNext;
+                block.pos = pindexNext->GetBlockPos();
+                block.posUndo = pindexNext->GetUndoPos();
+                block.result = CVerifyDBBlock::UNCHECKED;
             }
         }
-        // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
-        if (nCheckLevel >= 3 && pindex == pindexState && (coins.DynamicMemoryUsage() + pcoinsTip->DynamicMemoryUsage()) <= nCoinCacheUsage) {
-            bool fClean = true;
-            if (!DisconnectBlock(block, state, pindex, coins, dummyNames, &fClean))
-                return error("VerifyDB(): *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
-            pindexState = pindex->pprev;
-            if (!fClean) {
-                nGoodTransactions = 0;
-                pindexFailure = pindex;
-            } else
-                nGoodTransactions += block.vtx.size();
+        if (nBlocks == 0) {
+            LogPrintf("VerifyDB(): block data below height %d has been pruned, stopping\n", pindexNext->nHeight + 1);
+            break;
+        }
+        {
+            std::vector<CBlockVerifyCheck> vChecks;
+            vChecks.reserve(nBlocks);
+            for (unsigned int i = 0; i < nBlocks; i++)
+                vChecks.push_back(CBlockVerifyCheck(&vBlocks[i], nCheckLevel));
+            CCheckQueueControl<CBlockVerifyCheck> control(&queue);
+            control.Add(vChecks);
+            control.Wait();
+        }
+
+        for (unsigned int i = 0; i < nBlocks; i++) {
+            CVerifyDBBlock& block = vBlocks[i];
+            CBlockIndex* pindex = block.pindex;
+            if (block.result == CVerifyDBBlock::UNCHECKED)
+                continue; // skipped after another block of the batch failed
+            // With pruning, the files can go away while they are checked.
+            if ((block.result == CVerifyDBBlock::READ_FAILED || block.result == CVerifyDBBlock::BAD_UNDO) && IsBlockPruned(pindex)) {
+                LogPrintf("VerifyDB(): block data at height %d has been pruned, stopping\n", pindex->nHeight);
+                pindexNext = NULL;
+                break;
+            }
+            if (block.result == CVerifyDBBlock::READ_FAILED)
+                return error("VerifyDB(): *** ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
+            if (block.result == CVerifyDBBlock::BAD_BLOCK)
+                return error("VerifyDB(): *** found bad block at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+            if (block.result == CVerifyDBBlock::BAD_UNDO)
+                return error("VerifyDB(): *** found bad undo data at %d, hash=%s\n", pindex->nHeight, pindex->GetBlockHash().ToString());
+            // check level 3: check for inconsistencies during memory-only disconnect of tip blocks
+            if (nCheckLevel >= 3 && pindex == pindexState) {
+                size_t nTipUsage;
+                {
+                    LOCK(cs_main);
+                    nTipUsage = pcoinsTip->DynamicMemoryUsage();
+                }
+                if (coins.DynamicMemoryUsage() + nTipUsage > nCoinCacheUsage)
+                    continue;
+                bool fClean = true;
+                if (!DisconnectBlock(block.block, state, pindex, coins, dummyNames, &fClean)) {
+                    if (IsBlockPruned(pindex)) {
+                        LogPrintf("VerifyDB(): block data at height %d has been pruned, stopping\n", pindex->nHeight);
+                        pindexNext = NULL;
+                        break;
+                    }
+                    return error("VerifyDB(): *** irrecoverable inconsistency in block data at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
+                }
+                pindexState = pindex->pprev;
+                if (!fClean) {
+                    nGoodTransactions = 0;
+                    pindexFailure = pindex;
+                } else
+                    nGoodTransactions += block.block.vtx.size();
+            }
         }
         if (ShutdownRequested())
             return true;
     }
     if (pindexFailure)
-        return error("VerifyDB(): *** coin database inconsistencies found (last %i blocks, %i good transactions before that)\n", chainActive.Height() - pindexFailure->nHeight + 1, nGoodTransactions);
+        return error("VerifyDB(): *** coin database inconsistencies found (last %i blocks, %i good transactions before that)\n", nTipHeight - pindexFailure->nHeight + 1, nGoodTransactions);
 
     // check level 4: try reconnecting blocks
     if (nCheckLevel >= 4) {
         CBlockIndex *pindex = pindexState;
-        while (pindex != chainActive.Tip()) {
+        while (pindex != pindexTip) {
             boost::this_thread::interruption_point();
-            uiInterface.ShowProgress(_("Verifying blocks..."), std::max(1, std::min(99, 100 - (int)(((double)(chainActive.Height() - pindex->nHeight)) / (double)nCheckDepth * 50))));
-            pindex = chainActive.Next(pindex);
+            ReportProgress(pindex->nHeight, std::max(1, std::min(99, 100 - (int)(((double)(nTipHeight - pindex->nHeight)) / (double)nCheckDepth * 50))));
+            pindex = pindexTip->GetAncestor(pindex->nHeight + 1);
             CBlock block;
-            if (!ReadBlockFromDisk(block, pindex))
+            LOCK(cs_main);
+            if (!ReadBlockFromDisk(block, pindex)) {
+                if (!(pindex->nStatus & BLOCK_HAVE_DATA)) {
+                    LogPrintf("VerifyDB(): block data at height %d has been pruned, stopping\n", pindex->nHeight);
+                    break;
+                }
                 return error("VerifyDB(): *** ReadBlockFromDisk failed at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
+            }
             if (!ConnectBlock(block, state, pindex, coins, dummyNames))
                 return error("VerifyDB(): *** found unconnectable block at %d, hash=%s", pindex->nHeight, pindex->GetBlockHash().ToString());
         }
     }
 
-    LogPrintf("No coin database inconsistencies in last %i blocks (%i transactions)\n", chainActive.Height() - pindexState->nHeight, nGoodTransactions);
+    LogPrintf("No coin database inconsistencies in last %i blocks (%i transactions)\n", nTipHeight - pindexState->nHeight, nGoodTransactions);
+    LOCK(cs_verifyProgress);
+    verifyProgress.fOk = true;
+    verifyProgress.dProgress = 1.0;
 
     return true;
 }
 
+void ThreadVerifyDB(int nCheckLevel, int nCheckDepth)
+{
+    RenameThread("namecoin-verify");
+
+    // Verify against a snapshot of the databases at the tip, so that the
+    // node can go on connecting blocks meanwhile.
+    boost::scoped_ptr<CCoinsViewDBSnapshot> pview;
+    {
+        LOCK(cs_main);
+        CValidationState state;
+        if (!FlushStateToDisk(state, FLUSH_STATE_ALWAYS))
+            return;
+        pview.reset(new CCoinsViewDBSnapshot(pcoinsdbview->GetSnapshot()));
+    }
+
+    if (!CVerifyDB(true).VerifyDB(pview.get(), nCheckLevel, nCheckDepth) && !ShutdownRequested())
+        AbortNode("Corrupted block database detected", _("Corrupted block database detected"));
+}
+
 void UnloadBlockIndex()
 {
     LOCK(cs_main);
@@ -3527,6 +4415,8 @@ void UnloadBlockIndex()
     }
     mapBlockIndex.clear();
     fHavePruned = false;
+    blockFileMaps.Clear();
+    auxpowHeaderCache.Clear();
 }
 
 bool LoadBlockIndex()
@@ -3541,6 +4431,9 @@ bool LoadBlockIndex()
 bool InitBlockIndex() {
     const CChainParams& chainparams = Params();
     LOCK(cs_main);
+
+    // Initialize global variables that cannot be constructed at startup.
+    recentRejects.reset(new CRollingBloomFilter(120000, 0.000001, GetRand(std::numeric_limits<unsigned int>::max())));
     // Check whether we're already initialized
     if (chainActive.Genesis() != NULL)
         return true;
@@ -3945,10 +4838,21 @@ bool static AlreadyHave(const CInv& inv)
     {
     case MSG_TX:
         {
-            bool txInMap = false;
-            txInMap = mempool.exists(inv.hash);
-            return txInMap || mapOrphanTransactions.count(inv.hash) ||
-                pcoinsTip->HaveCoins(inv.hash);
+            assert(recentRejects);
+            if (chainActive.Tip()->GetBlockHash() != hashRecentRejectsChainTip)
+            {
+                // If the chain tip has changed previously rejected transactions
+                // might be now valid, e.g. due to a nLockTime'd tx becoming valid,
+                // a double-spend or a name operation that conflicted before.
+                // Reset the rejects filter and give those txs a second chance.
+                hashRecentRejectsChainTip = chainActive.Tip()->GetBlockHash();
+                recentRejects->clear();
+            }
+
+            return recentRejects->contains(inv.hash) ||
+                   mempool.exists(inv.hash) ||
+                   mapOrphanTransactions.count(inv.hash) ||
+                   pcoinsTip->HaveCoins(inv.hash);
         }
     case MSG_BLOCK:
         return mapBlockIndex.count(inv.hash);
@@ -4021,7 +4925,7 @@ void static ProcessGetData(CNode* pfrom)
                             // however we MUST always provide at least what the remote peer needs
                             typedef std::pair<unsigned int, uint256> PairType;
                             BOOST_FOREACH(PairType& pair, merkleBlock.vMatchedTxn)
-                                if (!pfrom->setInventoryKnown.count(CInv(MSG_TX, pair.second)))
+                                if (!pfrom->filterInventoryKnown.contains(pair.second))
                                     pfrom->PushMessage("tx", block.vtx[pair.first]);
                         }
                         // else
@@ -4544,6 +5448,7 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
                         }
                         // too-little-fee orphan
                         LogPrint("mempool", "   removed orphan tx %s\n", orphanHash.ToString());
+                        recentRejects->insert(orphanHash);
                     }
                     mempool.check(pcoinsTip);
                 }
@@ -4561,11 +5466,15 @@ bool static ProcessMessage(CNode* pfrom, string strCommand, CDataStream& vRecv,
             unsigned int nEvicted = LimitOrphanTxSize(nMaxOrphanTx);
             if (nEvicted > 0)
                 LogPrint("mempool", "mapOrphan overflow, removed %u tx\n", nEvicted);
-        } else if (pfrom->fWhitelisted) {
-            // Always relay transactions received from whitelisted peers, even
-            // if they are already in the mempool (allowing the node to function
-            // as a gateway for nodes hidden behind it).
-            RelayTransaction(tx);
+        } else {
+            recentRejects->insert(tx.GetHash());
+
+            if (pfrom->fWhitelisted) {
+                // Always relay transactions received from whitelisted peers, even
+                // if they are already in the mempool (allowing the node to function
+                // as a gateway for nodes hidden behind it).
+                RelayTransaction(tx);
+            }
         }
         int nDoS = 0;
         if (state.IsInvalid(nDoS))
@@ -5152,7 +6061,7 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
             vInvWait.reserve(pto->vInventoryToSend.size());
             BOOST_FOREACH(const CInv& inv, pto->vInventoryToSend)
             {
-                if (pto->setInventoryKnown.count(inv))
+                if (pto->filterInventoryKnown.contains(inv.hash))
                     continue;
 
                 // trickle out tx inv to protect privacy
@@ -5173,15 +6082,13 @@ bool SendMessages(CNode* pto, bool fSendTrickle)
                     }
                 }
 
-                // returns true if wasn't already contained in the set
-                if (pto->setInventoryKnown.insert(inv).second)
+                pto->filterInventoryKnown.insert(inv.hash);
+
+                vInv.push_back(inv);
+                if (vInv.size() >= 1000)
                 {
-                    vInv.push_back(inv);
-                    if (vInv.size() >= 1000)
-                    {
-                        pto->PushMessage("inv", vInv);
-                        vInv.clear();
-                    }
+                    pto->PushMessage("inv", vInv);
+                    vInv.clear();
                 }
             }
             pto->vInventoryToSend = vInvWait;
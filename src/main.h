@@ -41,12 +41,16 @@
 class CBlockIndex;
 class CBlockTreeDB;
 class CBloomFilter;
+class CChainStateSnapshot;
+class CCoinsViewAsyncWriter;
+class CCoinsViewDB;
 class CInv;
 class CScriptCheck;
 class CTxInUndo;
 class CValidationInterface;
 class CValidationState;
 
+struct CChainStateSnapshotStats;
 struct CNodeStateStats;
 
 /** Default for -blockmaxsize and -blockminsize, which control the range of sizes the mining code will create **/
@@ -62,6 +66,18 @@ static const unsigned int MAX_P2SH_SIGOPS = 15;
 static const unsigned int MAX_STANDARD_TX_SIGOPS = MAX_BLOCK_SIGOPS/5;
 /** Default for -maxorphantx, maximum number of orphan transactions kept in memory */
 static const unsigned int DEFAULT_MAX_ORPHAN_TRANSACTIONS = 100;
+/** Default for -maxmempool, maximum megabytes of mempool memory usage */
+static const unsigned int DEFAULT_MAX_MEMPOOL_SIZE = 300;
+/** Default for -mempoolexpiry, expiration time for mempool transactions in hours */
+static const unsigned int DEFAULT_MEMPOOL_EXPIRY = 72;
+/** Default for -persistmempool */
+static const bool DEFAULT_PERSIST_MEMPOOL = true;
+/** Default for -asyncverify */
+static const bool DEFAULT_ASYNC_VERIFY = false;
+/** -blockfilemaps default (number of memory-mapped blk/rev files, 0 = disabled) */
+static const int DEFAULT_BLOCKFILE_MAPS = 0;
+/** -headercache default (megabytes of auxpow block headers kept in memory) */
+static const unsigned int DEFAULT_HEADER_CACHE = 16;
 /** The maximum size of a blk?????.dat file (since 0.8) */
 static const unsigned int MAX_BLOCKFILE_SIZE = 0x8000000; // 128 MiB
 /** The pre-allocation chunk size for blk?????.dat files (since 0.8) */
@@ -109,11 +125,13 @@ extern CConditionVariable cvBlockChange;
 extern bool fImporting;
 extern bool fReindex;
 extern int nScriptCheckThreads;
+extern int nBlockFileMaps;
 extern bool fTxIndex;
 extern bool fIsBareMultisigStd;
 extern bool fCheckBlockIndex;
 extern bool fCheckpointsEnabled;
 extern size_t nCoinCacheUsage;
+extern size_t nHeaderCacheUsage;
 extern CFeeRate minRelayTxFee;
 
 /** Best header we've seen so far (used for getheaders queries' starting points). */
@@ -215,6 +233,11 @@ CAmount GetBlockSubsidy(int nHeight, const Consensus::Params& consensusParams);
  */
 void FindFilesToPrune(std::set<int>& setFilesToPrune);
 
+/**
+ *  Mark one block file as pruned in the block index (without unlinking it)
+ */
+void PruneOneBlockFile(const int fileNumber);
+
 /**
  *  Actually unlink the specified files
  */
@@ -235,6 +258,31 @@ void PruneAndFlush();
 bool AcceptToMemoryPool(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
                         bool* pfMissingInputs, bool fRejectAbsurdFee=false);
 
+/** (try to) add transaction to memory pool with a specified acceptance time **/
+bool AcceptToMemoryPoolWithTime(CTxMemPool& pool, CValidationState &state, const CTransaction &tx, bool fLimitFree,
+                                bool* pfMissingInputs, int64_t nAcceptTime, bool fRejectAbsurdFee=false,
+                                bool fCurrentEstimate=true);
+
+/** Dump the mempool to disk (mempool.dat). */
+bool DumpMempool();
+
+/** Load the mempool from disk, revalidating each transaction. */
+bool LoadMempool();
+
+/** Write a snapshot of the UTXO and name set at the current tip to path. */
+bool DumpChainStateSnapshot(const boost::filesystem::path& path, CChainStateSnapshot& header,
+                            CChainStateSnapshotStats& stats, CValidationState& state);
+
+/**
+ * Replace the chain state by a snapshot written by DumpChainStateSnapshot.
+ * The snapshot block must extend the active chain and its header must be
+ * known, and its checksum must be hashExpected, which the caller has to
+ * obtain from a trusted source.  Blocks after it are then validated as usual.
+ */
+bool LoadChainStateSnapshot(const boost::filesystem::path& path, const uint256& hashExpected,
+                            CChainStateSnapshot& header, CChainStateSnapshotStats& stats,
+                            CValidationState& state);
+
 
 struct CNodeStateStats {
     int nMisbehavior;
@@ -384,6 +432,8 @@ bool DisconnectBlock(CBlock& block, CValidationState& state, CBlockIndex* pindex
 /** Apply the effects of this block (with given index) on the UTXO set represented by coins */
 bool ConnectBlock(const CBlock& block, CValidationState& state, CBlockIndex* pindex, CCoinsViewCache& coins, std::set<valtype>& expiredNames, bool fJustCheck = false);
 
+/** Maximum number of BDB locks a block is estimated to need.  */
+static const unsigned int MAX_BLOCK_DB_LOCKS = 4500;
 // TODO: Remove when this check is no longer necessary.
 bool CheckDbLockLimit(const CBlock& block, const CTransaction* extraTx = NULL);
 
@@ -466,14 +516,51 @@ public:
      }
 };
 
+/** Progress of the last block verification by CVerifyDB */
+struct CVerifyDBProgress
+{
+    //! Whether it runs after startup (-asyncverify)
+    bool fBackground;
+    bool fRunning;
+    //! Set when all blocks were checked without finding an inconsistency
+    bool fOk;
+    int nCheckLevel;
+    int nCheckDepth;
+    //! Height the verification started at and height it has reached
+    int nTipHeight;
+    int nHeight;
+    double dProgress;
+
+    CVerifyDBProgress() : fBackground(false), fRunning(false), fOk(false), nCheckLevel(0), nCheckDepth(0),
+                          nTipHeight(0), nHeight(0), dProgress(0.0) {}
+};
+
 /** RAII wrapper for VerifyDB: Verify consistency of the block and coin databases */
 class CVerifyDB {
+private:
+    //! Whether to report progress only through GetVerifyDBProgress
+    bool fBackground;
+
+    void ReportProgress(int nHeight, int nPercent);
+
 public:
-    CVerifyDB();
+    CVerifyDB(bool fBackgroundIn = false);
     ~CVerifyDB();
+    /**
+     * Verify the last nCheckDepth blocks below the best block of coinsview.
+     * Only holds cs_main for short steps, so that coinsview can be a
+     * snapshot checked while the node runs.  Returns false if an
+     * inconsistency was found; block data pruned meanwhile just ends the
+     * verification.
+     */
     bool VerifyDB(CCoinsView *coinsview, int nCheckLevel, int nCheckDepth);
 };
 
+/** Get the progress of the last block verification */
+CVerifyDBProgress GetVerifyDBProgress();
+/** Run VerifyDB on a snapshot of the chain state at the tip; abort the node if it fails */
+void ThreadVerifyDB(int nCheckLevel, int nCheckDepth);
+
 /** Find the last common block between the parameter chain and a locator. */
 CBlockIndex* FindForkInGlobalIndex(const CChain& chain, const CBlockLocator& locator);
 
@@ -486,6 +573,12 @@ bool ReconsiderBlock(CValidationState& state, CBlockIndex *pindex);
 /** The currently-connected chain of blocks. */
 extern CChain chainActive;
 
+/** Global variable that points to the coin database (protected by cs_main) */
+extern CCoinsViewDB *pcoinsdbview;
+
+/** Background writer between pcoinsTip and pcoinsdbview with -asyncflush, else NULL (protected by cs_main) */
+extern CCoinsViewAsyncWriter *pcoinswriter;
+
 /** Global variable that points to the active CCoinsView (protected by cs_main) */
 extern CCoinsViewCache *pcoinsTip;
 
@@ -21,8 +21,11 @@
 #include "wallet/wallet.h"
 #endif
 
+#include <boost/scoped_ptr.hpp>
 #include <boost/thread.hpp>
-#include <boost/tuple/tuple.hpp>
+
+#include <queue>
+#include <set>
 
 using namespace std;
 
@@ -36,48 +39,34 @@ using namespace std;
 // transactions in the memory pool. When we select transactions from the
 // pool, we select by highest priority or fee rate, so we might consider
 // transactions that depend on transactions that aren't yet in the block.
-// The COrphan class keeps track of these 'temporary orphans' while
-// CreateBlock is figuring out which transactions to include.
+// The mempool keeps track of in-pool parents, so such transactions are
+// put into a wait set until all their parents have been included.
 //
-class COrphan
+
+uint64_t nLastBlockTx = 0;
+uint64_t nLastBlockSize = 0;
+
+// The (optional) high-priority area of the block is filled from a heap
+// sorted by coin-age priority; ties are broken by fee rate.
+typedef std::pair<double, CTxMemPool::txiter> TxCoinAgePriority;
+class TxCoinAgePriorityCompare
 {
 public:
-    const CTransaction* ptx;
-    set<uint256> setDependsOn;
-    CFeeRate feeRate;
-    double dPriority;
-
-    COrphan(const CTransaction* ptxIn) : ptx(ptxIn), feeRate(0), dPriority(0)
+    bool operator()(const TxCoinAgePriority& a, const TxCoinAgePriority& b)
     {
+        if (a.first == b.first)
+            return CompareTxMemPoolEntryByScore()(*(b.second), *(a.second));
+        return a.first < b.first;
     }
 };
 
-uint64_t nLastBlockTx = 0;
-uint64_t nLastBlockSize = 0;
-
-// We want to sort transactions by priority and fee rate, so:
-typedef boost::tuple<double, CFeeRate, const CTransaction*> TxPriority;
-class TxPriorityCompare
+// Order postponed transactions by the mempool's mining score.
+class ScoreCompare
 {
-    bool byFee;
-
 public:
-    TxPriorityCompare(bool _byFee) : byFee(_byFee) { }
-
-    bool operator()(const TxPriority& a, const TxPriority& b)
+    bool operator()(const CTxMemPool::txiter a, const CTxMemPool::txiter b)
     {
-        if (byFee)
-        {
-            if (a.get<1>() == b.get<1>())
-                return a.get<0>() < b.get<0>();
-            return a.get<1>() < b.get<1>();
-        }
-        else
-        {
-            if (a.get<0>() == b.get<0>())
-                return a.get<1>() < b.get<1>();
-            return a.get<0>() < b.get<0>();
-        }
+        return CompareTxMemPoolEntryByScore()(*b, *a);
     }
 };
 
@@ -90,260 +79,482 @@ void UpdateTime(CBlockHeader* pblock, const Consensus::Params& consensusParams,
         pblock->nBits = GetNextWorkRequired(pindexPrev, pblock, consensusParams);
 }
 
-CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
+/**
+ * The block candidate that CreateNewBlock keeps between calls.  It holds the
+ * selected transactions (with a placeholder coinbase), a coins view with
+ * their effects applied and the running totals.  As long as the tip stays
+ * the same and none of its transactions leave the mempool, transactions that
+ * entered the pool since are appended to it instead of assembling a new block
+ * from scratch.  Protected by cs_main.
+ */
+class CBlockCandidate
 {
-    const CChainParams& chainparams = Params();
-    // Create new block
-    auto_ptr<CBlockTemplate> pblocktemplate(new CBlockTemplate());
-    if(!pblocktemplate.get())
-        return NULL;
-    CBlock *pblock = &pblocktemplate->block; // pointer for convenience
+public:
+    CBlockTemplate tmpl;
+
+    //! The tip and coins view the candidate was assembled on
+    uint256 hashPrevBlock;
+    int nPrevHeight;
+    CCoinsView* pcoinsBase;
+    boost::scoped_ptr<CCoinsViewCache> view;
+
+    //! Mempool state the candidate is in sync with
+    unsigned int nTransactionsUpdated;
+    uint64_t nSequence;
+    unsigned int nDeltasUpdated;
+
+    uint64_t nBlockSize;
+    uint64_t nBlockTx;
+    int nBlockSigOps;
+    CAmount nFees;
+    //! Lowest fee rate of all included transactions
+    CFeeRate minFeeRate;
+
+    std::set<uint256> setTxids;
+    //! Names registered or updated by included transactions
+    std::set<valtype> setNames;
+    //! Transaction ids and name count for the BDB lock estimate
+    std::set<uint256> setDbLockIds;
+    unsigned int nDbLockNames;
+
+    CBlockCandidate() : pcoinsBase(NULL) {}
+
+    void Reset(const CBlockIndex* pindexPrev);
+    bool IsValidFor(const CBlockIndex* pindexPrev) const;
+    bool CheckDbLocks(const CTransaction& tx) const;
+    bool AddTransaction(CTxMemPool::txiter iter, int nHeight);
+};
 
-    /* Initialise the block version.  */
-    pblock->nVersion.SetBaseVersion(CBlockHeader::CURRENT_VERSION);
+static CBlockCandidate blockCandidate;
 
-    // -regtest only: allow overriding block.nVersion with
-    // -blockversion=N to test forking scenarios
-    if (Params().MineBlocksOnDemand())
-        pblock->nVersion.SetBaseVersion(GetArg("-blockversion", pblock->nVersion.GetBaseVersion()));
+void CBlockCandidate::Reset(const CBlockIndex* pindexPrev)
+{
+    tmpl = CBlockTemplate();
+    tmpl.block.vtx.push_back(CTransaction());
+    tmpl.vTxFees.push_back(-1); // updated by CreateNewBlock
+    tmpl.vTxSigOps.push_back(-1); // updated by CreateNewBlock
+
+    hashPrevBlock = pindexPrev->GetBlockHash();
+    nPrevHeight = pindexPrev->nHeight;
+    pcoinsBase = pcoinsTip;
+    view.reset(new CCoinsViewCache(pcoinsTip));
+
+    nTransactionsUpdated = mempool.GetTransactionsUpdated();
+    nSequence = mempool.GetSequence();
+    nDeltasUpdated = mempool.GetDeltasUpdated();
+
+    nBlockSize = 1000;
+    nBlockTx = 0;
+    nBlockSigOps = 100;
+    nFees = 0;
+    minFeeRate = CFeeRate(MAX_MONEY);
+
+    setTxids.clear();
+    setNames.clear();
+    setDbLockIds.clear();
+    nDbLockNames = 0;
+}
 
-    // Create coinbase tx
-    CMutableTransaction txNew;
-    txNew.vin.resize(1);
-    txNew.vin[0].prevout.SetNull();
-    txNew.vout.resize(1);
-    txNew.vout[0].scriptPubKey = scriptPubKeyIn;
+bool CBlockCandidate::IsValidFor(const CBlockIndex* pindexPrev) const
+{
+    return view && pcoinsBase == pcoinsTip
+           && hashPrevBlock == pindexPrev->GetBlockHash()
+           && nPrevHeight == pindexPrev->nHeight
+           && nDeltasUpdated == mempool.GetDeltasUpdated();
+}
 
-    // Add dummy coinbase tx as first transaction
-    pblock->vtx.push_back(CTransaction());
-    pblocktemplate->vTxFees.push_back(-1); // updated at end
-    pblocktemplate->vTxSigOps.push_back(-1); // updated at end
+void ResetBlockCandidate()
+{
+    LOCK(cs_main);
+    blockCandidate.view.reset();
+    blockCandidate.pcoinsBase = NULL;
+}
 
-    // Largest block you're willing to create:
-    unsigned int nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
-    // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
-    nBlockMaxSize = std::max((unsigned int)1000, std::min((unsigned int)(MAX_BLOCK_SIZE-1000), nBlockMaxSize));
+// Incremental version of CheckDbLockLimit.
+bool CBlockCandidate::CheckDbLocks(const CTransaction& tx) const
+{
+    std::set<uint256> setNewIds;
+    if (!setDbLockIds.count(tx.GetHash()))
+        setNewIds.insert(tx.GetHash());
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        if (!setDbLockIds.count(txin.prevout.hash))
+            setNewIds.insert(txin.prevout.hash);
+
+    const unsigned int nNames = nDbLockNames + (tx.IsNamecoin() ? 1 : 0);
+    return setDbLockIds.size() + setNewIds.size() + nNames <= MAX_BLOCK_DB_LOCKS;
+}
 
-    // How much of the block should be dedicated to high-priority transactions,
-    // included regardless of the fees they pay
-    unsigned int nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
-    nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
+// Try to add the mempool transaction to the candidate.  Limits on the block
+// size and the dependencies on other mempool transactions are checked by
+// the caller.
+bool CBlockCandidate::AddTransaction(CTxMemPool::txiter iter, int nHeight)
+{
+    const CTransaction& tx = iter->GetTx();
 
-    // Minimum block size you want to create; block will be filled with free transactions
-    // until there are no more or the block reaches this size:
-    unsigned int nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
-    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
+    if (tx.IsCoinBase() || !IsFinalTx(tx, nHeight))
+        return false;
+
+    // Only one operation per name is allowed in a block.
+    if ((iter->isNameRegistration() || iter->isNameUpdate())
+        && setNames.count(iter->getName()))
+        return false;
+
+    // Check the DB lock limit won't be exceeded.
+    if (!CheckDbLocks(tx))
+        return false;
+
+    // Legacy limits on sigOps:
+    unsigned int nTxSigOps = GetLegacySigOpCount(tx);
+    if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+        return false;
+
+    if (!view->HaveInputs(tx))
+        return false;
+
+    CAmount nTxFees = view->GetValueIn(tx)-tx.GetValueOut();
+
+    nTxSigOps += GetP2SHSigOpCount(tx, *view);
+    if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
+        return false;
+
+    // Note that flags: we don't want to set mempool/IsStandard()
+    // policy here, but we still have to ensure that the block we
+    // create only contains transactions that are valid in new blocks.
+    // This also rejects name operations that are allowed in the
+    // mempool but not yet in a block (premature NAME_FIRSTUPDATE).
+    CValidationState state;
+    if (!CheckInputs(tx, state, *view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
+        return false;
+
+    UpdateCoins(tx, state, *view, nHeight);
+
+    // Added
+    const unsigned int nTxSize = iter->GetTxSize();
+    tmpl.block.vtx.push_back(tx);
+    tmpl.vTxFees.push_back(nTxFees);
+    tmpl.vTxSigOps.push_back(nTxSigOps);
+    nBlockSize += nTxSize;
+    ++nBlockTx;
+    nBlockSigOps += nTxSigOps;
+    nFees += nTxFees;
+    minFeeRate = std::min(minFeeRate, CFeeRate(iter->GetModifiedFee(), nTxSize));
+
+    setTxids.insert(tx.GetHash());
+    if (iter->isNameRegistration() || iter->isNameUpdate())
+        setNames.insert(iter->getName());
+    setDbLockIds.insert(tx.GetHash());
+    BOOST_FOREACH(const CTxIn& txin, tx.vin)
+        setDbLockIds.insert(txin.prevout.hash);
+    if (tx.IsNamecoin())
+        ++nDbLockNames;
 
-    // Collect memory pool transactions into the block
-    CAmount nFees = 0;
+    return true;
+}
 
+// Fill the candidate from the mempool, starting from an empty block.
+static void AssembleCandidate(CBlockCandidate& cand, const CBlockIndex* pindexPrev,
+                              unsigned int nBlockMaxSize, unsigned int nBlockPrioritySize,
+                              unsigned int nBlockMinSize)
+{
+    const int nHeight = pindexPrev->nHeight + 1;
+    cand.Reset(pindexPrev);
+
+    bool fPrintPriority = GetBoolArg("-printpriority", false);
+
+    // The fee-rate part of the block is filled by walking the mempool's
+    // mining_score index, which is kept sorted as transactions enter and
+    // leave the pool.  Only the priority part needs a heap, since coin-age
+    // priority depends on the height.
+    typedef CTxMemPool::indexed_transaction_set::index<mining_score>::type::iterator scoreiter;
+    CTxMemPool::setEntries inBlock;
+    CTxMemPool::setEntries waitSet;
+    std::priority_queue<CTxMemPool::txiter, std::vector<CTxMemPool::txiter>, ScoreCompare> clearedTxs;
+    typedef std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash>::iterator waitPriIter;
+    std::map<CTxMemPool::txiter, double, CTxMemPool::CompareIteratorByHash> waitPriMap;
+
+    std::vector<TxCoinAgePriority> vecPriority;
+    TxCoinAgePriorityCompare pricomparer;
+    bool fPriorityBlock = (nBlockPrioritySize > 0);
+    if (fPriorityBlock)
     {
-        LOCK2(cs_main, mempool.cs);
-        CBlockIndex* pindexPrev = chainActive.Tip();
-        const int nHeight = pindexPrev->nHeight + 1;
-        CCoinsViewCache view(pcoinsTip);
-
-        // Priority order to process transactions
-        list<COrphan> vOrphan; // list memory doesn't move
-        map<uint256, vector<COrphan*> > mapDependers;
-        bool fPrintPriority = GetBoolArg("-printpriority", false);
-
-        // This vector will be sorted into a priority queue:
-        vector<TxPriority> vecPriority;
         vecPriority.reserve(mempool.mapTx.size());
-        for (map<uint256, CTxMemPoolEntry>::iterator mi = mempool.mapTx.begin();
+        for (CTxMemPool::indexed_transaction_set::iterator mi = mempool.mapTx.begin();
              mi != mempool.mapTx.end(); ++mi)
         {
-            const CTransaction& tx = mi->second.GetTx();
-            if (tx.IsCoinBase() || !IsFinalTx(tx, nHeight))
-                continue;
-
-            COrphan* porphan = NULL;
-            double dPriority = 0;
-            CAmount nTotalIn = 0;
-            bool fMissingInputs = false;
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-            {
-                // Read prev transaction
-                if (!view.HaveCoins(txin.prevout.hash))
-                {
-                    // This should never happen; all transactions in the memory
-                    // pool should connect to either transactions in the chain
-                    // or other transactions in the memory pool.
-                    if (!mempool.mapTx.count(txin.prevout.hash))
-                    {
-                        LogPrintf("ERROR: mempool transaction missing input\n");
-                        if (fDebug) assert("mempool transaction missing input" == 0);
-                        fMissingInputs = true;
-                        if (porphan)
-                            vOrphan.pop_back();
-                        break;
-                    }
+            double dPriority = mi->GetPriority(nHeight);
+            CAmount dummy;
+            mempool.ApplyDeltas(mi->GetTx().GetHash(), dPriority, dummy);
+            vecPriority.push_back(TxCoinAgePriority(dPriority, mi));
+        }
+        std::make_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+    }
 
-                    // Has to wait for dependencies
-                    if (!porphan)
-                    {
-                        // Use list for automatic deletion
-                        vOrphan.push_back(COrphan(&tx));
-                        porphan = &vOrphan.back();
-                    }
-                    mapDependers[txin.prevout.hash].push_back(porphan);
-                    porphan->setDependsOn.insert(txin.prevout.hash);
-                    nTotalIn += mempool.mapTx[txin.prevout.hash].GetTx().vout[txin.prevout.n].nValue;
-                    continue;
-                }
-                const CCoins* coins = view.AccessCoins(txin.prevout.hash);
-                assert(coins);
+    // Collect transactions into block
+    int lastFewTxs = 0;
 
-                CAmount nValueIn = coins->vout[txin.prevout.n].nValue;
-                nTotalIn += nValueIn;
+    scoreiter mi = mempool.mapTx.get<mining_score>().begin();
+    while (mi != mempool.mapTx.get<mining_score>().end() || !clearedTxs.empty())
+    {
+        bool fPriorityTx = false;
+        double dPriority = 0;
+        CTxMemPool::txiter iter;
+        if (fPriorityBlock && !vecPriority.empty())
+        {
+            // Take highest priority transaction off the priority queue
+            fPriorityTx = true;
+            iter = vecPriority.front().second;
+            dPriority = vecPriority.front().first;
+            std::pop_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+            vecPriority.pop_back();
+        }
+        else if (clearedTxs.empty())
+        {
+            // Next transaction by fee rate
+            iter = mempool.mapTx.project<0>(mi);
+            ++mi;
+        }
+        else
+        {
+            // A previously postponed tx whose parents are now included
+            iter = clearedTxs.top();
+            clearedTxs.pop();
+        }
 
-                int nConf = nHeight - coins->nHeight;
+        if (inBlock.count(iter))
+            continue;
 
-                dPriority += (double)nValueIn * nConf;
+        // Wait for in-mempool parents to be included first.
+        bool fOrphan = false;
+        BOOST_FOREACH(const CTxMemPool::txiter& parent, mempool.GetMemPoolParents(iter))
+        {
+            if (!inBlock.count(parent))
+            {
+                fOrphan = true;
+                break;
             }
-            if (fMissingInputs) continue;
+        }
+        if (fOrphan)
+        {
+            if (fPriorityTx)
+                waitPriMap.insert(std::make_pair(iter, dPriority));
+            else
+                waitSet.insert(iter);
+            continue;
+        }
 
-            // Priority is sum(valuein * age) / modified_txsize
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            dPriority = tx.ComputePriority(dPriority, nTxSize);
+        // Prioritise by fee once past the priority size or we run out of high-priority
+        // transactions:
+        const unsigned int nTxSize = iter->GetTxSize();
+        if (fPriorityBlock &&
+            ((cand.nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority)))
+        {
+            fPriorityBlock = false;
+            waitPriMap.clear();
+        }
 
-            uint256 hash = tx.GetHash();
-            mempool.ApplyDeltas(hash, dPriority, nTotalIn);
+        // Skip free transactions if we're past the minimum block size,
+        // unless they have been prioritised.  A transaction counts with
+        // the fee rate of its package with descendants if that is higher,
+        // so that a cheap parent does not keep out a child paying for both.
+        double dPriorityDelta = 0;
+        CAmount nFeeDelta = 0;
+        mempool.ApplyDeltas(iter->GetTx().GetHash(), dPriorityDelta, nFeeDelta);
+        const CFeeRate packageRate = CompareTxMemPoolEntryByDescendantScore::UseDescendantScore(*iter)
+            ? CFeeRate(iter->GetModFeesWithDescendants(), iter->GetSizeWithDescendants())
+            : CFeeRate(iter->GetModifiedFee(), nTxSize);
+        if (!fPriorityTx && dPriorityDelta <= 0 && nFeeDelta <= 0
+            && packageRate < ::minRelayTxFee
+            && cand.nBlockSize + nTxSize >= nBlockMinSize)
+            continue;
+
+        // Size limits
+        if (cand.nBlockSize + nTxSize >= nBlockMaxSize)
+        {
+            if (cand.nBlockSize > nBlockMaxSize - 100 || lastFewTxs > 50)
+                break;
+            // Once we're within 1000 bytes of a full block, only look at 50 more txs
+            // to try to fill the remaining space.
+            if (cand.nBlockSize > nBlockMaxSize - 1000)
+                lastFewTxs++;
+            continue;
+        }
 
-            CFeeRate feeRate(nTotalIn-tx.GetValueOut(), nTxSize);
+        if (!cand.AddTransaction(iter, nHeight))
+            continue;
+        inBlock.insert(iter);
 
-            if (porphan)
+        if (fPrintPriority)
+        {
+            LogPrintf("priority %.1f fee %s txid %s\n",
+                dPriority, CFeeRate(iter->GetModifiedFee(), nTxSize).ToString(),
+                iter->GetTx().GetHash().ToString());
+        }
+
+        // Transactions that depend on this one may now be included
+        BOOST_FOREACH(const CTxMemPool::txiter& child, mempool.GetMemPoolChildren(iter))
+        {
+            if (fPriorityBlock)
             {
-                porphan->dPriority = dPriority;
-                porphan->feeRate = feeRate;
+                waitPriIter wpiter = waitPriMap.find(child);
+                if (wpiter != waitPriMap.end())
+                {
+                    vecPriority.push_back(TxCoinAgePriority(wpiter->second, child));
+                    std::push_heap(vecPriority.begin(), vecPriority.end(), pricomparer);
+                    waitPriMap.erase(wpiter);
+                }
+            }
+            else if (waitSet.count(child))
+            {
+                clearedTxs.push(child);
+                waitSet.erase(child);
             }
-            else
-                vecPriority.push_back(TxPriority(dPriority, feeRate, &mi->second.GetTx()));
         }
+    }
+}
 
-        // Collect transactions into block
-        uint64_t nBlockSize = 1000;
-        uint64_t nBlockTx = 0;
-        int nBlockSigOps = 100;
-        bool fSortedByFee = (nBlockPrioritySize <= 0);
-
-        TxPriorityCompare comparer(fSortedByFee);
-        std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+// Bring the candidate in sync with the mempool by appending the transactions
+// that were added since it was last updated.  Only transactions that pay the
+// minimum relay fee are considered, and they are appended in the order in
+// which they entered the pool (so that parents come first).  Returns false
+// if the candidate has to be assembled anew, which is the case if one of its
+// transactions left the pool or a new transaction with a higher fee rate
+// than the worst included one does not fit anymore.
+static bool UpdateCandidate(CBlockCandidate& cand, const CBlockIndex* pindexPrev,
+                            unsigned int nBlockMaxSize)
+{
+    const int nHeight = pindexPrev->nHeight + 1;
 
-        while (!vecPriority.empty())
-        {
-            // Take highest priority transaction off the priority queue:
-            double dPriority = vecPriority.front().get<0>();
-            CFeeRate feeRate = vecPriority.front().get<1>();
-            const CTransaction& tx = *(vecPriority.front().get<2>());
+    if (mempool.GetTransactionsUpdated() == cand.nTransactionsUpdated)
+        return true;
 
-            std::pop_heap(vecPriority.begin(), vecPriority.end(), comparer);
-            vecPriority.pop_back();
+    for (unsigned int i = 1; i < cand.tmpl.block.vtx.size(); ++i)
+        if (mempool.mapTx.find(cand.tmpl.block.vtx[i].GetHash()) == mempool.mapTx.end())
+            return false;
 
-            // Size limits
-            unsigned int nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
-            if (nBlockSize + nTxSize >= nBlockMaxSize)
-                continue;
-
-            // Check the DB lock limit won't be exceeded.
-            if (!CheckDbLockLimit(*pblock, &tx))
-                continue;
-
-            // Legacy limits on sigOps:
-            unsigned int nTxSigOps = GetLegacySigOpCount(tx);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
-
-            // Skip free transactions if we're past the minimum block size:
-            const uint256& hash = tx.GetHash();
-            double dPriorityDelta = 0;
-            CAmount nFeeDelta = 0;
-            mempool.ApplyDeltas(hash, dPriorityDelta, nFeeDelta);
-            if (fSortedByFee && (dPriorityDelta <= 0) && (nFeeDelta <= 0) && (feeRate < ::minRelayTxFee) && (nBlockSize + nTxSize >= nBlockMinSize))
-                continue;
-
-            // Prioritise by fee once past the priority size or we run out of high-priority
-            // transactions:
-            if (!fSortedByFee &&
-                ((nBlockSize + nTxSize >= nBlockPrioritySize) || !AllowFree(dPriority)))
+    typedef CTxMemPool::indexed_transaction_set::index<insertion_order>::type::iterator seqiter;
+    seqiter mi = mempool.mapTx.get<insertion_order>().lower_bound(cand.nSequence);
+    for (; mi != mempool.mapTx.get<insertion_order>().end(); ++mi)
+    {
+        CTxMemPool::txiter iter = mempool.mapTx.project<0>(mi);
+        if (cand.setTxids.count(iter->GetTx().GetHash()))
+            continue;
+
+        const unsigned int nTxSize = iter->GetTxSize();
+        if (iter->GetModifiedFee() < ::minRelayTxFee.GetFee(nTxSize))
+            continue;
+
+        // A transaction whose parents were left out can only be appended
+        // together with them, which needs a new assembly if it pays for
+        // them.
+        bool fOrphan = false;
+        BOOST_FOREACH(const CTxMemPool::txiter& parent, mempool.GetMemPoolParents(iter))
+        {
+            if (!cand.setTxids.count(parent->GetTx().GetHash()))
             {
-                fSortedByFee = true;
-                comparer = TxPriorityCompare(fSortedByFee);
-                std::make_heap(vecPriority.begin(), vecPriority.end(), comparer);
+                fOrphan = true;
+                break;
             }
+        }
+        if (fOrphan)
+        {
+            if (CFeeRate(iter->GetModFeesWithAncestors(), iter->GetSizeWithAncestors()) >= ::minRelayTxFee)
+                return false;
+            continue;
+        }
+
+        if (cand.nBlockSize + nTxSize >= nBlockMaxSize)
+        {
+            if (CFeeRate(iter->GetModifiedFee(), nTxSize) > cand.minFeeRate)
+                return false;
+            continue;
+        }
+
+        cand.AddTransaction(iter, nHeight);
+    }
 
-            if (!view.HaveInputs(tx))
-                continue;
+    cand.nTransactionsUpdated = mempool.GetTransactionsUpdated();
+    cand.nSequence = mempool.GetSequence();
+    return true;
+}
 
-            CAmount nTxFees = view.GetValueIn(tx)-tx.GetValueOut();
+CBlockTemplate* CreateNewBlock(const CScript& scriptPubKeyIn)
+{
+    const CChainParams& chainparams = Params();
 
-            nTxSigOps += GetP2SHSigOpCount(tx, view);
-            if (nBlockSigOps + nTxSigOps >= MAX_BLOCK_SIGOPS)
-                continue;
+    // Largest block you're willing to create:
+    unsigned int nBlockMaxSize = GetArg("-blockmaxsize", DEFAULT_BLOCK_MAX_SIZE);
+    // Limit to betweeen 1K and MAX_BLOCK_SIZE-1K for sanity:
+    nBlockMaxSize = std::max((unsigned int)1000, std::min((unsigned int)(MAX_BLOCK_SIZE-1000), nBlockMaxSize));
 
-            // Note that flags: we don't want to set mempool/IsStandard()
-            // policy here, but we still have to ensure that the block we
-            // create only contains transactions that are valid in new blocks.
-            CValidationState state;
-            if (!CheckInputs(tx, state, view, true, MANDATORY_SCRIPT_VERIFY_FLAGS, true))
-                continue;
+    // How much of the block should be dedicated to high-priority transactions,
+    // included regardless of the fees they pay
+    unsigned int nBlockPrioritySize = GetArg("-blockprioritysize", DEFAULT_BLOCK_PRIORITY_SIZE);
+    nBlockPrioritySize = std::min(nBlockMaxSize, nBlockPrioritySize);
 
-            UpdateCoins(tx, state, view, nHeight);
+    // Minimum block size you want to create; block will be filled with free transactions
+    // until there are no more or the block reaches this size:
+    unsigned int nBlockMinSize = GetArg("-blockminsize", DEFAULT_BLOCK_MIN_SIZE);
+    nBlockMinSize = std::min(nBlockMaxSize, nBlockMinSize);
 
-            // Added
-            pblock->vtx.push_back(tx);
-            pblocktemplate->vTxFees.push_back(nTxFees);
-            pblocktemplate->vTxSigOps.push_back(nTxSigOps);
-            nBlockSize += nTxSize;
-            ++nBlockTx;
-            nBlockSigOps += nTxSigOps;
-            nFees += nTxFees;
+    LOCK2(cs_main, mempool.cs);
+    CBlockIndex* pindexPrev = chainActive.Tip();
+    const int nHeight = pindexPrev->nHeight + 1;
 
-            if (fPrintPriority)
-            {
-                LogPrintf("priority %.1f fee %s txid %s\n",
-                    dPriority, feeRate.ToString(), tx.GetHash().ToString());
-            }
+    // Reuse the candidate if possible; only a freshly assembled block needs
+    // to be run through TestBlockValidity, appended transactions have been
+    // checked against the candidate's coins view already.
+    CBlockCandidate& cand = blockCandidate;
+    bool fAssembled = false;
+    if (!cand.IsValidFor(pindexPrev) || !UpdateCandidate(cand, pindexPrev, nBlockMaxSize))
+    {
+        AssembleCandidate(cand, pindexPrev, nBlockMaxSize, nBlockPrioritySize, nBlockMinSize);
+        fAssembled = true;
+    }
 
-            // Add transactions that depend on this one to the priority queue
-            if (mapDependers.count(hash))
-            {
-                BOOST_FOREACH(COrphan* porphan, mapDependers[hash])
-                {
-                    if (!porphan->setDependsOn.empty())
-                    {
-                        porphan->setDependsOn.erase(hash);
-                        if (porphan->setDependsOn.empty())
-                        {
-                            vecPriority.push_back(TxPriority(porphan->dPriority, porphan->feeRate, porphan->ptx));
-                            std::push_heap(vecPriority.begin(), vecPriority.end(), comparer);
-                        }
-                    }
-                }
-            }
-        }
+    // Create new block
+    auto_ptr<CBlockTemplate> pblocktemplate(new CBlockTemplate(cand.tmpl));
+    if(!pblocktemplate.get())
+        return NULL;
+    CBlock *pblock = &pblocktemplate->block; // pointer for convenience
 
-        nLastBlockTx = nBlockTx;
-        nLastBlockSize = nBlockSize;
-        LogPrintf("CreateNewBlock(): total size %u\n", nBlockSize);
+    /* Initialise the block version.  */
+    pblock->nVersion.SetBaseVersion(CBlockHeader::CURRENT_VERSION);
 
-        // Compute final coinbase transaction.
-        txNew.vout[0].nValue = nFees + GetBlockSubsidy(nHeight, chainparams.GetConsensus());
-        txNew.vin[0].scriptSig = CScript() << nHeight << OP_0;
-        pblock->vtx[0] = txNew;
-        pblocktemplate->vTxFees[0] = -nFees;
+    // -regtest only: allow overriding block.nVersion with
+    // -blockversion=N to test forking scenarios
+    if (Params().MineBlocksOnDemand())
+        pblock->nVersion.SetBaseVersion(GetArg("-blockversion", pblock->nVersion.GetBaseVersion()));
 
-        // Fill in header
-        pblock->hashPrevBlock  = pindexPrev->GetBlockHash();
-        UpdateTime(pblock, Params().GetConsensus(), pindexPrev);
-        pblock->nBits          = GetNextWorkRequired(pindexPrev, pblock, Params().GetConsensus());
-        pblock->nNonce         = 0;
-        pblocktemplate->vTxSigOps[0] = GetLegacySigOpCount(pblock->vtx[0]);
+    nLastBlockTx = cand.nBlockTx;
+    nLastBlockSize = cand.nBlockSize;
+    LogPrintf("CreateNewBlock(): total size %u\n", cand.nBlockSize);
 
+    // Compute final coinbase transaction.
+    CMutableTransaction txNew;
+    txNew.vin.resize(1);
+    txNew.vin[0].prevout.SetNull();
+    txNew.vout.resize(1);
+    txNew.vout[0].scriptPubKey = scriptPubKeyIn;
+    txNew.vout[0].nValue = cand.nFees + GetBlockSubsidy(nHeight, chainparams.GetConsensus());
+    txNew.vin[0].scriptSig = CScript() << nHeight << OP_0;
+    pblock->vtx[0] = txNew;
+    pblocktemplate->vTxFees[0] = -cand.nFees;
+
+    // Fill in header
+    pblock->hashPrevBlock  = pindexPrev->GetBlockHash();
+    UpdateTime(pblock, Params().GetConsensus(), pindexPrev);
+    pblock->nBits          = GetNextWorkRequired(pindexPrev, pblock, Params().GetConsensus());
+    pblock->nNonce         = 0;
+    pblocktemplate->vTxSigOps[0] = GetLegacySigOpCount(pblock->vtx[0]);
+
+    if (fAssembled)
+    {
         CValidationState state;
         if (!TestBlockValidity(state, *pblock, pindexPrev, false, false))
+        {
+            cand.view.reset();
             throw std::runtime_error("CreateNewBlock(): TestBlockValidity failed");
+        }
     }
 
     return pblocktemplate.release();
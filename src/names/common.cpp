@@ -4,6 +4,9 @@
 
 #include "names/common.h"
 
+#include "clientversion.h"
+#include "streams.h"
+#include "crypto/sha256.h"
 #include "script/names.h"
 
 bool fNameHistory = false;
@@ -22,6 +25,18 @@ CNameData::fromScript (unsigned h, const COutPoint& out,
   addr = script.getAddress ();
 }
 
+uint256
+NameSetElementHash (const valtype& name, const CNameData& data)
+{
+  CDataStream ss(SER_DISK, CLIENT_VERSION);
+  ss << name << data;
+
+  uint256 hash;
+  CSHA256 ().Write (reinterpret_cast<const unsigned char*> (&ss[0]), ss.size ())
+            .Finalize (hash.begin ());
+  return hash;
+}
+
 /* ************************************************************************** */
 /* CNameIterator.  */
 
@@ -177,6 +192,27 @@ CNameCache::get (const valtype& name, CNameData& data) const
   return true;
 }
 
+void
+CNameCache::recordOriginal (const valtype& name, const CNameData* data)
+{
+  if (originals.count (name) > 0)
+    return;
+
+  originals.insert (std::make_pair (name, data ? NameSetElementHash (name, *data)
+                                               : uint256 ()));
+}
+
+bool
+CNameCache::getOriginal (const valtype& name, uint256& hash) const
+{
+  const std::map<valtype, uint256>::const_iterator i = originals.find (name);
+  if (i == originals.end ())
+    return false;
+
+  hash = i->second;
+  return true;
+}
+
 void
 CNameCache::set (const valtype& name, const CNameData& data)
 {
@@ -288,4 +324,8 @@ CNameCache::apply (const CNameCache& cache)
   for (std::map<ExpireEntry, bool>::const_iterator i
         = cache.expireIndex.begin (); i != cache.expireIndex.end (); ++i)
     expireIndex[i->first] = i->second;
+
+  /* Names that are changed here already keep their own base version.  For
+     the others, the base version of the other cache is also ours.  */
+  originals.insert (cache.originals.begin (), cache.originals.end ());
 }
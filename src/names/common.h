@@ -6,9 +6,11 @@
 #define H_BITCOIN_NAMES_COMMON
 
 #include "compat/endian.h"
+#include "compressor.h"
 #include "primitives/transaction.h"
 #include "script/script.h"
 #include "serialize.h"
+#include "uint256.h"
 
 #include <map>
 #include <set>
@@ -67,6 +69,8 @@ private:
    */
   CScript addr;
 
+  friend class CNameDataCompressor;
+
 public:
 
   ADD_SERIALIZE_METHODS;
@@ -172,6 +176,8 @@ private:
   /** The actual data.  */
   std::vector<CNameData> data;
 
+  friend class CNameHistoryCompressor;
+
 public:
 
   ADD_SERIALIZE_METHODS;
@@ -231,6 +237,85 @@ public:
 
 };
 
+/* ************************************************************************** */
+/* Compact serialisation.  */
+
+/**
+ * Wrapper for CNameData that provides a more compact serialisation.  It is
+ * used for the records in the name database.  The address is compressed
+ * with CScriptCompressor, and the height and outpoint index are stored
+ * as varints.
+ */
+class CNameDataCompressor
+{
+
+private:
+
+  CNameData& data;
+
+public:
+
+  explicit inline CNameDataCompressor (CNameData& d)
+    : data(d)
+  {}
+
+  ADD_SERIALIZE_METHODS;
+
+  template<typename Stream, typename Operation>
+    inline void SerializationOp (Stream& s, Operation ser_action,
+                                 int nType, int nVersion)
+  {
+    READWRITE (data.value);
+    READWRITE (VARINT (data.nHeight));
+    READWRITE (data.prevout.hash);
+    READWRITE (VARINT (data.prevout.n));
+    CScriptCompressor cscript(REF (data.addr));
+    READWRITE (cscript);
+  }
+
+};
+
+/**
+ * Wrapper for CNameHistory that serialises the entries
+ * with CNameDataCompressor.
+ */
+class CNameHistoryCompressor
+{
+
+private:
+
+  CNameHistory& history;
+
+public:
+
+  explicit inline CNameHistoryCompressor (CNameHistory& h)
+    : history(h)
+  {}
+
+  ADD_SERIALIZE_METHODS;
+
+  template<typename Stream, typename Operation>
+    inline void SerializationOp (Stream& s, Operation ser_action,
+                                 int nType, int nVersion)
+  {
+    uint64_t nEntries = history.data.size ();
+    READWRITE (VARINT (nEntries));
+    if (ser_action.ForRead ())
+      {
+        if (nEntries > MAX_SIZE)
+          throw std::ios_base::failure ("CNameHistory: too many entries");
+        history.data.resize (nEntries);
+      }
+
+    for (uint64_t i = 0; i < nEntries; ++i)
+      {
+        CNameDataCompressor entry(history.data[i]);
+        READWRITE (entry);
+      }
+  }
+
+};
+
 /* ************************************************************************** */
 /* CNameIterator.  */
 
@@ -269,6 +354,12 @@ public:
  * new names (or updates to them), this also keeps track of deleted names
  * (when rolling back changes).
  */
+/**
+ * Return the SHA256 of a name and its data as element of the name set hash
+ * (see CChainStateSetInfo).
+ */
+uint256 NameSetElementHash (const valtype& name, const CNameData& data);
+
 class CNameCache
 {
 
@@ -396,10 +487,33 @@ private:
    */
   std::map<ExpireEntry, bool> expireIndex;
 
+  /**
+   * Set hash elements (see NameSetElementHash) of the changed names as
+   * they are in the base view, recorded on their first change.  A null
+   * hash means that the name does not exist there.  With them, the name
+   * set hash can be updated without reading the old data back.
+   */
+  std::map<valtype, uint256> originals;
+
   friend class CCacheNameIterator;
 
 public:
 
+  /* The changes can be serialised, so that they can be kept around until
+     they are written to the name database.  The recorded base versions
+     are not needed for that and left out.  */
+  ADD_SERIALIZE_METHODS;
+
+  template<typename Stream, typename Operation>
+    inline void SerializationOp (Stream& s, Operation ser_action,
+                                 int nType, int nVersion)
+  {
+    READWRITE (entries);
+    READWRITE (deleted);
+    READWRITE (history);
+    READWRITE (expireIndex);
+  }
+
   inline void
   clear ()
   {
@@ -407,6 +521,7 @@ public:
     deleted.clear ();
     history.clear ();
     expireIndex.clear ();
+    originals.clear ();
   }
 
   /**
@@ -434,6 +549,29 @@ public:
     return (deleted.count (name) > 0); 
   }
 
+  /* Access the new or updated and the deleted names.  This is used to
+     keep the name set hash of the database up to date.  */
+  inline const EntryMap&
+  getEntries () const
+  {
+    return entries;
+  }
+
+  inline const std::set<valtype>&
+  getDeleted () const
+  {
+    return deleted;
+  }
+
+  /* Record the base version of a name before it is changed.  data is NULL
+     if the name does not exist in the base view.  Only the first call
+     for each name has an effect.  */
+  void recordOriginal (const valtype& name, const CNameData* data);
+
+  /* Look up the set hash element recorded for the base version of
+     a name.  Returns false if there is none.  */
+  bool getOriginal (const valtype& name, uint256& hash) const;
+
   /* Try to get a name's associated data.  This looks only
      in entries, and doesn't care about deleted data.  */
   bool get (const valtype& name, CNameData& data) const;
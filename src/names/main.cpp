@@ -14,6 +14,8 @@
 #include "undo.h"
 #include "util.h"
 
+#include <algorithm>
+
 /**
  * Check whether a name at nPrevHeight is expired at nHeight.  Also
  * heights of MEMPOOL_HEIGHT are supported.  For nHeight == MEMPOOL_HEIGHT,
@@ -70,6 +72,65 @@ CNameTxUndo::apply (CCoinsViewCache& view) const
 /* ************************************************************************** */
 /* CNameMemPool.  */
 
+/**
+ * Append the entries of a name map whose keys start with the given prefix.
+ * @param m The map to look into.
+ * @param prefix The prefix to look for.
+ * @param res Append matching entries here.
+ */
+static void
+collectPrefix (const std::map<valtype, uint256>& m, const valtype& prefix,
+               std::vector<std::pair<valtype, uint256> >& res)
+{
+  std::map<valtype, uint256>::const_iterator mit;
+  for (mit = m.lower_bound (prefix); mit != m.end (); ++mit)
+    {
+      const valtype& name = mit->first;
+      if (name.size () < prefix.size ()
+          || !std::equal (prefix.begin (), prefix.end (), name.begin ()))
+        break;
+      res.push_back (*mit);
+    }
+}
+
+void
+CNameMemPool::queryPending (const valtype& prefix,
+                            std::vector<std::pair<valtype, uint256> >& res) const
+{
+  std::vector<std::pair<valtype, uint256> > regs, updates;
+  collectPrefix (mapNameRegs, prefix, regs);
+  collectPrefix (mapNameUpdates, prefix, updates);
+
+  /* Merge both lists by name, putting registrations first.  */
+  res.clear ();
+  res.reserve (regs.size () + updates.size ());
+  std::vector<std::pair<valtype, uint256> >::const_iterator ri, ui;
+  for (ri = regs.begin (), ui = updates.begin ();
+       ri != regs.end () || ui != updates.end (); )
+    {
+      if (ui == updates.end ()
+          || (ri != regs.end () && !(ui->first < ri->first)))
+        res.push_back (*ri++);
+      else
+        res.push_back (*ui++);
+    }
+}
+
+void
+CNameMemPool::queryName (const valtype& name,
+                         std::vector<std::pair<valtype, uint256> >& res) const
+{
+  res.clear ();
+
+  std::map<valtype, uint256>::const_iterator mit = mapNameRegs.find (name);
+  if (mit != mapNameRegs.end ())
+    res.push_back (*mit);
+
+  mit = mapNameUpdates.find (name);
+  if (mit != mapNameUpdates.end ())
+    res.push_back (*mit);
+}
+
 void
 CNameMemPool::addUnchecked (const uint256& hash, const CTxMemPoolEntry& entry)
 {
@@ -141,10 +202,9 @@ CNameMemPool::removeConflicts (const CTransaction& tx,
             = mapNameRegs.find (name);
           if (mit != mapNameRegs.end ())
             {
-              const std::map<uint256, CTxMemPoolEntry>::const_iterator mit2
-                = pool.mapTx.find (mit->second);
+              const CTxMemPool::txiter mit2 = pool.mapTx.find (mit->second);
               assert (mit2 != pool.mapTx.end ());
-              pool.remove (mit2->second.GetTx (), removed, true);
+              pool.remove (mit2->GetTx (), removed, true);
             }
         }
     }
@@ -162,10 +222,9 @@ CNameMemPool::removeUnexpireConflicts (const std::set<valtype>& unexpired,
         = mapNameRegs.find (name);
       if (mit != mapNameRegs.end ())
         {
-          const std::map<uint256, CTxMemPoolEntry>::const_iterator mit2
-            = pool.mapTx.find (mit->second);
+          const CTxMemPool::txiter mit2 = pool.mapTx.find (mit->second);
           assert (mit2 != pool.mapTx.end ());
-          pool.remove (mit2->second.GetTx (), removed, true);
+          pool.remove (mit2->GetTx (), removed, true);
         }
     }
 }
@@ -182,10 +241,9 @@ CNameMemPool::removeExpireConflicts (const std::set<valtype>& expired,
         = mapNameUpdates.find (name);
       if (mit != mapNameUpdates.end ())
         {
-          const std::map<uint256, CTxMemPoolEntry>::const_iterator mit2
-            = pool.mapTx.find (mit->second);
+          const CTxMemPool::txiter mit2 = pool.mapTx.find (mit->second);
           assert (mit2 != pool.mapTx.end ());
-          pool.remove (mit2->second.GetTx (), removed, true);
+          pool.remove (mit2->GetTx (), removed, true);
         }
     }
 }
@@ -204,27 +262,28 @@ CNameMemPool::check (const CCoinsView& coins) const
 
   std::set<valtype> nameRegs;
   std::set<valtype> nameUpdates;
-  BOOST_FOREACH (const PAIRTYPE(const uint256, CTxMemPoolEntry)& entry,
-                 pool.mapTx)
+  BOOST_FOREACH (const CTxMemPoolEntry& entry, pool.mapTx)
     {
-      if (entry.second.isNameNew ())
+      const uint256 txHash = entry.GetTx ().GetHash ();
+
+      if (entry.isNameNew ())
         {
-          const valtype& newHash = entry.second.getNameNewHash ();
+          const valtype& newHash = entry.getNameNewHash ();
           const std::map<valtype, uint256>::const_iterator mit
             = mapNameNews.find (newHash);
 
           assert (mit != mapNameNews.end ());
-          assert (mit->second == entry.first);
+          assert (mit->second == txHash);
         }
 
-      if (entry.second.isNameRegistration ())
+      if (entry.isNameRegistration ())
         {
-          const valtype& name = entry.second.getName ();
+          const valtype& name = entry.getName ();
 
           const std::map<valtype, uint256>::const_iterator mit
             = mapNameRegs.find (name);
           assert (mit != mapNameRegs.end ());
-          assert (mit->second == entry.first);
+          assert (mit->second == txHash);
 
           assert (nameRegs.count (name) == 0);
           nameRegs.insert (name);
@@ -237,14 +296,14 @@ CNameMemPool::check (const CCoinsView& coins) const
             assert (data.isExpired (nHeight + 1));
         }
 
-      if (entry.second.isNameUpdate ())
+      if (entry.isNameUpdate ())
         {
-          const valtype& name = entry.second.getName ();
+          const valtype& name = entry.getName ();
 
           const std::map<valtype, uint256>::const_iterator mit
             = mapNameUpdates.find (name);
           assert (mit != mapNameUpdates.end ());
-          assert (mit->second == entry.first);
+          assert (mit->second == txHash);
 
           assert (nameUpdates.count (name) == 0);
           nameUpdates.insert (name);
@@ -15,6 +15,8 @@
 #include <map>
 #include <set>
 #include <string>
+#include <utility>
+#include <vector>
 
 class CBlockUndo;
 class CCoinsView;
@@ -152,6 +154,47 @@ public:
     return mapNameUpdates.count (name) > 0;
   }
 
+  /**
+   * Collect the pending registrations and updates of names that start
+   * with the given prefix.  The result is ordered by name, with the
+   * registration of a name (if any) before its update.  Does not lock.
+   * @param prefix Only consider names starting with this (may be empty).
+   * @param res Put the pairs of name and transaction ID here.
+   */
+  void queryPending (const valtype& prefix,
+                     std::vector<std::pair<valtype, uint256> >& res) const;
+
+  /**
+   * Like queryPending, but for exactly one name.  This looks the name up
+   * directly instead of scanning a prefix range.  Does not lock.
+   * @param name The name to look for.
+   * @param res Put the pairs of name and transaction ID here.
+   */
+  void queryName (const valtype& name,
+                  std::vector<std::pair<valtype, uint256> >& res) const;
+
+  /**
+   * Access the NAME_NEW hashes seen so far.  They are saved together
+   * with the mempool when shutting down.
+   * @return The map of NAME_NEW hashes to transaction IDs.
+   */
+  inline const std::map<valtype, uint256>&
+  getNameNews () const
+  {
+    return mapNameNews;
+  }
+
+  /**
+   * Restore saved NAME_NEW hashes (see getNameNews).  Entries that are
+   * known already take precedence.
+   * @param news The NAME_NEW hashes to add.
+   */
+  inline void
+  restoreNameNews (const std::map<valtype, uint256>& news)
+  {
+    mapNameNews.insert (news.begin (), news.end ());
+  }
+
   /**
    * Clear all data.
    */
@@ -522,6 +522,9 @@ void CNode::copyStats(CNodeStats &stats)
 
     // Leave string empty if addrLocal invalid (not filled in yet)
     stats.addrLocal = addrLocal.IsValid() ? addrLocal.ToString() : "";
+
+    // The filters have a fixed size, so no lock is needed.
+    stats.nKnownFilterBytes = addrKnown.DynamicMemoryUsage() + filterInventoryKnown.DynamicMemoryUsage();
 }
 #undef X
 
@@ -1909,7 +1912,7 @@ unsigned int SendBufferSize() { return 1000*GetArg("-maxsendbuffer", 1*1000); }
 CNode::CNode(SOCKET hSocketIn, CAddress addrIn, std::string addrNameIn, bool fInboundIn) :
     ssSend(SER_NETWORK, INIT_PROTO_VERSION),
     addrKnown(5000, 0.001, insecure_rand()),
-    setInventoryKnown(SendBufferSize() / 1000)
+    filterInventoryKnown(INVENTORY_KNOWN_SIZE, 0.000001, insecure_rand())
 {
     nServices = 0;
     hSocket = hSocketIn;
@@ -619,6 +619,42 @@ static bool rest_name(AcceptedConnection* conn,
     return true; // continue to process further HTTP reqs on this cxn
 }
 
+static bool rest_name_pending(AcceptedConnection* conn,
+                              const std::string& strURIPart,
+                              const std::string& strRequest,
+                              const std::map<std::string, std::string>& mapHeaders,
+                              bool fRun)
+{
+    std::string encodedName;
+    const RetFormat rf = ParseDataFormat(encodedName, strURIPart);
+
+    // Either "/rest/name_pending/.json" for all names or
+    // "/rest/name_pending/<ENCODED-NAME>.json" for a single name.
+    Array rpcParams;
+    if (!encodedName.empty()) {
+        valtype plainName;
+        if (!DecodeName(plainName, encodedName))
+            throw RESTERR(HTTP_BAD_REQUEST, "Invalid encoded name: " + encodedName);
+        rpcParams.push_back(ValtypeToString(plainName));
+    }
+
+    switch (rf) {
+    case RF_JSON: {
+        Value pending = name_pending(rpcParams, false);
+
+        string strJSON = write_string(pending, false) + "\n";
+        conn->stream() << HTTPReply(HTTP_OK, strJSON, fRun) << std::flush;
+        return true;
+    }
+    default: {
+        throw RESTERR(HTTP_NOT_FOUND, "output format not found (available: json)");
+    }
+    }
+
+    // not reached
+    return true; // continue to process further HTTP reqs on this cxn
+}
+
 static const struct {
     const char* prefix;
     bool (*handler)(AcceptedConnection* conn,
@@ -634,6 +670,7 @@ static const struct {
       {"/rest/headers/", rest_headers},
       {"/rest/getutxos", rest_getutxos},
       {"/rest/name/", rest_name},
+      {"/rest/name_pending/", rest_name_pending},
 };
 
 bool HTTPReq_REST(AcceptedConnection* conn,
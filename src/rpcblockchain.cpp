@@ -10,10 +10,13 @@
 #include "primitives/transaction.h"
 #include "rpcserver.h"
 #include "sync.h"
+#include "txdb.h"
 #include "util.h"
 
 #include <stdint.h>
 
+#include <boost/filesystem.hpp>
+
 #include "json/json_spirit_value.h"
 
 using namespace json_spirit;
@@ -200,6 +203,12 @@ Value getrawmempool(const Array& params, bool fHelp)
             "    \"height\" : n,           (numeric) block height when transaction entered pool\n"
             "    \"startingpriority\" : n, (numeric) priority when transaction entered pool\n"
             "    \"currentpriority\" : n,  (numeric) transaction priority now\n"
+            "    \"descendantcount\" : n,  (numeric) number of in-mempool descendant transactions (including this one)\n"
+            "    \"descendantsize\" : n,   (numeric) size of in-mempool descendants (including this one)\n"
+            "    \"descendantfees\" : n,   (numeric) modified fees (see above) of in-mempool descendants (including this one)\n"
+            "    \"ancestorcount\" : n,    (numeric) number of in-mempool ancestor transactions (including this one)\n"
+            "    \"ancestorsize\" : n,     (numeric) size of in-mempool ancestors (including this one)\n"
+            "    \"ancestorfees\" : n,     (numeric) modified fees (see above) of in-mempool ancestors (including this one)\n"
             "    \"depends\" : [           (array) unconfirmed transactions used as inputs for this transaction\n"
             "        \"transactionid\",    (string) parent transaction id\n"
             "       ... ]\n"
@@ -220,10 +229,9 @@ Value getrawmempool(const Array& params, bool fHelp)
     {
         LOCK(mempool.cs);
         Object o;
-        BOOST_FOREACH(const PAIRTYPE(uint256, CTxMemPoolEntry)& entry, mempool.mapTx)
+        BOOST_FOREACH(const CTxMemPoolEntry& e, mempool.mapTx)
         {
-            const uint256& hash = entry.first;
-            const CTxMemPoolEntry& e = entry.second;
+            const uint256& hash = e.GetTx().GetHash();
             Object info;
             info.push_back(Pair("size", (int)e.GetTxSize()));
             info.push_back(Pair("fee", ValueFromAmount(e.GetFee())));
@@ -231,6 +239,12 @@ Value getrawmempool(const Array& params, bool fHelp)
             info.push_back(Pair("height", (int)e.GetHeight()));
             info.push_back(Pair("startingpriority", e.GetPriority(e.GetHeight())));
             info.push_back(Pair("currentpriority", e.GetPriority(chainActive.Height())));
+            info.push_back(Pair("descendantcount", e.GetCountWithDescendants()));
+            info.push_back(Pair("descendantsize", e.GetSizeWithDescendants()));
+            info.push_back(Pair("descendantfees", ValueFromAmount(e.GetModFeesWithDescendants())));
+            info.push_back(Pair("ancestorcount", e.GetCountWithAncestors()));
+            info.push_back(Pair("ancestorsize", e.GetSizeWithAncestors()));
+            info.push_back(Pair("ancestorfees", ValueFromAmount(e.GetModFeesWithAncestors())));
             const CTransaction& tx = e.GetTx();
             set<string> setDepends;
             BOOST_FOREACH(const CTxIn& txin, tx.vin)
@@ -352,11 +366,16 @@ Value getblock(const Array& params, bool fHelp)
 
 Value gettxoutsetinfo(const Array& params, bool fHelp)
 {
-    if (fHelp || params.size() != 0)
+    if (fHelp || params.size() > 1)
         throw runtime_error(
-            "gettxoutsetinfo\n"
+            "gettxoutsetinfo ( \"hash_type\" )\n"
             "\nReturns statistics about the unspent transaction output set.\n"
-            "Note this call may take some time.\n"
+            "The statistics and the MuHash3072 set hash are kept up to date with each\n"
+            "database write, so this is fast unless hash_type is \"serialized\".\n"
+            "\nArguments:\n"
+            "1. \"hash_type\"   (string, optional, default=\"muhash\") Which hash of the set to return:\n"
+            "                 \"muhash\" for the rolling set hash, \"serialized\" for the hash of\n"
+            "                 the serialized database content (slow, it scans the whole set)\n"
             "\nResult:\n"
             "{\n"
             "  \"height\":n,     (numeric) The current block height (index)\n"
@@ -364,7 +383,8 @@ Value gettxoutsetinfo(const Array& params, bool fHelp)
             "  \"transactions\": n,      (numeric) The number of transactions\n"
             "  \"txouts\": n,            (numeric) The number of output transactions\n"
             "  \"bytes_serialized\": n,  (numeric) The serialized size\n"
-            "  \"hash_serialized\": \"hash\",   (string) The serialized hash\n"
+            "  \"muhash\": \"hash\",     (string) The rolling set hash (for hash_type \"muhash\")\n"
+            "  \"hash_serialized\": \"hash\",   (string) The serialized hash (for hash_type \"serialized\")\n"
             "  \"total_amount\": x.xxx          (numeric) The total amount\n"
             "}\n"
             "\nExamples:\n"
@@ -372,24 +392,134 @@ Value gettxoutsetinfo(const Array& params, bool fHelp)
             + HelpExampleRpc("gettxoutsetinfo", "")
         );
 
+    bool fSerialized = false;
+    if (params.size() > 0) {
+        const std::string strType = params[0].get_str();
+        if (strType == "serialized")
+            fSerialized = true;
+        else if (strType != "muhash")
+            throw JSONRPCError(RPC_INVALID_PARAMETER, "unknown hash_type " + strType);
+    }
+
     LOCK(cs_main);
 
     Object ret;
 
     CCoinsStats stats;
     FlushStateToDisk();
-    if (pcoinsTip->GetStats(stats)) {
+    if (fSerialized ? pcoinsdbview->GetStatsSerialized(stats) : pcoinsTip->GetStats(stats)) {
         ret.push_back(Pair("height", (int64_t)stats.nHeight));
         ret.push_back(Pair("bestblock", stats.hashBlock.GetHex()));
         ret.push_back(Pair("transactions", (int64_t)stats.nTransactions));
         ret.push_back(Pair("txouts", (int64_t)stats.nTransactionOutputs));
         ret.push_back(Pair("bytes_serialized", (int64_t)stats.nSerializedSize));
-        ret.push_back(Pair("hash_serialized", stats.hashSerialized.GetHex()));
+        if (fSerialized)
+            ret.push_back(Pair("hash_serialized", stats.hashSerialized.GetHex()));
+        else
+            ret.push_back(Pair("muhash", stats.hashMuHash.GetHex()));
         ret.push_back(Pair("total_amount", ValueFromAmount(stats.nTotalAmount)));
     }
     return ret;
 }
 
+/** Describe a chain state snapshot for dumptxoutset and loadtxoutset.  */
+static Object SnapshotToJSON(const boost::filesystem::path& path, const CChainStateSnapshot& header,
+                             const CChainStateSnapshotStats& stats)
+{
+    Object ret;
+    ret.push_back(Pair("path", path.string()));
+    ret.push_back(Pair("bestblock", header.hashBlock.GetHex()));
+    ret.push_back(Pair("height", (int64_t)header.vTxCount.size()));
+    ret.push_back(Pair("coins", (int64_t)stats.nCoins));
+    ret.push_back(Pair("names", (int64_t)stats.nNames));
+    ret.push_back(Pair("name_history", (int64_t)stats.nNameHistory));
+    ret.push_back(Pair("name_expiry", (int64_t)stats.nNameExpiry));
+    ret.push_back(Pair("checksum", stats.hashChecksum.GetHex()));
+    return ret;
+}
+
+Value dumptxoutset(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 1)
+        throw runtime_error(
+            "dumptxoutset \"path\"\n"
+            "\nWrite the unspent transaction output set and the name database at the current\n"
+            "tip to a checksummed snapshot file.  Another node can load it with loadtxoutset.\n"
+            "The node keeps running while the file is written.\n"
+            "\nArguments:\n"
+            "1. \"path\"     (string, required) The file to write, relative to the data directory\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"path\": \"path\",          (string) The absolute path of the snapshot\n"
+            "  \"bestblock\": \"hex\",      (string) The block the snapshot belongs to\n"
+            "  \"height\": n,               (numeric) The height of that block\n"
+            "  \"coins\": n,                (numeric) The number of transactions with unspent outputs\n"
+            "  \"names\": n,                (numeric) The number of names\n"
+            "  \"name_history\": n,         (numeric) The number of name history entries\n"
+            "  \"name_expiry\": n,          (numeric) The number of name expiration index entries\n"
+            "  \"checksum\": \"hash\"       (string) The checksum of the snapshot\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("dumptxoutset", "\"utxo.dat\"")
+            + HelpExampleRpc("dumptxoutset", "\"utxo.dat\"")
+        );
+
+    const boost::filesystem::path path = boost::filesystem::absolute(params[0].get_str(), GetDataDir());
+    if (boost::filesystem::exists(path))
+        throw JSONRPCError(RPC_INVALID_PARAMETER, path.string() + " already exists");
+
+    CChainStateSnapshot header;
+    CChainStateSnapshotStats stats;
+    CValidationState state;
+    if (!DumpChainStateSnapshot(path, header, stats, state))
+        throw JSONRPCError(RPC_MISC_ERROR, state.GetRejectReason());
+
+    return SnapshotToJSON(path, header, stats);
+}
+
+Value loadtxoutset(const Array& params, bool fHelp)
+{
+    if (fHelp || params.size() != 2)
+        throw runtime_error(
+            "loadtxoutset \"path\" \"checksum\"\n"
+            "\nReplace the chain state by a snapshot written by dumptxoutset.  The header of the\n"
+            "snapshot block must be known and extend the active chain.  Blocks after it are\n"
+            "downloaded and validated as usual, blocks before it are never downloaded.  This is\n"
+            "only possible with -prune, and wallet transactions before the snapshot are not found.\n"
+            "The snapshot is not validated, so its checksum has to be obtained from a trusted source\n"
+            "(for instance from dumptxoutset on an own node).  The chain state is left as it is if\n"
+            "the file does not have that checksum.\n"
+            "\nArguments:\n"
+            "1. \"path\"     (string, required) The snapshot file, relative to the data directory\n"
+            "2. \"checksum\" (string, required) The expected checksum of the snapshot\n"
+            "\nResult:\n"
+            "{\n"
+            "  \"path\": \"path\",          (string) The absolute path of the snapshot\n"
+            "  \"bestblock\": \"hex\",      (string) The block the snapshot belongs to\n"
+            "  \"height\": n,               (numeric) The height of that block\n"
+            "  \"coins\": n,                (numeric) The number of transactions with unspent outputs\n"
+            "  \"names\": n,                (numeric) The number of names\n"
+            "  \"name_history\": n,         (numeric) The number of name history entries\n"
+            "  \"name_expiry\": n,          (numeric) The number of name expiration index entries\n"
+            "  \"checksum\": \"hash\"       (string) The checksum of the snapshot\n"
+            "}\n"
+            "\nExamples:\n"
+            + HelpExampleCli("loadtxoutset", "\"utxo.dat\" \"checksum\"")
+            + HelpExampleRpc("loadtxoutset", "\"utxo.dat\", \"checksum\"")
+        );
+
+    const boost::filesystem::path path = boost::filesystem::absolute(params[0].get_str(), GetDataDir());
+    const uint256 hashExpected = ParseHashV(params[1], "checksum");
+
+    CChainStateSnapshot header;
+    CChainStateSnapshotStats stats;
+    CValidationState state;
+    if (!LoadChainStateSnapshot(path, hashExpected, header, stats, state))
+        throw JSONRPCError(RPC_MISC_ERROR, state.GetRejectReason());
+
+    return SnapshotToJSON(path, header, stats);
+}
+
 Value gettxout(const Array& params, bool fHelp)
 {
     if (fHelp || params.size() < 2 || params.size() > 3)
@@ -513,6 +643,15 @@ Value getblockchaininfo(const Array& params, bool fHelp)
             "  \"difficulty\": xxxxxx,     (numeric) the current difficulty\n"
             "  \"verificationprogress\": xxxx, (numeric) estimate of verification progress [0..1]\n"
             "  \"chainwork\": \"xxxx\"     (string) total amount of work in active chain, in hexadecimal\n"
+            "  \"blockverification\": {    (object, only with -asyncverify) the verification of -checkblocks\n"
+            "     \"running\": true|false, (boolean) whether it is still running\n"
+            "     \"ok\": true|false,      (boolean) whether it has completed without finding an inconsistency\n"
+            "     \"level\": xx,           (numeric) the -checklevel\n"
+            "     \"blocks\": xxxx,        (numeric) the number of blocks to verify\n"
+            "     \"startheight\": xxxx,   (numeric) the height of the tip it verifies\n"
+            "     \"height\": xxxx,        (numeric) the height it has reached\n"
+            "     \"progress\": xxxx       (numeric) estimate of its progress [0..1]\n"
+            "  }\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getblockchaininfo", "")
@@ -538,6 +677,20 @@ Value getblockchaininfo(const Array& params, bool fHelp)
 
         obj.push_back(Pair("pruneheight",        block->nHeight));
     }
+
+    const CVerifyDBProgress progress = GetVerifyDBProgress();
+    if (progress.fBackground)
+    {
+        Object verify;
+        verify.push_back(Pair("running",     progress.fRunning));
+        verify.push_back(Pair("ok",          progress.fOk));
+        verify.push_back(Pair("level",       progress.nCheckLevel));
+        verify.push_back(Pair("blocks",      progress.nCheckDepth));
+        verify.push_back(Pair("startheight", progress.nTipHeight));
+        verify.push_back(Pair("height",      progress.nHeight));
+        verify.push_back(Pair("progress",    progress.dProgress));
+        obj.push_back(Pair("blockverification", verify));
+    }
     return obj;
 }
 
@@ -656,6 +809,9 @@ Value getmempoolinfo(const Array& params, bool fHelp)
             "{\n"
             "  \"size\": xxxxx                (numeric) Current tx count\n"
             "  \"bytes\": xxxxx               (numeric) Sum of all tx sizes\n"
+            "  \"usage\": xxxxx               (numeric) Total memory usage for the mempool\n"
+            "  \"maxmempool\": xxxxx          (numeric) Maximum memory usage for the mempool\n"
+            "  \"mempoolminfee\": xxxxx       (numeric) Minimum fee for tx to be accepted\n"
             "}\n"
             "\nExamples:\n"
             + HelpExampleCli("getmempoolinfo", "")
@@ -665,6 +821,10 @@ Value getmempoolinfo(const Array& params, bool fHelp)
     Object ret;
     ret.push_back(Pair("size", (int64_t) mempool.size()));
     ret.push_back(Pair("bytes", (int64_t) mempool.GetTotalTxSize()));
+    ret.push_back(Pair("usage", (int64_t) mempool.DynamicMemoryUsage()));
+    size_t maxmempool = GetArg("-maxmempool", DEFAULT_MAX_MEMPOOL_SIZE) * 1000000;
+    ret.push_back(Pair("maxmempool", (int64_t) maxmempool));
+    ret.push_back(Pair("mempoolminfee", ValueFromAmount(mempool.GetMinFee(maxmempool).GetFeePerK())));
 
     return ret;
 }
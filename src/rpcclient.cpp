@@ -96,6 +96,9 @@ static const CRPCConvertParam vRPCConvertParams[] =
     { "name_filter", 1 },
     { "name_filter", 2 },
     { "name_filter", 3 },
+    { "name_pending", 1 },
+    { "name_firstupdate_many", 0 },
+    { "name_update_many", 0 },
 };
 
 class CRPCConvertTable
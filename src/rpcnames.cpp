@@ -10,15 +10,36 @@
 #include "primitives/transaction.h"
 #include "rpcserver.h"
 #include "script/names.h"
+#include "txdb.h"
+#include "txmempool.h"
 
 #include "json/json_spirit_utils.h"
 #include "json/json_spirit_value.h"
 
+#include <boost/scoped_ptr.hpp>
 #include <boost/xpressive/xpressive_dynamic.hpp>
 
 #include <memory>
 #include <sstream>
 
+/**
+ * Convert a name's address script to the string shown in name info objects.
+ * @param addr The name's address script.
+ * @return The address or "<nonstandard>".
+ */
+static std::string
+getAddressString (const CScript& addr)
+{
+  /* Try to extract the address.  May fail if we can't parse the script
+     as a "standard" script.  */
+  CTxDestination dest;
+  CBitcoinAddress addrParsed;
+  if (ExtractDestination (addr, dest) && addrParsed.Set (dest))
+    return addrParsed.ToString ();
+
+  return "<nonstandard>";
+}
+
 /**
  * Utility routine to construct a "name info" object to return.  This is used
  * for name_show and also name_list.
@@ -39,16 +60,7 @@ getNameInfo (const valtype& name, const valtype& value, const COutPoint& outp,
   obj.push_back (json_spirit::Pair ("txid", outp.hash.GetHex ()));
   obj.push_back (json_spirit::Pair ("vout", static_cast<int> (outp.n)));
 
-  /* Try to extract the address.  May fail if we can't parse the script
-     as a "standard" script.  */
-  CTxDestination dest;
-  CBitcoinAddress addrParsed;
-  std::string addrStr;
-  if (ExtractDestination (addr, dest) && addrParsed.Set (dest))
-    addrStr = addrParsed.ToString ();
-  else
-    addrStr = "<nonstandard>";
-  obj.push_back (json_spirit::Pair ("address", addrStr));
+  obj.push_back (json_spirit::Pair ("address", getAddressString (addr)));
 
   /* Calculate expiration data.  */
   const int curHeight = chainActive.Height ();
@@ -435,6 +447,91 @@ name_filter (const json_spirit::Array& params, bool fHelp)
 
 /* ************************************************************************** */
 
+json_spirit::Value
+name_pending (const json_spirit::Array& params, bool fHelp)
+{
+  if (fHelp || params.size () > 2)
+    throw std::runtime_error (
+        "name_pending (\"name\" (\"prefix\"))\n"
+        "\nList unconfirmed name registrations and updates in the mempool.\n"
+        "\nArguments:\n"
+        "1. \"name\"        (string, optional) only look for this name\n"
+        "2. \"prefix\"      (boolean, optional, default=false) list all names starting with \"name\" instead\n"
+        "\nResult:\n"
+        "[\n"
+        "  {\n"
+        "    \"op\": xxxxx,         (string) the operation, name_firstupdate or name_update\n"
+        "    \"name\": xxxxx,       (string) the name\n"
+        "    \"value\": xxxxx,      (string) the name's pending value\n"
+        "    \"txid\": xxxxx,       (string) the pending transaction\n"
+        "    \"vout\": xxxxx,       (numeric) the name output's index\n"
+        "    \"address\": xxxxx,    (string) the address that will hold the name\n"
+        "  },\n"
+        "  ...\n"
+        "]\n"
+        "\nExamples:\n"
+        + HelpExampleCli ("name_pending", "")
+        + HelpExampleCli ("name_pending", "\"d/domob\"")
+        + HelpExampleCli ("name_pending", "\"d/\" true")
+        + HelpExampleRpc ("name_pending", "\"d/domob\"")
+      );
+
+  valtype prefix;
+  bool exact = false;
+  if (params.size () >= 1)
+    {
+      prefix = ValtypeFromString (params[0].get_str ());
+      exact = true;
+    }
+  if (params.size () >= 2)
+    exact = !params[1].get_bool ();
+
+  json_spirit::Array res;
+
+  LOCK (mempool.cs);
+
+  std::vector<std::pair<valtype, uint256> > pending;
+  if (exact)
+    mempool.queryPendingName (prefix, pending);
+  else
+    mempool.queryPendingNames (prefix, pending);
+
+  std::vector<std::pair<valtype, uint256> >::const_iterator it;
+  for (it = pending.begin (); it != pending.end (); ++it)
+    {
+      const CTxMemPool::txiter mit = mempool.mapTx.find (it->second);
+      assert (mit != mempool.mapTx.end ());
+      const CTransaction& tx = mit->GetTx ();
+
+      for (unsigned i = 0; i < tx.vout.size (); ++i)
+        {
+          const CNameScript nameOp(tx.vout[i].scriptPubKey);
+          if (!nameOp.isNameOp () || !nameOp.isAnyUpdate ())
+            continue;
+
+          const std::string op = (nameOp.getNameOp () == OP_NAME_FIRSTUPDATE
+                                  ? "name_firstupdate" : "name_update");
+
+          json_spirit::Object obj;
+          obj.push_back (json_spirit::Pair ("op", op));
+          obj.push_back (json_spirit::Pair ("name",
+                                            ValtypeToString (it->first)));
+          obj.push_back (json_spirit::Pair ("value",
+                              ValtypeToString (nameOp.getOpValue ())));
+          obj.push_back (json_spirit::Pair ("txid", tx.GetHash ().GetHex ()));
+          obj.push_back (json_spirit::Pair ("vout", static_cast<int> (i)));
+          obj.push_back (json_spirit::Pair ("address",
+                              getAddressString (nameOp.getAddress ())));
+          res.push_back (obj);
+          break;
+        }
+    }
+
+  return res;
+}
+
+/* ************************************************************************** */
+
 json_spirit::Value
 name_checkdb (const json_spirit::Array& params, bool fHelp)
 {
@@ -451,7 +548,57 @@ name_checkdb (const json_spirit::Array& params, bool fHelp)
         + HelpExampleRpc ("name_checkdb", "")
       );
 
+  /* Only the snapshot is taken with cs_main held, the check itself
+     does not block the node.  */
+  boost::scoped_ptr<CChainStateDBSnapshot> snapshot;
+  int nHeight;
+  {
+    LOCK (cs_main);
+    FlushStateToDisk ();
+    snapshot.reset (pcoinsdbview->GetSnapshot ());
+    nHeight = chainActive.Height ();
+  }
+
+  return CCoinsViewDB::ValidateNameDB (*snapshot, nHeight);
+}
+
+/* ************************************************************************** */
+
+json_spirit::Value
+name_setinfo (const json_spirit::Array& params, bool fHelp)
+{
+  if (fHelp || params.size () != 0)
+    throw std::runtime_error (
+        "name_setinfo\n"
+        "\nReturn statistics about the name database.  The set hash is kept\n"
+        "up to date with each database write, so this call is fast.  It can\n"
+        "be used to compare the name databases of different nodes.\n"
+        "\nResult:\n"
+        "{\n"
+        "  \"height\": xxxxx,     (numeric) the current block height\n"
+        "  \"bestblock\": xxxxx,  (string) the current best block hash\n"
+        "  \"names\": xxxxx,      (numeric) number of names in the database,"
+                                " including expired ones\n"
+        "  \"muhash\": xxxxx,     (string) rolling hash of the set of names\n"
+        "}\n"
+        "\nExamples:\n"
+        + HelpExampleCli ("name_setinfo", "")
+        + HelpExampleRpc ("name_setinfo", "")
+      );
+
   LOCK (cs_main);
-  pcoinsTip->Flush ();
-  return pcoinsTip->ValidateNameDB ();
+  FlushStateToDisk ();
+
+  CNameSetStats stats;
+  if (!pcoinsdbview->GetNameStats (stats))
+    throw JSONRPCError (RPC_DATABASE_ERROR, "failed to read the name database");
+
+  json_spirit::Object res;
+  res.push_back (json_spirit::Pair ("height", stats.nHeight));
+  res.push_back (json_spirit::Pair ("bestblock", stats.hashBlock.GetHex ()));
+  res.push_back (json_spirit::Pair ("names",
+                                    static_cast<int64_t> (stats.nNames)));
+  res.push_back (json_spirit::Pair ("muhash", stats.hashMuHash.GetHex ()));
+
+  return res;
 }
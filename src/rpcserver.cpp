@@ -296,6 +296,8 @@ static const CRPCCommand vRPCCommands[] =
     { "blockchain",         "gettxoutproof",          &gettxoutproof,          true  },
     { "blockchain",         "verifytxoutproof",       &verifytxoutproof,       true  },
     { "blockchain",         "gettxoutsetinfo",        &gettxoutsetinfo,        true  },
+    { "blockchain",         "dumptxoutset",           &dumptxoutset,           true  },
+    { "blockchain",         "loadtxoutset",           &loadtxoutset,           true  },
     { "blockchain",         "verifychain",            &verifychain,            true  },
 
     /* Mining */
@@ -343,12 +345,16 @@ static const CRPCCommand vRPCCommands[] =
     { "namecoin",           "name_history",           &name_history,           false },
     { "namecoin",           "name_scan",              &name_scan,              false },
     { "namecoin",           "name_filter",            &name_filter,            false },
+    { "namecoin",           "name_pending",           &name_pending,           false },
     { "namecoin",           "name_checkdb",           &name_checkdb,           false },
+    { "namecoin",           "name_setinfo",           &name_setinfo,           true  },
 #ifdef ENABLE_WALLET
     { "namecoin",           "name_list",              &name_list,              false },
     { "namecoin",           "name_new",               &name_new,               false },
     { "namecoin",           "name_firstupdate",       &name_firstupdate,       false },
+    { "namecoin",           "name_firstupdate_many",  &name_firstupdate_many,  false },
     { "namecoin",           "name_update",            &name_update,            false },
+    { "namecoin",           "name_update_many",       &name_update_many,       false },
 #endif // ENABLE_WALLET
 
 #ifdef ENABLE_WALLET
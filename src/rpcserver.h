@@ -240,6 +240,8 @@ extern json_spirit::Value getrawmempool(const json_spirit::Array& params, bool f
 extern json_spirit::Value getblockhash(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getblock(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value gettxoutsetinfo(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value dumptxoutset(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value loadtxoutset(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value gettxout(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value verifychain(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value getchaintips(const json_spirit::Array& params, bool fHelp);
@@ -264,10 +266,14 @@ extern json_spirit::Value name_show(const json_spirit::Array& params, bool fHelp
 extern json_spirit::Value name_history(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value name_scan(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value name_filter(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value name_pending(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value name_list(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value name_new(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value name_firstupdate(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value name_firstupdate_many(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value name_update(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value name_update_many(const json_spirit::Array& params, bool fHelp);
 extern json_spirit::Value name_checkdb(const json_spirit::Array& params, bool fHelp);
+extern json_spirit::Value name_setinfo(const json_spirit::Array& params, bool fHelp);
 
 #endif // BITCOINRPC_SERVER_H
@@ -12,6 +12,7 @@
 
 #include "test/test_bitcoin.h"
 
+#include <boost/filesystem.hpp>
 #include <boost/test/unit_test.hpp>
 
 #include <algorithm>
@@ -449,4 +450,87 @@ BOOST_AUTO_TEST_CASE (auxpow_pow)
 
 /* ************************************************************************** */
 
+/**
+ * Mine a merge-mined block on top of hashPrev and write it to a fresh
+ * block file.
+ * @param hashPrev The previous block.
+ * @param nFile The block file to use.
+ * @param index Set up as the block's index entry (without hash).
+ * @return The block's header.
+ */
+static CBlockHeader
+writeAuxpowBlock (const uint256& hashPrev, int nFile, CBlockIndex& index)
+{
+  const Consensus::Params& params = Params ().GetConsensus ();
+  const unsigned height = 3;
+  const int nonce = 7;
+  const int chainIndex
+    = CAuxPow::getExpectedIndex (nonce, params.nAuxpowChainId, height);
+
+  const arith_uint256 target = (~arith_uint256 (0) >> 1);
+  CBlock block;
+  block.hashPrevBlock = hashPrev;
+  block.nBits = target.GetCompact ();
+  block.nVersion.SetBaseVersion (2);
+  block.nVersion.SetChainId (params.nAuxpowChainId);
+  block.nVersion.SetAuxpow (true);
+
+  CAuxpowBuilder builder(5, 42);
+  const valtype auxRoot
+    = builder.buildAuxpowChain (block.GetHash (), height, chainIndex);
+  const valtype data
+    = CAuxpowBuilder::buildCoinbaseData (true, auxRoot, height, nonce);
+  builder.setCoinbase (CScript () << data);
+  mineBlock (builder.parentBlock, true, block.nBits);
+  block.SetAuxpow (new CAuxPow (builder.get ()));
+  BOOST_CHECK (CheckProofOfWork (block, params));
+
+  CDiskBlockPos pos(nFile, 0);
+  BOOST_CHECK (WriteBlockToDisk (block, pos, Params ().MessageStart ()));
+
+  index = CBlockIndex (block);
+  index.nFile = pos.nFile;
+  index.nDataPos = pos.nPos;
+  index.nStatus |= BLOCK_HAVE_DATA;
+
+  return block;
+}
+
+BOOST_FIXTURE_TEST_CASE (auxpow_header_cache, TestingSetup)
+{
+  SelectParams (CBaseChainParams::REGTEST);
+  const size_t nOldHeaderCacheUsage = nHeaderCacheUsage;
+
+  CBlockIndex index1, index2;
+  const CBlockHeader block1 = writeAuxpowBlock (uint256 (), 1, index1);
+  const uint256 hash1 = block1.GetHash ();
+  index1.phashBlock = &hash1;
+  const CBlockHeader block2 = writeAuxpowBlock (hash1, 2, index2);
+  const uint256 hash2 = block2.GetHash ();
+  index2.phashBlock = &hash2;
+
+  /* The first read caches the header, so that it is served even after
+     the block file is gone.  */
+  CBlockHeader header;
+  BOOST_CHECK (ReadBlockHeaderFromDisk (header, &index1));
+  BOOST_CHECK (header.GetHash () == hash1 && header.auxpow);
+  boost::filesystem::remove (GetBlockPosFilename (index1.GetBlockPos (), "blk"));
+  header = index1.GetBlockHeader ();
+  BOOST_CHECK (header.GetHash () == hash1 && header.auxpow);
+  BOOST_CHECK (header.auxpow->parentBlock.GetHash ()
+                == block1.auxpow->parentBlock.GetHash ());
+
+  /* Caching another header while over the memory bound evicts the
+     first one.  */
+  nHeaderCacheUsage = 1;
+  BOOST_CHECK (ReadBlockHeaderFromDisk (header, &index2));
+  BOOST_CHECK (header.GetHash () == hash2 && header.auxpow);
+  BOOST_CHECK (!ReadBlockHeaderFromDisk (header, &index1));
+
+  nHeaderCacheUsage = nOldHeaderCacheUsage;
+  SelectParams (CBaseChainParams::MAIN);
+}
+
+/* ************************************************************************** */
+
 BOOST_AUTO_TEST_SUITE_END ()
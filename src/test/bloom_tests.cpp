@@ -7,7 +7,10 @@
 #include "base58.h"
 #include "clientversion.h"
 #include "key.h"
+#include "memusage.h"
 #include "merkleblock.h"
+#include "mruset.h"
+#include "protocol.h"
 #include "random.h"
 #include "serialize.h"
 #include "streams.h"
@@ -537,4 +540,53 @@ BOOST_AUTO_TEST_CASE(rolling_bloom)
     }
 }
 
+BOOST_AUTO_TEST_CASE(rolling_bloom_inventory)
+{
+    // Track hashes the way CNode::filterInventoryKnown does.
+    static const unsigned int NELEMENTS = 5000;
+    CRollingBloomFilter rb(NELEMENTS, 0.000001, 0);
+    const size_t nUsage = rb.DynamicMemoryUsage();
+    BOOST_CHECK(nUsage > 0);
+
+    std::vector<uint256> hashes;
+    for (unsigned int i = 0; i < 3 * NELEMENTS; i++)
+        hashes.push_back(GetRandHash());
+
+    for (unsigned int i = 0; i < hashes.size(); i++) {
+        if (i >= NELEMENTS)
+            BOOST_CHECK(rb.contains(hashes[i - NELEMENTS]));
+        rb.insert(hashes[i]);
+        BOOST_CHECK(rb.contains(hashes[i]));
+    }
+
+    // The filter does not grow, however many items are inserted.
+    BOOST_CHECK_EQUAL(rb.DynamicMemoryUsage(), nUsage);
+
+    // Compare against the mruset it replaces, which remembers the
+    // same number of items.  Run test_bitcoin with --log_level=message
+    // to see the numbers.
+    mruset<CInv> setKnown(NELEMENTS);
+    int64_t nStart = GetTimeMicros();
+    for (unsigned int i = 0; i < hashes.size(); i++) {
+        const CInv inv(MSG_TX, hashes[i]);
+        if (!setKnown.count(inv))
+            setKnown.insert(inv);
+    }
+    const int64_t nTimeSet = GetTimeMicros() - nStart;
+
+    rb.clear();
+    nStart = GetTimeMicros();
+    for (unsigned int i = 0; i < hashes.size(); i++) {
+        if (!rb.contains(hashes[i]))
+            rb.insert(hashes[i]);
+    }
+    const int64_t nTimeFilter = GetTimeMicros() - nStart;
+
+    // Each mruset entry needs a set node and a deque slot.
+    const size_t nSetUsage = NELEMENTS * (memusage::MallocUsage(sizeof(CInv) + 4 * sizeof(void*)) + sizeof(CInv));
+    BOOST_TEST_MESSAGE("Known inventory of " << NELEMENTS << " items: mruset ~" << nSetUsage
+                       << " bytes, " << nTimeSet << "us; rolling filter " << nUsage
+                       << " bytes, " << nTimeFilter << "us");
+}
+
 BOOST_AUTO_TEST_SUITE_END()
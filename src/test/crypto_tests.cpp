@@ -2,6 +2,7 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "crypto/muhash.h"
 #include "crypto/ripemd160.h"
 #include "crypto/sha1.h"
 #include "crypto/sha256.h"
@@ -9,6 +10,7 @@
 #include "crypto/hmac_sha256.h"
 #include "crypto/hmac_sha512.h"
 #include "random.h"
+#include "streams.h"
 #include "utilstrencodings.h"
 #include "test/test_bitcoin.h"
 
@@ -248,4 +250,59 @@ BOOST_AUTO_TEST_CASE(hmac_sha512_testvectors) {
                    "b6022cac3c4982b10d5eeb55c3e4de15134676fb6de0446065c97440fa8c6a58");
 }
 
+static std::string MuHashHex(const MuHash3072& hash) {
+    unsigned char out[MuHash3072::OUTPUT_SIZE];
+    hash.Finalize(out);
+    return HexStr(out, out + sizeof(out));
+}
+
+static MuHash3072 MuHashOf(const std::string& elements) {
+    MuHash3072 hash;
+    for (size_t i = 0; i < elements.size(); ++i)
+        hash.Insert((const unsigned char*)&elements[i], 1);
+    return hash;
+}
+
+BOOST_AUTO_TEST_CASE(muhash_tests) {
+    // The empty set hashes the number one.
+    BOOST_CHECK_EQUAL(MuHashHex(MuHash3072()), "c85525462fdcf30a2c18d6f4b92923000974355c2477f59594d2c205a1d25add");
+    BOOST_CHECK_EQUAL(MuHashHex(MuHashOf("ac")), "c8084ed431596b853a1ff3c109574a5e6e979be18d7abb3bcd60f4e46155f2d2");
+
+    // The order of insertions and removals does not matter.
+    MuHash3072 hash = MuHashOf("abc");
+    hash.Remove((const unsigned char*)"b", 1);
+    BOOST_CHECK_EQUAL(MuHashHex(hash), MuHashHex(MuHashOf("ca")));
+    BOOST_CHECK(MuHashHex(hash) != MuHashHex(MuHashOf("abc")));
+
+    // Removing an element before it is inserted works as well.
+    MuHash3072 early;
+    early.Remove((const unsigned char*)"x", 1);
+    early *= MuHashOf("cxa");
+    BOOST_CHECK_EQUAL(MuHashHex(early), MuHashHex(MuHashOf("ac")));
+
+    // An element can be given by the SHA256 of its data.
+    unsigned char hashB[CSHA256::OUTPUT_SIZE];
+    CSHA256().Write((const unsigned char*)"b", 1).Finalize(hashB);
+    MuHash3072 hashed = MuHashOf("ac");
+    hashed.InsertHashed(hashB);
+    BOOST_CHECK_EQUAL(MuHashHex(hashed), MuHashHex(MuHashOf("abc")));
+    hashed.RemoveHashed(hashB);
+    BOOST_CHECK_EQUAL(MuHashHex(hashed), MuHashHex(MuHashOf("ac")));
+
+    // Combining and splitting sets.
+    MuHash3072 combined = MuHashOf("ab");
+    combined *= MuHashOf("cd");
+    BOOST_CHECK_EQUAL(MuHashHex(combined), MuHashHex(MuHashOf("dcba")));
+    combined /= MuHashOf("ad");
+    BOOST_CHECK_EQUAL(MuHashHex(combined), MuHashHex(MuHashOf("bc")));
+
+    // The state survives serialization.
+    CDataStream ss(SER_DISK, 0);
+    ss << hash;
+    BOOST_CHECK_EQUAL(ss.size(), 2 * Num3072::BYTE_SIZE);
+    MuHash3072 hashRead;
+    ss >> hashRead;
+    BOOST_CHECK_EQUAL(MuHashHex(hashRead), MuHashHex(hash));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -7,6 +7,7 @@
 
 #include "test/test_bitcoin.h"
 
+#include <boost/filesystem.hpp>
 #include <boost/signals2/signal.hpp>
 #include <boost/test/unit_test.hpp>
 
@@ -73,4 +74,37 @@ BOOST_AUTO_TEST_CASE(test_combiner_all)
     BOOST_CHECK(Test());
 }
 
+BOOST_AUTO_TEST_CASE(block_file_maps)
+{
+    const int nOldBlockFileMaps = nBlockFileMaps;
+    nBlockFileMaps = 1;
+
+    const CBlock& genesis = Params().GenesisBlock();
+    CBlock block(genesis);
+
+    // The second record is only found after file 1 is mapped again with
+    // the size it has grown to.
+    CDiskBlockPos pos1(1, 0);
+    BOOST_CHECK(WriteBlockToDisk(block, pos1, Params().MessageStart()));
+    BOOST_CHECK(ReadBlockFromDisk(block, pos1));
+    BOOST_CHECK(block.GetHash() == genesis.GetHash());
+    CDiskBlockPos pos2(1, pos1.nPos + ::GetSerializeSize(genesis, SER_DISK, CLIENT_VERSION));
+    BOOST_CHECK(WriteBlockToDisk(block, pos2, Params().MessageStart()));
+    BOOST_CHECK(ReadBlockFromDisk(block, pos2));
+    BOOST_CHECK(block.GetHash() == genesis.GetHash());
+
+    // With a single mapping, reading file 0 evicts file 1.  Once file 0 is
+    // mapped, deleting it does not stop reads until it is pruned.
+    LOCK(cs_main);
+    const CDiskBlockPos pos0 = chainActive.Genesis()->GetBlockPos();
+    BOOST_CHECK(ReadBlockFromDisk(block, chainActive.Genesis()));
+    boost::filesystem::remove(GetBlockPosFilename(pos0, "blk"));
+    BOOST_CHECK(ReadBlockFromDisk(block, pos0));
+    BOOST_CHECK(block.GetHash() == genesis.GetHash());
+    PruneOneBlockFile(pos0.nFile);
+    BOOST_CHECK(!ReadBlockFromDisk(block, pos0));
+
+    nBlockFileMaps = nOldBlockFileMaps;
+}
+
 BOOST_AUTO_TEST_SUITE_END()
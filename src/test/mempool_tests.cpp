@@ -2,7 +2,14 @@
 // Distributed under the MIT software license, see the accompanying
 // file COPYING or http://www.opensource.org/licenses/mit-license.php.
 
+#include "coins.h"
+#include "consensus/validation.h"
+#include "hash.h"
 #include "main.h"
+#include "pubkey.h"
+#include "random.h"
+#include "script/names.h"
+#include "script/standard.h"
 #include "txmempool.h"
 #include "util.h"
 
@@ -101,4 +108,330 @@ BOOST_AUTO_TEST_CASE(MempoolRemoveTest)
     removed.clear();
 }
 
+BOOST_AUTO_TEST_CASE(MempoolAggregateTest)
+{
+    // Chain of three transactions:  tx1 <- tx2 <- tx3
+    CTxMemPool pool(CFeeRate(0));
+
+    CMutableTransaction tx1;
+    tx1.vin.resize(1);
+    tx1.vin[0].scriptSig = CScript() << OP_11;
+    tx1.vout.resize(1);
+    tx1.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx1.vout[0].nValue = 10 * COIN;
+
+    CMutableTransaction tx2;
+    tx2.vin.resize(1);
+    tx2.vin[0].prevout = COutPoint(tx1.GetHash(), 0);
+    tx2.vin[0].scriptSig = CScript() << OP_11;
+    tx2.vout.resize(1);
+    tx2.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx2.vout[0].nValue = 9 * COIN;
+
+    CMutableTransaction tx3;
+    tx3.vin.resize(1);
+    tx3.vin[0].prevout = COutPoint(tx2.GetHash(), 0);
+    tx3.vin[0].scriptSig = CScript() << OP_11;
+    tx3.vout.resize(1);
+    tx3.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    tx3.vout[0].nValue = 8 * COIN;
+
+    pool.addUnchecked(tx1.GetHash(), CTxMemPoolEntry(tx1, 1000, 0, 0.0, 1));
+    pool.addUnchecked(tx2.GetHash(), CTxMemPoolEntry(tx2, 2000, 0, 0.0, 1));
+    pool.addUnchecked(tx3.GetHash(), CTxMemPoolEntry(tx3, 3000, 0, 0.0, 1));
+
+    CTxMemPool::txiter it1 = pool.mapTx.find(tx1.GetHash());
+    CTxMemPool::txiter it2 = pool.mapTx.find(tx2.GetHash());
+    CTxMemPool::txiter it3 = pool.mapTx.find(tx3.GetHash());
+    const uint64_t nSize = it1->GetTxSize();
+
+    BOOST_CHECK_EQUAL(it1->GetCountWithDescendants(), 3);
+    BOOST_CHECK_EQUAL(it1->GetModFeesWithDescendants(), 6000);
+    BOOST_CHECK_EQUAL(it1->GetSizeWithDescendants(), 3 * nSize);
+    BOOST_CHECK_EQUAL(it2->GetCountWithDescendants(), 2);
+    BOOST_CHECK_EQUAL(it2->GetModFeesWithAncestors(), 3000);
+    BOOST_CHECK_EQUAL(it3->GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(it3->GetModFeesWithAncestors(), 6000);
+    BOOST_CHECK(pool.GetMemPoolParents(it2).count(it1));
+    BOOST_CHECK(pool.GetMemPoolChildren(it2).count(it3));
+
+    // Fee deltas propagate into the aggregates.
+    pool.PrioritiseTransaction(tx2.GetHash(), tx2.GetHash().ToString(), 0.0, 500);
+    BOOST_CHECK_EQUAL(it1->GetModFeesWithDescendants(), 6500);
+    BOOST_CHECK_EQUAL(it3->GetModFeesWithAncestors(), 6500);
+
+    // Removing tx1 as if it were mined keeps the children.
+    std::list<CTransaction> removed;
+    pool.remove(tx1, removed, false);
+    BOOST_CHECK_EQUAL(removed.size(), 1);
+    BOOST_CHECK_EQUAL(it2->GetCountWithAncestors(), 1);
+    BOOST_CHECK_EQUAL(it3->GetCountWithAncestors(), 2);
+    BOOST_CHECK_EQUAL(it3->GetModFeesWithAncestors(), 5500);
+    BOOST_CHECK(pool.GetMemPoolParents(it2).empty());
+
+    // Putting it back (as on a re-org) links the existing children again.
+    pool.addUnchecked(tx1.GetHash(), CTxMemPoolEntry(tx1, 1000, 0, 0.0, 1));
+    it1 = pool.mapTx.find(tx1.GetHash());
+    BOOST_CHECK_EQUAL(it1->GetCountWithDescendants(), 3);
+    BOOST_CHECK_EQUAL(it1->GetModFeesWithDescendants(), 6500);
+    BOOST_CHECK_EQUAL(it3->GetCountWithAncestors(), 3);
+    BOOST_CHECK_EQUAL(it2->GetSizeWithAncestors(), 2 * nSize);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolIndexingTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+
+    // Independent transactions with different fee rates and entry times.
+    std::vector<CMutableTransaction> vtx(4);
+    const CAmount fees[] = {3000, 1000, 4000, 2000};
+    for (unsigned i = 0; i < vtx.size(); ++i)
+    {
+        vtx[i].vin.resize(1);
+        vtx[i].vin[0].scriptSig = CScript() << OP_11 << CScriptNum(i);
+        vtx[i].vout.resize(1);
+        vtx[i].vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+        vtx[i].vout[0].nValue = COIN;
+        pool.addUnchecked(vtx[i].GetHash(), CTxMemPoolEntry(vtx[i], fees[i], 100 - i, 0.0, 1));
+    }
+
+    // Mining order is by fee rate, highest first.
+    std::vector<CAmount> miningOrder;
+    BOOST_FOREACH(const CTxMemPoolEntry& e, pool.mapTx.get<mining_score>())
+        miningOrder.push_back(e.GetFee());
+    BOOST_CHECK_EQUAL(miningOrder[0], 4000);
+    BOOST_CHECK_EQUAL(miningOrder[1], 3000);
+    BOOST_CHECK_EQUAL(miningOrder[2], 2000);
+    BOOST_CHECK_EQUAL(miningOrder[3], 1000);
+
+    // Eviction order is by fee rate, lowest first.
+    BOOST_CHECK_EQUAL(pool.mapTx.get<descendant_score>().begin()->GetFee(), 1000);
+
+    // Entry time order, oldest first.
+    BOOST_CHECK_EQUAL(pool.mapTx.get<entry_time>().begin()->GetFee(), 2000);
+
+    // Insertion order follows the calls to addUnchecked, independent
+    // of the entry time.
+    const uint64_t nSequence = pool.GetSequence();
+    BOOST_CHECK_EQUAL(nSequence, 4);
+    BOOST_CHECK_EQUAL(pool.mapTx.get<insertion_order>().begin()->GetFee(), 3000);
+
+    // A high-fee child lifts its parent's descendant score above others.
+    CMutableTransaction child;
+    child.vin.resize(1);
+    child.vin[0].prevout = COutPoint(vtx[1].GetHash(), 0);
+    child.vin[0].scriptSig = CScript() << OP_11;
+    child.vout.resize(1);
+    child.vout[0].scriptPubKey = CScript() << OP_11 << OP_EQUAL;
+    child.vout[0].nValue = COIN / 2;
+    pool.addUnchecked(child.GetHash(), CTxMemPoolEntry(child, 20000, 0, 0.0, 1));
+    BOOST_CHECK_EQUAL(pool.mapTx.get<descendant_score>().begin()->GetFee(), 2000);
+
+    // Only the child was added after nSequence was taken.
+    BOOST_CHECK(pool.mapTx.get<insertion_order>().lower_bound(nSequence)->GetTx().GetHash() == child.GetHash());
+    BOOST_CHECK_EQUAL(pool.mapTx.get<insertion_order>().rbegin()->GetSequence(), nSequence);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolSizeLimitTest)
+{
+    CTxMemPool pool(CFeeRate(0));
+
+    CMutableTransaction tx1;
+    tx1.vin.resize(1);
+    tx1.vin[0].scriptSig = CScript() << OP_1;
+    tx1.vout.resize(1);
+    tx1.vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+    tx1.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx1.GetHash(), CTxMemPoolEntry(tx1, 10000, 0, 0.0, 1));
+
+    CMutableTransaction tx2;
+    tx2.vin.resize(1);
+    tx2.vin[0].scriptSig = CScript() << OP_2;
+    tx2.vout.resize(1);
+    tx2.vout[0].scriptPubKey = CScript() << OP_2 << OP_EQUAL;
+    tx2.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx2.GetHash(), CTxMemPoolEntry(tx2, 5000, 0, 0.0, 1));
+
+    // Nothing is evicted if the pool fits.
+    pool.TrimToSize(pool.DynamicMemoryUsage());
+    BOOST_CHECK(pool.exists(tx1.GetHash()));
+    BOOST_CHECK(pool.exists(tx2.GetHash()));
+
+    // Shrinking the limit evicts the lower fee-rate transaction first.
+    std::list<CTransaction> removed;
+    pool.TrimToSize(pool.DynamicMemoryUsage() * 3 / 4, &removed);
+    BOOST_CHECK_EQUAL(removed.size(), 1);
+    BOOST_CHECK(pool.exists(tx1.GetHash()));
+    BOOST_CHECK(!pool.exists(tx2.GetHash()));
+
+    // A child with a high fee protects its parent, and both are evicted
+    // together as a package.
+    CMutableTransaction tx3;
+    tx3.vin.resize(1);
+    tx3.vin[0].prevout = COutPoint(tx2.GetHash(), 0);
+    tx3.vin[0].scriptSig = CScript() << OP_3;
+    tx3.vout.resize(1);
+    tx3.vout[0].scriptPubKey = CScript() << OP_3 << OP_EQUAL;
+    tx3.vout[0].nValue = 10 * COIN;
+    pool.addUnchecked(tx2.GetHash(), CTxMemPoolEntry(tx2, 5000, 0, 0.0, 1));
+    pool.addUnchecked(tx3.GetHash(), CTxMemPoolEntry(tx3, 20000, 0, 0.0, 1));
+
+    removed.clear();
+    pool.TrimToSize(pool.DynamicMemoryUsage() * 3 / 4, &removed);
+    BOOST_CHECK_EQUAL(removed.size(), 1);
+    BOOST_CHECK(!pool.exists(tx1.GetHash()));
+    BOOST_CHECK(pool.exists(tx2.GetHash()));
+    BOOST_CHECK(pool.exists(tx3.GetHash()));
+
+    removed.clear();
+    pool.TrimToSize(1, &removed);
+    BOOST_CHECK_EQUAL(removed.size(), 2);
+    BOOST_CHECK_EQUAL(pool.size(), 0);
+    BOOST_CHECK_EQUAL(pool.DynamicMemoryUsage(), 0);
+}
+
+BOOST_AUTO_TEST_CASE(MempoolMinFeeTest)
+{
+    CTxMemPool pool(CFeeRate(1000));
+    const int64_t nStart = GetTime();
+    SetMockTime(nStart);
+
+    CMutableTransaction tx;
+    tx.vin.resize(1);
+    tx.vin[0].scriptSig = CScript() << OP_1;
+    tx.vout.resize(1);
+    tx.vout[0].scriptPubKey = CScript() << OP_1 << OP_EQUAL;
+    tx.vout[0].nValue = 10 * COIN;
+    CTxMemPoolEntry entry(tx, 10000, 0, 0.0, 1);
+    pool.addUnchecked(tx.GetHash(), entry);
+    BOOST_CHECK(pool.GetMinFee(1) == CFeeRate(0));
+
+    // The evicted fee rate plus the minimum relay fee is required now.
+    pool.TrimToSize(1);
+    BOOST_CHECK(!pool.exists(tx.GetHash()));
+    const CAmount nMinFee = CFeeRate(10000, entry.GetTxSize()).GetFeePerK() + 1000;
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), nMinFee);
+
+    // It does not decay before a block is found.
+    SetMockTime(nStart + CTxMemPool::ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), nMinFee);
+
+    std::list<CTransaction> conflicts;
+    pool.removeForBlock(std::vector<CTransaction>(), 1, conflicts);
+    SetMockTime(nStart + 2 * CTxMemPool::ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK_EQUAL(pool.GetMinFee(1).GetFeePerK(), nMinFee / 2);
+
+    // Far enough below the minimum relay fee, it drops to zero.
+    SetMockTime(nStart + 20 * CTxMemPool::ROLLING_FEE_HALFLIFE);
+    BOOST_CHECK(pool.GetMinFee(1) == CFeeRate(0));
+
+    SetMockTime(0);
+}
+
+// Outputs that AcceptToMemoryPool accepts to spend with SpendTestCoin.
+static const CScript redeemScript = CScript() << OP_NOP << OP_TRUE;
+
+static uint256 AddTestCoin(const CScript& scriptPubKey, CAmount nValue)
+{
+    CMutableTransaction mtx;
+    mtx.vout.push_back(CTxOut(nValue, scriptPubKey));
+    mtx.nLockTime = GetRand(1000000);
+    const CTransaction tx(mtx);
+
+    CCoinsModifier coins = pcoinsTip->ModifyCoins(tx.GetHash());
+    *coins = CCoins(tx, 0);
+    return tx.GetHash();
+}
+
+static CTransaction SpendTestCoin(const uint256& txid, CAmount nValueIn, CAmount nFee,
+                                  const CScript& scriptPubKey)
+{
+    CMutableTransaction mtx;
+    mtx.vin.push_back(CTxIn(COutPoint(txid, 0), CScript() << ToByteVector(redeemScript)));
+    mtx.vout.push_back(CTxOut(nValueIn - nFee, scriptPubKey));
+    if (CNameScript(scriptPubKey).isNameOp())
+        mtx.SetNamecoin();
+    return mtx;
+}
+
+BOOST_AUTO_TEST_CASE(MempoolDumpLoadTest)
+{
+    const CScript addr = GetScriptForDestination(CScriptID(redeemScript));
+    const CAmount nFee = ::minRelayTxFee.GetFeePerK();
+    const int64_t nNow = GetTime();
+    std::list<CTransaction> removed;
+
+    LOCK(cs_main);
+
+    // A plain transaction with a child, one that will conflict with the
+    // chain, one that has expired and a NAME_NEW with its NAME_FIRSTUPDATE.
+    const CTransaction txParent = SpendTestCoin(AddTestCoin(addr, COIN), COIN, nFee, addr);
+    const CTransaction txChild = SpendTestCoin(txParent.GetHash(), COIN - nFee, nFee, addr);
+    const uint256 txidSpent = AddTestCoin(addr, COIN);
+    const CTransaction txConflict = SpendTestCoin(txidSpent, COIN, nFee, addr);
+    const CTransaction txExpired = SpendTestCoin(AddTestCoin(addr, COIN), COIN, nFee, addr);
+
+    const valtype name = ValtypeFromString("dump-test-name");
+    const valtype rand(20, 'x');
+    valtype toHash(rand);
+    toHash.insert(toHash.end(), name.begin(), name.end());
+    const uint160 hash = Hash160(toHash);
+    const CTransaction txNew = SpendTestCoin(AddTestCoin(addr, COIN), COIN, nFee,
+                                             CNameScript::buildNameNew(addr, hash));
+    const CTransaction txFirst = SpendTestCoin(txNew.GetHash(), COIN - nFee, nFee,
+        CNameScript::buildNameFirstupdate(addr, name, ValtypeFromString("value"), rand));
+
+    const CTransaction txs[] = {txParent, txChild, txConflict, txNew, txFirst};
+    BOOST_FOREACH(const CTransaction& tx, txs)
+    {
+        CValidationState state;
+        BOOST_CHECK(AcceptToMemoryPool(mempool, state, tx, true, NULL));
+    }
+    {
+        LOCK(mempool.cs);
+        mempool.addUnchecked(txExpired.GetHash(),
+            CTxMemPoolEntry(txExpired, nFee, nNow - DEFAULT_MEMPOOL_EXPIRY * 60 * 60, 0.0, 0));
+    }
+    BOOST_CHECK_EQUAL(mempool.size(), 6);
+    mempool.PrioritiseTransaction(txParent.GetHash(), txParent.GetHash().ToString(), 1.0, 1000);
+
+    // The hash of a NAME_NEW that has left the pool is not dumped.
+    const valtype staleHash(20, 's');
+    std::map<valtype, uint256> mapNameNews;
+    mapNameNews[staleHash] = GetRandHash();
+    mempool.restoreNameNews(mapNameNews);
+
+    // Dump and start over as after a restart.
+    BOOST_CHECK(DumpMempool());
+    mempool.clear();
+    mempool.ClearPrioritisation(txParent.GetHash());
+    BOOST_CHECK_EQUAL(mempool.size(), 0);
+
+    // A block spends the input of txConflict meanwhile.
+    pcoinsTip->ModifyCoins(txidSpent)->Spend(0);
+
+    BOOST_CHECK(LoadMempool());
+    BOOST_CHECK_EQUAL(mempool.size(), 4);
+    BOOST_CHECK(mempool.exists(txParent.GetHash()));
+    BOOST_CHECK(mempool.exists(txChild.GetHash()));
+    BOOST_CHECK(!mempool.exists(txConflict.GetHash()));
+    BOOST_CHECK(!mempool.exists(txExpired.GetHash()));
+    BOOST_CHECK(mempool.exists(txNew.GetHash()));
+    BOOST_CHECK(mempool.exists(txFirst.GetHash()));
+    BOOST_CHECK(mempool.registersName(name));
+
+    mempool.getNameNews(mapNameNews);
+    BOOST_CHECK_EQUAL(mapNameNews.size(), 1);
+    BOOST_CHECK(mapNameNews[valtype(hash.begin(), hash.end())] == txNew.GetHash());
+
+    double dPriorityDelta = 0;
+    CAmount nFeeDelta = 0;
+    mempool.ApplyDeltas(txParent.GetHash(), dPriorityDelta, nFeeDelta);
+    BOOST_CHECK_EQUAL(dPriorityDelta, 1.0);
+    BOOST_CHECK_EQUAL(nFeeDelta, 1000);
+
+    mempool.clear();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
+
@@ -5,6 +5,8 @@
 #include "consensus/validation.h"
 #include "main.h"
 #include "miner.h"
+#include "names/common.h"
+#include "names/main.h"
 #include "pubkey.h"
 #include "uint256.h"
 #include "util.h"
@@ -13,6 +15,8 @@
 
 #include <boost/test/unit_test.hpp>
 
+#include <memory>
+
 BOOST_FIXTURE_TEST_SUITE(miner_tests, TestingSetup)
 
 #if 0
@@ -270,4 +274,194 @@ BOOST_AUTO_TEST_CASE(CreateNewBlock_validity)
 }
 #endif
 
+// Add an output (not a coinbase) that CreateNewBlock can spend to pcoinsTip.
+static uint256 AddTestCoin(const CScript& scriptPubKey, CAmount nValue)
+{
+    static unsigned int nCounter = 0;
+    CMutableTransaction mtx;
+    mtx.vout.push_back(CTxOut(nValue, scriptPubKey));
+    mtx.nLockTime = ++nCounter;
+    const CTransaction tx(mtx);
+
+    CCoinsModifier coins = pcoinsTip->ModifyCoins(tx.GetHash());
+    *coins = CCoins(tx, 0);
+    return tx.GetHash();
+}
+
+// Spend an output of value nValueIn to scriptPubKey, leaving nFee as fee.
+static CTransaction SpendTestCoin(const uint256& txid, unsigned int n, CAmount nValueIn,
+                                  CAmount nFee, const CScript& scriptPubKey)
+{
+    CMutableTransaction mtx;
+    mtx.vin.push_back(CTxIn(COutPoint(txid, n)));
+    mtx.vout.push_back(CTxOut(nValueIn - nFee, scriptPubKey));
+    if (CNameScript(scriptPubKey).isNameOp())
+        mtx.SetNamecoin();
+    return mtx;
+}
+
+static void AddToMempool(const CTransaction& tx, CAmount nFee)
+{
+    LOCK(mempool.cs);
+    mempool.addUnchecked(tx.GetHash(), CTxMemPoolEntry(tx, nFee, GetTime(), 0.0, chainActive.Height()));
+}
+
+// Position of the transaction in the block, or -1 if it is not included.
+static int FindTx(const CBlock& block, const CTransaction& tx)
+{
+    for (unsigned int i = 0; i < block.vtx.size(); ++i)
+        if (block.vtx[i].GetHash() == tx.GetHash())
+            return i;
+    return -1;
+}
+
+// CreateNewBlock keeps its block candidate between calls and appends new
+// mempool transactions to it.  Check that the candidate is reassembled
+// whenever the appended result would not be what a new block is.
+BOOST_AUTO_TEST_CASE(CreateNewBlock_candidate)
+{
+    const CScript scriptPubKey = CScript() << OP_TRUE;
+    const CAmount nFee = 10000;
+    std::list<CTransaction> removed;
+
+    LOCK(cs_main);
+    fCheckpointsEnabled = false;
+    mapArgs["-blockprioritysize"] = "0";
+
+    // A new transaction is appended to the candidate, even though its fee
+    // rate is higher than that of the one already included.
+    const CTransaction tx1 = SpendTestCoin(AddTestCoin(scriptPubKey, COIN), 0, COIN, nFee, scriptPubKey);
+    AddToMempool(tx1, nFee);
+    std::auto_ptr<CBlockTemplate> pblocktemplate(CreateNewBlock(scriptPubKey));
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 2);
+    BOOST_CHECK_EQUAL(FindTx(pblocktemplate->block, tx1), 1);
+
+    const CTransaction tx2 = SpendTestCoin(AddTestCoin(scriptPubKey, COIN), 0, COIN, 2 * nFee, scriptPubKey);
+    AddToMempool(tx2, 2 * nFee);
+    pblocktemplate.reset(CreateNewBlock(scriptPubKey));
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 3);
+    BOOST_CHECK_EQUAL(FindTx(pblocktemplate->block, tx1), 1);
+    BOOST_CHECK_EQUAL(FindTx(pblocktemplate->block, tx2), 2);
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx[0].vout[0].nValue,
+                      GetBlockSubsidy(1, Params().GetConsensus()) + 3 * nFee);
+
+    // Transactions that leave the mempool leave the candidate as well.
+    mempool.remove(tx1, removed, true);
+    pblocktemplate.reset(CreateNewBlock(scriptPubKey));
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 2);
+    BOOST_CHECK_EQUAL(FindTx(pblocktemplate->block, tx2), 1);
+
+    // So do transactions that conflict with a block.
+    const uint256 txidShared = AddTestCoin(scriptPubKey, COIN);
+    const CTransaction tx3 = SpendTestCoin(txidShared, 0, COIN, nFee, scriptPubKey);
+    AddToMempool(tx3, nFee);
+    pblocktemplate.reset(CreateNewBlock(scriptPubKey));
+    BOOST_CHECK(FindTx(pblocktemplate->block, tx3) > 0);
+    const CTransaction tx3Conflict = SpendTestCoin(txidShared, 0, COIN, 2 * nFee, scriptPubKey);
+    std::vector<CTransaction> vtxBlock(1, tx3Conflict);
+    mempool.removeForBlock(vtxBlock, 1, removed);
+    pblocktemplate.reset(CreateNewBlock(scriptPubKey));
+    BOOST_CHECK_EQUAL(FindTx(pblocktemplate->block, tx3), -1);
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 2);
+
+    // A name update that conflicts with one in a block is dropped, too.
+    const valtype name = ValtypeFromString("miner-test-name");
+    const CScript nameScript = CNameScript::buildNameUpdate(scriptPubKey, name, ValtypeFromString("old"));
+    const uint256 txidName = AddTestCoin(nameScript, COIN);
+    CNameData data;
+    data.fromScript(0, COutPoint(txidName, 0), CNameScript(nameScript));
+    pcoinsTip->SetName(name, data, false);
+    const CTransaction txName = SpendTestCoin(txidName, 0, COIN, nFee,
+        CNameScript::buildNameUpdate(scriptPubKey, name, ValtypeFromString("new")));
+    AddToMempool(txName, nFee);
+    pblocktemplate.reset(CreateNewBlock(scriptPubKey));
+    BOOST_CHECK(FindTx(pblocktemplate->block, txName) > 0);
+    const CTransaction txNameConflict = SpendTestCoin(txidName, 0, COIN, nFee,
+        CNameScript::buildNameUpdate(scriptPubKey, name, ValtypeFromString("other")));
+    vtxBlock.assign(1, txNameConflict);
+    mempool.removeForBlock(vtxBlock, 1, removed);
+    BOOST_CHECK(!mempool.exists(txName.GetHash()));
+    BOOST_CHECK(!mempool.updatesName(name));
+    pblocktemplate.reset(CreateNewBlock(scriptPubKey));
+    BOOST_CHECK_EQUAL(FindTx(pblocktemplate->block, txName), -1);
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 2);
+
+    // A new tip invalidates the candidate.  Connect a stand-in block that
+    // mines tx2 without changing the coins (nothing else spends them).
+    CBlockIndex* pindexGenesis = chainActive.Tip();
+    const uint256 hashNewTip = GetRandHash();
+    CBlockIndex indexNewTip;
+    indexNewTip.pprev = pindexGenesis;
+    indexNewTip.nHeight = 1;
+    indexNewTip.phashBlock = &mapBlockIndex.insert(std::make_pair(hashNewTip, &indexNewTip)).first->first;
+    indexNewTip.nTime = pindexGenesis->nTime + 1;
+    indexNewTip.nBits = pindexGenesis->nBits;
+    indexNewTip.nVersion = pindexGenesis->nVersion;
+    chainActive.SetTip(&indexNewTip);
+    pcoinsTip->SetBestBlock(hashNewTip);
+    vtxBlock.assign(1, tx2);
+    mempool.removeForBlock(vtxBlock, 1, removed);
+    const CTransaction tx4 = SpendTestCoin(AddTestCoin(scriptPubKey, COIN), 0, COIN, nFee, scriptPubKey);
+    AddToMempool(tx4, nFee);
+    pblocktemplate.reset(CreateNewBlock(scriptPubKey));
+    BOOST_CHECK(pblocktemplate->block.hashPrevBlock == hashNewTip);
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 2);
+    BOOST_CHECK_EQUAL(FindTx(pblocktemplate->block, tx4), 1);
+    chainActive.SetTip(pindexGenesis);
+    pcoinsTip->SetBestBlock(pindexGenesis->GetBlockHash());
+    mapBlockIndex.erase(hashNewTip);
+
+    pblocktemplate.reset(CreateNewBlock(scriptPubKey));
+    BOOST_CHECK(pblocktemplate->block.hashPrevBlock == pindexGenesis->GetBlockHash());
+    BOOST_CHECK_EQUAL(FindTx(pblocktemplate->block, tx4), 1);
+
+    // Prioritising transactions changes what the candidate holds, without
+    // any transaction entering or leaving the pool.
+    const CTransaction txFree = SpendTestCoin(AddTestCoin(scriptPubKey, COIN), 0, COIN, 0, scriptPubKey);
+    AddToMempool(txFree, 0);
+    pblocktemplate.reset(CreateNewBlock(scriptPubKey));
+    BOOST_CHECK_EQUAL(FindTx(pblocktemplate->block, txFree), -1);
+    mempool.PrioritiseTransaction(txFree.GetHash(), txFree.GetHash().ToString(), 0.0, nFee);
+    pblocktemplate.reset(CreateNewBlock(scriptPubKey));
+    BOOST_CHECK(FindTx(pblocktemplate->block, txFree) > 0);
+    mempool.PrioritiseTransaction(tx4.GetHash(), tx4.GetHash().ToString(), 0.0, -nFee);
+    pblocktemplate.reset(CreateNewBlock(scriptPubKey));
+    BOOST_CHECK_EQUAL(FindTx(pblocktemplate->block, tx4), -1);
+    BOOST_CHECK(FindTx(pblocktemplate->block, txFree) > 0);
+    // The coinbase collects the fees actually paid.
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx[0].vout[0].nValue,
+                      GetBlockSubsidy(1, Params().GetConsensus()));
+
+    mempool.clear();
+    mapArgs.erase("-blockprioritysize");
+    fCheckpointsEnabled = true;
+}
+
+// A parent below the minimum relay fee is mined together with a child
+// that pays for both.
+BOOST_AUTO_TEST_CASE(CreateNewBlock_package)
+{
+    const CScript scriptPubKey = CScript() << OP_TRUE;
+
+    LOCK(cs_main);
+    fCheckpointsEnabled = false;
+    mapArgs["-blockprioritysize"] = "0";
+
+    const CTransaction txParent = SpendTestCoin(AddTestCoin(scriptPubKey, COIN), 0, COIN, 0, scriptPubKey);
+    AddToMempool(txParent, 0);
+    std::auto_ptr<CBlockTemplate> pblocktemplate(CreateNewBlock(scriptPubKey));
+    BOOST_CHECK_EQUAL(FindTx(pblocktemplate->block, txParent), -1);
+
+    const CTransaction txChild = SpendTestCoin(txParent.GetHash(), 0, COIN, 100000, scriptPubKey);
+    AddToMempool(txChild, 100000);
+    pblocktemplate.reset(CreateNewBlock(scriptPubKey));
+    BOOST_CHECK_EQUAL(pblocktemplate->block.vtx.size(), 3);
+    BOOST_CHECK_EQUAL(FindTx(pblocktemplate->block, txParent), 1);
+    BOOST_CHECK_EQUAL(FindTx(pblocktemplate->block, txChild), 2);
+
+    mempool.clear();
+    mapArgs.erase("-blockprioritysize");
+    fCheckpointsEnabled = true;
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -14,6 +14,7 @@
 #include "script/names.h"
 #include "test/test_bitcoin.h"
 
+#include <boost/scoped_ptr.hpp>
 #include <boost/test/unit_test.hpp>
 
 #include <list>
@@ -947,6 +948,26 @@ BOOST_AUTO_TEST_CASE (name_mempool)
   BOOST_CHECK (mempool.updatesName (nameUpd));
   BOOST_CHECK (!mempool.checkNameOps (txUpd2));
 
+  /* Query the pending operations.  */
+  std::vector<std::pair<valtype, uint256> > pending;
+  mempool.queryPendingNames (ValtypeFromString ("name-"), pending);
+  BOOST_CHECK_EQUAL (pending.size (), 2);
+  BOOST_CHECK (pending[0].first == nameReg
+                && pending[0].second == txReg1.GetHash ());
+  BOOST_CHECK (pending[1].first == nameUpd
+                && pending[1].second == txUpd1.GetHash ());
+  mempool.queryPendingNames (ValtypeFromString ("name-u"), pending);
+  BOOST_CHECK_EQUAL (pending.size (), 1);
+  BOOST_CHECK (pending[0].first == nameUpd);
+  mempool.queryPendingNames (ValtypeFromString ("name-x"), pending);
+  BOOST_CHECK (pending.empty ());
+  mempool.queryPendingName (nameReg, pending);
+  BOOST_CHECK_EQUAL (pending.size (), 1);
+  BOOST_CHECK (pending[0].first == nameReg
+                && pending[0].second == txReg1.GetHash ());
+  mempool.queryPendingName (ValtypeFromString ("name-"), pending);
+  BOOST_CHECK (pending.empty ());
+
   /* Run mempool sanity check.  */
   CCoinsViewCache view(pcoinsTip);
   const CNameScript nameOp(upd1);
@@ -1024,4 +1045,658 @@ BOOST_AUTO_TEST_CASE (name_mempool)
 
 /* ************************************************************************** */
 
+/**
+ * Fixture for the tests of the chain state databases:  a name with an
+ * update script paying to the test address, and the genesis block to
+ * use as best block.
+ */
+struct NameDBTestingSetup : public TestingSetup
+{
+
+  const valtype name;
+  const valtype value;
+  const CScript addr;
+  const CScript updateScript;
+  const uint256 hashBlock;
+
+  NameDBTestingSetup ()
+    : name(ValtypeFromString ("db-test-name")),
+      value(ValtypeFromString ("my-value")),
+      addr(getTestAddress ()),
+      updateScript(CNameScript::buildNameUpdate (addr, name, value)),
+      hashBlock(Params ().GenesisBlock ().GetHash ())
+  {}
+
+  /**
+   * Name data for the update script, as if it were confirmed at the
+   * given height (and outpoint).
+   */
+  CNameData
+  nameData (unsigned height, const COutPoint& prevout = COutPoint (uint256 (), 0)) const
+  {
+    CNameData data;
+    data.fromScript (height, prevout, CNameScript (updateScript));
+    return data;
+  }
+
+};
+
+/** CCoinsViewDB in memory with small caches.  */
+class CMemoryCoinsViewDB : public CCoinsViewDB
+{
+public:
+
+  CMemoryCoinsViewDB ()
+    : CCoinsViewDB (1 << 20, 1 << 20, true)
+  {}
+
+};
+
+BOOST_FIXTURE_TEST_CASE (name_set_hash, NameDBTestingSetup)
+{
+  const valtype name2 = ValtypeFromString ("set-hash-name-2");
+
+  const CNameData data1 = nameData (100);
+  const CNameData data2 = nameData (200);
+
+  /* Build the same final state directly and with intermediate changes,
+     once with the old versions read back from the database and once with
+     them recorded by the cache.  The changes are made partly in the cache
+     and partly in a child view flushed into it.  */
+
+  CMemoryCoinsViewDB dbDirect;
+  uint256 txid1;
+  {
+    CCoinsViewCache view(&dbDirect);
+    txid1 = addTestCoin (addr, 100, view);
+    view.SetName (name, data2, false);
+    view.SetBestBlock (hashBlock);
+    BOOST_CHECK (view.Flush ());
+  }
+
+  CCoinsStats statsDirect;
+  BOOST_CHECK (dbDirect.GetStats (statsDirect));
+  CNameSetStats nameStatsDirect;
+  BOOST_CHECK (dbDirect.GetNameStats (nameStatsDirect));
+
+  for (unsigned i = 0; i < 2; ++i)
+    {
+      const bool fSetElements = (i == 1);
+
+      CMemoryCoinsViewDB dbChanged;
+      CCoinsViewCache view(&dbChanged, fSetElements);
+      BOOST_CHECK (addTestCoin (addr, 100, view) == txid1);
+      const uint256 txid2 = addTestCoin (updateScript, 100, view);
+      const uint256 txid3 = addTestCoin (CScript () << OP_TRUE, 100, view);
+      view.SetName (name, data1, false);
+      view.SetName (name2, data1, false);
+      view.SetBestBlock (hashBlock);
+      BOOST_CHECK (view.Flush ());
+
+      view.ModifyCoins (txid2)->Clear ();
+      view.SetName (name, data2, false);
+      {
+        CCoinsViewCache child(&view);
+        BOOST_CHECK (child.HaveCoins (txid3));
+        child.ModifyCoins (txid3)->Clear ();
+        child.DeleteName (name2);
+        BOOST_CHECK (child.Flush ());
+      }
+      BOOST_CHECK (view.Flush ());
+
+      CCoinsStats statsChanged;
+      BOOST_CHECK (dbChanged.GetStats (statsChanged));
+      BOOST_CHECK_EQUAL (statsChanged.nTransactions, 1);
+      BOOST_CHECK_EQUAL (statsChanged.nTransactionOutputs, 1);
+      BOOST_CHECK_EQUAL (statsChanged.nTotalAmount, 1000 * COIN);
+      BOOST_CHECK_EQUAL (statsChanged.nSerializedSize,
+                         statsDirect.nSerializedSize);
+      BOOST_CHECK (statsChanged.hashMuHash == statsDirect.hashMuHash);
+
+      CNameSetStats nameStatsChanged;
+      BOOST_CHECK (dbChanged.GetNameStats (nameStatsChanged));
+      BOOST_CHECK_EQUAL (nameStatsChanged.nNames, 1);
+      BOOST_CHECK (nameStatsChanged.hashMuHash == nameStatsDirect.hashMuHash);
+    }
+
+  CNameSetStats nameStatsEmpty;
+  CMemoryCoinsViewDB dbEmpty;
+  {
+    CCoinsViewCache view(&dbEmpty);
+    view.SetBestBlock (hashBlock);
+    BOOST_CHECK (view.Flush ());
+  }
+  BOOST_CHECK (dbEmpty.GetNameStats (nameStatsEmpty));
+  BOOST_CHECK (nameStatsEmpty.hashMuHash != nameStatsDirect.hashMuHash);
+}
+
+/* ************************************************************************** */
+
+/**
+ * Stage a snapshot file in the given database.  Exceptions are turned
+ * into failure.
+ */
+static bool
+stageSnapshotFile (const boost::filesystem::path& path, CCoinsViewDB& db,
+                   CChainStateSnapshot& header, CChainStateSnapshotStats& stats)
+{
+  CAutoFile file(fopen (path.string ().c_str (), "rb"),
+                 SER_DISK, CLIENT_VERSION);
+  if (file.IsNull ())
+    return false;
+
+  try
+    {
+      file >> header;
+      return db.StageSnapshot (file, header, stats);
+    }
+  catch (const std::exception& exc)
+    {
+      db.DiscardStagedSnapshot ();
+      return false;
+    }
+}
+
+BOOST_FIXTURE_TEST_CASE (name_snapshot, NameDBTestingSetup)
+{
+  const unsigned height = 100;
+
+  CMemoryCoinsViewDB dbFrom;
+  CCoinsViewCache viewFrom(&dbFrom);
+  const uint256 txidName = addTestCoin (updateScript, height, viewFrom);
+  CNameData data;
+  data.fromScript (height, COutPoint (txidName, 0), CNameScript (updateScript));
+  viewFrom.SetName (name, data, false);
+  viewFrom.SetBestBlock (hashBlock);
+  BOOST_CHECK (viewFrom.Flush ());
+
+  /* Changes after the database snapshot is taken are not dumped.  */
+  boost::scoped_ptr<CChainStateDBSnapshot> snapshot(dbFrom.GetSnapshot ());
+  const uint256 txidLater = addTestCoin (addr, height, viewFrom);
+  BOOST_CHECK (viewFrom.Flush ());
+
+  CChainStateSnapshot header;
+  header.hashBlock = hashBlock;
+  header.fNameHistory = fNameHistory;
+  header.vTxCount.assign (3, 1);
+
+  const boost::filesystem::path path = GetDataDir () / "snapshot.dat";
+  CChainStateSnapshotStats statsDump;
+  {
+    CAutoFile file(fopen (path.string ().c_str (), "wb"),
+                   SER_DISK, CLIENT_VERSION);
+    BOOST_CHECK (dbFrom.DumpSnapshot (*snapshot, header, file, statsDump));
+  }
+  BOOST_CHECK_EQUAL (statsDump.nCoins, 1);
+  BOOST_CHECK_EQUAL (statsDump.nNames, 1);
+  BOOST_CHECK_EQUAL (statsDump.nNameExpiry, 1);
+
+  /* A snapshot of another best block is refused.  */
+  {
+    CChainStateSnapshot headerWrong = header;
+    headerWrong.hashBlock = txidName;
+    CAutoFile file(fopen (path.string ().c_str (), "wb"),
+                   SER_DISK, CLIENT_VERSION);
+    CChainStateSnapshotStats stats;
+    BOOST_CHECK (!dbFrom.DumpSnapshot (*snapshot, headerWrong, file, stats));
+  }
+  {
+    CAutoFile file(fopen (path.string ().c_str (), "wb"),
+                   SER_DISK, CLIENT_VERSION);
+    CChainStateSnapshotStats stats;
+    BOOST_CHECK (dbFrom.DumpSnapshot (*snapshot, header, file, stats));
+  }
+
+  /* Load it into a database whose old content must be replaced.  */
+  CMemoryCoinsViewDB dbTo;
+  CCoinsViewCache viewTo(&dbTo);
+  const uint256 txidOld = addTestCoin (addr, height, viewTo);
+  BOOST_CHECK (viewTo.Flush ());
+
+  /* Nothing can be applied before a snapshot is staged, and staging
+     leaves the database alone.  */
+  CChainStateSnapshot headerRead;
+  CChainStateSnapshotStats statsLoad;
+  BOOST_CHECK (!dbTo.ApplyStagedSnapshot (header));
+  BOOST_CHECK (stageSnapshotFile (path, dbTo, headerRead, statsLoad));
+  BOOST_CHECK (headerRead.hashBlock == hashBlock);
+  BOOST_CHECK (headerRead.vTxCount == header.vTxCount);
+  BOOST_CHECK (statsLoad.hashChecksum == statsDump.hashChecksum);
+  BOOST_CHECK_EQUAL (statsLoad.nCoins, 1);
+  BOOST_CHECK (dbTo.HaveCoins (txidOld));
+  BOOST_CHECK (!dbTo.HaveCoins (txidName));
+  BOOST_CHECK (dbTo.GetBestBlock ().IsNull ());
+
+  BOOST_CHECK (dbTo.ApplyStagedSnapshot (headerRead));
+  dbTo.DiscardStagedSnapshot ();
+
+  BOOST_CHECK (dbTo.GetBestBlock () == hashBlock);
+  BOOST_CHECK (dbTo.HaveCoins (txidName));
+  BOOST_CHECK (!dbTo.HaveCoins (txidLater));
+  BOOST_CHECK (!dbTo.HaveCoins (txidOld));
+  /* The set hash computed after loading matches the incrementally
+     maintained one.  */
+  CNameSetStats nameStatsFrom, nameStatsTo;
+  BOOST_CHECK (dbFrom.GetNameStats (nameStatsFrom));
+  BOOST_CHECK (dbTo.GetNameStats (nameStatsTo));
+  BOOST_CHECK_EQUAL (nameStatsTo.nNames, 1);
+  BOOST_CHECK (nameStatsTo.hashMuHash == nameStatsFrom.hashMuHash);
+
+  CNameData dataRead;
+  BOOST_CHECK (dbTo.GetName (name, dataRead));
+  BOOST_CHECK (dataRead == data);
+  std::set<valtype> names;
+  BOOST_CHECK (dbTo.GetNamesForHeight (data.getHeight (), names));
+  BOOST_CHECK (names.count (name) == 1);
+
+  {
+    FILE* f = fopen (path.string ().c_str (), "r+b");
+    BOOST_REQUIRE (f);
+    BOOST_REQUIRE (fseek (f, -40, SEEK_END) == 0);
+    const int c = fgetc (f);
+    BOOST_REQUIRE (fseek (f, -40, SEEK_END) == 0);
+    fputc (c ^ 1, f);
+    fclose (f);
+  }
+  /* Any corruption is detected by the checksum, and the loaded state
+     stays as it is.  */
+  CChainStateSnapshotStats statsCorrupt;
+  BOOST_CHECK (!stageSnapshotFile (path, dbTo, headerRead, statsCorrupt));
+  BOOST_CHECK (!dbTo.ApplyStagedSnapshot (headerRead));
+  BOOST_CHECK (dbTo.GetBestBlock () == hashBlock);
+  BOOST_CHECK (dbTo.HaveCoins (txidName));
+  BOOST_CHECK (dbTo.GetName (name, dataRead));
+}
+
+/* ************************************************************************** */
+
+BOOST_FIXTURE_TEST_CASE (name_data_compression, NameDBTestingSetup)
+{
+  const CNameScript nameOp(updateScript);
+
+  CNameData data1, data2;
+  data1.fromScript (100, COutPoint (uint256S ("0x42"), 1), nameOp);
+  data2.fromScript (250000, COutPoint (uint256S ("0x43"), 0), nameOp);
+
+  CDataStream ssPlain(SER_DISK, CLIENT_VERSION);
+  CDataStream ssCompact(SER_DISK, CLIENT_VERSION);
+  ssPlain << data2;
+  ssCompact << CNameDataCompressor (data2);
+  BOOST_CHECK (ssCompact.size () < ssPlain.size ());
+
+  CNameData dataRead;
+  CNameDataCompressor comprRead(dataRead);
+  ssCompact >> comprRead;
+  BOOST_CHECK (dataRead == data2);
+  BOOST_CHECK (ssCompact.empty ());
+
+  CNameHistory history;
+  history.push (data1);
+  history.push (data2);
+  ssPlain.clear ();
+  ssPlain << history;
+  ssCompact << CNameHistoryCompressor (history);
+  BOOST_CHECK (ssCompact.size () < ssPlain.size ());
+
+  CNameHistory historyRead;
+  CNameHistoryCompressor historyComprRead(historyRead);
+  ssCompact >> historyComprRead;
+  BOOST_CHECK (historyRead.getData () == history.getData ());
+}
+
+/* ************************************************************************** */
+
+BOOST_FIXTURE_TEST_CASE (name_async_flush, NameDBTestingSetup)
+{
+  const CNameData data = nameData (100);
+
+  CMemoryCoinsViewDB db;
+  CCoinsViewAsyncWriter writer(&db);
+  CCoinsViewCache view(&writer);
+
+  /* Whether or not the background write is done already, the changes
+     are visible through the writer right after the flush.  */
+  const uint256 txid = addTestCoin (updateScript, 100, view);
+  view.SetName (name, data, false);
+  view.SetBestBlock (hashBlock);
+  BOOST_CHECK (view.Flush ());
+  BOOST_CHECK (writer.HaveCoins (txid));
+  BOOST_CHECK (writer.GetBestBlock () == hashBlock);
+  CNameData dataRead;
+  BOOST_CHECK (writer.GetName (name, dataRead));
+  BOOST_CHECK (dataRead == data);
+  std::set<valtype> names;
+  BOOST_CHECK (writer.GetNamesForHeight (100, names));
+  BOOST_CHECK (names.count (name) == 1);
+
+  /* A further flush waits for the previous write.  The history is served
+     from the pending changes as well, including a history stack that an
+     undo has emptied and that the write deletes.  */
+  fNameHistory = true;
+  view.SetName (name, nameData (200), false);
+  BOOST_CHECK (view.Flush ());
+  CNameHistory history;
+  BOOST_CHECK (writer.GetNameHistory (name, history));
+  BOOST_CHECK (history.getData ().size () == 1);
+  BOOST_CHECK (history.getData ().back () == data);
+  view.SetName (name, data, true);
+  BOOST_CHECK (view.Flush ());
+  BOOST_CHECK (!writer.GetNameHistory (name, history));
+
+  view.ModifyCoins (txid)->Clear ();
+  view.DeleteName (name);
+  BOOST_CHECK (view.Flush ());
+  BOOST_CHECK (!writer.HaveCoins (txid));
+  BOOST_CHECK (!writer.GetName (name, dataRead));
+  BOOST_CHECK (writer.GetNamesForHeight (100, names));
+  BOOST_CHECK (names.empty ());
+
+  BOOST_CHECK (writer.Sync ());
+  BOOST_CHECK (db.GetBestBlock () == hashBlock);
+  BOOST_CHECK (!db.HaveCoins (txid));
+  BOOST_CHECK (!db.GetName (name, dataRead));
+
+  CNameSetStats stats;
+  BOOST_CHECK (db.GetNameStats (stats));
+  BOOST_CHECK_EQUAL (stats.nNames, 0);
+}
+
+/**
+ * Give the test access to both databases of a CCoinsViewDB on disk, so that
+ * it can put the name records back into the coin database like versions
+ * before the separate name database did.
+ */
+class CCoinsViewDBAccess : public CCoinsViewDB
+{
+public:
+
+  CCoinsViewDBAccess ()
+    : CCoinsViewDB (1 << 20, 1 << 20)
+  {}
+
+  /* Name records are written in the plain encoding of these versions.  */
+  void
+  moveNamesToCoinsDB ()
+  {
+    CLevelDBBatch batch, batchNames;
+    boost::scoped_ptr<leveldb::Iterator> pcursor(dbNames.NewIterator ());
+    for (pcursor->SeekToFirst (); pcursor->Valid (); pcursor->Next ())
+      {
+        const leveldb::Slice slKey = pcursor->key ();
+        const leveldb::Slice slValue = pcursor->value ();
+        CDataStream ssValue(slValue.data (), slValue.data () + slValue.size (),
+                            SER_DISK, CLIENT_VERSION);
+        CDataStream ssOld(SER_DISK, CLIENT_VERSION);
+        switch (slKey[0])
+          {
+          case 'n':
+            {
+              CNameData data;
+              CNameDataCompressor compr(data);
+              ssValue >> compr;
+              ssOld << data;
+              batch.WriteRaw (slKey, ssOld.str ());
+              break;
+            }
+
+          case 'x':
+            batch.WriteRaw (slKey, slValue);
+            break;
+
+          default:
+            break;
+          }
+        batchNames.EraseRaw (slKey);
+      }
+    dbNames.WriteBatch (batchNames, true);
+    db.WriteBatch (batch, true);
+  }
+
+  /* Write or erase a raw record of the name database.  */
+  template<typename K, typename V>
+    void
+    writeNameRecord (const K& key, const V& value)
+  {
+    dbNames.Write (key, value, true);
+  }
+
+  template<typename K>
+    void
+    eraseNameRecord (const K& key)
+  {
+    dbNames.Erase (key, true);
+  }
+
+  /**
+   * Put the name database back to an older state and store the changes
+   * leading from there to the current one as pending in the coin database.
+   * This is how the databases are left if a flush is interrupted between
+   * the writes to them.
+   */
+  void
+  interruptNameWrite (const CNameCache& oldNames, const uint256& hashOld,
+                      const CNameCache& newNames, const uint256& hashNew)
+  {
+    CLevelDBBatch batchNames;
+    oldNames.writeBatch (batchNames);
+    batchNames.Write ('B', hashOld);
+    dbNames.WriteBatch (batchNames, true);
+
+    CLevelDBBatch batch;
+    batch.Write ('P', std::make_pair (hashNew, newNames));
+    db.WriteBatch (batch, true);
+  }
+
+  bool
+  coinsDBHasNames () const
+  {
+    boost::scoped_ptr<leveldb::Iterator> pcursor(
+        const_cast<CLevelDBWrapper&> (db).NewIterator ());
+    for (pcursor->SeekToFirst (); pcursor->Valid (); pcursor->Next ())
+      if (pcursor->key ()[0] == 'n' || pcursor->key ()[0] == 'x')
+        return true;
+    return false;
+  }
+
+};
+
+BOOST_FIXTURE_TEST_CASE (name_db_migration, NameDBTestingSetup)
+{
+  CNameData data;
+
+  CNameSetStats statsBefore;
+  {
+    CCoinsViewDBAccess db;
+    CCoinsViewCache view(&db);
+    const uint256 txid = addTestCoin (updateScript, 100, view);
+    data = nameData (100, COutPoint (txid, 0));
+    view.SetName (name, data, false);
+    view.SetBestBlock (hashBlock);
+    BOOST_CHECK (view.Flush ());
+    BOOST_CHECK (db.IsNameDBConsistent ());
+    BOOST_CHECK (!db.coinsDBHasNames ());
+    BOOST_CHECK (db.GetNameStats (statsBefore));
+
+    db.moveNamesToCoinsDB ();
+    BOOST_CHECK (db.coinsDBHasNames ());
+    BOOST_CHECK (!db.IsNameDBConsistent ());
+  }
+
+  /* Opening the database again moves the records to the name database.  */
+  CCoinsViewDBAccess db;
+  BOOST_CHECK (!db.coinsDBHasNames ());
+  BOOST_CHECK (db.IsNameDBConsistent ());
+
+  CNameData dataRead;
+  BOOST_CHECK (db.GetName (name, dataRead));
+  BOOST_CHECK (dataRead == data);
+  std::set<valtype> names;
+  BOOST_CHECK (db.GetNamesForHeight (data.getHeight (), names));
+  BOOST_CHECK (names.count (name) == 1);
+  BOOST_CHECK (db.ValidateNameDB ());
+
+  CNameSetStats statsAfter;
+  BOOST_CHECK (db.GetNameStats (statsAfter));
+  BOOST_CHECK (statsAfter.hashMuHash == statsBefore.hashMuHash);
+}
+
+BOOST_FIXTURE_TEST_CASE (name_db_interrupted_write, NameDBTestingSetup)
+{
+  const CNameData data1 = nameData (100);
+  const CNameData data2 = nameData (200);
+  const uint256 hashBlock2 = uint256S ("0x42");
+
+  {
+    CCoinsViewDBAccess db;
+    CCoinsViewCache view(&db, true);
+    addTestCoin (updateScript, 100, view);
+    view.SetName (name, data1, false);
+    view.SetBestBlock (hashBlock);
+    BOOST_CHECK (view.Flush ());
+
+    view.SetName (name, data2, false);
+    view.SetBestBlock (hashBlock2);
+    BOOST_CHECK (view.Flush ());
+    BOOST_CHECK (db.IsNameDBConsistent ());
+
+    /* Take the second write out of the name database again.  */
+    CNameCache oldNames, newNames;
+    oldNames.set (name, data1);
+    oldNames.removeExpireIndex (name, data2.getHeight ());
+    oldNames.addExpireIndex (name, data1.getHeight ());
+    newNames.set (name, data2);
+    newNames.removeExpireIndex (name, data1.getHeight ());
+    newNames.addExpireIndex (name, data2.getHeight ());
+    db.interruptNameWrite (oldNames, hashBlock, newNames, hashBlock2);
+
+    BOOST_CHECK (!db.IsNameDBConsistent ());
+    CNameData dataRead;
+    BOOST_CHECK (db.GetName (name, dataRead));
+    BOOST_CHECK (dataRead == data1);
+  }
+
+  /* Opening the database again completes the write.  */
+  CCoinsViewDBAccess db;
+  BOOST_CHECK (db.IsNameDBConsistent ());
+  BOOST_CHECK (db.GetBestBlock () == hashBlock2);
+  CNameData dataRead;
+  BOOST_CHECK (db.GetName (name, dataRead));
+  BOOST_CHECK (dataRead == data2);
+  std::set<valtype> names;
+  BOOST_CHECK (db.GetNamesForHeight (data1.getHeight (), names));
+  BOOST_CHECK (names.empty ());
+  BOOST_CHECK (db.GetNamesForHeight (data2.getHeight (), names));
+  BOOST_CHECK (names.count (name) == 1);
+}
+
+BOOST_FIXTURE_TEST_CASE (name_db_snapshot_view, NameDBTestingSetup)
+{
+  const CNameData data1 = nameData (100);
+  const CNameData data2 = nameData (200);
+
+  CMemoryCoinsViewDB db;
+  CCoinsViewCache view(&db);
+  const uint256 txid = addTestCoin (updateScript, 100, view);
+  view.SetName (name, data1, false);
+  view.SetBestBlock (hashBlock);
+  BOOST_CHECK (view.Flush ());
+
+  /* The snapshot view keeps the state while the database changes.  */
+  CCoinsViewDBSnapshot snapshot(db.GetSnapshot ());
+  const uint256 txidLater = addTestCoin (addr, 200, view);
+  view.SetName (name, data2, false);
+  view.SetBestBlock (uint256S ("0x42"));
+  BOOST_CHECK (view.Flush ());
+
+  BOOST_CHECK (snapshot.GetBestBlock () == hashBlock);
+  BOOST_CHECK (snapshot.HaveCoins (txid));
+  BOOST_CHECK (!snapshot.HaveCoins (txidLater));
+  BOOST_CHECK (db.HaveCoins (txidLater));
+  CCoins coins;
+  BOOST_CHECK (snapshot.GetCoins (txid, coins));
+
+  CNameData dataRead;
+  BOOST_CHECK (snapshot.GetName (name, dataRead));
+  BOOST_CHECK (dataRead == data1);
+  std::set<valtype> names;
+  BOOST_CHECK (snapshot.GetNamesForHeight (data1.getHeight (), names));
+  BOOST_CHECK (names.count (name) == 1);
+  BOOST_CHECK (snapshot.GetNamesForHeight (data2.getHeight (), names));
+  BOOST_CHECK (names.empty ());
+
+  boost::scoped_ptr<CNameIterator> iter(snapshot.IterateNames ());
+  valtype nameRead;
+  BOOST_CHECK (iter->next (nameRead, dataRead));
+  BOOST_CHECK (nameRead == name && dataRead == data1);
+  BOOST_CHECK (!iter->next (nameRead, dataRead));
+}
+
+BOOST_FIXTURE_TEST_CASE (name_checkdb_snapshot, NameDBTestingSetup)
+{
+  CCoinsViewDBAccess db;
+  CCoinsViewCache view(&db);
+  const uint256 txid = addTestCoin (updateScript, 100, view);
+  const CNameData data = nameData (100, COutPoint (txid, 0));
+  view.SetName (name, data, false);
+  view.SetBestBlock (hashBlock);
+  BOOST_CHECK (view.Flush ());
+
+  /* The check at expireHeight is the first to see the name expired.  */
+  unsigned expireHeight = 100;
+  while (!data.isExpired (expireHeight + 1))
+    ++expireHeight;
+
+  boost::scoped_ptr<CChainStateDBSnapshot> snapshot(db.GetSnapshot ());
+  BOOST_CHECK (CCoinsViewDB::ValidateNameDB (*snapshot, 110));
+  BOOST_CHECK (CCoinsViewDB::ValidateNameDB (*snapshot, expireHeight - 1));
+  /* An expired name must not be in the UTXO set anymore.  */
+  BOOST_CHECK (!CCoinsViewDB::ValidateNameDB (*snapshot, expireHeight));
+
+  /* A second output with the name is not at the name's outpoint.  */
+  CMutableTransaction mtx;
+  mtx.vout.push_back (CTxOut (COIN, updateScript));
+  const CTransaction txDup(mtx);
+  const uint256 txidDup = txDup.GetHash ();
+  *view.ModifyCoins (txidDup) = CCoins (txDup, 100);
+  BOOST_CHECK (view.Flush ());
+  snapshot.reset (db.GetSnapshot ());
+  BOOST_CHECK (!CCoinsViewDB::ValidateNameDB (*snapshot, 110));
+
+  /* Nor may the outpoint of an unexpired name be spent.  */
+  view.ModifyCoins (txidDup)->Spend (0);
+  view.ModifyCoins (txid)->Spend (0);
+  BOOST_CHECK (view.Flush ());
+  snapshot.reset (db.GetSnapshot ());
+  BOOST_CHECK (!CCoinsViewDB::ValidateNameDB (*snapshot, 110));
+  BOOST_CHECK (CCoinsViewDB::ValidateNameDB (*snapshot, expireHeight));
+
+  /* The expire index must have the name at its height.  */
+  db.writeNameRecord (std::make_pair ('x', CNameCache::ExpireEntry (105, name)), '\0');
+  snapshot.reset (db.GetSnapshot ());
+  BOOST_CHECK (!CCoinsViewDB::ValidateNameDB (*snapshot, expireHeight));
+  db.eraseNameRecord (std::make_pair ('x', CNameCache::ExpireEntry (105, name)));
+  db.eraseNameRecord (std::make_pair ('x', CNameCache::ExpireEntry (100, name)));
+  snapshot.reset (db.GetSnapshot ());
+  BOOST_CHECK (!CCoinsViewDB::ValidateNameDB (*snapshot, expireHeight));
+  db.writeNameRecord (std::make_pair ('x', CNameCache::ExpireEntry (100, name)), '\0');
+
+  /* Name history is only allowed with -namehistory, and only for names
+     in the database.  */
+  CNameHistory history;
+  history.push (data);
+  db.writeNameRecord (std::make_pair ('h', name), CNameHistoryCompressor (history));
+  snapshot.reset (db.GetSnapshot ());
+  fNameHistory = false;
+  BOOST_CHECK (!CCoinsViewDB::ValidateNameDB (*snapshot, expireHeight));
+  fNameHistory = true;
+  BOOST_CHECK (CCoinsViewDB::ValidateNameDB (*snapshot, expireHeight));
+
+  const valtype nameOther = ValtypeFromString ("db-test-name-2");
+  db.writeNameRecord (std::make_pair ('h', nameOther), CNameHistoryCompressor (history));
+  snapshot.reset (db.GetSnapshot ());
+  BOOST_CHECK (!CCoinsViewDB::ValidateNameDB (*snapshot, expireHeight));
+}
+
+/* ************************************************************************** */
+
 BOOST_AUTO_TEST_SUITE_END ()
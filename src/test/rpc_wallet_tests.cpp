@@ -219,4 +219,28 @@ BOOST_AUTO_TEST_CASE(rpc_wallet)
     BOOST_CHECK(CBitcoinAddress(arr[0].get_str()).Get() == demoAddress.Get());
 }
 
+BOOST_AUTO_TEST_CASE(rpc_name_batch)
+{
+    Value r;
+
+    BOOST_CHECK_THROW(CallRPC("name_update_many"), runtime_error);
+    BOOST_CHECK_THROW(CallRPC("name_update_many not_array"), runtime_error);
+    BOOST_CHECK_THROW(CallRPC("name_firstupdate_many [] extra"), runtime_error);
+
+    // Each request fails on its own:  an unknown name, a repeated name
+    // and a missing value.
+    BOOST_CHECK_NO_THROW(r = CallRPC("name_update_many [{\"name\":\"a\",\"value\":\"x\"},{\"name\":\"a\",\"value\":\"y\"},{\"name\":\"b\"}]"));
+    const Array& res = r.get_array();
+    BOOST_CHECK_EQUAL(res.size(), 3);
+    BOOST_CHECK_EQUAL(find_value(res[0].get_obj(), "name").get_str(), "a");
+    BOOST_CHECK_EQUAL(find_value(res[0].get_obj(), "error").get_str(), "this name can not be updated");
+    BOOST_CHECK_EQUAL(find_value(res[1].get_obj(), "error").get_str(), "the name is given more than once");
+    BOOST_CHECK_EQUAL(find_value(res[2].get_obj(), "name").get_str(), "b");
+    BOOST_CHECK(find_value(res[2].get_obj(), "txid").is_null());
+    BOOST_CHECK(!find_value(res[2].get_obj(), "error").is_null());
+
+    BOOST_CHECK_NO_THROW(r = CallRPC("name_firstupdate_many []"));
+    BOOST_CHECK(r.get_array().empty());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -9,6 +9,7 @@
 
 #include <vector>
 
+#include <boost/bind.hpp>
 #include <boost/test/unit_test.hpp>
 
 #define SKIPLIST_LENGTH 300000
@@ -44,6 +45,30 @@ BOOST_AUTO_TEST_CASE(skiplist_test)
     }
 }
 
+BOOST_AUTO_TEST_CASE(skiplist_parallel_test)
+{
+    std::vector<CBlockIndex> vIndex(SKIPLIST_LENGTH);
+    std::vector<CBlockIndex> vIndexParallel(SKIPLIST_LENGTH);
+
+    for (int i=0; i<SKIPLIST_LENGTH; i++) {
+        vIndex[i].nHeight = vIndexParallel[i].nHeight = i;
+        vIndex[i].pprev = (i == 0) ? NULL : &vIndex[i - 1];
+        vIndexParallel[i].pprev = (i == 0) ? NULL : &vIndexParallel[i - 1];
+        vIndex[i].BuildSkip();
+    }
+
+    CChain chain;
+    chain.SetTip(&vIndexParallel.back());
+    ParallelForRanges(SKIPLIST_LENGTH, boost::bind(&CChain::BuildSkipRange, &chain, _1, _2));
+
+    for (int i=0; i<SKIPLIST_LENGTH; i++) {
+        if (i > 0)
+            BOOST_CHECK_EQUAL(vIndexParallel[i].pskip->nHeight, vIndex[i].pskip->nHeight);
+        else
+            BOOST_CHECK(vIndexParallel[i].pskip == NULL);
+    }
+}
+
 BOOST_AUTO_TEST_CASE(getlocator_test)
 {
     // Build a main chain 100000 blocks long.
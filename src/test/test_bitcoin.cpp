@@ -8,6 +8,7 @@
 
 #include "key.h"
 #include "main.h"
+#include "miner.h"
 #include "random.h"
 #include "txdb.h"
 #include "ui_interface.h"
@@ -50,8 +51,8 @@ TestingSetup::TestingSetup()
         boost::filesystem::create_directories(pathTemp);
         mapArgs["-datadir"] = pathTemp.string();
         pblocktree = new CBlockTreeDB(1 << 20, true);
-        pcoinsdbview = new CCoinsViewDB(1 << 23, true);
-        pcoinsTip = new CCoinsViewCache(pcoinsdbview);
+        pcoinsdbview = new CCoinsViewDB(1 << 23, 1 << 20, true);
+        pcoinsTip = new CCoinsViewCache(pcoinsdbview, true);
         InitBlockIndex();
 #ifdef ENABLE_WALLET
         bool fFirstRun;
@@ -76,6 +77,7 @@ TestingSetup::~TestingSetup()
         pwalletMain = NULL;
 #endif
         UnloadBlockIndex();
+        ResetBlockCandidate();
         delete pcoinsTip;
         delete pcoinsdbview;
         delete pblocktree;
@@ -15,6 +15,8 @@
 #include <stdint.h>
 #include <vector>
 
+#include <boost/bind.hpp>
+#include <boost/foreach.hpp>
 #include <boost/test/unit_test.hpp>
 
 using namespace std;
@@ -355,4 +357,20 @@ BOOST_AUTO_TEST_CASE(test_FormatSubVersion)
     BOOST_CHECK_EQUAL(FormatSubVersion("Test", 99900, comments),std::string("/Test:0.9.99(comment1)/"));
     BOOST_CHECK_EQUAL(FormatSubVersion("Test", 99900, comments2),std::string("/Test:0.9.99(comment1; comment2)/"));
 }
+
+static void MarkRange(std::vector<int>* pvVisits, size_t nBegin, size_t nEnd)
+{
+    for (size_t i = nBegin; i < nEnd; ++i)
+        ++(*pvVisits)[i];
+}
+
+BOOST_AUTO_TEST_CASE(test_ParallelForRanges)
+{
+    const size_t vSizes[] = {0, 1, 1000, 100000};
+    BOOST_FOREACH(size_t nSize, vSizes) {
+        std::vector<int> vVisits(nSize, 0);
+        ParallelForRanges(nSize, boost::bind(MarkRange, &vVisits, _1, _2));
+        BOOST_CHECK(std::count(vVisits.begin(), vVisits.end(), 1) == (int)nSize);
+    }
+}
 BOOST_AUTO_TEST_SUITE_END()
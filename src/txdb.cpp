@@ -6,15 +6,18 @@
 #include "txdb.h"
 
 #include "chainparams.h"
+#include "checkqueue.h"
 #include "hash.h"
 #include "main.h"
 #include "pow.h"
+#include "ui_interface.h"
 #include "uint256.h"
 
 #include "script/names.h"
 
 #include <stdint.h>
 
+#include <boost/filesystem.hpp>
 #include <boost/thread.hpp>
 
 using namespace std;
@@ -32,6 +35,15 @@ static const char DB_BEST_BLOCK = 'B';
 static const char DB_FLAG = 'F';
 static const char DB_REINDEX_FLAG = 'R';
 static const char DB_LAST_BLOCK = 'l';
+static const char DB_SET_INFO = 'S';
+static const char DB_NAME_VERSION = 'V';
+static const char DB_NAME_UPGRADE = 'U';
+static const char DB_NAMES_PENDING = 'P';
+
+/* Encoding of the name and name history records.  Version 0 is the plain
+   serialisation of CNameData and CNameHistory, version 1 the one of
+   CNameDataCompressor and CNameHistoryCompressor.  */
+static const int NAME_DB_VERSION = 1;
 
 
 void static BatchWriteCoins(CLevelDBBatch &batch, const uint256 &hash, const CCoins &coins) {
@@ -45,7 +57,242 @@ void static BatchWriteHashBestChain(CLevelDBBatch &batch, const uint256 &hash) {
     batch.Write(DB_BEST_BLOCK, hash);
 }
 
-CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, bool fMemory, bool fWipe) : db(GetDataDir() / "chainstate", nCacheSize, fMemory, fWipe) {
+/* Number of records moved or erased at once when migrating the name
+   records out of the coin database.  */
+static const unsigned MIGRATE_BATCH_RECORDS = 10000;
+
+CCoinsViewDB::CCoinsViewDB(size_t nCacheSize, size_t nNameCacheSize, bool fMemoryIn, bool fWipe)
+    : db(GetDataDir() / "chainstate", nCacheSize, fMemoryIn, fWipe),
+      dbNames(GetDataDir() / "chainstate" / "names", nNameCacheSize, fMemoryIn, fWipe),
+      fMemory(fMemoryIn) {
+    MigrateNameRecords();
+    UpgradeNameRecords();
+    ReplayPendingNames();
+
+    /* Databases written by older versions do not have the set info yet,
+       so it has to be computed once.  */
+    if (!db.Read(DB_SET_INFO, setInfo) && !GetBestBlock().IsNull())
+        RecomputeSetInfo();
+}
+
+CCoinsViewDB::~CCoinsViewDB() {
+    DiscardStagedSnapshot();
+}
+
+static bool IsNameRecord(char chType)
+{
+    return chType == DB_NAME || chType == DB_NAME_HISTORY || chType == DB_NAME_EXPIRY;
+}
+
+void CCoinsViewDB::MigrateNameRecords() {
+    /* The name records sort after the coins, starting with the history.  */
+    CDataStream ssSeek(SER_DISK, CLIENT_VERSION);
+    ssSeek << DB_NAME_HISTORY;
+
+    boost::scoped_ptr<leveldb::Iterator> pcursor(db.NewIterator());
+    pcursor->Seek(ssSeek.str());
+    HandleError(pcursor->status());
+    if (!pcursor->Valid() || !IsNameRecord(pcursor->key()[0])) {
+        /* Without any name records, there is only the best block to set.
+           Don't do that if the set info knows about names, since then
+           the name database has been lost.  */
+        CChainStateSetInfo info;
+        if (dbNames.Exists(DB_BEST_BLOCK) || GetBestBlock().IsNull()
+            || (db.Read(DB_SET_INFO, info) && info.nNames > 0))
+            return;
+    }
+
+    LogPrintf("Moving the name records to the name database...\n");
+
+    /* Copy the records first and only erase them from the coin database
+       once the name database has its best block.  If this is interrupted,
+       it just starts over the next time.  */
+    CLevelDBBatch batch;
+    unsigned nBatch = 0;
+    uint64_t nMoved = 0;
+    for (pcursor->Seek(ssSeek.str()); pcursor->Valid(); pcursor->Next()) {
+        const leveldb::Slice slKey = pcursor->key();
+        if (!IsNameRecord(slKey[0]))
+            continue;
+        batch.WriteRaw(slKey, pcursor->value());
+        ++nMoved;
+        if (++nBatch >= MIGRATE_BATCH_RECORDS) {
+            dbNames.WriteBatch(batch);
+            batch.Clear();
+            nBatch = 0;
+        }
+    }
+    HandleError(pcursor->status());
+    BatchWriteHashBestChain(batch, GetBestBlock());
+    dbNames.WriteBatch(batch, true);
+    batch.Clear();
+    nBatch = 0;
+
+    for (pcursor->Seek(ssSeek.str()); pcursor->Valid(); pcursor->Next()) {
+        const leveldb::Slice slKey = pcursor->key();
+        if (!IsNameRecord(slKey[0]))
+            continue;
+        batch.EraseRaw(slKey);
+        if (++nBatch >= MIGRATE_BATCH_RECORDS) {
+            db.WriteBatch(batch);
+            batch.Clear();
+            nBatch = 0;
+        }
+    }
+    HandleError(pcursor->status());
+    db.WriteBatch(batch, true);
+
+    LogPrintf("Moved %u name records.\n", (unsigned)nMoved);
+}
+
+void CCoinsViewDB::UpgradeNameRecords() {
+    int nVersion = 0;
+    if (dbNames.Read(DB_NAME_VERSION, nVersion) && nVersion >= NAME_DB_VERSION)
+        return;
+
+    /* A new database has no records to convert yet.  */
+    if (!dbNames.Exists(DB_BEST_BLOCK)) {
+        dbNames.Write(DB_NAME_VERSION, NAME_DB_VERSION, true);
+        return;
+    }
+
+    LogPrintf("Converting the name database to the compact encoding...\n");
+
+    /* The records are converted in key order, and the last converted key is
+       written together with each batch.  If this is interrupted, it
+       continues after that key the next time.  */
+    CDataStream ssSeek(SER_DISK, CLIENT_VERSION);
+    ssSeek << DB_NAME_HISTORY;
+    std::string strSeek = ssSeek.str();
+    const bool fResume = dbNames.Read(DB_NAME_UPGRADE, strSeek);
+
+    boost::scoped_ptr<leveldb::Iterator> pcursor(dbNames.NewIterator());
+    pcursor->Seek(strSeek);
+    if (fResume && pcursor->Valid() && pcursor->key().ToString() == strSeek)
+        pcursor->Next();
+
+    CLevelDBBatch batch;
+    unsigned nBatch = 0;
+    uint64_t nRecords = 0, nSizeOld = 0, nSizeNew = 0;
+    for (; pcursor->Valid(); pcursor->Next()) {
+        const leveldb::Slice slKey = pcursor->key();
+        const char chType = slKey[0];
+        if (chType != DB_NAME && chType != DB_NAME_HISTORY)
+            break;
+
+        const leveldb::Slice slValue = pcursor->value();
+        CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+        CDataStream ssNew(SER_DISK, CLIENT_VERSION);
+        try {
+            if (chType == DB_NAME) {
+                CNameData data;
+                ssValue >> data;
+                ssNew << CNameDataCompressor(data);
+            } else {
+                CNameHistory history;
+                ssValue >> history;
+                ssNew << CNameHistoryCompressor(history);
+            }
+        } catch (const std::exception& e) {
+            throw std::runtime_error(strprintf("%s: Deserialize or I/O error - %s", __func__, e.what()));
+        }
+
+        batch.WriteRaw(slKey, leveldb::Slice(&ssNew[0], ssNew.size()));
+        ++nRecords;
+        nSizeOld += slValue.size();
+        nSizeNew += ssNew.size();
+        if (++nBatch >= MIGRATE_BATCH_RECORDS) {
+            batch.Write(DB_NAME_UPGRADE, slKey.ToString());
+            dbNames.WriteBatch(batch);
+            batch.Clear();
+            nBatch = 0;
+        }
+    }
+    HandleError(pcursor->status());
+
+    batch.Erase(DB_NAME_UPGRADE);
+    batch.Write(DB_NAME_VERSION, NAME_DB_VERSION);
+    dbNames.WriteBatch(batch, true);
+
+    LogPrintf("Converted %u name records, %u bytes before and %u bytes after.\n",
+              (unsigned)nRecords, (unsigned)nSizeOld, (unsigned)nSizeNew);
+}
+
+bool CCoinsViewDB::IsNameDBConsistent() const {
+    uint256 hashNames;
+    if (!dbNames.Read(DB_BEST_BLOCK, hashNames))
+        hashNames.SetNull();
+    return hashNames == GetBestBlock();
+}
+
+void CChainStateSetInfo::AddCoins(const CCoinsSetElement& element) {
+    hashCoins.InsertHashed(element.hash.begin());
+    ++nTransactions;
+    nTransactionOutputs += element.nOutputs;
+    nTotalAmount += element.nAmount;
+    nSerializedSize += element.nSerializedSize;
+}
+
+void CChainStateSetInfo::RemoveCoins(const CCoinsSetElement& element) {
+    hashCoins.RemoveHashed(element.hash.begin());
+    --nTransactions;
+    nTransactionOutputs -= element.nOutputs;
+    nTotalAmount -= element.nAmount;
+    nSerializedSize -= element.nSerializedSize;
+}
+
+void CChainStateSetInfo::AddName(const uint256& hashElement) {
+    hashNames.InsertHashed(hashElement.begin());
+    ++nNames;
+}
+
+void CChainStateSetInfo::RemoveName(const uint256& hashElement) {
+    hashNames.RemoveHashed(hashElement.begin());
+    --nNames;
+}
+
+bool CCoinsViewDB::RecomputeSetInfo() {
+    LogPrintf("Computing the coin and name set hashes...\n");
+
+    CChainStateSetInfo info;
+    CLevelDBWrapper* const dbs[] = {&db, &dbNames};
+    for (unsigned i = 0; i < 2; ++i) {
+        boost::scoped_ptr<leveldb::Iterator> pcursor(dbs[i]->NewIterator());
+        for (pcursor->SeekToFirst(); pcursor->Valid(); pcursor->Next()) {
+            boost::this_thread::interruption_point();
+            try {
+                const leveldb::Slice slKey = pcursor->key();
+                CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+                char chType;
+                ssKey >> chType;
+                if (chType != DB_COINS && chType != DB_NAME)
+                    continue;
+
+                const leveldb::Slice slValue = pcursor->value();
+                CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+                if (chType == DB_COINS) {
+                    uint256 txid;
+                    CCoins coins;
+                    ssKey >> txid;
+                    ssValue >> coins;
+                    info.AddCoins(CCoinsSetElement(txid, coins));
+                } else {
+                    valtype name;
+                    CNameData data;
+                    ssKey >> name;
+                    CNameDataCompressor compr(data);
+                    ssValue >> compr;
+                    info.AddName(NameSetElementHash(name, data));
+                }
+            } catch (const std::exception& e) {
+                return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+            }
+        }
+        HandleError(pcursor->status());
+    }
+
+    setInfo = info;
+    return db.Write(DB_SET_INFO, setInfo, true);
 }
 
 bool CCoinsViewDB::GetCoins(const uint256 &txid, CCoins &coins) const {
@@ -64,22 +311,21 @@ uint256 CCoinsViewDB::GetBestBlock() const {
 }
 
 bool CCoinsViewDB::GetName(const valtype &name, CNameData& data) const {
-    return db.Read(std::make_pair(DB_NAME, name), data);
+    CNameDataCompressor compr(data);
+    return dbNames.Read(std::make_pair(DB_NAME, name), compr);
 }
 
 bool CCoinsViewDB::GetNameHistory(const valtype &name, CNameHistory& data) const {
     assert (fNameHistory);
-    return db.Read(std::make_pair(DB_NAME_HISTORY, name), data);
+    CNameHistoryCompressor compr(data);
+    return dbNames.Read(std::make_pair(DB_NAME_HISTORY, name), compr);
 }
 
-bool CCoinsViewDB::GetNamesForHeight(unsigned nHeight, std::set<valtype>& names) const {
+/* Collect the names of the expire index at nHeight, reading the name
+   database through pcursor.  */
+static bool ReadNamesForHeight(leveldb::Iterator* pcursor, unsigned nHeight, std::set<valtype>& names) {
     names.clear();
 
-    /* It seems that there are no "const iterators" for LevelDB.  Since we
-       only need read operations on it, use a const-cast to get around
-       that restriction.  */
-    boost::scoped_ptr<leveldb::Iterator> pcursor(const_cast<CLevelDBWrapper*>(&db)->NewIterator());
-
     const CNameCache::ExpireEntry seekEntry(nHeight, valtype ());
     const std::pair<char, CNameCache::ExpireEntry> seekKey(DB_NAME_EXPIRY,
                                                            seekEntry);
@@ -122,6 +368,14 @@ bool CCoinsViewDB::GetNamesForHeight(unsigned nHeight, std::set<valtype>& names)
     return true;
 }
 
+bool CCoinsViewDB::GetNamesForHeight(unsigned nHeight, std::set<valtype>& names) const {
+    /* It seems that there are no "const iterators" for LevelDB.  Since we
+       only need read operations on it, use a const-cast to get around
+       that restriction.  */
+    boost::scoped_ptr<leveldb::Iterator> pcursor(const_cast<CLevelDBWrapper*>(&dbNames)->NewIterator());
+    return ReadNamesForHeight(pcursor.get(), nHeight, names);
+}
+
 class CDbNameIterator : public CNameIterator
 {
 
@@ -140,6 +394,12 @@ public:
      */
     CDbNameIterator(const CLevelDBWrapper& db);
 
+    /**
+     * Construct a new name iterator for a database snapshot.
+     * @param snapshot The snapshot to create the iterator for.
+     */
+    CDbNameIterator(const CLevelDBSnapshot& snapshot);
+
     /* Implement iterator methods.  */
     void seek (const valtype& start);
     bool next (valtype& name, CNameData& data);
@@ -156,6 +416,12 @@ CDbNameIterator::CDbNameIterator(const CLevelDBWrapper& db)
     seek(valtype());
 }
 
+CDbNameIterator::CDbNameIterator(const CLevelDBSnapshot& snapshot)
+    : iter(snapshot.NewIterator())
+{
+    seek(valtype());
+}
+
 void CDbNameIterator::seek(const valtype& start) {
     const std::pair<char, valtype> seekKey(DB_NAME, start);
     CDataStream seekKeyStream(SER_DISK, CLIENT_VERSION);
@@ -187,7 +453,8 @@ bool CDbNameIterator::next(valtype& name, CNameData& data) {
                             SER_DISK, CLIENT_VERSION);
 
         ssKey >> name;
-        ssValue >> data;
+        CNameDataCompressor compr(data);
+        ssValue >> compr;
     } catch (const std::exception& exc)
     {
         LogPrintf("%s : Deserialize or I/O error - %s", __func__, exc.what());
@@ -199,15 +466,44 @@ bool CDbNameIterator::next(valtype& name, CNameData& data) {
 }
 
 CNameIterator* CCoinsViewDB::IterateNames() const {
-    return new CDbNameIterator(db);
+    return new CDbNameIterator(dbNames);
+}
+
+void CCoinsViewDB::RemoveOldName(const CNameCache &names, const valtype &name, CChainStateSetInfo &info) const {
+    /* The cache records the version of the name that we have, unless
+       the change came from elsewhere.  */
+    uint256 hashElement;
+    if (names.getOriginal(name, hashElement)) {
+        if (!hashElement.IsNull())
+            info.RemoveName(hashElement);
+        return;
+    }
+    CNameData dataOld;
+    if (GetName(name, dataOld))
+        info.RemoveName(NameSetElementHash(name, dataOld));
 }
 
 bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock, const CNameCache &names) {
     CLevelDBBatch batch;
+    CChainStateSetInfo setInfoNew = setInfo;
     size_t count = 0;
     size_t changed = 0;
     for (CCoinsMap::iterator it = mapCoins.begin(); it != mapCoins.end();) {
         if (it->second.flags & CCoinsCacheEntry::DIRTY) {
+            /* Unless the entry is fresh, an old version of it is in the
+               database and has to be taken out of the set hash.  The
+               cache on top of us records it when the entry is modified,
+               so it only has to be read back for other writers.  */
+            if (!(it->second.flags & CCoinsCacheEntry::FRESH)) {
+                CCoins coinsOld;
+                if (it->second.original)
+                    setInfoNew.RemoveCoins(*it->second.original);
+                else if (GetCoins(it->first, coinsOld))
+                    setInfoNew.RemoveCoins(CCoinsSetElement(it->first, coinsOld));
+            }
+            if (!it->second.coins.IsPruned())
+                setInfoNew.AddCoins(CCoinsSetElement(it->first, it->second.coins));
+
             BatchWriteCoins(batch, it->first, it->second.coins);
             changed++;
         }
@@ -218,10 +514,243 @@ bool CCoinsViewDB::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock, con
     if (!hashBlock.IsNull())
         BatchWriteHashBestChain(batch, hashBlock);
 
-    names.writeBatch(batch);
+    const CNameCache::EntryMap& nameEntries = names.getEntries();
+    for (CNameCache::EntryMap::const_iterator i = nameEntries.begin(); i != nameEntries.end(); ++i) {
+        RemoveOldName(names, i->first, setInfoNew);
+        setInfoNew.AddName(NameSetElementHash(i->first, i->second));
+    }
+    const std::set<valtype>& namesDeleted = names.getDeleted();
+    for (std::set<valtype>::const_iterator i = namesDeleted.begin(); i != namesDeleted.end(); ++i)
+        RemoveOldName(names, *i, setInfoNew);
+
+    batch.Write(DB_SET_INFO, setInfoNew);
+
+    /* A write to one database is atomic, but there are two of them.  The
+       name changes are therefore stored in the coin database along with
+       the coins, and only then written to the name database.  If that
+       does not complete, ReplayPendingNames finishes it on the next start.
+       The coin database write is synced, so that it cannot be lost while
+       the name database write is not.  */
+    batch.Write(DB_NAMES_PENDING, std::pair<const uint256&, const CNameCache&>(hashBlock, names));
 
     LogPrint("coindb", "Committing %u changed transactions (out of %u) to coin database...\n", (unsigned int)changed, (unsigned int)count);
-    return db.WriteBatch(batch);
+    if (!db.WriteBatch(batch, true))
+        return false;
+    setInfo = setInfoNew;
+
+    return WritePendingNames(hashBlock, names);
+}
+
+bool CCoinsViewDB::WritePendingNames(const uint256 &hashBlock, const CNameCache &names) {
+    CLevelDBBatch batchNames;
+    names.writeBatch(batchNames);
+    if (!hashBlock.IsNull())
+        BatchWriteHashBestChain(batchNames, hashBlock);
+    if (!dbNames.WriteBatch(batchNames))
+        return false;
+
+    /* If erasing the changes is lost, they are written once more, which
+       does no harm.  */
+    return db.Erase(DB_NAMES_PENDING);
+}
+
+void CCoinsViewDB::ReplayPendingNames() {
+    std::pair<uint256, CNameCache> pending;
+    if (!db.Read(DB_NAMES_PENDING, pending))
+        return;
+
+    uint256 hashNames;
+    if (!dbNames.Read(DB_BEST_BLOCK, hashNames) || hashNames != pending.first)
+        LogPrintf("Completing the interrupted write of the name database at %s\n",
+                  pending.first.ToString());
+    WritePendingNames(pending.first, pending.second);
+}
+
+CCoinsViewAsyncWriter::CCoinsViewAsyncWriter(CCoinsView* viewIn)
+    : CCoinsViewBacked(viewIn), fPending(false), fFailed(false), fStop(false),
+      thread(boost::bind(&CCoinsViewAsyncWriter::ThreadWrite, this)) {
+}
+
+CCoinsViewAsyncWriter::~CCoinsViewAsyncWriter() {
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        fStop = true;
+        cond.notify_all();
+    }
+    thread.join();
+}
+
+void CCoinsViewAsyncWriter::ThreadWrite() {
+    RenameThread("namecoin-flush");
+
+    boost::unique_lock<boost::mutex> lock(cs);
+    while (true) {
+        while (!fPending && !fStop)
+            cond.wait(lock);
+        if (!fPending)
+            return;
+
+        /* The pending changes are not modified while fPending is set, so
+           they can be read without the lock.  The base may modify the map
+           passed to it, so it gets a copy.  */
+        lock.unlock();
+        bool fOk;
+        try {
+            CCoinsMap mapWrite(mapPending);
+            fOk = base->BatchWrite(mapWrite, hashPending, namesPending);
+        } catch (const std::exception& e) {
+            LogPrintf("%s: %s\n", __func__, e.what());
+            fOk = false;
+        }
+        lock.lock();
+
+        if (!fOk) {
+            /* Keep serving the pending changes, the next flush reports the
+               failure.  */
+            LogPrintf("%s: failed to write the chain state\n", __func__);
+            fFailed = true;
+            cond.notify_all();
+            return;
+        }
+
+        mapPending.clear();
+        hashPending.SetNull();
+        namesPending.clear();
+        fPending = false;
+        cond.notify_all();
+    }
+}
+
+void CCoinsViewAsyncWriter::WaitPending(boost::unique_lock<boost::mutex>& lock) const {
+    while (fPending && !fFailed)
+        cond.wait(lock);
+}
+
+bool CCoinsViewAsyncWriter::GetCoins(const uint256 &txid, CCoins &coins) const {
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        if (fPending) {
+            CCoinsMap::const_iterator it = mapPending.find(txid);
+            if (it != mapPending.end()) {
+                if (it->second.coins.IsPruned())
+                    return false;
+                coins = it->second.coins;
+                return true;
+            }
+        }
+    }
+    /* Entries that are not pending are the same before and after the
+       write, so the base can be read without the lock.  */
+    return base->GetCoins(txid, coins);
+}
+
+bool CCoinsViewAsyncWriter::HaveCoins(const uint256 &txid) const {
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        if (fPending) {
+            CCoinsMap::const_iterator it = mapPending.find(txid);
+            if (it != mapPending.end())
+                return !it->second.coins.IsPruned();
+        }
+    }
+    return base->HaveCoins(txid);
+}
+
+uint256 CCoinsViewAsyncWriter::GetBestBlock() const {
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        if (fPending && !hashPending.IsNull())
+            return hashPending;
+    }
+    return base->GetBestBlock();
+}
+
+bool CCoinsViewAsyncWriter::GetName(const valtype &name, CNameData &data) const {
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        if (fPending) {
+            if (namesPending.isDeleted(name))
+                return false;
+            if (namesPending.get(name, data))
+                return true;
+        }
+    }
+    return base->GetName(name, data);
+}
+
+bool CCoinsViewAsyncWriter::GetNameHistory(const valtype &name, CNameHistory &data) const {
+    {
+        boost::unique_lock<boost::mutex> lock(cs);
+        if (fPending) {
+            /* An empty history is deleted from the database by the write,
+               and so is the history of a deleted name.  */
+            if (namesPending.getHistory(name, data))
+                return !data.empty();
+            if (namesPending.isDeleted(name))
+                return false;
+        }
+    }
+    return base->GetNameHistory(name, data);
+}
+
+bool CCoinsViewAsyncWriter::GetNamesForHeight(unsigned nHeight, std::set<valtype>& names) const {
+    /* Applying the pending changes is idempotent, so it does not matter
+       whether the base already has them.  */
+    if (!base->GetNamesForHeight(nHeight, names))
+        return false;
+    boost::unique_lock<boost::mutex> lock(cs);
+    if (fPending)
+        namesPending.updateNamesForHeight(nHeight, names);
+    return true;
+}
+
+CNameIterator* CCoinsViewAsyncWriter::IterateNames() const {
+    /* The iterator outlives the pending changes, so wait for them.  */
+    boost::unique_lock<boost::mutex> lock(cs);
+    WaitPending(lock);
+    return base->IterateNames();
+}
+
+bool CCoinsViewAsyncWriter::BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock, const CNameCache &names) {
+    boost::unique_lock<boost::mutex> lock(cs);
+    WaitPending(lock);
+    if (fFailed)
+        return false;
+
+    /* Only the dirty entries differ from the base.  */
+    mapPending.swap(mapCoins);
+    for (CCoinsMap::iterator it = mapPending.begin(); it != mapPending.end();) {
+        if (it->second.flags & CCoinsCacheEntry::DIRTY)
+            ++it;
+        else
+            mapPending.erase(it++);
+    }
+    mapCoins.clear();
+    hashPending = hashBlock;
+    namesPending = names;
+    fPending = true;
+    cond.notify_all();
+
+    LogPrint("coindb", "Handed %u changed transactions to the background writer\n", (unsigned int)mapPending.size());
+    return true;
+}
+
+bool CCoinsViewAsyncWriter::GetStats(CCoinsStats &stats) const {
+    boost::unique_lock<boost::mutex> lock(cs);
+    WaitPending(lock);
+    return base->GetStats(stats);
+}
+
+bool CCoinsViewAsyncWriter::ValidateNameDB() const {
+    boost::unique_lock<boost::mutex> lock(cs);
+    WaitPending(lock);
+    return base->ValidateNameDB();
+}
+
+bool CCoinsViewAsyncWriter::Sync() {
+    boost::unique_lock<boost::mutex> lock(cs);
+    WaitPending(lock);
+    return !fFailed;
 }
 
 CBlockTreeDB::CBlockTreeDB(size_t nCacheSize, bool fMemory, bool fWipe) : CLevelDBWrapper(GetDataDir() / "blocks" / "index", nCacheSize, fMemory, fWipe) {
@@ -248,6 +777,25 @@ bool CBlockTreeDB::ReadLastBlockFile(int &nFile) {
 }
 
 bool CCoinsViewDB::GetStats(CCoinsStats &stats) const {
+    stats.hashBlock = GetBestBlock();
+    stats.nHeight = mapBlockIndex.find(stats.hashBlock)->second->nHeight;
+    stats.nTransactions = setInfo.nTransactions;
+    stats.nTransactionOutputs = setInfo.nTransactionOutputs;
+    stats.nSerializedSize = setInfo.nSerializedSize;
+    stats.nTotalAmount = setInfo.nTotalAmount;
+    setInfo.hashCoins.Finalize(stats.hashMuHash.begin());
+    return true;
+}
+
+bool CCoinsViewDB::GetNameStats(CNameSetStats &stats) const {
+    stats.hashBlock = GetBestBlock();
+    stats.nHeight = mapBlockIndex.find(stats.hashBlock)->second->nHeight;
+    stats.nNames = setInfo.nNames;
+    setInfo.hashNames.Finalize(stats.hashMuHash.begin());
+    return true;
+}
+
+bool CCoinsViewDB::GetStatsSerialized(CCoinsStats &stats) const {
     /* It seems that there are no "const iterators" for LevelDB.  Since we
        only need read operations on it, use a const-cast to get around
        that restriction.  */
@@ -312,6 +860,251 @@ bool CBlockTreeDB::WriteBatchSync(const std::vector<std::pair<int, const CBlockF
     return WriteBatch(batch, true);
 }
 
+/** Read the best block stored in a database snapshot. */
+static bool ReadSnapshotBestBlock(const CLevelDBSnapshot& snapshot, uint256& hashBestBlock)
+{
+    return snapshot.Read(DB_BEST_BLOCK, hashBestBlock);
+}
+
+/* Number of shards the expire index is split into by height for
+   ValidateNameDB.  The coin and name records are split by the first
+   byte of the txid and of the name's serialisation (its length).  */
+static const unsigned VALIDATE_EXPIRY_SHARDS = 256;
+
+/** Record counts of one shard of ValidateNameDB. */
+struct CNameDBCheckCounts
+{
+    uint64_t nNames;
+    uint64_t nUnexpired;
+    uint64_t nHistory;
+    uint64_t nNamesInUTXO;
+
+    CNameDBCheckCounts() : nNames(0), nUnexpired(0), nHistory(0), nNamesInUTXO(0) {}
+};
+
+/**
+ * One key range of a database snapshot checked by ValidateNameDB on the
+ * threads of a CCheckQueue.  Each record is checked against the other
+ * databases by point lookups, or in the case of the name history by
+ * walking the matching range of the name records along with it, so
+ * that nothing has to be collected in memory.  Together, the checks of
+ * all shards make sure that
+ *  - each name in the UTXO set has unexpired name data at its outpoint,
+ *  - the outpoint of each unexpired name holds that name in the UTXO set,
+ *  - the expire index has exactly one entry for each name, at its height,
+ *  - each name history belongs to a name (and there is none without
+ *    -namehistory).
+ */
+class CNameDBCheck
+{
+public:
+    enum Type { COINS, NAMES, EXPIRY };
+
+private:
+    const CChainStateDBSnapshot* snapshot;
+    Type type;
+    std::string strBegin;
+    std::string strEnd;
+    unsigned nHeight;
+    CNameDBCheckCounts* pcounts;
+
+    bool CheckCoins(leveldb::Iterator* pcursor, const leveldb::Slice& slEnd);
+    bool CheckNames(leveldb::Iterator* pcursor, const leveldb::Slice& slEnd);
+    bool CheckExpiry(leveldb::Iterator* pcursor, const leveldb::Slice& slEnd);
+
+public:
+    CNameDBCheck() : snapshot(NULL), type(COINS), nHeight(0), pcounts(NULL) {}
+    CNameDBCheck(const CChainStateDBSnapshot& snapshotIn, Type typeIn, const std::string& strBeginIn,
+                 const std::string& strEndIn, unsigned nHeightIn, CNameDBCheckCounts& counts)
+        : snapshot(&snapshotIn), type(typeIn), strBegin(strBeginIn), strEnd(strEndIn),
+          nHeight(nHeightIn), pcounts(&counts) {}
+
+    bool operator()();
+
+    void swap(CNameDBCheck& check)
+    {
+        std::swap(snapshot, check.snapshot);
+        std::swap(type, check.type);
+        strBegin.swap(check.strBegin);
+        strEnd.swap(check.strEnd);
+        std::swap(nHeight, check.nHeight);
+        std::swap(pcounts, check.pcounts);
+    }
+};
+
+bool CNameDBCheck::operator()()
+{
+    const CLevelDBSnapshot& db = (type == COINS ? snapshot->coins : snapshot->names);
+    boost::scoped_ptr<leveldb::Iterator> pcursor(db.NewIterator());
+    const leveldb::Slice slEnd(strEnd);
+    pcursor->Seek(strBegin);
+    try {
+        switch (type)
+        {
+        case COINS:
+            return CheckCoins(pcursor.get(), slEnd);
+        case NAMES:
+            return CheckNames(pcursor.get(), slEnd);
+        case EXPIRY:
+            return CheckExpiry(pcursor.get(), slEnd);
+        }
+    } catch (const std::exception& e) {
+        return error("ValidateNameDB : Deserialize or I/O error - %s", e.what());
+    }
+    return false;
+}
+
+bool CNameDBCheck::CheckCoins(leveldb::Iterator* pcursor, const leveldb::Slice& slEnd)
+{
+    for (; pcursor->Valid() && pcursor->key().compare(slEnd) < 0; pcursor->Next())
+    {
+        boost::this_thread::interruption_point();
+        const leveldb::Slice slKey = pcursor->key();
+        CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+        char chType;
+        uint256 txid;
+        ssKey >> chType >> txid;
+
+        const leveldb::Slice slValue = pcursor->value();
+        CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+        CCoins coins;
+        ssValue >> coins;
+
+        for (unsigned i = 0; i < coins.vout.size(); ++i)
+        {
+            const CTxOut& txout = coins.vout[i];
+            if (txout.IsNull())
+                continue;
+            const CNameScript nameOp(txout.scriptPubKey);
+            if (!nameOp.isNameOp() || !nameOp.isAnyUpdate())
+                continue;
+
+            const valtype& name = nameOp.getOpName();
+            CNameData data;
+            CNameDataCompressor compr(data);
+            /* Expiration is checked at height+1, because that matches
+               how the UTXO set is cleared in ExpireNames.  */
+            if (!snapshot->names.Read(std::make_pair(DB_NAME, name), compr) || data.isExpired(nHeight + 1))
+                return error("ValidateNameDB : name '%s' in UTXO set but not DB",
+                             ValtypeToString(name).c_str());
+            if (data.getUpdateOutpoint() != COutPoint(txid, i))
+                return error("ValidateNameDB : name '%s' in UTXO set at %s, but DB has %s",
+                             ValtypeToString(name).c_str(), COutPoint(txid, i).ToString(),
+                             data.getUpdateOutpoint().ToString());
+            ++pcounts->nNamesInUTXO;
+        }
+    }
+    return true;
+}
+
+bool CNameDBCheck::CheckNames(leveldb::Iterator* pcursor, const leveldb::Slice& slEnd)
+{
+    /* The history records are keyed by the name like the name records,
+       so the history range of this shard is walked along with them.  */
+    std::string strHistoryBegin = strBegin, strHistoryEnd = strEnd;
+    strHistoryBegin[0] = DB_NAME_HISTORY;
+    strHistoryEnd[0] = (strEnd.size() == 1 ? DB_NAME_HISTORY + 1 : DB_NAME_HISTORY);
+    const leveldb::Slice slHistoryEnd(strHistoryEnd);
+    boost::scoped_ptr<leveldb::Iterator> phistory(snapshot->names.NewIterator());
+    phistory->Seek(strHistoryBegin);
+
+    /* The serialised name of the next history record not matched yet */
+    std::string strHistoryName;
+    bool fHaveHistory = false;
+    for (;;)
+    {
+        boost::this_thread::interruption_point();
+        if (!fHaveHistory && phistory->Valid() && phistory->key().compare(slHistoryEnd) < 0) {
+            if (!fNameHistory)
+                return error("ValidateNameDB : name_history entries in DB, but"
+                             " -namehistory not set");
+            const leveldb::Slice slKey = phistory->key();
+            strHistoryName.assign(slKey.data() + 1, slKey.size() - 1);
+            fHaveHistory = true;
+            phistory->Next();
+            ++pcounts->nHistory;
+        }
+
+        if (!pcursor->Valid() || pcursor->key().compare(slEnd) >= 0)
+            break;
+
+        const leveldb::Slice slKey = pcursor->key();
+        CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+        char chType;
+        valtype name;
+        ssKey >> chType >> name;
+
+        /* Both ranges are sorted by the serialised name, so a history
+           record before the current name has no name record.  */
+        if (fHaveHistory) {
+            const int nCompare = leveldb::Slice(strHistoryName).compare(leveldb::Slice(slKey.data() + 1, slKey.size() - 1));
+            if (nCompare < 0)
+                break;
+            if (nCompare == 0)
+                fHaveHistory = false;
+        }
+
+        const leveldb::Slice slValue = pcursor->value();
+        CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(), SER_DISK, CLIENT_VERSION);
+        CNameData data;
+        CNameDataCompressor compr(data);
+        ssValue >> compr;
+        ++pcounts->nNames;
+
+        const CNameCache::ExpireEntry entry(data.getHeight(), name);
+        if (!snapshot->names.Exists(std::make_pair(DB_NAME_EXPIRY, entry)))
+            return error("ValidateNameDB : name height data mismatch for '%s'",
+                         ValtypeToString(name).c_str());
+
+        if (!data.isExpired(nHeight + 1))
+        {
+            const COutPoint& outpoint = data.getUpdateOutpoint();
+            CCoins coins;
+            if (!snapshot->coins.Read(std::make_pair(DB_COINS, outpoint.hash), coins)
+                || !coins.IsAvailable(outpoint.n))
+                return error("ValidateNameDB : name '%s' in DB but not UTXO set",
+                             ValtypeToString(name).c_str());
+            const CNameScript nameOp(coins.vout[outpoint.n].scriptPubKey);
+            if (!nameOp.isNameOp() || !nameOp.isAnyUpdate() || nameOp.getOpName() != name)
+                return error("ValidateNameDB : name '%s' in DB but not UTXO set",
+                             ValtypeToString(name).c_str());
+            ++pcounts->nUnexpired;
+        }
+
+        pcursor->Next();
+    }
+
+    if (fHaveHistory) {
+        CDataStream ssName(strHistoryName.data(), strHistoryName.data() + strHistoryName.size(), SER_DISK, CLIENT_VERSION);
+        valtype name;
+        ssName >> name;
+        return error("ValidateNameDB : history entry for name '%s' not in main DB",
+                     ValtypeToString(name).c_str());
+    }
+    return true;
+}
+
+bool CNameDBCheck::CheckExpiry(leveldb::Iterator* pcursor, const leveldb::Slice& slEnd)
+{
+    for (; pcursor->Valid() && pcursor->key().compare(slEnd) < 0; pcursor->Next())
+    {
+        boost::this_thread::interruption_point();
+        const leveldb::Slice slKey = pcursor->key();
+        CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(), SER_DISK, CLIENT_VERSION);
+        char chType;
+        CNameCache::ExpireEntry entry;
+        ssKey >> chType >> entry;
+
+        CNameData data;
+        CNameDataCompressor compr(data);
+        if (!snapshot->names.Read(std::make_pair(DB_NAME, entry.name), compr)
+            || data.getHeight() != entry.nHeight)
+            return error("ValidateNameDB : name height data mismatch for '%s'",
+                         ValtypeToString(entry.name).c_str());
+    }
+    return true;
+}
+
 bool CCoinsViewDB::ValidateNameDB() const
 {
     const uint256 blockHash = GetBestBlock();
@@ -321,156 +1114,355 @@ bool CCoinsViewDB::ValidateNameDB() const
     else
         nHeight = mapBlockIndex.find(blockHash)->second->nHeight;
 
-    /* It seems that there are no "const iterators" for LevelDB.  Since we
-       only need read operations on it, use a const-cast to get around
-       that restriction.  */
-    boost::scoped_ptr<leveldb::Iterator> pcursor(const_cast<CLevelDBWrapper*>(&db)->NewIterator());
-    pcursor->SeekToFirst();
+    boost::scoped_ptr<CChainStateDBSnapshot> snapshot(GetSnapshot());
+    return ValidateNameDB(*snapshot, nHeight);
+}
 
-    /* Loop over the total database and read interesting
-       things to memory.  We later use that to check
-       everything against each other.  */
+bool CCoinsViewDB::ValidateNameDB(const CChainStateDBSnapshot& snapshot, unsigned nHeight)
+{
+    uint256 hashBestBlock, hashNamesBlock;
+    if (!ReadSnapshotBestBlock(snapshot.coins, hashBestBlock))
+        hashBestBlock.SetNull();
+    if (!ReadSnapshotBestBlock(snapshot.names, hashNamesBlock))
+        hashNamesBlock.SetNull();
+    if (hashNamesBlock != hashBestBlock)
+        return error("%s : name database is not at the best block", __func__);
+
+    /* Split the records into key ranges, which are checked on the script
+       check threads (-par).  */
+    std::vector<CNameDBCheck> vChecks;
+    std::vector<CNameDBCheckCounts> vCounts(2 * 256 + VALIDATE_EXPIRY_SHARDS);
+    for (unsigned i = 0; i < 256; ++i)
+    {
+        const char chTypes[] = {DB_COINS, DB_NAME};
+        for (unsigned j = 0; j < 2; ++j)
+        {
+            const std::string strBegin = std::string(1, chTypes[j]) + static_cast<char>(i);
+            const std::string strEnd = (i < 255 ? std::string(1, chTypes[j]) + static_cast<char>(i + 1)
+                                                : std::string(1, chTypes[j] + 1));
+            vChecks.push_back(CNameDBCheck(snapshot, j == 0 ? CNameDBCheck::COINS : CNameDBCheck::NAMES,
+                                           strBegin, strEnd, nHeight, vCounts[2 * i + j]));
+        }
+    }
+    const unsigned nExpiryStep = std::max(1u, (nHeight + VALIDATE_EXPIRY_SHARDS) / VALIDATE_EXPIRY_SHARDS);
+    for (unsigned i = 0; i < VALIDATE_EXPIRY_SHARDS; ++i)
+    {
+        CDataStream ssBegin(SER_DISK, CLIENT_VERSION), ssEnd(SER_DISK, CLIENT_VERSION);
+        ssBegin << std::make_pair(DB_NAME_EXPIRY, CNameCache::ExpireEntry(i * nExpiryStep, valtype()));
+        if (i + 1 < VALIDATE_EXPIRY_SHARDS)
+            ssEnd << std::make_pair(DB_NAME_EXPIRY, CNameCache::ExpireEntry((i + 1) * nExpiryStep, valtype()));
+        else
+            ssEnd << static_cast<char>(DB_NAME_EXPIRY + 1);
+        vChecks.push_back(CNameDBCheck(snapshot, CNameDBCheck::EXPIRY, ssBegin.str(), ssEnd.str(),
+                                       nHeight, vCounts[2 * 256 + i]));
+    }
 
-    std::map<valtype, unsigned> nameHeightsIndex;
-    std::map<valtype, unsigned> nameHeightsData;
-    std::set<valtype> namesInDB;
-    std::set<valtype> namesInUTXO;
-    std::set<valtype> namesWithHistory;
+    CCheckQueue<CNameDBCheck> queue(1);
+    bool fOk;
+    {
+        CCheckQueueThreads<CNameDBCheck> workers(queue, nScriptCheckThreads - 1);
+        CCheckQueueControl<CNameDBCheck> control(&queue);
+        control.Add(vChecks);
+        fOk = control.Wait();
+    }
+    if (!fOk)
+        return false;
 
-    while (pcursor->Valid())
+    CNameDBCheckCounts total;
+    BOOST_FOREACH(const CNameDBCheckCounts& counts, vCounts)
     {
-        boost::this_thread::interruption_point();
-        try
-        {
-            const leveldb::Slice slKey = pcursor->key();
-            CDataStream ssKey(slKey.data(), slKey.data() + slKey.size(),
-                              SER_DISK, CLIENT_VERSION);
-            char chType;
-            ssKey >> chType;
+        total.nNames += counts.nNames;
+        total.nUnexpired += counts.nUnexpired;
+        total.nHistory += counts.nHistory;
+        total.nNamesInUTXO += counts.nNamesInUTXO;
+    }
+    if (total.nNamesInUTXO != total.nUnexpired)
+        return error("%s : %u names in UTXO set, but %u unexpired names in DB", __func__,
+                     total.nNamesInUTXO, total.nUnexpired);
 
-            const leveldb::Slice slValue = pcursor->value();
-            CDataStream ssValue(slValue.data(), slValue.data() + slValue.size(),
-                                SER_DISK, CLIENT_VERSION);
+    LogPrintf("Checked name database, %u unexpired names, %u total.\n",
+              total.nUnexpired, total.nNames);
+    LogPrintf("Names with history: %u\n", total.nHistory);
 
-            switch (chType)
-            {
-            case DB_COINS:
-            {
-                CCoins coins;
-                ssValue >> coins;
-                BOOST_FOREACH(const CTxOut& txout, coins.vout)
-                    if (!txout.IsNull())
-                    {
-                        const CNameScript nameOp(txout.scriptPubKey);
-                        if (nameOp.isNameOp() && nameOp.isAnyUpdate())
-                        {
-                            const valtype& name = nameOp.getOpName();
-                            if (namesInUTXO.count(name) > 0)
-                                return error("%s : name %s duplicated in UTXO set",
-                                             __func__, ValtypeToString(name).c_str());
-                            namesInUTXO.insert(nameOp.getOpName());
-                        }
-                    }
-                break;
-            }
+    return true;
+}
 
-            case DB_NAME:
-            {
-                valtype name;
-                ssKey >> name;
-                CNameData data;
-                ssValue >> data;
+/* Number of records written to the database at once while loading
+   a chain state snapshot.  */
+static const unsigned SNAPSHOT_BATCH_RECORDS = 10000;
 
-                if (nameHeightsData.count(name) > 0)
-                    return error("%s : name %s duplicated in name index",
-                                 __func__, ValtypeToString(name).c_str());
-                nameHeightsData.insert(std::make_pair(name, data.getHeight()));
-                
-                /* Expiration is checked at height+1, because that matches
-                   how the UTXO set is cleared in ExpireNames.  */
-                assert(namesInDB.count(name) == 0);
-                if (!data.isExpired(nHeight + 1))
-                    namesInDB.insert(name);
-                break;
-            }
+/** Scratch database a snapshot is read into before it replaces the chain state. */
+static boost::filesystem::path GetStagedSnapshotPath()
+{
+    return GetDataDir() / "snapshot";
+}
 
-            case DB_NAME_HISTORY:
-            {
-                valtype name;
-                ssKey >> name;
+/**
+ * Count a database record for the snapshot statistics.  Returns false
+ * if the record is not part of chain state snapshots.
+ */
+static bool CountSnapshotRecord(char chType, CChainStateSnapshotStats& stats)
+{
+    switch (chType)
+    {
+    case DB_COINS:
+        ++stats.nCoins;
+        return true;
+    case DB_NAME:
+        ++stats.nNames;
+        return true;
+    case DB_NAME_HISTORY:
+        ++stats.nNameHistory;
+        return true;
+    case DB_NAME_EXPIRY:
+        ++stats.nNameExpiry;
+        return true;
+    default:
+        return false;
+    }
+}
 
-                if (namesWithHistory.count(name) > 0)
-                    return error("%s : name %s has duplicate history",
-                                 __func__, ValtypeToString(name).c_str());
-                namesWithHistory.insert(name);
-                break;
-            }
+CChainStateDBSnapshot* CCoinsViewDB::GetSnapshot() const {
+    return new CChainStateDBSnapshot(db, dbNames);
+}
 
-            case DB_NAME_EXPIRY:
-            {
-                CNameCache::ExpireEntry entry;
-                ssKey >> entry;
-                const valtype& name = entry.name;
+CCoinsViewDBSnapshot::CCoinsViewDBSnapshot(CChainStateDBSnapshot* snapshotIn)
+    : snapshot(snapshotIn) {
+}
 
-                if (nameHeightsIndex.count(name) > 0)
-                    return error("%s : name %s duplicated in expire idnex",
-                                 __func__, ValtypeToString(name).c_str());
+bool CCoinsViewDBSnapshot::GetCoins(const uint256 &txid, CCoins &coins) const {
+    return snapshot->coins.Read(make_pair(DB_COINS, txid), coins);
+}
 
-                nameHeightsIndex.insert(std::make_pair(name, entry.nHeight));
-                break;
-            }
+bool CCoinsViewDBSnapshot::HaveCoins(const uint256 &txid) const {
+    return snapshot->coins.Exists(make_pair(DB_COINS, txid));
+}
 
-            default:
-                break;
-            }
+uint256 CCoinsViewDBSnapshot::GetBestBlock() const {
+    uint256 hashBestChain;
+    if (!ReadSnapshotBestBlock(snapshot->coins, hashBestChain))
+        return uint256();
+    return hashBestChain;
+}
 
-            pcursor->Next();
-        } catch (std::exception &e)
-        {
-            return error("%s : Deserialize or I/O error - %s",
-                         __func__, e.what());
+bool CCoinsViewDBSnapshot::GetName(const valtype &name, CNameData& data) const {
+    CNameDataCompressor compr(data);
+    return snapshot->names.Read(std::make_pair(DB_NAME, name), compr);
+}
+
+bool CCoinsViewDBSnapshot::GetNameHistory(const valtype &name, CNameHistory& data) const {
+    assert (fNameHistory);
+    CNameHistoryCompressor compr(data);
+    return snapshot->names.Read(std::make_pair(DB_NAME_HISTORY, name), compr);
+}
+
+bool CCoinsViewDBSnapshot::GetNamesForHeight(unsigned nHeight, std::set<valtype>& names) const {
+    boost::scoped_ptr<leveldb::Iterator> pcursor(snapshot->names.NewIterator());
+    return ReadNamesForHeight(pcursor.get(), nHeight, names);
+}
+
+CNameIterator* CCoinsViewDBSnapshot::IterateNames() const {
+    return new CDbNameIterator(snapshot->names);
+}
+
+bool CCoinsViewDB::DumpSnapshot(const CChainStateDBSnapshot& snapshot, const CChainStateSnapshot& header,
+                                CAutoFile& file, CChainStateSnapshotStats& stats) const {
+    uint256 hashBestBlock;
+    if (!ReadSnapshotBestBlock(snapshot.coins, hashBestBlock))
+        return error("%s: no best block in coin database", __func__);
+    if (hashBestBlock != header.hashBlock)
+        return error("%s: best block %s does not match snapshot block %s", __func__,
+                     hashBestBlock.ToString(), header.hashBlock.ToString());
+    uint256 hashNamesBlock;
+    if (!ReadSnapshotBestBlock(snapshot.names, hashNamesBlock) || hashNamesBlock != hashBestBlock)
+        return error("%s: name database is not at the best block", __func__);
+
+    CHashWriter hasher(SER_DISK, CLIENT_VERSION);
+    file << header;
+    hasher << header;
+
+    /* All coin records sort before the name records, so dumping the coin
+       database first keeps the records ordered by key.  */
+    uint64_t nRecords = 0;
+    const CLevelDBSnapshot* const snapshots[] = {&snapshot.coins, &snapshot.names};
+    for (unsigned i = 0; i < 2; ++i) {
+        boost::scoped_ptr<leveldb::Iterator> pcursor(snapshots[i]->NewIterator());
+        for (pcursor->SeekToFirst(); pcursor->Valid(); pcursor->Next()) {
+            boost::this_thread::interruption_point();
+            const leveldb::Slice slKey = pcursor->key();
+            if (slKey.empty() || !CountSnapshotRecord(slKey[0], stats))
+                continue;
+
+            const leveldb::Slice slValue = pcursor->value();
+            const std::string strKey(slKey.data(), slKey.size());
+            const std::string strValue(slValue.data(), slValue.size());
+            file << strKey << strValue;
+            hasher << strKey << strValue;
+            ++nRecords;
         }
+        HandleError(pcursor->status());
     }
 
-    /* Now verify the collected data.  */
+    /* The record list is terminated by an empty key.  */
+    const std::string strEnd;
+    file << strEnd << VARINT(nRecords);
+    hasher << strEnd << VARINT(nRecords);
 
-    assert (nameHeightsData.size() >= namesInDB.size());
+    stats.hashChecksum = hasher.GetHash();
+    file << stats.hashChecksum;
 
-    if (nameHeightsIndex != nameHeightsData)
-        return error("%s : name height data mismatch", __func__);
+    return true;
+}
 
-    BOOST_FOREACH(const valtype& name, namesInDB)
-        if (namesInUTXO.count(name) == 0)
-            return error("%s : name '%s' in DB but not UTXO set",
-                         __func__, ValtypeToString(name).c_str());
-    BOOST_FOREACH(const valtype& name, namesInUTXO)
-        if (namesInDB.count(name) == 0)
-            return error("%s : name '%s' in UTXO set but not DB",
-                         __func__, ValtypeToString(name).c_str());
+bool CCoinsViewDB::StageSnapshot(CAutoFile& file, const CChainStateSnapshot& header,
+                                 CChainStateSnapshotStats& stats) {
+    /* The records go to a scratch database, so that the chain state is
+       untouched until the whole file has been verified.  */
+    DiscardStagedSnapshot();
+    pdbStaged.reset(new CLevelDBWrapper(GetStagedSnapshotPath(), 8 << 20, fMemory, true));
 
-    if (fNameHistory)
-    {
-        BOOST_FOREACH(const valtype& name, namesWithHistory)
-            if (nameHeightsData.count(name) == 0)
-                return error("%s : history entry for name '%s' not in main DB",
-                             __func__, ValtypeToString(name).c_str());
-    } else if (!namesWithHistory.empty ())
-        return error("%s : name_history entries in DB, but"
-                     " -namehistory not set", __func__);
+    CLevelDBBatch batch;
+    unsigned nBatch = 0;
+    CHashWriter hasher(SER_DISK, CLIENT_VERSION);
+    hasher << header;
 
-    LogPrintf("Checked name database, %u unexpired names, %u total.\n",
-              namesInDB.size(), nameHeightsData.size());
-    LogPrintf("Names with history: %u\n", namesWithHistory.size());
+    uint64_t nRecords = 0;
+    while (true) {
+        boost::this_thread::interruption_point();
+        std::string strKey;
+        file >> strKey;
+        hasher << strKey;
+        if (strKey.empty())
+            break;
+
+        std::string strValue;
+        file >> strValue;
+        hasher << strValue;
+
+        if (!CountSnapshotRecord(strKey[0], stats)) {
+            DiscardStagedSnapshot();
+            return error("%s: unexpected record type '%c' in snapshot", __func__, strKey[0]);
+        }
+        ++nRecords;
+
+        if (strKey[0] == DB_NAME_HISTORY && !fNameHistory)
+            continue;
+        batch.WriteRaw(strKey, strValue);
+        if (++nBatch >= SNAPSHOT_BATCH_RECORDS) {
+            pdbStaged->WriteBatch(batch);
+            batch.Clear();
+            nBatch = 0;
+        }
+    }
+    pdbStaged->WriteBatch(batch);
+
+    uint64_t nRecordsExpected;
+    file >> VARINT(nRecordsExpected);
+    hasher << VARINT(nRecordsExpected);
+    if (nRecords != nRecordsExpected) {
+        DiscardStagedSnapshot();
+        return error("%s: snapshot has %u records, expected %u", __func__,
+                     (unsigned)nRecords, (unsigned)nRecordsExpected);
+    }
+
+    uint256 hashChecksum;
+    file >> hashChecksum;
+    stats.hashChecksum = hasher.GetHash();
+    if (hashChecksum != stats.hashChecksum) {
+        DiscardStagedSnapshot();
+        return error("%s: snapshot checksum mismatch", __func__);
+    }
 
     return true;
 }
 
+bool CCoinsViewDB::ApplyStagedSnapshot(const CChainStateSnapshot& header) {
+    if (!pdbStaged)
+        return error("%s: no snapshot is staged", __func__);
+
+    /* Remove the current chain state first.  The best block goes first,
+       so that an interrupted load is not mistaken for a consistent
+       state.  */
+    CLevelDBBatch batch;
+    unsigned nBatch = 0;
+    batch.Erase(DB_BEST_BLOCK);
+    batch.Erase(DB_SET_INFO);
+    db.WriteBatch(batch);
+    batch.Clear();
+    batch.Erase(DB_BEST_BLOCK);
+    dbNames.WriteBatch(batch);
+    batch.Clear();
+
+    CLevelDBWrapper* const dbs[] = {&db, &dbNames};
+    for (unsigned i = 0; i < 2; ++i) {
+        boost::scoped_ptr<leveldb::Iterator> pcursor(dbs[i]->NewIterator());
+        CChainStateSnapshotStats dummy;
+        for (pcursor->SeekToFirst(); pcursor->Valid(); pcursor->Next()) {
+            boost::this_thread::interruption_point();
+            const leveldb::Slice slKey = pcursor->key();
+            if (slKey.empty() || !CountSnapshotRecord(slKey[0], dummy))
+                continue;
+            batch.EraseRaw(slKey);
+            if (++nBatch >= SNAPSHOT_BATCH_RECORDS) {
+                dbs[i]->WriteBatch(batch);
+                batch.Clear();
+                nBatch = 0;
+            }
+        }
+        HandleError(pcursor->status());
+        dbs[i]->WriteBatch(batch);
+        batch.Clear();
+        nBatch = 0;
+    }
+
+    /* Copy the verified records over.  */
+    CLevelDBBatch batchNames;
+    unsigned nBatchNames = 0;
+    boost::scoped_ptr<leveldb::Iterator> pcursor(pdbStaged->NewIterator());
+    for (pcursor->SeekToFirst(); pcursor->Valid(); pcursor->Next()) {
+        boost::this_thread::interruption_point();
+        const leveldb::Slice slKey = pcursor->key();
+        const leveldb::Slice slValue = pcursor->value();
+        if (IsNameRecord(slKey[0])) {
+            batchNames.WriteRaw(slKey, slValue);
+            if (++nBatchNames >= SNAPSHOT_BATCH_RECORDS) {
+                dbNames.WriteBatch(batchNames);
+                batchNames.Clear();
+                nBatchNames = 0;
+            }
+        } else {
+            batch.WriteRaw(slKey, slValue);
+            if (++nBatch >= SNAPSHOT_BATCH_RECORDS) {
+                db.WriteBatch(batch);
+                batch.Clear();
+                nBatch = 0;
+            }
+        }
+    }
+    HandleError(pcursor->status());
+
+    BatchWriteHashBestChain(batchNames, header.hashBlock);
+    dbNames.WriteBatch(batchNames, true);
+    BatchWriteHashBestChain(batch, header.hashBlock);
+    db.WriteBatch(batch, true);
+    return RecomputeSetInfo();
+}
+
+void CCoinsViewDB::DiscardStagedSnapshot() {
+    if (!pdbStaged)
+        return;
+    pdbStaged.reset();
+    if (!fMemory)
+        boost::filesystem::remove_all(GetStagedSnapshotPath());
+}
+
 void
 CNameCache::writeBatch (CLevelDBBatch& batch) const
 {
   for (EntryMap::const_iterator i = entries.begin ();
        i != entries.end (); ++i)
-    batch.Write (std::make_pair (DB_NAME, i->first), i->second);
+    batch.Write (std::make_pair (DB_NAME, i->first),
+                 CNameDataCompressor (REF (i->second)));
 
   for (std::set<valtype>::const_iterator i = deleted.begin ();
        i != deleted.end (); ++i)
@@ -482,7 +1474,8 @@ CNameCache::writeBatch (CLevelDBBatch& batch) const
     if (i->second.empty ())
       batch.Erase (std::make_pair (DB_NAME_HISTORY, i->first));
     else
-      batch.Write (std::make_pair (DB_NAME_HISTORY, i->first), i->second);
+      batch.Write (std::make_pair (DB_NAME_HISTORY, i->first),
+                   CNameHistoryCompressor (REF (i->second)));
 
   for (std::map<ExpireEntry, bool>::const_iterator i = expireIndex.begin ();
        i != expireIndex.end (); ++i)
@@ -515,6 +1508,78 @@ bool CBlockTreeDB::ReadFlag(const std::string &name, bool &fValue) {
     return true;
 }
 
+/* Number of block index entries that are deserialised (in parallel) at once
+   while loading the block index.  */
+static const size_t BLOCK_INDEX_LOAD_BATCH = 50000;
+
+/** Deserialise a range of block index records, for ParallelForRanges. */
+class DeserializeBlockIndexRange
+{
+private:
+    const std::vector<std::string>& vValues;
+    std::vector<CDiskBlockIndex>& vIndex;
+    std::vector<uint256>& vHash;
+    std::vector<char>& vError;
+
+public:
+    DeserializeBlockIndexRange(const std::vector<std::string>& vValuesIn, std::vector<CDiskBlockIndex>& vIndexIn,
+                               std::vector<uint256>& vHashIn, std::vector<char>& vErrorIn)
+        : vValues(vValuesIn), vIndex(vIndexIn), vHash(vHashIn), vError(vErrorIn) {}
+
+    void operator()(size_t nBegin, size_t nEnd) const {
+        for (size_t i = nBegin; i < nEnd; ++i) {
+            try {
+                CDataStream ssValue(vValues[i].data(), vValues[i].data() + vValues[i].size(), SER_DISK, CLIENT_VERSION);
+                ssValue >> vIndex[i];
+                vHash[i] = vIndex[i].GetBlockHash();
+            } catch (const std::exception&) {
+                vError[i] = 1;
+            }
+        }
+    }
+};
+
+/**
+ * Deserialise a batch of CDiskBlockIndex records in parallel, including
+ * the computation of their block hashes, and insert them into
+ * mapBlockIndex.
+ */
+static bool LoadBlockIndexBatch(const std::vector<std::string>& vValues)
+{
+    std::vector<CDiskBlockIndex> vIndex(vValues.size());
+    std::vector<uint256> vHash(vValues.size());
+    std::vector<char> vError(vValues.size(), 0);
+    ParallelForRanges(vValues.size(), DeserializeBlockIndexRange(vValues, vIndex, vHash, vError));
+
+    for (size_t i = 0; i < vValues.size(); ++i) {
+        if (vError[i])
+            return error("%s: Deserialize or I/O error", __func__);
+        const CDiskBlockIndex& diskindex = vIndex[i];
+
+        // Construct block index object
+        CBlockIndex* pindexNew = InsertBlockIndex(vHash[i]);
+        pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
+        pindexNew->nHeight        = diskindex.nHeight;
+        pindexNew->nFile          = diskindex.nFile;
+        pindexNew->nDataPos       = diskindex.nDataPos;
+        pindexNew->nUndoPos       = diskindex.nUndoPos;
+        pindexNew->nVersion       = diskindex.nVersion;
+        pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
+        pindexNew->nTime          = diskindex.nTime;
+        pindexNew->nBits          = diskindex.nBits;
+        pindexNew->nNonce         = diskindex.nNonce;
+        pindexNew->nStatus        = diskindex.nStatus;
+        pindexNew->nTx            = diskindex.nTx;
+
+        /* Bitcoin checks the PoW here.  We don't do this because
+           the CDiskBlockIndex does not contain the auxpow.
+           This check isn't important, since the data on disk should
+           already be valid and can be trusted.  */
+    }
+
+    return true;
+}
+
 bool CBlockTreeDB::LoadBlockIndexGuts()
 {
     boost::scoped_ptr<leveldb::Iterator> pcursor(NewIterator());
@@ -523,48 +1588,33 @@ bool CBlockTreeDB::LoadBlockIndexGuts()
     ssKeySet << make_pair(DB_BLOCK_INDEX, uint256());
     pcursor->Seek(ssKeySet.str());
 
-    // Load mapBlockIndex
-    while (pcursor->Valid()) {
+    /* The raw records are read sequentially and deserialised in batches.
+       Since the keys are block hashes, which are uniformly distributed,
+       the position of the key gives the progress.  */
+    std::vector<std::string> vValues;
+    vValues.reserve(BLOCK_INDEX_LOAD_BATCH);
+    int nLastProgress = -1;
+    for (; pcursor->Valid(); pcursor->Next()) {
         boost::this_thread::interruption_point();
-        try {
-            leveldb::Slice slKey = pcursor->key();
-            CDataStream ssKey(slKey.data(), slKey.data()+slKey.size(), SER_DISK, CLIENT_VERSION);
-            char chType;
-            ssKey >> chType;
-            if (chType == DB_BLOCK_INDEX) {
-                leveldb::Slice slValue = pcursor->value();
-                CDataStream ssValue(slValue.data(), slValue.data()+slValue.size(), SER_DISK, CLIENT_VERSION);
-                CDiskBlockIndex diskindex;
-                ssValue >> diskindex;
-
-                // Construct block index object
-                CBlockIndex* pindexNew = InsertBlockIndex(diskindex.GetBlockHash());
-                pindexNew->pprev          = InsertBlockIndex(diskindex.hashPrev);
-                pindexNew->nHeight        = diskindex.nHeight;
-                pindexNew->nFile          = diskindex.nFile;
-                pindexNew->nDataPos       = diskindex.nDataPos;
-                pindexNew->nUndoPos       = diskindex.nUndoPos;
-                pindexNew->nVersion       = diskindex.nVersion;
-                pindexNew->hashMerkleRoot = diskindex.hashMerkleRoot;
-                pindexNew->nTime          = diskindex.nTime;
-                pindexNew->nBits          = diskindex.nBits;
-                pindexNew->nNonce         = diskindex.nNonce;
-                pindexNew->nStatus        = diskindex.nStatus;
-                pindexNew->nTx            = diskindex.nTx;
-
-                /* Bitcoin checks the PoW here.  We don't do this because
-                   the CDiskBlockIndex does not contain the auxpow.
-                   This check isn't important, since the data on disk should
-                   already be valid and can be trusted.  */
-
-                pcursor->Next();
-            } else {
-                break; // if shutdown requested or finished loading block index
-            }
-        } catch (const std::exception& e) {
-            return error("%s: Deserialize or I/O error - %s", __func__, e.what());
+        const leveldb::Slice slKey = pcursor->key();
+        if (slKey.size() < 3 || slKey[0] != DB_BLOCK_INDEX)
+            break; // finished loading block index
+
+        const leveldb::Slice slValue = pcursor->value();
+        vValues.push_back(std::string(slValue.data(), slValue.size()));
+        if (vValues.size() >= BLOCK_INDEX_LOAD_BATCH) {
+            if (!LoadBlockIndexBatch(vValues))
+                return false;
+            vValues.clear();
+        }
+
+        const int nProgress = (((unsigned char)slKey[1] << 8) | (unsigned char)slKey[2]) * 100 / 0x10000;
+        if (nProgress != nLastProgress) {
+            uiInterface.InitMessage(strprintf("%s (%d%%)", _("Loading block index..."), nProgress));
+            nLastProgress = nProgress;
         }
     }
+    HandleError(pcursor->status());
 
-    return true;
+    return LoadBlockIndexBatch(vValues);
 }
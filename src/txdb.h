@@ -7,17 +7,26 @@
 #define BITCOIN_TXDB_H
 
 #include "coins.h"
+#include "crypto/muhash.h"
 #include "leveldbwrapper.h"
+#include "protocol.h"
+#include "serialize.h"
+#include "uint256.h"
 
 #include <map>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include <boost/scoped_ptr.hpp>
+#include <boost/thread/condition_variable.hpp>
+#include <boost/thread/mutex.hpp>
+#include <boost/thread/thread.hpp>
+
+class CAutoFile;
 class CBlockFileInfo;
 class CBlockIndex;
 struct CDiskTxPos;
-class uint256;
 
 //! -dbcache default (MiB)
 static const int64_t nDefaultDbCache = 100;
@@ -25,14 +34,169 @@ static const int64_t nDefaultDbCache = 100;
 static const int64_t nMaxDbCache = sizeof(void*) > 4 ? 16384 : 1024;
 //! min. -dbcache in (MiB)
 static const int64_t nMinDbCache = 4;
+//! -namedbcache default (MiB)
+static const int64_t nDefaultNameDbCache = 16;
+//! -asyncflush default
+static const bool DEFAULT_ASYNC_FLUSH = false;
+
+/**
+ * Header of a chain state snapshot, as written by dumptxoutset.  It ties
+ * the coin and name database records that follow it to a block, and holds
+ * the transaction counts of the chain up to that block so that a node
+ * loading the snapshot can link its block index without the block data.
+ */
+class CChainStateSnapshot
+{
+public:
+    //! Version 2 has the name records in the compact encoding
+    static const int CURRENT_VERSION = 2;
+
+    int nVersion;
+    CMessageHeader::MessageStartChars pchMessageStart;
+    uint256 hashBlock;
+    //! Whether the name history records are included.
+    bool fNameHistory;
+    //! Number of transactions of each block from height 1 to hashBlock.
+    std::vector<unsigned int> vTxCount;
+
+    CChainStateSnapshot()
+    {
+        SetNull();
+    }
+
+    void SetNull()
+    {
+        nVersion = CURRENT_VERSION;
+        memset(pchMessageStart, 0, sizeof(pchMessageStart));
+        hashBlock.SetNull();
+        fNameHistory = false;
+        vTxCount.clear();
+    }
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(this->nVersion);
+        READWRITE(FLATDATA(pchMessageStart));
+        READWRITE(hashBlock);
+        READWRITE(fNameHistory);
+
+        uint64_t nBlocks = vTxCount.size();
+        READWRITE(VARINT(nBlocks));
+        if (ser_action.ForRead()) {
+            if (nBlocks > MAX_SIZE)
+                throw std::ios_base::failure("CChainStateSnapshot: too many blocks");
+            vTxCount.resize(nBlocks);
+        }
+        for (uint64_t i = 0; i < nBlocks; ++i)
+            READWRITE(VARINT(vTxCount[i]));
+    }
+};
+
+/** Record counts and checksum of a chain state snapshot. */
+struct CChainStateSnapshotStats
+{
+    uint64_t nCoins;
+    uint64_t nNames;
+    uint64_t nNameHistory;
+    uint64_t nNameExpiry;
+    uint256 hashChecksum;
+
+    CChainStateSnapshotStats() : nCoins(0), nNames(0), nNameHistory(0), nNameExpiry(0) {}
+};
+
+/**
+ * Statistics and set hashes of the coins and the names in the coin
+ * database.  They are updated with each BatchWrite and stored along with
+ * the data, so that they can be queried without a scan of the database.
+ */
+class CChainStateSetInfo
+{
+public:
+    uint64_t nTransactions;
+    uint64_t nTransactionOutputs;
+    uint64_t nSerializedSize;
+    CAmount nTotalAmount;
+    MuHash3072 hashCoins;
+
+    uint64_t nNames;
+    MuHash3072 hashNames;
+
+    CChainStateSetInfo() : nTransactions(0), nTransactionOutputs(0), nSerializedSize(0), nTotalAmount(0), nNames(0) {}
+
+    void AddCoins(const CCoinsSetElement& element);
+    void RemoveCoins(const CCoinsSetElement& element);
+    //! Add or remove a name given by its NameSetElementHash
+    void AddName(const uint256& hashElement);
+    void RemoveName(const uint256& hashElement);
+
+    ADD_SERIALIZE_METHODS;
+
+    template <typename Stream, typename Operation>
+    inline void SerializationOp(Stream& s, Operation ser_action, int nType, int nVersion) {
+        READWRITE(VARINT(nTransactions));
+        READWRITE(VARINT(nTransactionOutputs));
+        READWRITE(VARINT(nSerializedSize));
+        READWRITE(nTotalAmount);
+        READWRITE(hashCoins);
+        READWRITE(VARINT(nNames));
+        READWRITE(hashNames);
+    }
+};
+
+/** Statistics about the name database, as returned by name_setinfo. */
+struct CNameSetStats
+{
+    int nHeight;
+    uint256 hashBlock;
+    uint64_t nNames;
+    uint256 hashMuHash;
 
-/** CCoinsView backed by the LevelDB coin database (chainstate/) */
+    CNameSetStats() : nHeight(0), nNames(0) {}
+};
+
+/** Consistent views of the coin and the name database, see DumpSnapshot. */
+class CChainStateDBSnapshot
+{
+public:
+    CLevelDBSnapshot coins;
+    CLevelDBSnapshot names;
+
+    CChainStateDBSnapshot(const CLevelDBWrapper& dbCoins, const CLevelDBWrapper& dbNames)
+        : coins(dbCoins), names(dbNames) {}
+};
+
+/**
+ * CCoinsView backed by the LevelDB coin database (chainstate/) and the
+ * name database (chainstate/names/).  The name database has its own
+ * best block, which is written before the one of the coin database.
+ */
 class CCoinsViewDB : public CCoinsView
 {
 protected:
     CLevelDBWrapper db;
+    CLevelDBWrapper dbNames;
+    CChainStateSetInfo setInfo;
+    bool fMemory;
+    //! Verified snapshot records waiting for ApplyStagedSnapshot
+    boost::scoped_ptr<CLevelDBWrapper> pdbStaged;
+
+    //! Move name records left in the coin database by older versions
+    void MigrateNameRecords();
+    //! Convert name records of older versions to the compact encoding
+    void UpgradeNameRecords();
+    //! Compute setInfo from scratch and store it in the database
+    bool RecomputeSetInfo();
+    //! Apply name changes stored in the coin database to the name database
+    bool WritePendingNames(const uint256& hashBlock, const CNameCache& names);
+    //! Complete a name database write that was interrupted
+    void ReplayPendingNames();
+    //! Take the version of a changed name in the database out of info
+    void RemoveOldName(const CNameCache& names, const valtype& name, CChainStateSetInfo& info) const;
 public:
-    CCoinsViewDB(size_t nCacheSize, bool fMemory = false, bool fWipe = false);
+    CCoinsViewDB(size_t nCacheSize, size_t nNameCacheSize, bool fMemoryIn = false, bool fWipe = false);
+    ~CCoinsViewDB();
 
     bool GetCoins(const uint256 &txid, CCoins &coins) const;
     bool HaveCoins(const uint256 &txid) const;
@@ -43,7 +207,117 @@ public:
     CNameIterator* IterateNames() const;
     bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock, const CNameCache &names);
     bool GetStats(CCoinsStats &stats) const;
+    //! Like GetStats, but hash the serialised database content (slow)
+    bool GetStatsSerialized(CCoinsStats &stats) const;
+    bool GetNameStats(CNameSetStats &stats) const;
+    //! Check a snapshot of the databases at the best block (needs cs_main)
     bool ValidateNameDB() const;
+    /**
+     * Check that the name database of snapshot matches its coins, given
+     * the height of its best block.  The key ranges are checked in
+     * parallel and without cs_main, which is not needed for a snapshot.
+     */
+    static bool ValidateNameDB(const CChainStateDBSnapshot& snapshot, unsigned nHeight);
+    //! Check that the name database is at the best block of the coin database
+    bool IsNameDBConsistent() const;
+
+    //! Take a consistent view of the databases for DumpSnapshot (caller owns it)
+    CChainStateDBSnapshot* GetSnapshot() const;
+    /**
+     * Stream the coin and name records of a database snapshot to a file,
+     * preceded by header and followed by a checksum.  header.hashBlock
+     * must match the best block of the snapshot.
+     */
+    bool DumpSnapshot(const CChainStateDBSnapshot& snapshot, const CChainStateSnapshot& header,
+                      CAutoFile& file, CChainStateSnapshotStats& stats) const;
+    /**
+     * Read the records following header from a snapshot file into a
+     * scratch database and verify the record count and checksum.  The
+     * chain state is not touched; nothing is kept if verification fails.
+     */
+    bool StageSnapshot(CAutoFile& file, const CChainStateSnapshot& header,
+                       CChainStateSnapshotStats& stats);
+    /**
+     * Replace the coin and name records by the staged snapshot and set
+     * the best block to header.hashBlock.  Only I/O errors can make this
+     * fail, since the records have been verified by StageSnapshot.
+     */
+    bool ApplyStagedSnapshot(const CChainStateSnapshot& header);
+    //! Drop the scratch database of StageSnapshot, if any
+    void DiscardStagedSnapshot();
+};
+
+/**
+ * Read-only CCoinsView of the databases as captured by a
+ * CChainStateDBSnapshot, for work that needs a fixed chain state while
+ * the node goes on writing (-asyncverify).  Takes ownership of the
+ * snapshot.
+ */
+class CCoinsViewDBSnapshot : public CCoinsView
+{
+private:
+    boost::scoped_ptr<CChainStateDBSnapshot> snapshot;
+
+public:
+    CCoinsViewDBSnapshot(CChainStateDBSnapshot* snapshotIn);
+
+    bool GetCoins(const uint256 &txid, CCoins &coins) const;
+    bool HaveCoins(const uint256 &txid) const;
+    uint256 GetBestBlock() const;
+    bool GetName(const valtype &name, CNameData &data) const;
+    bool GetNameHistory(const valtype &name, CNameHistory &data) const;
+    bool GetNamesForHeight(unsigned nHeight, std::set<valtype>& names) const;
+    CNameIterator* IterateNames() const;
+};
+
+/**
+ * CCoinsView that writes the changes passed to BatchWrite to its base in
+ * a background thread (-asyncflush).  The frozen changes are served from
+ * memory until the write is done, so that the flushed cache can go on
+ * empty right away.  Only one write is in flight at a time, and the base
+ * writes the best block together with the changes, so that the database
+ * on disk is always at some flushed block.
+ */
+class CCoinsViewAsyncWriter : public CCoinsViewBacked
+{
+private:
+    //! Protects the members below
+    mutable boost::mutex cs;
+    mutable boost::condition_variable cond;
+
+    //! The changes being written; not modified until the write is done
+    CCoinsMap mapPending;
+    uint256 hashPending;
+    CNameCache namesPending;
+    bool fPending;
+    //! Set when a background write has failed
+    bool fFailed;
+    bool fStop;
+
+    boost::thread thread;
+
+    void ThreadWrite();
+    //! Wait until no write is in flight (or one has failed)
+    void WaitPending(boost::unique_lock<boost::mutex>& lock) const;
+
+public:
+    CCoinsViewAsyncWriter(CCoinsView* viewIn);
+    ~CCoinsViewAsyncWriter();
+
+    bool GetCoins(const uint256 &txid, CCoins &coins) const;
+    bool HaveCoins(const uint256 &txid) const;
+    uint256 GetBestBlock() const;
+    bool GetName(const valtype &name, CNameData &data) const;
+    bool GetNameHistory(const valtype &name, CNameHistory &data) const;
+    bool GetNamesForHeight(unsigned nHeight, std::set<valtype>& names) const;
+    CNameIterator* IterateNames() const;
+    //! Hand the dirty entries to the background thread and return
+    bool BatchWrite(CCoinsMap &mapCoins, const uint256 &hashBlock, const CNameCache &names);
+    bool GetStats(CCoinsStats &stats) const;
+    bool ValidateNameDB() const;
+
+    //! Wait for the write in flight; returns false if a write has failed
+    bool Sync();
 };
 
 /** Access to the block database (blocks/index/) */
@@ -8,6 +8,7 @@
 #include "clientversion.h"
 #include "consensus/consensus.h"
 #include "consensus/validation.h"
+#include "core_memusage.h"
 #include "main.h"
 #include "policy/fees.h"
 #include "streams.h"
@@ -15,10 +16,15 @@
 #include "utilmoneystr.h"
 #include "version.h"
 
+#include <math.h>
+
 using namespace std;
 
 CTxMemPoolEntry::CTxMemPoolEntry():
-    nFee(0), nTxSize(0), nModSize(0), nTime(0), dPriority(0.0), hadNoDependencies(false),
+    nFee(0), nTxSize(0), nModSize(0), nUsageSize(0), nTime(0), dPriority(0.0),
+    hadNoDependencies(false), feeDelta(0), nSequence(0),
+    nCountWithDescendants(0), nSizeWithDescendants(0), nModFeesWithDescendants(0),
+    nCountWithAncestors(0), nSizeWithAncestors(0), nModFeesWithAncestors(0),
     nameOp()
 {
     nHeight = MEMPOOL_HEIGHT;
@@ -28,11 +34,13 @@ CTxMemPoolEntry::CTxMemPoolEntry(const CTransaction& _tx, const CAmount& _nFee,
                                  int64_t _nTime, double _dPriority,
                                  unsigned int _nHeight, bool poolHasNoInputsOf):
     tx(_tx), nFee(_nFee), nTime(_nTime), dPriority(_dPriority), nHeight(_nHeight),
-    hadNoDependencies(poolHasNoInputsOf),
+    hadNoDependencies(poolHasNoInputsOf), feeDelta(0), nSequence(0),
     nameOp()
 {
     nTxSize = ::GetSerializeSize(tx, SER_NETWORK, PROTOCOL_VERSION);
     nModSize = tx.CalculateModifiedSize(nTxSize);
+    nUsageSize = RecursiveDynamicUsage(tx);
+    ResetAggregateState();
 
     if (tx.IsNamecoin())
     {
@@ -64,8 +72,45 @@ CTxMemPoolEntry::GetPriority(unsigned int currentHeight) const
     return dResult;
 }
 
+void CTxMemPoolEntry::UpdateDescendantState(int64_t modifySize, CAmount modifyFee, int64_t modifyCount)
+{
+    nSizeWithDescendants += modifySize;
+    assert(int64_t(nSizeWithDescendants) > 0);
+    nModFeesWithDescendants += modifyFee;
+    nCountWithDescendants += modifyCount;
+    assert(int64_t(nCountWithDescendants) > 0);
+}
+
+void CTxMemPoolEntry::UpdateAncestorState(int64_t modifySize, CAmount modifyFee, int64_t modifyCount)
+{
+    nSizeWithAncestors += modifySize;
+    assert(int64_t(nSizeWithAncestors) > 0);
+    nModFeesWithAncestors += modifyFee;
+    nCountWithAncestors += modifyCount;
+    assert(int64_t(nCountWithAncestors) > 0);
+}
+
+void CTxMemPoolEntry::ResetAggregateState()
+{
+    nCountWithDescendants = 1;
+    nSizeWithDescendants = nTxSize;
+    nModFeesWithDescendants = GetModifiedFee();
+    nCountWithAncestors = 1;
+    nSizeWithAncestors = nTxSize;
+    nModFeesWithAncestors = GetModifiedFee();
+}
+
+void CTxMemPoolEntry::UpdateFeeDelta(CAmount newFeeDelta)
+{
+    nModFeesWithDescendants += newFeeDelta - feeDelta;
+    nModFeesWithAncestors += newFeeDelta - feeDelta;
+    feeDelta = newFeeDelta;
+}
+
 CTxMemPool::CTxMemPool(const CFeeRate& _minRelayFee) :
-    nTransactionsUpdated(0),
+    nTransactionsUpdated(0), nSequenceNext(0), nDeltasUpdated(0), totalTxSize(0), cachedInnerUsage(0),
+    minReasonableRelayFee(_minRelayFee), lastRollingFeeUpdate(GetTime()),
+    blockSinceLastRollingFeeBump(false), rollingMinimumFeeRate(0),
     names(*this), fCheckInputs(true)
 {
     // Sanity checks off by default for performance, because otherwise
@@ -106,6 +151,110 @@ void CTxMemPool::AddTransactionsUpdated(unsigned int n)
     nTransactionsUpdated += n;
 }
 
+uint64_t CTxMemPool::GetSequence() const
+{
+    LOCK(cs);
+    return nSequenceNext;
+}
+
+unsigned int CTxMemPool::GetDeltasUpdated() const
+{
+    LOCK(cs);
+    return nDeltasUpdated;
+}
+
+const CTxMemPool::setEntries& CTxMemPool::GetMemPoolParents(txiter entry) const
+{
+    assert(entry != mapTx.end());
+    txlinksMap::const_iterator it = mapLinks.find(entry);
+    assert(it != mapLinks.end());
+    return it->second.parents;
+}
+
+const CTxMemPool::setEntries& CTxMemPool::GetMemPoolChildren(txiter entry) const
+{
+    assert(entry != mapTx.end());
+    txlinksMap::const_iterator it = mapLinks.find(entry);
+    assert(it != mapLinks.end());
+    return it->second.children;
+}
+
+void CTxMemPool::UpdateLink(txiter entry, txiter other, bool fChild, bool add)
+{
+    setEntries& s = fChild ? mapLinks[entry].children : mapLinks[entry].parents;
+    const size_t nIncrement = memusage::IncrementalDynamicUsage(s);
+    if (add) {
+        if (s.insert(other).second)
+            cachedInnerUsage += nIncrement;
+    } else {
+        if (s.erase(other))
+            cachedInnerUsage -= nIncrement;
+    }
+}
+
+void CTxMemPool::CalculateMemPoolAncestors(txiter entry, setEntries& setAncestors) const
+{
+    const setEntries& parents = GetMemPoolParents(entry);
+    std::vector<txiter> stage(parents.begin(), parents.end());
+
+    while (!stage.empty()) {
+        const txiter it = stage.back();
+        stage.pop_back();
+        if (!setAncestors.insert(it).second)
+            continue;
+
+        const setEntries& setParents = GetMemPoolParents(it);
+        stage.insert(stage.end(), setParents.begin(), setParents.end());
+    }
+}
+
+void CTxMemPool::CalculateDescendants(txiter entry, setEntries& setDescendants) const
+{
+    std::vector<txiter> stage;
+    if (setDescendants.count(entry) == 0)
+        stage.push_back(entry);
+
+    while (!stage.empty()) {
+        const txiter it = stage.back();
+        stage.pop_back();
+        if (!setDescendants.insert(it).second)
+            continue;
+
+        const setEntries& setChildren = GetMemPoolChildren(it);
+        BOOST_FOREACH(const txiter& childit, setChildren) {
+            if (setDescendants.count(childit) == 0)
+                stage.push_back(childit);
+        }
+    }
+}
+
+void CTxMemPool::RecomputeAggregateState(const setEntries& entries)
+{
+    BOOST_FOREACH(const txiter& it, entries) {
+        setEntries setAncestors;
+        CalculateMemPoolAncestors(it, setAncestors);
+        int64_t nSize = 0;
+        CAmount nFees = 0;
+        BOOST_FOREACH(const txiter& ancit, setAncestors) {
+            nSize += ancit->GetTxSize();
+            nFees += ancit->GetModifiedFee();
+        }
+
+        setEntries setDescendants;
+        CalculateDescendants(it, setDescendants);
+        setDescendants.erase(it);
+        int64_t nDescSize = 0;
+        CAmount nDescFees = 0;
+        BOOST_FOREACH(const txiter& descit, setDescendants) {
+            nDescSize += descit->GetTxSize();
+            nDescFees += descit->GetModifiedFee();
+        }
+
+        mapTx.modify(it, reset_aggregate_state());
+        mapTx.modify(it, update_ancestor_state(nSize, nFees, setAncestors.size()));
+        mapTx.modify(it, update_descendant_state(nDescSize, nDescFees, setDescendants.size()));
+    }
+}
 
 bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry, bool fCurrentEstimate)
 {
@@ -113,10 +262,59 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry,
     // Used by main.cpp AcceptToMemoryPool(), which DOES do
     // all the appropriate checks.
     LOCK(cs);
-    mapTx[hash] = entry;
-    const CTransaction& tx = mapTx[hash].GetTx();
-    for (unsigned int i = 0; i < tx.vin.size(); i++)
+    txiter newit = mapTx.insert(entry).first;
+    mapTx.modify(newit, update_sequence(nSequenceNext++));
+    mapLinks.insert(std::make_pair(newit, TxLinks()));
+
+    // Update the entry for any fee delta created by PrioritiseTransaction.
+    std::map<uint256, std::pair<double, CAmount> >::const_iterator pos = mapDeltas.find(hash);
+    if (pos != mapDeltas.end() && pos->second.second != 0)
+        mapTx.modify(newit, update_fee_delta(pos->second.second));
+
+    cachedInnerUsage += entry.DynamicMemoryUsage();
+
+    // Link to in-mempool parents.
+    const CTransaction& tx = newit->GetTx();
+    for (unsigned int i = 0; i < tx.vin.size(); i++) {
         mapNextTx[tx.vin[i].prevout] = CInPoint(&tx, i);
+        const txiter parentit = mapTx.find(tx.vin[i].prevout.hash);
+        if (parentit != mapTx.end()) {
+            UpdateLink(newit, parentit, false, true);
+            UpdateLink(parentit, newit, true, true);
+        }
+    }
+
+    // Link to in-mempool children.  This only happens when a transaction
+    // from a disconnected block is put back while its spenders stayed.
+    bool fHaveChildren = false;
+    std::map<COutPoint, CInPoint>::const_iterator nextit = mapNextTx.lower_bound(COutPoint(hash, 0));
+    for (; nextit != mapNextTx.end() && nextit->first.hash == hash; ++nextit) {
+        const txiter childit = mapTx.find(nextit->second.ptx->GetHash());
+        assert(childit != mapTx.end());
+        UpdateLink(newit, childit, true, true);
+        UpdateLink(childit, newit, false, true);
+        fHaveChildren = true;
+    }
+
+    setEntries setAncestors;
+    CalculateMemPoolAncestors(newit, setAncestors);
+    if (!fHaveChildren) {
+        int64_t nSize = 0;
+        CAmount nFees = 0;
+        BOOST_FOREACH(const txiter& ancit, setAncestors) {
+            mapTx.modify(ancit, update_descendant_state(newit->GetTxSize(), newit->GetModifiedFee(), 1));
+            nSize += ancit->GetTxSize();
+            nFees += ancit->GetModifiedFee();
+        }
+        mapTx.modify(newit, update_ancestor_state(nSize, nFees, setAncestors.size()));
+    } else {
+        // The new entry connects existing packages; recompute everything
+        // that is affected rather than trying to avoid double counting.
+        setEntries setAffected = setAncestors;
+        CalculateDescendants(newit, setAffected);
+        RecomputeAggregateState(setAffected);
+    }
+
     nTransactionsUpdated++;
     totalTxSize += entry.GetTxSize();
     minerPolicyEstimator->processTransaction(entry, fCurrentEstimate);
@@ -124,52 +322,94 @@ bool CTxMemPool::addUnchecked(const uint256& hash, const CTxMemPoolEntry &entry,
     return true;
 }
 
+void CTxMemPool::removeUnchecked(const setEntries& stage, std::list<CTransaction>& removed)
+{
+    AssertLockHeld(cs);
+
+    // Update the statistics of entries that stay in the pool while all
+    // links are still intact.
+    BOOST_FOREACH(const txiter& it, stage) {
+        const int64_t nSize = it->GetTxSize();
+        const CAmount nFee = it->GetModifiedFee();
+
+        setEntries setAncestors;
+        CalculateMemPoolAncestors(it, setAncestors);
+        BOOST_FOREACH(const txiter& ancit, setAncestors)
+            if (stage.count(ancit) == 0)
+                mapTx.modify(ancit, update_descendant_state(-nSize, -nFee, -1));
+
+        setEntries setDescendants;
+        CalculateDescendants(it, setDescendants);
+        BOOST_FOREACH(const txiter& descit, setDescendants)
+            if (stage.count(descit) == 0)
+                mapTx.modify(descit, update_ancestor_state(-nSize, -nFee, -1));
+    }
+
+    // Unlink from parents and children.
+    BOOST_FOREACH(const txiter& it, stage) {
+        const TxLinks& links = mapLinks[it];
+        BOOST_FOREACH(const txiter& parentit, links.parents)
+            UpdateLink(parentit, it, true, false);
+        BOOST_FOREACH(const txiter& childit, links.children)
+            UpdateLink(childit, it, false, false);
+    }
+
+    BOOST_FOREACH(const txiter& it, stage) {
+        const uint256 hash = it->GetTx().GetHash();
+        BOOST_FOREACH(const CTxIn& txin, it->GetTx().vin)
+            mapNextTx.erase(txin.prevout);
+
+        removed.push_back(it->GetTx());
+        totalTxSize -= it->GetTxSize();
+
+        const txlinksMap::iterator linksit = mapLinks.find(it);
+        assert(linksit != mapLinks.end());
+        cachedInnerUsage -= it->DynamicMemoryUsage();
+        cachedInnerUsage -= memusage::DynamicUsage(linksit->second.parents)
+                            + memusage::DynamicUsage(linksit->second.children);
+        mapLinks.erase(linksit);
+
+        names.remove (*it);
+        mapTx.erase(it);
+        nTransactionsUpdated++;
+        minerPolicyEstimator->removeTx(hash);
+    }
+}
 
 void CTxMemPool::remove(const CTransaction &origTx, std::list<CTransaction>& removed, bool fRecursive)
 {
     // Remove transaction from memory pool
     {
         LOCK(cs);
-        std::deque<uint256> txToRemove;
-        txToRemove.push_back(origTx.GetHash());
-        if (fRecursive && !mapTx.count(origTx.GetHash())) {
+        const uint256 origHash = origTx.GetHash();
+        setEntries txToRemove;
+        const txiter origit = mapTx.find(origHash);
+        if (origit != mapTx.end()) {
+            txToRemove.insert(origit);
+        } else if (fRecursive) {
             // If recursively removing but origTx isn't in the mempool
             // be sure to remove any children that are in the pool. This can
             // happen during chain re-orgs if origTx isn't re-accepted into
             // the mempool for any reason.
             for (unsigned int i = 0; i < origTx.vout.size(); i++) {
-                std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(origTx.GetHash(), i));
+                std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(origHash, i));
                 if (it == mapNextTx.end())
                     continue;
-                txToRemove.push_back(it->second.ptx->GetHash());
+                const txiter nextit = mapTx.find(it->second.ptx->GetHash());
+                assert(nextit != mapTx.end());
+                txToRemove.insert(nextit);
             }
         }
-        while (!txToRemove.empty())
-        {
-            uint256 hash = txToRemove.front();
-            txToRemove.pop_front();
-            if (!mapTx.count(hash))
-                continue;
-            const CTransaction& tx = mapTx[hash].GetTx();
-            if (fRecursive) {
-                for (unsigned int i = 0; i < tx.vout.size(); i++) {
-                    std::map<COutPoint, CInPoint>::iterator it = mapNextTx.find(COutPoint(hash, i));
-                    if (it == mapNextTx.end())
-                        continue;
-                    txToRemove.push_back(it->second.ptx->GetHash());
-                }
-            }
-            BOOST_FOREACH(const CTxIn& txin, tx.vin)
-                mapNextTx.erase(txin.prevout);
-
-            removed.push_back(tx);
-            totalTxSize -= mapTx[hash].GetTxSize();
 
-            names.remove (mapTx[hash]);
-            mapTx.erase(hash);
-            nTransactionsUpdated++;
-            minerPolicyEstimator->removeTx(hash);
+        setEntries setAllRemoves;
+        if (fRecursive) {
+            BOOST_FOREACH(const txiter& it, txToRemove)
+                CalculateDescendants(it, setAllRemoves);
+        } else {
+            setAllRemoves.swap(txToRemove);
         }
+
+        removeUnchecked(setAllRemoves, removed);
     }
 }
 
@@ -178,10 +418,10 @@ void CTxMemPool::removeCoinbaseSpends(const CCoinsViewCache *pcoins, unsigned in
     // Remove transactions spending a coinbase which are now immature
     LOCK(cs);
     list<CTransaction> transactionsToRemove;
-    for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
-        const CTransaction& tx = it->second.GetTx();
+    for (indexed_transaction_set::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
+        const CTransaction& tx = it->GetTx();
         BOOST_FOREACH(const CTxIn& txin, tx.vin) {
-            std::map<uint256, CTxMemPoolEntry>::const_iterator it2 = mapTx.find(txin.prevout.hash);
+            indexed_transaction_set::const_iterator it2 = mapTx.find(txin.prevout.hash);
             if (it2 != mapTx.end())
                 continue;
             const CCoins *coins = pcoins->AccessCoins(txin.prevout.hash);
@@ -228,9 +468,9 @@ void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, unsigned i
     std::vector<CTxMemPoolEntry> entries;
     BOOST_FOREACH(const CTransaction& tx, vtx)
     {
-        uint256 hash = tx.GetHash();
-        if (mapTx.count(hash))
-            entries.push_back(mapTx[hash]);
+        indexed_transaction_set::const_iterator i = mapTx.find(tx.GetHash());
+        if (i != mapTx.end())
+            entries.push_back(*i);
     }
     BOOST_FOREACH(const CTransaction& tx, vtx)
     {
@@ -241,15 +481,22 @@ void CTxMemPool::removeForBlock(const std::vector<CTransaction>& vtx, unsigned i
     }
     // After the txs in the new block have been removed from the mempool, update policy estimates
     minerPolicyEstimator->processBlock(nBlockHeight, entries, fCurrentEstimate);
+    lastRollingFeeUpdate = GetTime();
+    blockSinceLastRollingFeeBump = true;
 }
 
 void CTxMemPool::clear()
 {
     LOCK(cs);
+    mapLinks.clear();
     mapTx.clear();
     mapNextTx.clear();
     names.clear();
     totalTxSize = 0;
+    cachedInnerUsage = 0;
+    lastRollingFeeUpdate = GetTime();
+    blockSinceLastRollingFeeBump = false;
+    rollingMinimumFeeRate = 0;
     ++nTransactionsUpdated;
 }
 
@@ -261,23 +508,31 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
     LogPrint("mempool", "Checking mempool with %u transactions and %u inputs\n", (unsigned int)mapTx.size(), (unsigned int)mapNextTx.size());
 
     uint64_t checkTotal = 0;
+    uint64_t innerUsage = 0;
 
     CCoinsViewCache mempoolDuplicate(const_cast<CCoinsViewCache*>(pcoins));
 
     LOCK(cs);
     list<const CTxMemPoolEntry*> waitingOnDependants;
-    for (std::map<uint256, CTxMemPoolEntry>::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
+    for (indexed_transaction_set::const_iterator it = mapTx.begin(); it != mapTx.end(); it++) {
         unsigned int i = 0;
-        checkTotal += it->second.GetTxSize();
-        const CTransaction& tx = it->second.GetTx();
+        checkTotal += it->GetTxSize();
+        innerUsage += it->DynamicMemoryUsage();
+        const CTransaction& tx = it->GetTx();
+        txlinksMap::const_iterator linksit = mapLinks.find(it);
+        assert(linksit != mapLinks.end());
+        const TxLinks& links = linksit->second;
+        innerUsage += memusage::DynamicUsage(links.parents) + memusage::DynamicUsage(links.children);
         bool fDependsWait = false;
+        setEntries setParentCheck;
         BOOST_FOREACH(const CTxIn &txin, tx.vin) {
             // Check that every mempool transaction's inputs refer to available coins, or other mempool tx's.
-            std::map<uint256, CTxMemPoolEntry>::const_iterator it2 = mapTx.find(txin.prevout.hash);
+            indexed_transaction_set::const_iterator it2 = mapTx.find(txin.prevout.hash);
             if (it2 != mapTx.end()) {
-                const CTransaction& tx2 = it2->second.GetTx();
+                const CTransaction& tx2 = it2->GetTx();
                 assert(tx2.vout.size() > txin.prevout.n && !tx2.vout[txin.prevout.n].IsNull());
                 fDependsWait = true;
+                setParentCheck.insert(it2);
             } else {
                 const CCoins* coins = pcoins->AccessCoins(txin.prevout.hash);
                 assert(coins && coins->IsAvailable(txin.prevout.n));
@@ -289,8 +544,45 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
             assert(it3->second.n == i);
             i++;
         }
+        assert(setParentCheck == links.parents);
+
+        // Check children against mapNextTx.
+        setEntries setChildrenCheck;
+        std::map<COutPoint, CInPoint>::const_iterator iter = mapNextTx.lower_bound(COutPoint(tx.GetHash(), 0));
+        for (; iter != mapNextTx.end() && iter->first.hash == tx.GetHash(); ++iter) {
+            indexed_transaction_set::const_iterator childit = mapTx.find(iter->second.ptx->GetHash());
+            assert(childit != mapTx.end());
+            setChildrenCheck.insert(childit);
+        }
+        assert(setChildrenCheck == links.children);
+
+        // Check the aggregate statistics.
+        setEntries setAncestors;
+        CalculateMemPoolAncestors(it, setAncestors);
+        uint64_t nSizeCheck = it->GetTxSize();
+        CAmount nFeesCheck = it->GetModifiedFee();
+        BOOST_FOREACH(const txiter& ancit, setAncestors) {
+            nSizeCheck += ancit->GetTxSize();
+            nFeesCheck += ancit->GetModifiedFee();
+        }
+        assert(it->GetCountWithAncestors() == setAncestors.size() + 1);
+        assert(it->GetSizeWithAncestors() == nSizeCheck);
+        assert(it->GetModFeesWithAncestors() == nFeesCheck);
+
+        setEntries setDescendants;
+        CalculateDescendants(it, setDescendants);
+        nSizeCheck = 0;
+        nFeesCheck = 0;
+        BOOST_FOREACH(const txiter& descit, setDescendants) {
+            nSizeCheck += descit->GetTxSize();
+            nFeesCheck += descit->GetModifiedFee();
+        }
+        assert(it->GetCountWithDescendants() == setDescendants.size());
+        assert(it->GetSizeWithDescendants() == nSizeCheck);
+        assert(it->GetModFeesWithDescendants() == nFeesCheck);
+
         if (fDependsWait)
-            waitingOnDependants.push_back(&it->second);
+            waitingOnDependants.push_back(&(*it));
         else {
             CValidationState state;
             assert(!fCheckInputs || CheckInputs(tx, state, mempoolDuplicate, false, SCRIPT_VERIFY_NAMES_MEMPOOL, false, NULL));
@@ -314,15 +606,17 @@ void CTxMemPool::check(const CCoinsViewCache *pcoins) const
     }
     for (std::map<COutPoint, CInPoint>::const_iterator it = mapNextTx.begin(); it != mapNextTx.end(); it++) {
         uint256 hash = it->second.ptx->GetHash();
-        map<uint256, CTxMemPoolEntry>::const_iterator it2 = mapTx.find(hash);
-        const CTransaction& tx = it2->second.GetTx();
+        indexed_transaction_set::const_iterator it2 = mapTx.find(hash);
         assert(it2 != mapTx.end());
+        const CTransaction& tx = it2->GetTx();
         assert(&tx == it->second.ptx);
         assert(tx.vin.size() > it->second.n);
         assert(it->first == it->second.ptx->vin[it->second.n].prevout);
     }
 
     assert(totalTxSize == checkTotal);
+    assert(innerUsage == cachedInnerUsage);
+    assert(mapLinks.size() == mapTx.size());
 
     names.check (*pcoins);
 }
@@ -333,16 +627,16 @@ void CTxMemPool::queryHashes(vector<uint256>& vtxid)
 
     LOCK(cs);
     vtxid.reserve(mapTx.size());
-    for (map<uint256, CTxMemPoolEntry>::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
-        vtxid.push_back((*mi).first);
+    for (indexed_transaction_set::iterator mi = mapTx.begin(); mi != mapTx.end(); ++mi)
+        vtxid.push_back(mi->GetTx().GetHash());
 }
 
 bool CTxMemPool::lookup(uint256 hash, CTransaction& result) const
 {
     LOCK(cs);
-    map<uint256, CTxMemPoolEntry>::const_iterator i = mapTx.find(hash);
+    indexed_transaction_set::const_iterator i = mapTx.find(hash);
     if (i == mapTx.end()) return false;
-    result = i->second.GetTx();
+    result = i->GetTx();
     return true;
 }
 
@@ -399,6 +693,24 @@ void CTxMemPool::PrioritiseTransaction(const uint256 hash, const string strHash,
         std::pair<double, CAmount> &deltas = mapDeltas[hash];
         deltas.first += dPriorityDelta;
         deltas.second += nFeeDelta;
+        ++nDeltasUpdated;
+
+        // Update the entry and the aggregate statistics that include it.
+        const txiter it = mapTx.find(hash);
+        if (it != mapTx.end() && nFeeDelta != 0) {
+            mapTx.modify(it, update_fee_delta(deltas.second));
+
+            setEntries setAncestors;
+            CalculateMemPoolAncestors(it, setAncestors);
+            BOOST_FOREACH(const txiter& ancit, setAncestors)
+                mapTx.modify(ancit, update_descendant_state(0, nFeeDelta, 0));
+
+            setEntries setDescendants;
+            CalculateDescendants(it, setDescendants);
+            setDescendants.erase(it);
+            BOOST_FOREACH(const txiter& descit, setDescendants)
+                mapTx.modify(descit, update_ancestor_state(0, nFeeDelta, 0));
+        }
     }
     LogPrintf("PrioritiseTransaction: %s priority += %f, fee += %d\n", strHash, dPriorityDelta, FormatMoney(nFeeDelta));
 }
@@ -420,6 +732,102 @@ void CTxMemPool::ClearPrioritisation(const uint256 hash)
     mapDeltas.erase(hash);
 }
 
+size_t CTxMemPool::DynamicMemoryUsage() const
+{
+    LOCK(cs);
+    // Estimate the overhead of mapTx to be 15 pointers plus an allocation,
+    // as there is no exact formula for boost::multi_index_container.
+    return memusage::MallocUsage(sizeof(CTxMemPoolEntry) + 15 * sizeof(void*)) * mapTx.size()
+           + memusage::DynamicUsage(mapNextTx) + memusage::DynamicUsage(mapDeltas)
+           + memusage::DynamicUsage(mapLinks) + cachedInnerUsage;
+}
+
+CFeeRate CTxMemPool::TrimToSize(size_t sizelimit, std::list<CTransaction>* removed)
+{
+    LOCK(cs);
+
+    std::list<CTransaction> dummy;
+    CFeeRate maxFeeRateRemoved(0);
+    unsigned nTxnRemoved = 0;
+    while (!mapTx.empty() && DynamicMemoryUsage() > sizelimit) {
+        const indexed_transaction_set::index<descendant_score>::type::iterator it
+          = mapTx.get<descendant_score>().begin();
+
+        // The package is evicted at the higher of its own and its
+        // descendant fee rate, as that is what the index sorts by.
+        CFeeRate removedRate(it->GetModFeesWithDescendants(), it->GetSizeWithDescendants());
+        const CFeeRate ownRate(it->GetModifiedFee(), it->GetTxSize());
+        if (removedRate < ownRate)
+            removedRate = ownRate;
+        if (maxFeeRateRemoved < removedRate)
+            maxFeeRateRemoved = removedRate;
+        trackPackageRemoved(CFeeRate(removedRate.GetFeePerK() + minReasonableRelayFee.GetFeePerK()));
+
+        setEntries stage;
+        CalculateDescendants(mapTx.project<0>(it), stage);
+        nTxnRemoved += stage.size();
+        removeUnchecked(stage, removed ? *removed : dummy);
+    }
+
+    if (nTxnRemoved > 0)
+        LogPrint("mempool", "TrimToSize: removed %u txn, highest evicted fee rate %s\n",
+                 nTxnRemoved, maxFeeRateRemoved.ToString());
+    return maxFeeRateRemoved;
+}
+
+int CTxMemPool::Expire(int64_t time)
+{
+    LOCK(cs);
+
+    setEntries toremove;
+    indexed_transaction_set::index<entry_time>::type::iterator it = mapTx.get<entry_time>().begin();
+    while (it != mapTx.get<entry_time>().end() && it->GetTime() < time) {
+        toremove.insert(mapTx.project<0>(it));
+        ++it;
+    }
+
+    setEntries stage;
+    BOOST_FOREACH(const txiter& removeit, toremove)
+        CalculateDescendants(removeit, stage);
+    std::list<CTransaction> removed;
+    removeUnchecked(stage, removed);
+    return stage.size();
+}
+
+void CTxMemPool::trackPackageRemoved(const CFeeRate& rate)
+{
+    AssertLockHeld(cs);
+    if (rate.GetFeePerK() > rollingMinimumFeeRate) {
+        rollingMinimumFeeRate = rate.GetFeePerK();
+        blockSinceLastRollingFeeBump = false;
+    }
+}
+
+CFeeRate CTxMemPool::GetMinFee(size_t sizelimit) const
+{
+    LOCK(cs);
+    if (!blockSinceLastRollingFeeBump || rollingMinimumFeeRate == 0)
+        return CFeeRate(rollingMinimumFeeRate);
+
+    const int64_t nTime = GetTime();
+    if (nTime > lastRollingFeeUpdate + 10) {
+        double halflife = ROLLING_FEE_HALFLIFE;
+        if (DynamicMemoryUsage() < sizelimit / 4)
+            halflife /= 4;
+        else if (DynamicMemoryUsage() < sizelimit / 2)
+            halflife /= 2;
+
+        rollingMinimumFeeRate = rollingMinimumFeeRate / pow(2.0, (nTime - lastRollingFeeUpdate) / halflife);
+        lastRollingFeeUpdate = nTime;
+
+        if (rollingMinimumFeeRate < minReasonableRelayFee.GetFeePerK() / 2) {
+            rollingMinimumFeeRate = 0;
+            return CFeeRate(0);
+        }
+    }
+    return std::max(CFeeRate(rollingMinimumFeeRate), minReasonableRelayFee);
+}
+
 bool CTxMemPool::HasNoInputsOf(const CTransaction &tx) const
 {
     for (unsigned int i = 0; i < tx.vin.size(); i++)
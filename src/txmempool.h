@@ -7,6 +7,7 @@
 #define BITCOIN_TXMEMPOOL_H
 
 #include <list>
+#include <set>
 
 #include "amount.h"
 #include "coins.h"
@@ -15,6 +16,11 @@
 #include "sync.h"
 #include "script/names.h"
 
+#include <boost/multi_index_container.hpp>
+#include <boost/multi_index/hashed_index.hpp>
+#include <boost/multi_index/mem_fun.hpp>
+#include <boost/multi_index/ordered_index.hpp>
+
 class CAutoFile;
 
 inline double AllowFreeThreshold()
@@ -34,6 +40,11 @@ static const unsigned int MEMPOOL_HEIGHT = 0x7FFFFFFF;
 
 /**
  * CTxMemPool stores these:
+ *
+ * Besides the transaction itself, each entry caches statistics about its
+ * in-mempool descendants and ancestors (itself included).  These are kept
+ * up-to-date by CTxMemPool when transactions are added or removed, and
+ * are used to order the pool by fee rate for mining and eviction.
  */
 class CTxMemPoolEntry
 {
@@ -42,10 +53,23 @@ private:
     CAmount nFee; //! Cached to avoid expensive parent-transaction lookups
     size_t nTxSize; //! ... and avoid recomputing tx size
     size_t nModSize; //! ... and modified size for priority
+    size_t nUsageSize; //! ... and total memory usage
     int64_t nTime; //! Local time when entering the mempool
     double dPriority; //! Priority when entering the mempool
     unsigned int nHeight; //! Chain height when entering the mempool
     bool hadNoDependencies; //! Not dependent on any other txs when it entered the mempool
+    CAmount feeDelta; //! Fee delta set by PrioritiseTransaction
+    uint64_t nSequence; //! Order of entry into the pool, set by CTxMemPool
+
+    //! Number, size and modified fees of in-mempool descendants (incl. this)
+    uint64_t nCountWithDescendants;
+    uint64_t nSizeWithDescendants;
+    CAmount nModFeesWithDescendants;
+
+    //! Number, size and modified fees of in-mempool ancestors (incl. this)
+    uint64_t nCountWithAncestors;
+    uint64_t nSizeWithAncestors;
+    CAmount nModFeesWithAncestors;
 
     /* Cache name operation (if any) performed by this tx.  */
     CNameScript nameOp;
@@ -59,10 +83,30 @@ public:
     const CTransaction& GetTx() const { return this->tx; }
     double GetPriority(unsigned int currentHeight) const;
     CAmount GetFee() const { return nFee; }
+    CAmount GetModifiedFee() const { return nFee + feeDelta; }
     size_t GetTxSize() const { return nTxSize; }
     int64_t GetTime() const { return nTime; }
     unsigned int GetHeight() const { return nHeight; }
     bool WasClearAtEntry() const { return hadNoDependencies; }
+    size_t DynamicMemoryUsage() const { return nUsageSize; }
+    uint64_t GetSequence() const { return nSequence; }
+
+    uint64_t GetCountWithDescendants() const { return nCountWithDescendants; }
+    uint64_t GetSizeWithDescendants() const { return nSizeWithDescendants; }
+    CAmount GetModFeesWithDescendants() const { return nModFeesWithDescendants; }
+    uint64_t GetCountWithAncestors() const { return nCountWithAncestors; }
+    uint64_t GetSizeWithAncestors() const { return nSizeWithAncestors; }
+    CAmount GetModFeesWithAncestors() const { return nModFeesWithAncestors; }
+
+    /** Adjust the descendant statistics by the given amounts.  */
+    void UpdateDescendantState(int64_t modifySize, CAmount modifyFee, int64_t modifyCount);
+    /** Adjust the ancestor statistics by the given amounts.  */
+    void UpdateAncestorState(int64_t modifySize, CAmount modifyFee, int64_t modifyCount);
+    /** Reset both aggregates to contain only this entry.  */
+    void ResetAggregateState();
+    /** Set the fee delta from PrioritiseTransaction, adjusting own totals.  */
+    void UpdateFeeDelta(CAmount newFeeDelta);
+    void SetSequence(uint64_t _nSequence) { nSequence = _nSequence; }
 
     inline bool
     isNameNew() const
@@ -91,6 +135,148 @@ public:
     }
 };
 
+/** Functors to modify entries in place through the multi_index container.  */
+struct update_descendant_state
+{
+    update_descendant_state(int64_t _modifySize, CAmount _modifyFee, int64_t _modifyCount) :
+        modifySize(_modifySize), modifyFee(_modifyFee), modifyCount(_modifyCount)
+    {}
+
+    void operator() (CTxMemPoolEntry &e)
+        { e.UpdateDescendantState(modifySize, modifyFee, modifyCount); }
+
+    private:
+        int64_t modifySize;
+        CAmount modifyFee;
+        int64_t modifyCount;
+};
+
+struct update_ancestor_state
+{
+    update_ancestor_state(int64_t _modifySize, CAmount _modifyFee, int64_t _modifyCount) :
+        modifySize(_modifySize), modifyFee(_modifyFee), modifyCount(_modifyCount)
+    {}
+
+    void operator() (CTxMemPoolEntry &e)
+        { e.UpdateAncestorState(modifySize, modifyFee, modifyCount); }
+
+    private:
+        int64_t modifySize;
+        CAmount modifyFee;
+        int64_t modifyCount;
+};
+
+struct update_fee_delta
+{
+    update_fee_delta(CAmount _feeDelta) : feeDelta(_feeDelta) { }
+
+    void operator() (CTxMemPoolEntry &e) { e.UpdateFeeDelta(feeDelta); }
+
+private:
+    CAmount feeDelta;
+};
+
+struct reset_aggregate_state
+{
+    void operator() (CTxMemPoolEntry &e) { e.ResetAggregateState(); }
+};
+
+struct update_sequence
+{
+    update_sequence(uint64_t _nSequence) : nSequence(_nSequence) { }
+
+    void operator() (CTxMemPoolEntry &e) { e.SetSequence(nSequence); }
+
+private:
+    uint64_t nSequence;
+};
+
+/** Extract the txid of an entry, used as key for the hashed index.  */
+struct mempoolentry_txid
+{
+    typedef uint256 result_type;
+    result_type operator() (const CTxMemPoolEntry &entry) const
+    {
+        return entry.GetTx().GetHash();
+    }
+};
+
+/**
+ * Sort an entry by max(own fee rate, fee rate with descendants), lowest
+ * first.  This is used for eviction:  The front of this index is the
+ * package that is least valuable to keep.  Ties are broken by entry
+ * time (newer first).
+ */
+class CompareTxMemPoolEntryByDescendantScore
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        const bool fUseADescendants = UseDescendantScore(a);
+        const bool fUseBDescendants = UseDescendantScore(b);
+
+        const double aFees = fUseADescendants ? a.GetModFeesWithDescendants() : a.GetModifiedFee();
+        const double aSize = fUseADescendants ? a.GetSizeWithDescendants() : a.GetTxSize();
+        const double bFees = fUseBDescendants ? b.GetModFeesWithDescendants() : b.GetModifiedFee();
+        const double bSize = fUseBDescendants ? b.GetSizeWithDescendants() : b.GetTxSize();
+
+        // Avoid division by rewriting (a/b > c/d) as (a*d > c*b).
+        const double f1 = aFees * bSize;
+        const double f2 = aSize * bFees;
+
+        // Of packages with the same fee rate, the newer ones are evicted
+        // first.  The txid makes this a strict weak ordering.
+        if (f1 == f2) {
+            if (a.GetTime() != b.GetTime())
+                return a.GetTime() > b.GetTime();
+            return a.GetTx().GetHash() < b.GetTx().GetHash();
+        }
+        return f1 < f2;
+    }
+
+    /** Whether the descendant fee rate is higher than the entry's own.  */
+    static bool UseDescendantScore(const CTxMemPoolEntry& a)
+    {
+        const double f1 = (double)a.GetModifiedFee() * a.GetSizeWithDescendants();
+        const double f2 = (double)a.GetModFeesWithDescendants() * a.GetTxSize();
+        return f2 > f1;
+    }
+};
+
+/**
+ * Sort by own (modified) fee rate, highest first.  This is the order in
+ * which CreateNewBlock considers transactions.  Ties are broken by txid
+ * to make the order deterministic.
+ */
+class CompareTxMemPoolEntryByScore
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        const double f1 = (double)a.GetModifiedFee() * b.GetTxSize();
+        const double f2 = (double)b.GetModifiedFee() * a.GetTxSize();
+        if (f1 == f2)
+            return b.GetTx().GetHash() < a.GetTx().GetHash();
+        return f1 > f2;
+    }
+};
+
+/** Sort by time of entry into the mempool, oldest first.  */
+class CompareTxMemPoolEntryByEntryTime
+{
+public:
+    bool operator()(const CTxMemPoolEntry& a, const CTxMemPoolEntry& b) const
+    {
+        return a.GetTime() < b.GetTime();
+    }
+};
+
+/* Tags for the secondary indices of CTxMemPool::indexed_transaction_set.  */
+struct descendant_score {};
+struct entry_time {};
+struct mining_score {};
+struct insertion_order {};
+
 class CBlockPolicyEstimator;
 
 /** An inpoint - a combination of a transaction and an index n into its vin */
@@ -115,15 +301,41 @@ public:
  * are added to the pool: if a new transaction double-spends
  * an input of a transaction in the pool, it is dropped,
  * as are non-standard transactions.
+ *
+ * The entries are kept in a boost::multi_index container with these
+ * indices:
+ *
+ * - txid:  hashed, for lookup by transaction hash,
+ * - descendant_score:  ordered by fee rate including descendants,
+ *   lowest first; used to evict packages when the pool exceeds
+ *   the size limit (see TrimToSize),
+ * - entry_time:  ordered by time of entry into the pool,
+ * - mining_score:  ordered by own fee rate, highest first; used by
+ *   CreateNewBlock to select transactions without re-sorting the pool,
+ * - insertion_order:  ordered by the sequence number assigned on entry;
+ *   used to find the transactions added since a block template was built.
+ *
+ * In addition, mapLinks keeps the direct in-mempool parents and children
+ * of each entry, from which the full ancestor and descendant sets can
+ * be computed.  The aggregate statistics stored in each entry are updated
+ * whenever a transaction enters or leaves the pool.
  */
 class CTxMemPool
 {
 private:
     bool fSanityCheck; //! Normally false, true if -checkmempool or -regtest
     unsigned int nTransactionsUpdated;
+    uint64_t nSequenceNext; //! Sequence number for the next added entry
+    unsigned int nDeltasUpdated; //! Incremented by PrioritiseTransaction
     CBlockPolicyEstimator* minerPolicyEstimator;
 
     uint64_t totalTxSize; //! sum of all mempool tx' byte sizes
+    uint64_t cachedInnerUsage; //! sum of dynamic memory usage of all the map elements (NOT the maps themselves)
+
+    CFeeRate minReasonableRelayFee; //! Added to the fee rate of evicted packages
+    mutable int64_t lastRollingFeeUpdate;
+    mutable bool blockSinceLastRollingFeeBump;
+    mutable double rollingMinimumFeeRate; //! minimum fee to get into the pool, decreases exponentially
 
     /** Name-related mempool data.  */
     CNameMemPool names;
@@ -134,19 +346,90 @@ private:
     bool fCheckInputs;
 
 public:
+    typedef boost::multi_index_container<
+        CTxMemPoolEntry,
+        boost::multi_index::indexed_by<
+            // sorted by txid
+            boost::multi_index::hashed_unique<mempoolentry_txid, CCoinsKeyHasher>,
+            // sorted by fee rate (with descendants)
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<descendant_score>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByDescendantScore
+            >,
+            // sorted by entry time
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<entry_time>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByEntryTime
+            >,
+            // sorted by own fee rate for mining
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<mining_score>,
+                boost::multi_index::identity<CTxMemPoolEntry>,
+                CompareTxMemPoolEntryByScore
+            >,
+            // sorted by order of entry into the pool
+            boost::multi_index::ordered_non_unique<
+                boost::multi_index::tag<insertion_order>,
+                boost::multi_index::const_mem_fun<CTxMemPoolEntry, uint64_t, &CTxMemPoolEntry::GetSequence>
+            >
+        >
+    > indexed_transaction_set;
+
+    typedef indexed_transaction_set::nth_index<0>::type::iterator txiter;
+
+    struct CompareIteratorByHash {
+        bool operator()(const txiter &a, const txiter &b) const {
+            return a->GetTx().GetHash() < b->GetTx().GetHash();
+        }
+    };
+    typedef std::set<txiter, CompareIteratorByHash> setEntries;
+
     mutable CCriticalSection cs;
-    std::map<uint256, CTxMemPoolEntry> mapTx;
+    indexed_transaction_set mapTx;
     std::map<COutPoint, CInPoint> mapNextTx;
     std::map<uint256, std::pair<double, CAmount> > mapDeltas;
 
+private:
+    struct TxLinks {
+        setEntries parents;
+        setEntries children;
+    };
+
+    typedef std::map<txiter, TxLinks, CompareIteratorByHash> txlinksMap;
+    txlinksMap mapLinks;
+
+    /**
+     * Remove a set of transactions from the pool.  The set must be closed
+     * under "descendant of" (i. e., contain all in-mempool descendants of
+     * each member) unless the members have no in-mempool children.  The
+     * statistics of entries that stay are updated accordingly.
+     */
+    void removeUnchecked(const setEntries& stage, std::list<CTransaction>& removed);
+
+    /** Add or remove other as child (fChild) or parent of entry.  */
+    void UpdateLink(txiter entry, txiter other, bool fChild, bool add);
+
+    /** Recompute the aggregate statistics of the given entries from scratch.  */
+    void RecomputeAggregateState(const setEntries& entries);
+
+    /** Raise the rolling minimum fee to the rate of an evicted package.  */
+    void trackPackageRemoved(const CFeeRate& rate);
+
+public:
+    /** Half-life of the rolling minimum fee while the pool is at least half full.  */
+    static const int ROLLING_FEE_HALFLIFE = 60 * 60 * 12;
+
     CTxMemPool(const CFeeRate& _minRelayFee);
     ~CTxMemPool();
 
     /**
      * If sanity-checking is turned on, check makes sure the pool is
      * consistent (does not contain two transactions that spend the same inputs,
-     * all inputs are in the mapNextTx array). If sanity-checking is turned off,
-     * check does nothing.
+     * all inputs are in the mapNextTx array, the parent/child links and
+     * the aggregate statistics of each entry are correct). If sanity-checking
+     * is turned off, check does nothing.
      */
     void check(const CCoinsViewCache *pcoins) const;
     void setSanityCheck(bool _fSanityCheck, bool _fCheckInputs = true) { fSanityCheck = _fSanityCheck; fCheckInputs = _fCheckInputs; }
@@ -162,12 +445,68 @@ public:
     void pruneSpent(const uint256& hash, CCoins &coins);
     unsigned int GetTransactionsUpdated() const;
     void AddTransactionsUpdated(unsigned int n);
+    /**
+     * Sequence number that the next added transaction will get.  Entries
+     * with a sequence number at least the returned value (see the
+     * insertion_order index) have been added after this call.
+     */
+    uint64_t GetSequence() const;
+    /**
+     * Number of PrioritiseTransaction calls so far.  Prioritising can
+     * change the order in which transactions should be mined, so block
+     * templates built before a change have to be assembled anew.
+     */
+    unsigned int GetDeltasUpdated() const;
     /**
      * Check that none of this transactions inputs are in the mempool, and thus
      * the tx is not dependent on other mempool transactions to be included in a block.
      */
     bool HasNoInputsOf(const CTransaction& tx) const;
 
+    /** Direct in-mempool parents and children of an entry.  */
+    const setEntries& GetMemPoolParents(txiter entry) const;
+    const setEntries& GetMemPoolChildren(txiter entry) const;
+
+    /**
+     * Collect all in-mempool ancestors of entry (not including entry
+     * itself) into setAncestors.
+     */
+    void CalculateMemPoolAncestors(txiter entry, setEntries& setAncestors) const;
+
+    /**
+     * Collect entry and all its in-mempool descendants into setDescendants.
+     * Entries already in setDescendants are assumed to have their
+     * descendants in the set as well and are not walked again.
+     */
+    void CalculateDescendants(txiter entry, setEntries& setDescendants) const;
+
+    /**
+     * Remove transactions (and their descendants) with the lowest descendant
+     * fee rate until the dynamic memory usage is at most sizelimit bytes.
+     * Name operations of evicted transactions are released, so that
+     * CNameMemPool stays consistent.
+     * @param sizelimit The target memory usage in bytes.
+     * @param removed Put evicted transactions here.
+     * @return The highest fee rate (with descendants) of the evicted packages.
+     */
+    CFeeRate TrimToSize(size_t sizelimit, std::list<CTransaction>* removed = NULL);
+
+    /**
+     * Remove transactions that entered the pool before time, together
+     * with their descendants.  Returns the number of removed transactions.
+     */
+    int Expire(int64_t time);
+
+    /**
+     * The minimum fee rate to get into the pool.  After an eviction it is
+     * the fee rate of the evicted package plus the minimum relay fee, so
+     * that evicted or cheaper packages are not accepted (and relayed)
+     * again right away.  Once a block has been found, it decays with a
+     * half-life of ROLLING_FEE_HALFLIFE, which is shortened if the pool
+     * (with limit sizelimit) is less than half full.
+     */
+    CFeeRate GetMinFee(size_t sizelimit) const;
+
     /* Remove entries that conflict with name expirations / unexpirations.  */
     inline void
     removeUnexpireConflicts (const std::set<valtype>& unexpired,
@@ -206,6 +545,36 @@ public:
         return (mapTx.count(hash) != 0);
     }
 
+    /* Pending name registrations and updates (see CNameMemPool).  */
+    inline void
+    queryPendingNames(const valtype& prefix,
+                      std::vector<std::pair<valtype, uint256> >& res) const
+    {
+        LOCK(cs);
+        names.queryPending(prefix, res);
+    }
+    inline void
+    queryPendingName(const valtype& name,
+                     std::vector<std::pair<valtype, uint256> >& res) const
+    {
+        LOCK(cs);
+        names.queryName(name, res);
+    }
+
+    /* Save and restore the NAME_NEW hashes used against name_new stealing.  */
+    inline void
+    getNameNews(std::map<valtype, uint256>& news) const
+    {
+        LOCK(cs);
+        news = names.getNameNews();
+    }
+    inline void
+    restoreNameNews(const std::map<valtype, uint256>& news)
+    {
+        LOCK(cs);
+        names.restoreNameNews(news);
+    }
+
     inline bool
     registersName(const valtype& name) const
     {
@@ -244,6 +613,9 @@ public:
     /** Write/Read estimates to disk */
     bool WriteFeeEstimates(CAutoFile& fileout) const;
     bool ReadFeeEstimates(CAutoFile& filein);
+
+    /** Estimated memory usage of the pool, used for -maxmempool.  */
+    size_t DynamicMemoryUsage() const;
 };
 
 /** 
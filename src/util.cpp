@@ -75,6 +75,7 @@
 #include <boost/algorithm/string/case_conv.hpp> // for to_lower()
 #include <boost/algorithm/string/join.hpp>
 #include <boost/algorithm/string/predicate.hpp> // for startswith() and endswith()
+#include <boost/bind.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/filesystem/fstream.hpp>
 #include <boost/foreach.hpp>
@@ -724,6 +725,22 @@ void RenameThread(const char* name)
 #endif
 }
 
+void ParallelForRanges(size_t nItems, const boost::function<void (size_t, size_t)>& func,
+                       size_t nMinItemsPerThread)
+{
+    const size_t nThreads = std::min<size_t>(boost::thread::hardware_concurrency(),
+                                             nItems / std::max<size_t>(nMinItemsPerThread, 1));
+    if (nThreads <= 1) {
+        func(0, nItems);
+        return;
+    }
+
+    boost::thread_group threads;
+    for (size_t i = 0; i < nThreads; ++i)
+        threads.create_thread(boost::bind(func, nItems * i / nThreads, nItems * (i + 1) / nThreads));
+    threads.join_all();
+}
+
 void SetupEnvironment()
 {
     // On most POSIX systems (e.g. Linux, but not BSD) the environment's locale
@@ -25,6 +25,7 @@
 #include <vector>
 
 #include <boost/filesystem/path.hpp>
+#include <boost/function.hpp>
 #include <boost/signals2/signal.hpp>
 #include <boost/thread/exceptions.hpp>
 
@@ -202,6 +203,16 @@ std::string HelpMessageOpt(const std::string& option, const std::string& message
 void SetThreadPriority(int nPriority);
 void RenameThread(const char* name);
 
+/**
+ * Split [0, nItems) into consecutive ranges, one per core, and call
+ * func(nBegin, nEnd) for each of them in its own thread.  No range is
+ * smaller than nMinItemsPerThread, so that small inputs are handled in
+ * the calling thread.  Returns when all calls are done.  func must not
+ * throw.
+ */
+void ParallelForRanges(size_t nItems, const boost::function<void (size_t, size_t)>& func,
+                       size_t nMinItemsPerThread = 1024);
+
 /**
  * .. and a wrapper that just calls func once
  */
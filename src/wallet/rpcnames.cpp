@@ -18,6 +18,10 @@
 #include "json/json_spirit_utils.h"
 #include "json/json_spirit_value.h"
 
+#include <boost/shared_ptr.hpp>
+
+#include <set>
+
 /**
  * Helper routine to fetch the name output of a previous transaction.  This
  * is required for name_firstupdate.
@@ -47,6 +51,278 @@ getNamePrevout (const uint256& txid, CTxOut& txOut, CTxIn& txIn)
   return false;
 }
 
+/**
+ * Parse a name given to an RPC and check its length.
+ * @param str The name as string.
+ * @return The name.
+ */
+static valtype
+parseNameArg (const std::string& str)
+{
+  const valtype name = ValtypeFromString (str);
+  if (name.size () > MAX_NAME_LENGTH)
+    throw JSONRPCError (RPC_INVALID_PARAMETER, "the name is too long");
+  return name;
+}
+
+/**
+ * Parse a value given to an RPC and check its length.
+ * @param str The value as string.
+ * @return The value.
+ */
+static valtype
+parseValueArg (const std::string& str)
+{
+  const valtype value = ValtypeFromString (str);
+  if (value.size () > MAX_VALUE_LENGTH_UI)
+    throw JSONRPCError (RPC_INVALID_PARAMETER, "the value is too long");
+  return value;
+}
+
+/**
+ * Check that a name_new can be followed up with a name_firstupdate and
+ * find the input spending it.  Throws a JSONRPCError if not.
+ * @param name The name to register.
+ * @param rand The rand value of the name_new.
+ * @param prevTxid The name_new's txid.
+ * @return The input to include in the name_firstupdate.
+ */
+static CTxIn
+getNameFirstupdateInput (const valtype& name, const valtype& rand,
+                         const uint256& prevTxid)
+{
+  {
+    LOCK (mempool.cs);
+    if (mempool.registersName (name))
+      throw JSONRPCError (RPC_TRANSACTION_ERROR,
+                          "this name is already being registered");
+  }
+
+  {
+    LOCK (cs_main);
+    CNameData oldData;
+    if (pcoinsTip->GetName (name, oldData) && !oldData.isExpired ())
+      throw JSONRPCError (RPC_TRANSACTION_ERROR, "this name is already active");
+  }
+
+  CTxOut prevOut;
+  CTxIn txIn;
+  {
+    LOCK (cs_main);
+    if (!getNamePrevout (prevTxid, prevOut, txIn))
+      throw JSONRPCError (RPC_TRANSACTION_ERROR, "previous txid not found");
+  }
+
+  const CNameScript prevNameOp(prevOut.scriptPubKey);
+  assert (prevNameOp.isNameOp ());
+  if (prevNameOp.getNameOp () != OP_NAME_NEW)
+    throw JSONRPCError (RPC_TRANSACTION_ERROR, "previous tx is not name_new");
+
+  valtype toHash(rand);
+  toHash.insert (toHash.end (), name.begin (), name.end ());
+  if (uint160 (prevNameOp.getOpHash ()) != Hash160 (toHash))
+    throw JSONRPCError (RPC_TRANSACTION_ERROR, "rand value is wrong");
+
+  return txIn;
+}
+
+/**
+ * Check that a name can be updated and find the input spending its
+ * current output.  Throws a JSONRPCError if not.
+ * @param name The name to update.
+ * @return The input to include in the name_update.
+ */
+static CTxIn
+getNameUpdateInput (const valtype& name)
+{
+  /* Reject updates to a name for which the mempool already has
+     a pending update.  This is not a hard rule enforced by network
+     rules, but it is necessary with the current mempool implementation.  */
+  {
+    LOCK (mempool.cs);
+    if (mempool.updatesName (name))
+      throw JSONRPCError (RPC_TRANSACTION_ERROR,
+                          "there is already a pending update for this name");
+  }
+
+  CNameData oldData;
+  {
+    LOCK (cs_main);
+    if (!pcoinsTip->GetName (name, oldData) || oldData.isExpired ())
+      throw JSONRPCError (RPC_TRANSACTION_ERROR,
+                          "this name can not be updated");
+  }
+
+  return CTxIn (oldData.getUpdateOutpoint ());
+}
+
+/**
+ * Get the script to send a name to.
+ * @param toAddress The address given to the RPC, or NULL for a new key.
+ * @param keyName Used to reserve the new key.
+ * @param usedKey Set to true if the caller has to keep the key.
+ * @return The name's address script.
+ */
+static CScript
+getNameAddress (const std::string* toAddress, CReserveKey& keyName,
+                bool& usedKey)
+{
+  if (toAddress)
+    {
+      const CBitcoinAddress addr(*toAddress);
+      if (!addr.IsValid ())
+        throw JSONRPCError (RPC_INVALID_ADDRESS_OR_KEY, "invalid address");
+
+      usedKey = false;
+      return GetScriptForDestination (addr.Get ());
+    }
+
+  CPubKey pubKeyReserve;
+  const bool ok = keyName.GetReservedKey (pubKeyReserve);
+  assert (ok);
+
+  usedKey = true;
+  return GetScriptForDestination (pubKeyReserve.GetID ());
+}
+
+/**
+ * One name operation of name_firstupdate_many or name_update_many.  The
+ * reserved keys are shared so that items can be copied.
+ */
+struct CNameBatchItem
+{
+  std::string nameStr;
+  CScript nameScript;
+  CTxIn txIn;
+
+  boost::shared_ptr<CReserveKey> keyName;
+  bool usedKey;
+  boost::shared_ptr<CReserveKey> keyChange;
+
+  CWalletTx wtx;
+  /** Set if the operation failed.  */
+  std::string error;
+
+  CNameBatchItem ()
+    : usedKey(false)
+  {}
+};
+
+/**
+ * Record the error of a failed batch item.  Call from a catch block.
+ * @param item The batch item.
+ */
+static void
+setBatchError (CNameBatchItem& item)
+{
+  try
+    {
+      throw;
+    }
+  catch (const json_spirit::Object& objError)
+    {
+      item.error = json_spirit::find_value (objError, "message").get_str ();
+    }
+  catch (const std::exception& e)
+    {
+      item.error = e.what ();
+    }
+}
+
+/**
+ * Create and send the transactions of a batch of name operations.  Fee
+ * inputs are selected from a single list of the wallet's available coins,
+ * and all transactions are written to the wallet in a single database
+ * transaction.  Items that already failed are skipped.
+ * @param items The batch.
+ */
+static void
+sendNameBatch (std::vector<CNameBatchItem>& items)
+{
+  LOCK2 (cs_main, pwalletMain->cs_wallet);
+
+  /* Coins used by one transaction are removed from the list, so that none
+     is spent twice although nothing is committed until the end.  */
+  std::vector<COutput> vCoins;
+  pwalletMain->AvailableCoins (vCoins);
+
+  BOOST_FOREACH (CNameBatchItem& item, items)
+    {
+      if (!item.error.empty ())
+        continue;
+
+      std::vector<CRecipient> vecSend;
+      const CRecipient recipient = {item.nameScript, NAME_LOCKED_AMOUNT, false};
+      vecSend.push_back (recipient);
+
+      item.keyChange.reset (new CReserveKey (pwalletMain));
+      CAmount nFeeRequired;
+      int nChangePos;
+      if (!pwalletMain->CreateTransaction (vecSend, &item.txIn, item.wtx,
+                                           *item.keyChange, nFeeRequired,
+                                           nChangePos, item.error, NULL,
+                                           &vCoins)
+            && item.error.empty ())
+        item.error = "the transaction could not be created";
+    }
+
+  /* Keeping the keys writes through other database handles, which must
+     not happen while our database transaction is open.  */
+  BOOST_FOREACH (CNameBatchItem& item, items)
+    if (item.error.empty ())
+      {
+        item.keyChange->KeepKey ();
+        if (item.usedKey)
+          item.keyName->KeepKey ();
+      }
+
+  CWalletDB walletdb(pwalletMain->strWalletFile);
+  walletdb.TxnBegin ();
+  BOOST_FOREACH (CNameBatchItem& item, items)
+    if (item.error.empty ()
+        && !pwalletMain->CommitTransaction (item.wtx, *item.keyChange,
+                                            &walletdb))
+      item.error = "the transaction was rejected";
+  walletdb.TxnCommit ();
+}
+
+/**
+ * Build the result of name_firstupdate_many and name_update_many.
+ * @param items The batch.
+ * @return The name and txid or error for each item.
+ */
+static json_spirit::Array
+getBatchResult (const std::vector<CNameBatchItem>& items)
+{
+  json_spirit::Array res;
+  BOOST_FOREACH (const CNameBatchItem& item, items)
+    {
+      json_spirit::Object obj;
+      obj.push_back (json_spirit::Pair ("name", item.nameStr));
+      if (item.error.empty ())
+        obj.push_back (json_spirit::Pair ("txid", item.wtx.GetHash ().GetHex ()));
+      else
+        obj.push_back (json_spirit::Pair ("error", item.error));
+      res.push_back (obj);
+    }
+
+  return res;
+}
+
+/**
+ * Get the optional address of a batch request.
+ * @param obj The request object.
+ * @return The address, or NULL if none is given.
+ */
+static const std::string*
+getBatchAddress (const json_spirit::Object& obj)
+{
+  const json_spirit::Value& val = json_spirit::find_value (obj, "toaddress");
+  if (val.is_null ())
+    return NULL;
+  return &val.get_str ();
+}
+
 /* ************************************************************************** */
 
 json_spirit::Value
@@ -81,57 +357,54 @@ name_list (const json_spirit::Array& params, bool fHelp)
 
   {
   LOCK2 (cs_main, pwalletMain->cs_wallet);
-  BOOST_FOREACH (const PAIRTYPE(const uint256, CWalletTx)& item,
-                 pwalletMain->mapWallet)
+
+  /* Only the transactions updating names are looked at, through the
+     wallet's name index.  */
+  typedef CWallet::NameOutputs::const_iterator NameIter;
+  NameIter begin = pwalletMain->mapNameOutputs.begin ();
+  NameIter end = pwalletMain->mapNameOutputs.end ();
+  if (!nameFilter.empty ())
     {
-      const CWalletTx& tx = item.second;
-      if (!tx.IsNamecoin ())
-        continue;
+      begin = pwalletMain->mapNameOutputs.find (nameFilter);
+      end = begin;
+      if (end != pwalletMain->mapNameOutputs.end ())
+        ++end;
+    }
 
-      CNameScript nameOp;
-      int nOut = -1;
-      for (unsigned i = 0; i < tx.vout.size (); ++i)
-        {
-          const CNameScript cur(tx.vout[i].scriptPubKey);
-          if (cur.isNameOp ())
-            {
-              if (nOut != -1)
-                LogPrintf ("ERROR: wallet contains tx with multiple"
-                           " name outputs");
-              else
-                {
-                  nameOp = cur;
-                  nOut = i;
-                }
-            }
-        }
+  for (NameIter nit = begin; nit != end; ++nit)
+    {
+      const valtype& name = nit->first;
 
-      if (nOut == -1 || !nameOp.isAnyUpdate ())
-        continue;
+      BOOST_FOREACH (const COutPoint& outp, nit->second)
+        {
+          const std::map<uint256, CWalletTx>::const_iterator wit
+            = pwalletMain->mapWallet.find (outp.hash);
+          assert (wit != pwalletMain->mapWallet.end ());
+          const CWalletTx& tx = wit->second;
 
-      const valtype& name = nameOp.getOpName ();
-      if (!nameFilter.empty () && nameFilter != name)
-        continue;
+          const CBlockIndex* pindex;
+          const int depth = tx.GetDepthInMainChain (pindex);
+          if (depth <= 0)
+            continue;
 
-      const CBlockIndex* pindex;
-      const int depth = tx.GetDepthInMainChain (pindex);
-      if (depth <= 0)
-        continue;
+          const std::map<valtype, int>::const_iterator mit
+            = mapHeights.find (name);
+          if (mit != mapHeights.end () && mit->second > pindex->nHeight)
+            continue;
 
-      const std::map<valtype, int>::const_iterator mit = mapHeights.find (name);
-      if (mit != mapHeights.end () && mit->second > pindex->nHeight)
-        continue;
+          const CNameScript nameOp(tx.vout[outp.n].scriptPubKey);
+          assert (nameOp.isAnyUpdate () && nameOp.getOpName () == name);
 
-      json_spirit::Object obj
-        = getNameInfo (name, nameOp.getOpValue (),
-                       COutPoint (tx.GetHash (), nOut),
-                       nameOp.getAddress (), pindex->nHeight);
+          json_spirit::Object obj
+            = getNameInfo (name, nameOp.getOpValue (), outp,
+                           nameOp.getAddress (), pindex->nHeight);
 
-      const bool mine = IsMine (*pwalletMain, nameOp.getAddress ());
-      obj.push_back (json_spirit::Pair ("transferred", !mine));
+          const bool mine = IsMine (*pwalletMain, nameOp.getAddress ());
+          obj.push_back (json_spirit::Pair ("transferred", !mine));
 
-      mapHeights[name] = pindex->nHeight;
-      mapObjects[name] = obj;
+          mapHeights[name] = pindex->nHeight;
+          mapObjects[name] = obj;
+        }
     }
   }
 
@@ -169,9 +442,7 @@ name_new (const json_spirit::Array& params, bool fHelp)
       );
 
   const std::string nameStr = params[0].get_str ();
-  const valtype name = ValtypeFromString (nameStr);
-  if (name.size () > MAX_NAME_LENGTH)
-    throw JSONRPCError (RPC_INVALID_PARAMETER, "the name is too long");
+  const valtype name = parseNameArg (nameStr);
 
   valtype rand(20);
   GetRandBytes (&rand[0], rand.size ());
@@ -237,10 +508,7 @@ name_firstupdate (const json_spirit::Array& params, bool fHelp)
         + HelpExampleRpc ("name_firstupdate", "\"myname\", \"555844f2db9c7f4b25da6cb8277596de45021ef2\" \"a77ceb22aa03304b7de64ec43328974aeaca211c37dd29dcce4ae461bb80ca84\", \"my-value\"")
       );
 
-  const std::string nameStr = params[0].get_str ();
-  const valtype name = ValtypeFromString (nameStr);
-  if (name.size () > MAX_NAME_LENGTH)
-    throw JSONRPCError (RPC_INVALID_PARAMETER, "the name is too long");
+  const valtype name = parseNameArg (params[0].get_str ());
 
   const valtype rand = ParseHexV (params[1], "rand");
   if (rand.size () > 20)
@@ -248,68 +516,19 @@ name_firstupdate (const json_spirit::Array& params, bool fHelp)
 
   const uint256 prevTxid = ParseHashV (params[2], "txid");
 
-  const std::string valueStr = params[3].get_str ();
-  const valtype value = ValtypeFromString (valueStr);
-  if (value.size () > MAX_VALUE_LENGTH_UI)
-    throw JSONRPCError (RPC_INVALID_PARAMETER, "the value is too long");
-
-  {
-    LOCK (mempool.cs);
-    if (mempool.registersName (name))
-      throw JSONRPCError (RPC_TRANSACTION_ERROR,
-                          "this name is already being registered");
-  }
-
-  {
-    LOCK (cs_main);
-    CNameData oldData;
-    if (pcoinsTip->GetName (name, oldData) && !oldData.isExpired ())
-      throw JSONRPCError (RPC_TRANSACTION_ERROR, "this name is already active");
-  }
-
-  CTxOut prevOut;
-  CTxIn txIn;
-  {
-    LOCK (cs_main);
-    if (!getNamePrevout (prevTxid, prevOut, txIn))
-      throw JSONRPCError (RPC_TRANSACTION_ERROR, "previous txid not found");
-  }
-
-  const CNameScript prevNameOp(prevOut.scriptPubKey);
-  assert (prevNameOp.isNameOp ());
-  if (prevNameOp.getNameOp () != OP_NAME_NEW)
-    throw JSONRPCError (RPC_TRANSACTION_ERROR, "previous tx is not name_new");
+  const valtype value = parseValueArg (params[3].get_str ());
 
-  valtype toHash(rand);
-  toHash.insert (toHash.end (), name.begin (), name.end ());
-  if (uint160 (prevNameOp.getOpHash ()) != Hash160 (toHash))
-    throw JSONRPCError (RPC_TRANSACTION_ERROR, "rand value is wrong");
+  const CTxIn txIn = getNameFirstupdateInput (name, rand, prevTxid);
 
   /* No more locking required, similarly to name_new.  */
 
   EnsureWalletIsUnlocked ();
 
   CReserveKey keyName(pwalletMain);
-  CPubKey pubKeyReserve;
-  const bool ok = keyName.GetReservedKey (pubKeyReserve);
-  assert (ok);
-  bool usedKey = false;
-
-  CScript addrName;
-  if (params.size () == 5)
-    {
-      keyName.ReturnKey ();
-      const CBitcoinAddress toAddress(params[4].get_str ());
-      if (!toAddress.IsValid ())
-        throw JSONRPCError (RPC_INVALID_ADDRESS_OR_KEY, "invalid address");
-
-      addrName = GetScriptForDestination (toAddress.Get ());
-    }
-  else
-    {
-      usedKey = true;
-      addrName = GetScriptForDestination (pubKeyReserve.GetID ());
-    }
+  bool usedKey;
+  const CScript addrName
+    = getNameAddress (params.size () == 5 ? &params[4].get_str () : NULL,
+                      keyName, usedKey);
 
   const CScript nameScript
     = CNameScript::buildNameFirstupdate (addrName, name, value, rand);
@@ -325,6 +544,85 @@ name_firstupdate (const json_spirit::Array& params, bool fHelp)
 
 /* ************************************************************************** */
 
+json_spirit::Value
+name_firstupdate_many (const json_spirit::Array& params, bool fHelp)
+{
+  if (!EnsureWalletIsAvailable (fHelp))
+    return json_spirit::Value::null;
+
+  if (fHelp || params.size () != 1)
+    throw std::runtime_error (
+        "name_firstupdate_many [{\"name\":\"name\",\"rand\":\"rand\","
+        "\"tx\":\"tx\",\"value\":\"value\",\"toaddress\":\"address\"},...]\n"
+        "\nFinish the registration of many names, like name_firstupdate"
+        " for each of them.  Fee inputs are selected once for all"
+        " transactions, which are written to the wallet together.\n"
+        "\nArguments:\n"
+        "1. registrations     (array, required) the names to register, each"
+        " with rand, tx, value and optionally toaddress as for"
+        " name_firstupdate\n"
+        "\nResult:\n"
+        "[\n"
+        "  {\n"
+        "    \"name\": xxxxx,   (string) the name\n"
+        "    \"txid\": xxxxx,   (string) the name_firstupdate's txid\n"
+        "    \"error\": xxxxx,  (string) instead of txid, if this one failed\n"
+        "  },\n"
+        "  ...\n"
+        "]\n"
+        "\nExamples:\n"
+        + HelpExampleCli ("name_firstupdate_many", "\"[{\\\"name\\\":\\\"myname\\\",\\\"rand\\\":\\\"555844f2db9c7f4b25da6cb8277596de45021ef2\\\",\\\"tx\\\":\\\"a77ceb22aa03304b7de64ec43328974aeaca211c37dd29dcce4ae461bb80ca84\\\",\\\"value\\\":\\\"my-value\\\"}]\"")
+        + HelpExampleRpc ("name_firstupdate_many", "[{\"name\":\"myname\",\"rand\":\"555844f2db9c7f4b25da6cb8277596de45021ef2\",\"tx\":\"a77ceb22aa03304b7de64ec43328974aeaca211c37dd29dcce4ae461bb80ca84\",\"value\":\"my-value\"}]")
+      );
+
+  const json_spirit::Array& requests = params[0].get_array ();
+
+  EnsureWalletIsUnlocked ();
+
+  std::vector<CNameBatchItem> items(requests.size ());
+  std::set<valtype> names;
+  for (unsigned i = 0; i < requests.size (); ++i)
+    {
+      CNameBatchItem& item = items[i];
+      try
+        {
+          const json_spirit::Object& obj = requests[i].get_obj ();
+          item.nameStr = json_spirit::find_value (obj, "name").get_str ();
+          const valtype name = parseNameArg (item.nameStr);
+          if (!names.insert (name).second)
+            throw JSONRPCError (RPC_INVALID_PARAMETER,
+                                "the name is given more than once");
+
+          const valtype rand
+            = ParseHexV (json_spirit::find_value (obj, "rand"), "rand");
+          if (rand.size () > 20)
+            throw JSONRPCError (RPC_INVALID_PARAMETER, "invalid rand value");
+          const uint256 prevTxid
+            = ParseHashV (json_spirit::find_value (obj, "tx"), "txid");
+          const valtype value
+            = parseValueArg (json_spirit::find_value (obj, "value").get_str ());
+
+          item.txIn = getNameFirstupdateInput (name, rand, prevTxid);
+          item.keyName.reset (new CReserveKey (pwalletMain));
+          const CScript addrName
+            = getNameAddress (getBatchAddress (obj), *item.keyName,
+                              item.usedKey);
+          item.nameScript
+            = CNameScript::buildNameFirstupdate (addrName, name, value, rand);
+        }
+      catch (...)
+        {
+          setBatchError (item);
+        }
+    }
+
+  sendNameBatch (items);
+
+  return getBatchResult (items);
+}
+
+/* ************************************************************************** */
+
 json_spirit::Value
 name_update (const json_spirit::Array& params, bool fHelp)
 {
@@ -347,62 +645,20 @@ name_update (const json_spirit::Array& params, bool fHelp)
         + HelpExampleRpc ("name_update", "\"myname\", \"new-value\"")
       );
 
-  const std::string nameStr = params[0].get_str ();
-  const valtype name = ValtypeFromString (nameStr);
-  if (name.size () > MAX_NAME_LENGTH)
-    throw JSONRPCError (RPC_INVALID_PARAMETER, "the name is too long");
+  const valtype name = parseNameArg (params[0].get_str ());
+  const valtype value = parseValueArg (params[1].get_str ());
 
-  const std::string valueStr = params[1].get_str ();
-  const valtype value = ValtypeFromString (valueStr);
-  if (value.size () > MAX_VALUE_LENGTH_UI)
-    throw JSONRPCError (RPC_INVALID_PARAMETER, "the value is too long");
-
-  /* Reject updates to a name for which the mempool already has
-     a pending update.  This is not a hard rule enforced by network
-     rules, but it is necessary with the current mempool implementation.  */
-  {
-    LOCK (mempool.cs);
-    if (mempool.updatesName (name))
-      throw JSONRPCError (RPC_TRANSACTION_ERROR,
-                          "there is already a pending update for this name");
-  }
-
-  CNameData oldData;
-  {
-    LOCK (cs_main);
-    if (!pcoinsTip->GetName (name, oldData) || oldData.isExpired ())
-      throw JSONRPCError (RPC_TRANSACTION_ERROR,
-                          "this name can not be updated");
-  }
-
-  const COutPoint outp = oldData.getUpdateOutpoint ();
-  const CTxIn txIn(outp);
+  const CTxIn txIn = getNameUpdateInput (name);
 
   /* No more locking required, similarly to name_new.  */
 
   EnsureWalletIsUnlocked ();
 
   CReserveKey keyName(pwalletMain);
-  CPubKey pubKeyReserve;
-  const bool ok = keyName.GetReservedKey (pubKeyReserve);
-  assert (ok);
-  bool usedKey = false;
-
-  CScript addrName;
-  if (params.size () == 3)
-    {
-      keyName.ReturnKey ();
-      const CBitcoinAddress toAddress(params[2].get_str ());
-      if (!toAddress.IsValid ())
-        throw JSONRPCError (RPC_INVALID_ADDRESS_OR_KEY, "invalid address");
-
-      addrName = GetScriptForDestination (toAddress.Get ());
-    }
-  else
-    {
-      usedKey = true;
-      addrName = GetScriptForDestination (pubKeyReserve.GetID ());
-    }
+  bool usedKey;
+  const CScript addrName
+    = getNameAddress (params.size () == 3 ? &params[2].get_str () : NULL,
+                      keyName, usedKey);
 
   const CScript nameScript
     = CNameScript::buildNameUpdate (addrName, name, value);
@@ -415,3 +671,73 @@ name_update (const json_spirit::Array& params, bool fHelp)
 
   return wtx.GetHash ().GetHex ();
 }
+
+/* ************************************************************************** */
+
+json_spirit::Value
+name_update_many (const json_spirit::Array& params, bool fHelp)
+{
+  if (!EnsureWalletIsAvailable (fHelp))
+    return json_spirit::Value::null;
+
+  if (fHelp || params.size () != 1)
+    throw std::runtime_error (
+        "name_update_many [{\"name\":\"name\",\"value\":\"value\","
+        "\"toaddress\":\"address\"},...]\n"
+        "\nUpdate many names, like name_update for each of them.  Fee inputs"
+        " are selected once for all transactions, which are written to the"
+        " wallet together.\n"
+        "\nArguments:\n"
+        "1. updates           (array, required) the names to update, each"
+        " with value and optionally toaddress as for name_update\n"
+        "\nResult:\n"
+        "[\n"
+        "  {\n"
+        "    \"name\": xxxxx,   (string) the name\n"
+        "    \"txid\": xxxxx,   (string) the name_update's txid\n"
+        "    \"error\": xxxxx,  (string) instead of txid, if this one failed\n"
+        "  },\n"
+        "  ...\n"
+        "]\n"
+        "\nExamples:\n"
+        + HelpExampleCli ("name_update_many", "\"[{\\\"name\\\":\\\"myname\\\",\\\"value\\\":\\\"new-value\\\"}]\"")
+        + HelpExampleRpc ("name_update_many", "[{\"name\":\"myname\",\"value\":\"new-value\"}]")
+      );
+
+  const json_spirit::Array& requests = params[0].get_array ();
+
+  EnsureWalletIsUnlocked ();
+
+  std::vector<CNameBatchItem> items(requests.size ());
+  std::set<valtype> names;
+  for (unsigned i = 0; i < requests.size (); ++i)
+    {
+      CNameBatchItem& item = items[i];
+      try
+        {
+          const json_spirit::Object& obj = requests[i].get_obj ();
+          item.nameStr = json_spirit::find_value (obj, "name").get_str ();
+          const valtype name = parseNameArg (item.nameStr);
+          if (!names.insert (name).second)
+            throw JSONRPCError (RPC_INVALID_PARAMETER,
+                                "the name is given more than once");
+          const valtype value
+            = parseValueArg (json_spirit::find_value (obj, "value").get_str ());
+
+          item.txIn = getNameUpdateInput (name);
+          item.keyName.reset (new CReserveKey (pwalletMain));
+          const CScript addrName
+            = getNameAddress (getBatchAddress (obj), *item.keyName,
+                              item.usedKey);
+          item.nameScript = CNameScript::buildNameUpdate (addrName, name, value);
+        }
+      catch (...)
+        {
+          setBatchError (item);
+        }
+    }
+
+  sendNameBatch (items);
+
+  return getBatchResult (items);
+}
@@ -4,6 +4,13 @@
 
 #include "wallet/wallet.h"
 
+#include "init.h"
+#include "main.h"
+#include "names/common.h"
+#include "names/main.h"
+#include "script/names.h"
+#include "txmempool.h"
+
 #include <set>
 #include <stdint.h>
 #include <utility>
@@ -307,4 +314,129 @@ BOOST_AUTO_TEST_CASE(coin_selection_tests)
     empty_wallet();
 }
 
+BOOST_AUTO_TEST_CASE(wallet_name_index)
+{
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+    CWalletDB walletdb(pwalletMain->strWalletFile);
+
+    const valtype name = ValtypeFromString("test-name");
+    const CScript addr = CScript() << OP_TRUE;
+
+    CMutableTransaction mtx;
+    mtx.SetNamecoin();
+    mtx.vout.push_back(CTxOut(COIN, addr));
+    mtx.vout.push_back(CTxOut(NAME_LOCKED_AMOUNT, CNameScript::buildNameUpdate(addr, name, ValtypeFromString("value"))));
+    const CWalletTx wtxUpdate(pwalletMain, mtx);
+    BOOST_CHECK(pwalletMain->AddToWallet(wtxUpdate, false, &walletdb));
+
+    // name_new outputs do not update a name and are not indexed
+    mtx.vout[1].scriptPubKey = CNameScript::buildNameNew(addr, uint160());
+    const CWalletTx wtxNew(pwalletMain, mtx);
+    BOOST_CHECK(pwalletMain->AddToWallet(wtxNew, false, &walletdb));
+
+    BOOST_CHECK_EQUAL(pwalletMain->mapNameOutputs.size(), 1);
+    BOOST_CHECK(pwalletMain->mapNameOutputs[name].size() == 1);
+    BOOST_CHECK(pwalletMain->mapNameOutputs[name].count(COutPoint(wtxUpdate.GetHash(), 1)));
+
+    pwalletMain->EraseFromWallet(wtxUpdate.GetHash());
+    pwalletMain->EraseFromWallet(wtxNew.GetHash());
+    BOOST_CHECK(pwalletMain->mapNameOutputs.empty());
+}
+
+BOOST_AUTO_TEST_CASE(wallet_cached_balances)
+{
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+    CWalletDB walletdb(pwalletMain->strWalletFile);
+
+    const CScript addr = GetScriptForDestination(pwalletMain->GenerateNewKey().GetID());
+
+    CMutableTransaction mtx;
+    mtx.vin.push_back(CTxIn(COutPoint(GetRandHash(), 0)));
+    mtx.vout.push_back(CTxOut(COIN, addr));
+    const CWalletTx wtx(pwalletMain, mtx);
+    const CAmount nUnconfirmed = pwalletMain->GetUnconfirmedBalance();
+    BOOST_CHECK(pwalletMain->AddToWallet(wtx, false, &walletdb));
+
+    // Neither in the chain nor in the mempool
+    std::vector<COutput> vCoins;
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmed);
+    pwalletMain->AvailableCoins(vCoins, false);
+    BOOST_CHECK(vCoins.empty());
+
+    // The cached totals and coins follow the mempool
+    mempool.addUnchecked(wtx.GetHash(), CTxMemPoolEntry(wtx, 0, 0, 0.0, 1));
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmed + COIN);
+    pwalletMain->AvailableCoins(vCoins, false);
+    BOOST_CHECK_EQUAL(vCoins.size(), 1);
+    pwalletMain->AvailableCoins(vCoins, true);
+    BOOST_CHECK(vCoins.empty());
+
+    // Locked coins are filtered from the cached list
+    COutPoint out(wtx.GetHash(), 0);
+    pwalletMain->LockCoin(out);
+    pwalletMain->AvailableCoins(vCoins, false);
+    BOOST_CHECK(vCoins.empty());
+    pwalletMain->UnlockCoin(out);
+    pwalletMain->AvailableCoins(vCoins, false);
+    BOOST_CHECK_EQUAL(vCoins.size(), 1);
+
+    mempool.clear();
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmed);
+
+    // And the wallet
+    mempool.addUnchecked(wtx.GetHash(), CTxMemPoolEntry(wtx, 0, 0, 0.0, 1));
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmed + COIN);
+    pwalletMain->EraseFromWallet(wtx.GetHash());
+    BOOST_CHECK_EQUAL(pwalletMain->GetUnconfirmedBalance(), nUnconfirmed);
+    mempool.clear();
+}
+
+BOOST_AUTO_TEST_CASE(wallet_ismine_filter)
+{
+    CKey key;
+    key.MakeNewKey(true);
+    const CPubKey pubkey = key.GetPubKey();
+    const CScript p2pkh = GetScriptForDestination(pubkey.GetID());
+    const CScript p2pk = CScript() << ToByteVector(pubkey) << OP_CHECKSIG;
+    const CScript p2sh = GetScriptForDestination(CScriptID(p2pkh));
+    const CScript named = CNameScript::buildNameUpdate(p2pkh, ValtypeFromString("test-name"), ValtypeFromString("value"));
+    const CScript multisig = GetScriptForMultisig(1, std::vector<CPubKey>(1, pubkey));
+
+    CIsMineFilter filter;
+    BOOST_CHECK(!filter.MayBeMine(p2pkh));
+    BOOST_CHECK(!filter.MayBeMine(p2pk));
+    BOOST_CHECK(!filter.MayBeMine(named));
+    BOOST_CHECK(!filter.MayBeMine(p2sh));
+    // Scripts the filter cannot parse always pass
+    BOOST_CHECK(filter.MayBeMine(multisig));
+
+    filter.Insert(pubkey.GetID());
+    BOOST_CHECK(filter.MayBeMine(p2pkh));
+    BOOST_CHECK(filter.MayBeMine(p2pk));
+    BOOST_CHECK(filter.MayBeMine(named));
+    BOOST_CHECK(!filter.MayBeMine(p2sh));
+    filter.Insert(p2sh);
+    BOOST_CHECK(filter.MayBeMine(p2sh));
+
+    CIsMineFilter small(2);
+    small.Insert(pubkey.GetID());
+    small.Insert(CScriptID(p2pkh));
+    BOOST_CHECK(!small.IsFull());
+    small.Insert(uint160());
+    BOOST_CHECK(small.IsFull());
+
+    // The wallet's filter follows new keys and watch-only scripts
+    LOCK2(cs_main, pwalletMain->cs_wallet);
+    const CScript walletScript = GetScriptForDestination(pwalletMain->GenerateNewKey().GetID());
+    BOOST_CHECK(pwalletMain->IsMine(CTxOut(COIN, walletScript)) == ISMINE_SPENDABLE);
+    const CScript walletNamed = CNameScript::buildNameUpdate(walletScript, ValtypeFromString("test-name"), ValtypeFromString("value"));
+    BOOST_CHECK(pwalletMain->IsMine(CTxOut(COIN, walletNamed)) == ISMINE_SPENDABLE);
+
+    BOOST_CHECK(pwalletMain->IsMine(CTxOut(COIN, p2pkh)) == ISMINE_NO);
+    BOOST_CHECK(pwalletMain->AddWatchOnly(p2pkh));
+    BOOST_CHECK(pwalletMain->IsMine(CTxOut(COIN, p2pkh)) == ISMINE_WATCH_ONLY);
+    BOOST_CHECK(pwalletMain->RemoveWatchOnly(p2pkh));
+    BOOST_CHECK(pwalletMain->IsMine(CTxOut(COIN, p2pkh)) == ISMINE_NO);
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -7,6 +7,7 @@
 
 #include "base58.h"
 #include "checkpoints.h"
+#include "checkqueue.h"
 #include "coincontrol.h"
 #include "consensus/consensus.h"
 #include "consensus/validation.h"
@@ -101,6 +102,7 @@ bool CWallet::AddKeyPubKey(const CKey& secret, const CPubKey &pubkey)
     AssertLockHeld(cs_wallet); // mapKeyMetadata
     if (!CCryptoKeyStore::AddKeyPubKey(secret, pubkey))
         return false;
+    AddToIsMineFilter(pubkey.GetID());
 
     // check if we need to remove from watch-only
     CScript script;
@@ -123,6 +125,7 @@ bool CWallet::AddCryptedKey(const CPubKey &vchPubKey,
 {
     if (!CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret))
         return false;
+    AddToIsMineFilter(vchPubKey.GetID());
     if (!fFileBacked)
         return true;
     {
@@ -149,15 +152,27 @@ bool CWallet::LoadKeyMetadata(const CPubKey &pubkey, const CKeyMetadata &meta)
     return true;
 }
 
+bool CWallet::LoadKey(const CKey& key, const CPubKey &pubkey)
+{
+    if (!CCryptoKeyStore::AddKeyPubKey(key, pubkey))
+        return false;
+    AddToIsMineFilter(pubkey.GetID());
+    return true;
+}
+
 bool CWallet::LoadCryptedKey(const CPubKey &vchPubKey, const std::vector<unsigned char> &vchCryptedSecret)
 {
-    return CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret);
+    if (!CCryptoKeyStore::AddCryptedKey(vchPubKey, vchCryptedSecret))
+        return false;
+    AddToIsMineFilter(vchPubKey.GetID());
+    return true;
 }
 
 bool CWallet::AddCScript(const CScript& redeemScript)
 {
     if (!CCryptoKeyStore::AddCScript(redeemScript))
         return false;
+    AddToIsMineFilter(CScriptID(redeemScript));
     if (!fFileBacked)
         return true;
     return CWalletDB(strWalletFile).WriteCScript(Hash160(redeemScript), redeemScript);
@@ -176,13 +191,17 @@ bool CWallet::LoadCScript(const CScript& redeemScript)
         return true;
     }
 
-    return CCryptoKeyStore::AddCScript(redeemScript);
+    if (!CCryptoKeyStore::AddCScript(redeemScript))
+        return false;
+    AddToIsMineFilter(CScriptID(redeemScript));
+    return true;
 }
 
 bool CWallet::AddWatchOnly(const CScript &dest)
 {
     if (!CCryptoKeyStore::AddWatchOnly(dest))
         return false;
+    AddToIsMineFilter(dest);
     nTimeFirstKey = 1; // No birthday information for watch-only keys.
     NotifyWatchonlyChanged(true);
     if (!fFileBacked)
@@ -206,7 +225,44 @@ bool CWallet::RemoveWatchOnly(const CScript &dest)
 
 bool CWallet::LoadWatchOnly(const CScript &dest)
 {
-    return CCryptoKeyStore::AddWatchOnly(dest);
+    if (!CCryptoKeyStore::AddWatchOnly(dest))
+        return false;
+    AddToIsMineFilter(dest);
+    return true;
+}
+
+void CWallet::AddToIsMineFilter(const uint160& id)
+{
+    LOCK(cs_KeyStore);
+    isMineFilter.Insert(id);
+    if (isMineFilter.IsFull())
+        RebuildIsMineFilter();
+}
+
+void CWallet::AddToIsMineFilter(const CScript& script)
+{
+    LOCK(cs_KeyStore);
+    isMineFilter.Insert(script);
+    if (isMineFilter.IsFull())
+        RebuildIsMineFilter();
+}
+
+/** Rebuild the IsMine filter from the key store, with room to grow */
+void CWallet::RebuildIsMineFilter()
+{
+    LOCK(cs_KeyStore);
+    std::set<CKeyID> setKeys;
+    GetKeys(setKeys);
+    const unsigned int nElements = setKeys.size() + mapScripts.size() + setWatchOnly.size();
+
+    CIsMineFilter filter(2 * std::max(nElements, isMineFilter.GetCapacity()));
+    BOOST_FOREACH(const CKeyID& keyID, setKeys)
+        filter.Insert(keyID);
+    for (ScriptMap::const_iterator it = mapScripts.begin(); it != mapScripts.end(); ++it)
+        filter.Insert(it->first);
+    BOOST_FOREACH(const CScript& script, setWatchOnly)
+        filter.Insert(script);
+    isMineFilter = filter;
 }
 
 bool CWallet::Unlock(const SecureString& strWalletPassphrase)
@@ -472,6 +528,54 @@ void CWallet::AddToSpends(const uint256& wtxid)
         AddToSpends(txin.prevout, wtxid);
 }
 
+/**
+ * Find the output through which a wallet transaction updates a name:  its
+ * first name output, if that is a name_firstupdate or name_update.
+ */
+static bool FindNameUpdate(const CWalletTx& wtx, CNameScript& nameOp, unsigned int& nOut)
+{
+    if (!wtx.IsNamecoin())
+        return false;
+
+    for (unsigned int i = 0; i < wtx.vout.size(); ++i)
+    {
+        const CNameScript cur(wtx.vout[i].scriptPubKey);
+        if (cur.isNameOp())
+        {
+            if (!cur.isAnyUpdate())
+                return false;
+            nameOp = cur;
+            nOut = i;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void CWallet::AddToNameIndex(const CWalletTx& wtx)
+{
+    CNameScript nameOp;
+    unsigned int nOut;
+    if (FindNameUpdate(wtx, nameOp, nOut))
+        mapNameOutputs[nameOp.getOpName()].insert(COutPoint(wtx.GetHash(), nOut));
+}
+
+void CWallet::RemoveFromNameIndex(const CWalletTx& wtx)
+{
+    CNameScript nameOp;
+    unsigned int nOut;
+    if (!FindNameUpdate(wtx, nameOp, nOut))
+        return;
+
+    NameOutputs::iterator it = mapNameOutputs.find(nameOp.getOpName());
+    if (it == mapNameOutputs.end())
+        return;
+    it->second.erase(COutPoint(wtx.GetHash(), nOut));
+    if (it->second.empty())
+        mapNameOutputs.erase(it);
+}
+
 bool CWallet::EncryptWallet(const SecureString& strWalletPassphrase)
 {
     if (IsCrypted())
@@ -608,6 +712,7 @@ void CWallet::MarkDirty()
         LOCK(cs_wallet);
         BOOST_FOREACH(PAIRTYPE(const uint256, CWalletTx)& item, mapWallet)
             item.second.MarkDirty();
+        ++nWalletChanges;
     }
 }
 
@@ -620,6 +725,8 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
         mapWallet[hash] = wtxIn;
         mapWallet[hash].BindWallet(this);
         AddToSpends(hash);
+        AddToNameIndex(wtxIn);
+        ++nWalletChanges;
     }
     else
     {
@@ -680,6 +787,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
                              wtxIn.hashBlock.ToString());
             }
             AddToSpends(hash);
+            AddToNameIndex(wtx);
         }
 
         bool fUpdated = false;
@@ -714,6 +822,7 @@ bool CWallet::AddToWallet(const CWalletTx& wtxIn, bool fFromLoadWallet, CWalletD
 
         // Break debit/credit balance caches:
         wtx.MarkDirty();
+        ++nWalletChanges;
 
         // Notify UI of new or updated transaction
         NotifyTransactionChanged(this, hash, fInsertedNew ? CT_NEW : CT_UPDATED);
@@ -774,6 +883,7 @@ void CWallet::SyncTransaction(const CTransaction& tx, const CBlock* pblock)
         if (mapWallet.count(txin.prevout.hash))
             mapWallet[txin.prevout.hash].MarkDirty();
     }
+    ++nWalletChanges;
 }
 
 void CWallet::EraseFromWallet(const uint256 &hash)
@@ -782,8 +892,14 @@ void CWallet::EraseFromWallet(const uint256 &hash)
         return;
     {
         LOCK(cs_wallet);
-        if (mapWallet.erase(hash))
+        map<uint256, CWalletTx>::iterator it = mapWallet.find(hash);
+        if (it != mapWallet.end())
+        {
+            RemoveFromNameIndex(it->second);
+            mapWallet.erase(it);
+            ++nWalletChanges;
             CWalletDB(strWalletFile).EraseTx(hash);
+        }
     }
     return;
 }
@@ -829,6 +945,11 @@ CAmount CWallet::GetDebit(const CTxIn &txin, const isminefilter& filter, bool fE
 
 isminetype CWallet::IsMine(const CTxOut& txout) const
 {
+    {
+        LOCK(cs_KeyStore);
+        if (!isMineFilter.MayBeMine(txout.scriptPubKey))
+            return ISMINE_NO;
+    }
     return ::IsMine(*this, txout.scriptPubKey);
 }
 
@@ -1076,10 +1197,60 @@ bool CWalletTx::WriteToDisk(CWalletDB *pwalletdb)
     return pwalletdb->WriteTx(GetHash(), *this);
 }
 
+/** Number of blocks that are read and matched together during a rescan */
+static const unsigned int RESCAN_BATCH_BLOCKS = 16;
+
+/** A block of a rescan, filled in by CRescanCheck */
+struct CRescanBlock
+{
+    CBlockIndex* pindex;
+    CBlock block;
+    bool fRead;
+    //! Whether each transaction pays to the wallet
+    std::vector<char> vMine;
+};
+
+/**
+ * Reads a block and matches its outputs against the keys of the wallet.
+ * This only needs the keystore, so it can run on the script check threads
+ * while the rescan holds cs_wallet.  Spends of wallet coins depend on the
+ * transactions found before and are checked in block order afterwards.
+ */
+class CRescanCheck
+{
+private:
+    const CWallet* pwallet;
+    CRescanBlock* pblock;
+
+public:
+    CRescanCheck() : pwallet(NULL), pblock(NULL) {}
+    CRescanCheck(const CWallet* pwalletIn, CRescanBlock* pblockIn) : pwallet(pwalletIn), pblock(pblockIn) {}
+
+    bool operator()()
+    {
+        pblock->vMine.clear();
+        pblock->fRead = ReadBlockFromDisk(pblock->block, pblock->pindex);
+        if (!pblock->fRead)
+            return true;
+        pblock->vMine.reserve(pblock->block.vtx.size());
+        BOOST_FOREACH(const CTransaction& tx, pblock->block.vtx)
+            pblock->vMine.push_back(pwallet->IsMine(tx));
+        return true;
+    }
+
+    void swap(CRescanCheck& check)
+    {
+        std::swap(pwallet, check.pwallet);
+        std::swap(pblock, check.pblock);
+    }
+};
+
 /**
  * Scan the block chain (starting in pindexStart) for transactions
  * from or to us. If fUpdate is true, found transactions that already
  * exist in the wallet will be updated.
+ * Blocks are read and matched in batches on the script check threads
+ * (-par), the transactions found are added in block order.
  */
 int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
 {
@@ -1087,6 +1258,9 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
     int64_t nNow = GetTime();
     const CChainParams& chainParams = Params();
 
+    CCheckQueue<CRescanCheck> queue(1);
+    CCheckQueueThreads<CRescanCheck> workers(queue, nScriptCheckThreads - 1);
+
     CBlockIndex* pindex = pindexStart;
     {
         LOCK2(cs_main, cs_wallet);
@@ -1099,22 +1273,44 @@ int CWallet::ScanForWalletTransactions(CBlockIndex* pindexStart, bool fUpdate)
         ShowProgress(_("Rescanning..."), 0); // show rescan progress in GUI as dialog or on splashscreen, if -rescan on startup
         double dProgressStart = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex, false);
         double dProgressTip = Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), chainActive.Tip(), false);
+        std::vector<CRescanBlock> vBlocks(RESCAN_BATCH_BLOCKS);
         while (pindex)
         {
-            if (pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
-                ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
-
-            CBlock block;
-            ReadBlockFromDisk(block, pindex);
-            BOOST_FOREACH(CTransaction& tx, block.vtx)
+            unsigned int nBlocks = 0;
+            for (; nBlocks < vBlocks.size() && pindex; pindex = chainActive.Next(pindex))
+                vBlocks[nBlocks++].pindex = pindex;
             {
-                if (AddToWalletIfInvolvingMe(tx, &block, fUpdate))
-                    ret++;
+                std::vector<CRescanCheck> vChecks;
+                vChecks.reserve(nBlocks);
+                for (unsigned int i = 0; i < nBlocks; i++)
+                    vChecks.push_back(CRescanCheck(this, &vBlocks[i]));
+                CCheckQueueControl<CRescanCheck> control(&queue);
+                control.Add(vChecks);
+                control.Wait();
             }
-            pindex = chainActive.Next(pindex);
-            if (GetTime() >= nNow + 60) {
-                nNow = GetTime();
-                LogPrintf("Still rescanning. At block %d. Progress=%f\n", pindex->nHeight, Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), pindex));
+
+            for (unsigned int i = 0; i < nBlocks; i++)
+            {
+                const CRescanBlock& scanned = vBlocks[i];
+                if (scanned.pindex->nHeight % 100 == 0 && dProgressTip - dProgressStart > 0.0)
+                    ShowProgress(_("Rescanning..."), std::max(1, std::min(99, (int)((Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), scanned.pindex, false) - dProgressStart) / (dProgressTip - dProgressStart) * 100))));
+
+                if (!scanned.fRead)
+                    continue;
+                for (unsigned int j = 0; j < scanned.block.vtx.size(); j++)
+                {
+                    const CTransaction& tx = scanned.block.vtx[j];
+                    // Spends of our coins are only known once the earlier
+                    // transactions have been added.
+                    if (!scanned.vMine[j] && !mapWallet.count(tx.GetHash()) && !IsFromMe(tx))
+                        continue;
+                    if (AddToWalletIfInvolvingMe(tx, &scanned.block, fUpdate))
+                        ret++;
+                }
+                if (GetTime() >= nNow + 60) {
+                    nNow = GetTime();
+                    LogPrintf("Still rescanning. At block %d. Progress=%f\n", scanned.pindex->nHeight, Checkpoints::GuessVerificationProgress(chainParams.Checkpoints(), scanned.pindex));
+                }
             }
         }
         ShowProgress(_("Rescanning..."), 100); // hide progress dialog in GUI
@@ -1423,98 +1619,101 @@ void CWallet::ResendWalletTransactions(int64_t nBestBlockTime)
  */
 
 
-CAmount CWallet::GetBalance() const
+void CWallet::CheckCacheState() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableCredit();
+    AssertLockHeld(cs_main);
+    AssertLockHeld(cs_wallet);
+
+    const unsigned int nMempoolUpdates = mempool.GetTransactionsUpdated();
+    if (nCacheWalletChanges == nWalletChanges && pindexCacheTip == chainActive.Tip()
+        && nCacheMempoolUpdates == nMempoolUpdates)
+        return;
+
+    fTotalsCached = false;
+    for (unsigned int i = 0; i < 2; ++i) {
+        fCoinsCached[i] = false;
+        vCachedCoins[i].clear();
+    }
+    nCacheWalletChanges = nWalletChanges;
+    pindexCacheTip = chainActive.Tip();
+    nCacheMempoolUpdates = nMempoolUpdates;
+}
+
+/**
+ * Compute all balances in one pass over mapWallet and cache them.  Whether a
+ * transaction is final also depends on the time, so nothing is cached while
+ * the wallet has non-final transactions.
+ */
+CAmount CWallet::GetCachedTotal(CachedTotal total) const
+{
+    LOCK2(cs_main, cs_wallet);
+    CheckCacheState();
+    if (fTotalsCached)
+        return nCachedTotals[total];
+
+    CAmount nTotals[TOTAL_COUNT] = {};
+    bool fAllFinal = true;
+    for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+    {
+        const CWalletTx* pcoin = &(*it).second;
+        const bool fFinal = IsFinalTx(*pcoin);
+        const bool fTrusted = pcoin->IsTrusted();
+        if (!fFinal)
+            fAllFinal = false;
+
+        if (fTrusted) {
+            nTotals[TOTAL_BALANCE] += pcoin->GetAvailableCredit();
+            nTotals[TOTAL_WATCH_ONLY] += pcoin->GetAvailableWatchOnlyCredit();
+        }
+        if (!fFinal || (!fTrusted && pcoin->GetDepthInMainChain() == 0)) {
+            nTotals[TOTAL_UNCONFIRMED] += pcoin->GetAvailableCredit();
+            nTotals[TOTAL_UNCONFIRMED_WATCH_ONLY] += pcoin->GetAvailableWatchOnlyCredit();
         }
+        nTotals[TOTAL_IMMATURE] += pcoin->GetImmatureCredit();
+        nTotals[TOTAL_IMMATURE_WATCH_ONLY] += pcoin->GetImmatureWatchOnlyCredit();
     }
 
-    return nTotal;
+    if (fAllFinal) {
+        std::copy(nTotals, nTotals + TOTAL_COUNT, nCachedTotals);
+        fTotalsCached = true;
+    }
+    return nTotals[total];
+}
+
+CAmount CWallet::GetBalance() const
+{
+    return GetCachedTotal(TOTAL_BALANCE);
 }
 
 CAmount CWallet::GetUnconfirmedBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableCredit();
-        }
-    }
-    return nTotal;
+    return GetCachedTotal(TOTAL_UNCONFIRMED);
 }
 
 CAmount CWallet::GetImmatureBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureCredit();
-        }
-    }
-    return nTotal;
+    return GetCachedTotal(TOTAL_IMMATURE);
 }
 
 CAmount CWallet::GetWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (pcoin->IsTrusted())
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
-    }
-
-    return nTotal;
+    return GetCachedTotal(TOTAL_WATCH_ONLY);
 }
 
 CAmount CWallet::GetUnconfirmedWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            if (!IsFinalTx(*pcoin) || (!pcoin->IsTrusted() && pcoin->GetDepthInMainChain() == 0))
-                nTotal += pcoin->GetAvailableWatchOnlyCredit();
-        }
-    }
-    return nTotal;
+    return GetCachedTotal(TOTAL_UNCONFIRMED_WATCH_ONLY);
 }
 
 CAmount CWallet::GetImmatureWatchOnlyBalance() const
 {
-    CAmount nTotal = 0;
-    {
-        LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
-        {
-            const CWalletTx* pcoin = &(*it).second;
-            nTotal += pcoin->GetImmatureWatchOnlyCredit();
-        }
-    }
-    return nTotal;
+    return GetCachedTotal(TOTAL_IMMATURE_WATCH_ONLY);
 }
 
 /**
  * populate vCoins with vector of available COutputs.
+ * The unspent outputs are cached (see CheckCacheState); locked coins, coin
+ * control and zero values are filtered per call.
  */
 void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const CCoinControl *coinControl, bool fIncludeZeroValue) const
 {
@@ -1522,32 +1721,49 @@ void CWallet::AvailableCoins(vector<COutput>& vCoins, bool fOnlyConfirmed, const
 
     {
         LOCK2(cs_main, cs_wallet);
-        for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+        CheckCacheState();
+
+        std::vector<COutput>& vCached = vCachedCoins[fOnlyConfirmed];
+        if (!fCoinsCached[fOnlyConfirmed])
         {
-            const uint256& wtxid = it->first;
-            const CWalletTx* pcoin = &(*it).second;
+            vCached.clear();
+            bool fAllFinal = true;
+            for (map<uint256, CWalletTx>::const_iterator it = mapWallet.begin(); it != mapWallet.end(); ++it)
+            {
+                const uint256& wtxid = it->first;
+                const CWalletTx* pcoin = &(*it).second;
 
-            if (!IsFinalTx(*pcoin))
-                continue;
+                if (!IsFinalTx(*pcoin)) {
+                    fAllFinal = false;
+                    continue;
+                }
 
-            if (fOnlyConfirmed && !pcoin->IsTrusted())
-                continue;
+                if (fOnlyConfirmed && !pcoin->IsTrusted())
+                    continue;
 
-            if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
-                continue;
+                if (pcoin->IsCoinBase() && pcoin->GetBlocksToMaturity() > 0)
+                    continue;
 
-            int nDepth = pcoin->GetDepthInMainChain();
-            if (nDepth < 0)
-                continue;
+                int nDepth = pcoin->GetDepthInMainChain();
+                if (nDepth < 0)
+                    continue;
 
-            for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
-                isminetype mine = IsMine(pcoin->vout[i]);
-                if (!(IsSpent(wtxid, i)) && mine != ISMINE_NO &&
-                    !IsLockedCoin((*it).first, i) && (pcoin->vout[i].nValue > 0 || fIncludeZeroValue) &&
-                    (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected((*it).first, i))
-                    && !CNameScript::isNameScript(pcoin->vout[i].scriptPubKey))
-                        vCoins.push_back(COutput(pcoin, i, nDepth, (mine & ISMINE_SPENDABLE) != ISMINE_NO));
+                for (unsigned int i = 0; i < pcoin->vout.size(); i++) {
+                    isminetype mine = IsMine(pcoin->vout[i]);
+                    if (!(IsSpent(wtxid, i)) && mine != ISMINE_NO
+                        && !CNameScript::isNameScript(pcoin->vout[i].scriptPubKey))
+                            vCached.push_back(COutput(pcoin, i, nDepth, (mine & ISMINE_SPENDABLE) != ISMINE_NO));
+                }
             }
+            fCoinsCached[fOnlyConfirmed] = fAllFinal;
+        }
+
+        BOOST_FOREACH(const COutput& out, vCached)
+        {
+            const uint256& wtxid = out.tx->GetHash();
+            if (!IsLockedCoin(wtxid, out.i) && (out.tx->vout[out.i].nValue > 0 || fIncludeZeroValue) &&
+                (!coinControl || !coinControl->HasSelected() || coinControl->IsSelected(wtxid, out.i)))
+                    vCoins.push_back(out);
         }
     }
 }
@@ -1699,10 +1915,13 @@ bool CWallet::SelectCoinsMinConf(const CAmount& nTargetValue, int nConfMine, int
     return true;
 }
 
-bool CWallet::SelectCoins(const CAmount& nTargetValue, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl* coinControl) const
+bool CWallet::SelectCoins(const CAmount& nTargetValue, set<pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl* coinControl, const vector<COutput>* pvCoins) const
 {
     vector<COutput> vCoins;
-    AvailableCoins(vCoins, true, coinControl);
+    if (pvCoins)
+        vCoins = *pvCoins;
+    else
+        AvailableCoins(vCoins, true, coinControl);
 
     // coin control -> return all selected outputs (we want all selected to go into the transaction for sure)
     if (coinControl && coinControl->HasSelected())
@@ -1724,7 +1943,8 @@ bool CWallet::SelectCoins(const CAmount& nTargetValue, set<pair<const CWalletTx*
 
 bool CWallet::CreateTransaction(const vector<CRecipient>& vecSend,
                                 const CTxIn* withInput,
-                                CWalletTx& wtxNew, CReserveKey& reservekey, CAmount& nFeeRet, int& nChangePosRet, std::string& strFailReason, const CCoinControl* coinControl)
+                                CWalletTx& wtxNew, CReserveKey& reservekey, CAmount& nFeeRet, int& nChangePosRet, std::string& strFailReason, const CCoinControl* coinControl,
+                                vector<COutput>* pvCoins)
 {
     /* Initialise nFeeRet here so that SendMoney doesn't see an uninitialised
        value in case we error out earlier.  */
@@ -1807,6 +2027,7 @@ bool CWallet::CreateTransaction(const vector<CRecipient>& vecSend,
     {
         LOCK2(cs_main, cs_wallet);
         {
+            set<pair<const CWalletTx*,unsigned int> > setCoins;
             nFeeRet = 0;
             while (true)
             {
@@ -1853,9 +2074,9 @@ bool CWallet::CreateTransaction(const vector<CRecipient>& vecSend,
                 }
 
                 // Choose coins to use
-                set<pair<const CWalletTx*,unsigned int> > setCoins;
+                setCoins.clear();
                 CAmount nValueIn = 0;
-                if (!SelectCoins(nValueToSelect, setCoins, nValueIn, coinControl))
+                if (!SelectCoins(nValueToSelect, setCoins, nValueIn, coinControl, pvCoins))
                 {
                     strFailReason = _("Insufficient funds");
                     return false;
@@ -2008,6 +2229,17 @@ bool CWallet::CreateTransaction(const vector<CRecipient>& vecSend,
                 nFeeRet = nFeeNeeded;
                 continue;
             }
+
+            // The coins used are no longer available for later transactions
+            if (pvCoins)
+            {
+                vector<COutput> vRemaining;
+                vRemaining.reserve(pvCoins->size());
+                BOOST_FOREACH(const COutput& out, *pvCoins)
+                    if (!setCoins.count(make_pair(out.tx, (unsigned int)out.i)))
+                        vRemaining.push_back(out);
+                pvCoins->swap(vRemaining);
+            }
         }
     }
 
@@ -2017,7 +2249,7 @@ bool CWallet::CreateTransaction(const vector<CRecipient>& vecSend,
 /**
  * Call after CreateTransaction unless you want to abort
  */
-bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
+bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey, CWalletDB* pwalletdbIn)
 {
     {
         LOCK2(cs_main, cs_wallet);
@@ -2026,7 +2258,10 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
             // This is only to keep the database open to defeat the auto-flush for the
             // duration of this scope.  This is the only place where this optimization
             // maybe makes sense; please don't do it anywhere else.
-            CWalletDB* pwalletdb = fFileBacked ? new CWalletDB(strWalletFile,"r+") : NULL;
+            // Callers committing several transactions can pass their own handle instead.
+            CWalletDB* pwalletdb = pwalletdbIn;
+            if (!pwalletdb && fFileBacked)
+                pwalletdb = new CWalletDB(strWalletFile,"r+");
 
             // Take key pair from key pool so it won't be used again
             reservekey.KeepKey();
@@ -2044,7 +2279,7 @@ bool CWallet::CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey)
                 NotifyTransactionChanged(this, coin.GetHash(), CT_UPDATED);
             }
 
-            if (fFileBacked)
+            if (pwalletdb != pwalletdbIn)
                 delete pwalletdb;
         }
 
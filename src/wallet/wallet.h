@@ -394,7 +394,7 @@ public:
 class CWallet : public CCryptoKeyStore, public CValidationInterface
 {
 private:
-    bool SelectCoins(const CAmount& nTargetValue, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl *coinControl = NULL) const;
+    bool SelectCoins(const CAmount& nTargetValue, std::set<std::pair<const CWalletTx*,unsigned int> >& setCoinsRet, CAmount& nValueRet, const CCoinControl *coinControl = NULL, const std::vector<COutput>* pvCoins = NULL) const;
 
     CWalletDB *pwalletdbEncryption;
 
@@ -420,6 +420,48 @@ private:
 
     void SyncMetaData(std::pair<TxSpends::iterator, TxSpends::iterator>);
 
+    void AddToNameIndex(const CWalletTx& wtx);
+    void RemoveFromNameIndex(const CWalletTx& wtx);
+
+    /**
+     * Balances and available coins are cached until the wallet, the chain
+     * tip or the mempool changes.  nWalletChanges is bumped whenever
+     * transactions are added, updated or erased (or MarkDirty is called),
+     * the other parts of the state come from chainActive and mempool.
+     */
+    enum CachedTotal
+    {
+        TOTAL_BALANCE,
+        TOTAL_UNCONFIRMED,
+        TOTAL_IMMATURE,
+        TOTAL_WATCH_ONLY,
+        TOTAL_UNCONFIRMED_WATCH_ONLY,
+        TOTAL_IMMATURE_WATCH_ONLY,
+        TOTAL_COUNT
+    };
+    uint64_t nWalletChanges;
+    mutable uint64_t nCacheWalletChanges;
+    mutable const CBlockIndex* pindexCacheTip;
+    mutable unsigned int nCacheMempoolUpdates;
+    mutable bool fTotalsCached;
+    mutable CAmount nCachedTotals[TOTAL_COUNT];
+    //! Available coins without the per-call filters, by fOnlyConfirmed
+    mutable bool fCoinsCached[2];
+    mutable std::vector<COutput> vCachedCoins[2];
+
+    void CheckCacheState() const;
+    CAmount GetCachedTotal(CachedTotal total) const;
+
+    /**
+     * The key and script IDs of the wallet, checked by IsMine(CTxOut) before
+     * the full IsMine logic.  It is protected by cs_KeyStore and filled in
+     * wherever keys, scripts and watch-only scripts are added or loaded.
+     */
+    CIsMineFilter isMineFilter;
+    void AddToIsMineFilter(const uint160& id);
+    void AddToIsMineFilter(const CScript& script);
+    void RebuildIsMineFilter();
+
 public:
     /*
      * Main wallet lock.
@@ -471,10 +513,25 @@ public:
         nLastResend = 0;
         nTimeFirstKey = 0;
         fBroadcastTransactions = false;
+        nWalletChanges = 0;
+        nCacheWalletChanges = 0;
+        pindexCacheTip = NULL;
+        nCacheMempoolUpdates = 0;
+        fTotalsCached = false;
+        fCoinsCached[0] = fCoinsCached[1] = false;
     }
 
     std::map<uint256, CWalletTx> mapWallet;
 
+    /**
+     * The name_firstupdate and name_update outputs of wallet transactions,
+     * by name.  This lets name_list look only at the transactions of the
+     * names in the wallet.  It is kept up to date in AddToWallet (also when
+     * loading the wallet) and EraseFromWallet.
+     */
+    typedef std::map<valtype, std::set<COutPoint> > NameOutputs;
+    NameOutputs mapNameOutputs;
+
     int64_t nOrderPosNext;
     std::map<uint256, int> mapRequestCount;
 
@@ -510,7 +567,7 @@ public:
     //! Adds a key to the store, and saves it to disk.
     bool AddKeyPubKey(const CKey& key, const CPubKey &pubkey);
     //! Adds a key to the store, without saving it to disk (used by LoadWallet)
-    bool LoadKey(const CKey& key, const CPubKey &pubkey) { return CCryptoKeyStore::AddKeyPubKey(key, pubkey); }
+    bool LoadKey(const CKey& key, const CPubKey &pubkey);
     //! Load metadata (used by LoadWallet)
     bool LoadKeyMetadata(const CPubKey &pubkey, const CKeyMetadata &metadata);
 
@@ -575,10 +632,16 @@ public:
     CAmount GetWatchOnlyBalance() const;
     CAmount GetUnconfirmedWatchOnlyBalance() const;
     CAmount GetImmatureWatchOnlyBalance() const;
+    /**
+     * If pvCoins is given, inputs are selected from it instead of from all
+     * available coins, and the ones used are removed from it.  This lets
+     * callers create several transactions before committing any of them.
+     */
     bool CreateTransaction(const std::vector<CRecipient>& vecSend,
                            const CTxIn* withInput,
-                           CWalletTx& wtxNew, CReserveKey& reservekey, CAmount& nFeeRet, int& nChangePosRet, std::string& strFailReason, const CCoinControl *coinControl = NULL);
-    bool CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey);
+                           CWalletTx& wtxNew, CReserveKey& reservekey, CAmount& nFeeRet, int& nChangePosRet, std::string& strFailReason, const CCoinControl *coinControl = NULL,
+                           std::vector<COutput>* pvCoins = NULL);
+    bool CommitTransaction(CWalletTx& wtxNew, CReserveKey& reservekey, CWalletDB* pwalletdbIn = NULL);
 
     static CFeeRate minTxFee;
     static CAmount GetMinimumFee(unsigned int nTxBytes, unsigned int nConfirmTarget, const CTxMemPool& pool);
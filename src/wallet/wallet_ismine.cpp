@@ -5,8 +5,11 @@
 
 #include "wallet_ismine.h"
 
+#include "crypto/common.h"
+#include "hash.h"
 #include "key.h"
 #include "keystore.h"
+#include "script/names.h"
 #include "script/script.h"
 #include "script/standard.h"
 
@@ -89,3 +92,76 @@ isminetype IsMine(const CKeyStore &keystore, const CScript& scriptPubKey)
         return ISMINE_WATCH_ONLY;
     return ISMINE_NO;
 }
+
+/** Number of filter bits per element, and bits set for each */
+static const unsigned int ISMINE_FILTER_BITS = 16;
+static const unsigned int ISMINE_FILTER_PROBES = 4;
+
+/**
+ * Get the key or script ID that a script pays to, for the script forms that
+ * are cheap to recognise.  Other scripts (multisig, non-standard) have none.
+ */
+static bool GetFilterID(const CScript& scriptPubKey, uint160& id)
+{
+    // Only parse name prefixes if the first opcode can start one
+    CNameScript nameOp;
+    if (!scriptPubKey.empty() && scriptPubKey[0] >= OP_NAME_NEW && scriptPubKey[0] <= OP_NAME_UPDATE)
+        nameOp = CNameScript(scriptPubKey);
+    const CScript& script = nameOp.isNameOp() ? nameOp.getAddress() : scriptPubKey;
+
+    const unsigned int nSize = script.size();
+    if (nSize == 25 && script[0] == OP_DUP && script[1] == OP_HASH160 && script[2] == 20
+        && script[23] == OP_EQUALVERIFY && script[24] == OP_CHECKSIG) {
+        memcpy(id.begin(), &script[3], 20);
+        return true;
+    }
+    if (nSize == 23 && script[0] == OP_HASH160 && script[1] == 20 && script[22] == OP_EQUAL) {
+        memcpy(id.begin(), &script[2], 20);
+        return true;
+    }
+    if (((nSize == 35 && script[0] == 33) || (nSize == 67 && script[0] == 65)) && script[nSize - 1] == OP_CHECKSIG) {
+        id = Hash160(script.begin() + 1, script.end() - 1);
+        return true;
+    }
+    return false;
+}
+
+CIsMineFilter::CIsMineFilter(unsigned int nCapacityIn) : nCapacity(nCapacityIn), nElements(0)
+{
+    // Round the size up to a power of two, so that bits can be masked
+    unsigned int nBytes = 1;
+    while (nBytes * 8 < nCapacity * ISMINE_FILTER_BITS)
+        nBytes *= 2;
+    vData.assign(nBytes, 0);
+}
+
+void CIsMineFilter::Insert(const uint160& id)
+{
+    const uint32_t nMask = vData.size() * 8 - 1;
+    for (unsigned int i = 0; i < ISMINE_FILTER_PROBES; i++) {
+        const uint32_t nBit = ReadLE32(id.begin() + 4 * i) & nMask;
+        vData[nBit >> 3] |= (1 << (nBit & 7));
+    }
+    nElements++;
+}
+
+void CIsMineFilter::Insert(const CScript& script)
+{
+    uint160 id;
+    if (GetFilterID(script, id))
+        Insert(id);
+}
+
+bool CIsMineFilter::MayBeMine(const CScript& scriptPubKey) const
+{
+    uint160 id;
+    if (!GetFilterID(scriptPubKey, id))
+        return true;
+    const uint32_t nMask = vData.size() * 8 - 1;
+    for (unsigned int i = 0; i < ISMINE_FILTER_PROBES; i++) {
+        const uint32_t nBit = ReadLE32(id.begin() + 4 * i) & nMask;
+        if (!(vData[nBit >> 3] & (1 << (nBit & 7))))
+            return false;
+    }
+    return true;
+}
@@ -9,6 +9,8 @@
 #include "key.h"
 #include "script/standard.h"
 
+#include <vector>
+
 class CKeyStore;
 class CScript;
 
@@ -26,4 +28,33 @@ typedef uint8_t isminefilter;
 isminetype IsMine(const CKeyStore& keystore, const CScript& scriptPubKey);
 isminetype IsMine(const CKeyStore& keystore, const CTxDestination& dest);
 
+/**
+ * Filter of the key and script IDs a key store can match, used to reject
+ * outputs that do not belong to the wallet before running Solver and the
+ * key lookups of IsMine.  There are no false negatives for the scripts it
+ * can parse (pay to pubkey, pubkey hash or script hash, also behind a name
+ * prefix); other scripts always pass.  Since the IDs are hashes, their
+ * bits index the filter directly.  Nothing is ever removed, so removed
+ * watch-only scripts stay as false positives until the filter is rebuilt.
+ */
+class CIsMineFilter
+{
+private:
+    std::vector<unsigned char> vData;
+    unsigned int nCapacity;
+    unsigned int nElements;
+
+public:
+    explicit CIsMineFilter(unsigned int nCapacityIn = 1024);
+
+    //! Whether more elements were inserted than the filter was sized for
+    bool IsFull() const { return nElements > nCapacity; }
+    unsigned int GetCapacity() const { return nCapacity; }
+
+    void Insert(const uint160& id);
+    //! Insert the ID of a watch-only script, if it has one
+    void Insert(const CScript& script);
+    bool MayBeMine(const CScript& scriptPubKey) const;
+};
+
 #endif // BITCOIN_WALLET_WALLET_ISMINE_H